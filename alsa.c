@@ -17,6 +17,8 @@
  *
  */
 
+#include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/poll.h>
@@ -35,7 +37,9 @@ struct alsa_pcm {
     struct pollfd *pe;
     size_t pe_count; /* number of pollfd entries */
 
-    signed short *buf;
+    bool mmap; /* audio is accessed directly in the device buffer */
+    signed short *buf; /* otherwise, audio is copied via here */
+    float *collect; /* playback only, before conversion */
     snd_pcm_uframes_t period;
     int rate;
 };
@@ -74,13 +78,23 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
         return -1;
     }
     
+    /* Prefer to work in the device's own buffer, to save a copy of
+     * the audio in each direction */
+
     r = snd_pcm_hw_params_set_access(alsa->pcm, hw_params,
-                                     SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (r < 0) {
-        alsa_error("hw_params_set_access", r);
-        return -1;
+                                     SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (r == 0) {
+        alsa->mmap = true;
+    } else {
+        alsa->mmap = false;
+        r = snd_pcm_hw_params_set_access(alsa->pcm, hw_params,
+                                         SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (r < 0) {
+            alsa_error("hw_params_set_access", r);
+            return -1;
+        }
     }
-    
+
     r = snd_pcm_hw_params_set_format(alsa->pcm, hw_params, SND_PCM_FORMAT_S16);
     if (r < 0) {
         alsa_error("hw_params_set_format", r);
@@ -138,17 +152,30 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
         return -1;
     }
 
-    bytes = alsa->period * DEVICE_CHANNELS * sizeof(signed short);
-    alsa->buf = malloc(bytes);
-    if (!alsa->buf) {
-        perror("malloc");
-        return -1;
-    }
+    alsa->buf = NULL;
+    if (!alsa->mmap) {
+        bytes = alsa->period * DEVICE_CHANNELS * sizeof(signed short);
+        alsa->buf = malloc(bytes);
+        if (!alsa->buf) {
+            perror("malloc");
+            return -1;
+        }
 
-    /* snd_pcm_readi() returns uninitialised memory on first call,
-     * possibly caused by premature POLLIN. Keep valgrind happy. */
+        /* snd_pcm_readi() returns uninitialised memory on first call,
+         * possibly caused by premature POLLIN. Keep valgrind happy. */
 
-    memset(alsa->buf, 0, bytes);
+        memset(alsa->buf, 0, bytes);
+    }
+
+    alsa->collect = NULL;
+    if (stream == SND_PCM_STREAM_PLAYBACK) {
+        alsa->collect = malloc(alsa->period * DEVICE_CHANNELS * sizeof(float));
+        if (!alsa->collect) {
+            perror("malloc");
+            free(alsa->buf);
+            return -1;
+        }
+    }
 
     return 0;
 }
@@ -159,6 +186,7 @@ static void pcm_close(struct alsa_pcm *alsa)
     if (snd_pcm_close(alsa->pcm) < 0)
         abort();
     free(alsa->buf);
+    free(alsa->collect);
 }
 
 
@@ -241,6 +269,114 @@ static ssize_t pollfds(struct device *dv, struct pollfd *pe, size_t z)
 }
     
 
+/* Return the address of the given frame in a memory mapped,
+ * interleaved device buffer */
+
+static signed short* area_frame(const snd_pcm_channel_area_t *area,
+                                snd_pcm_uframes_t offset)
+{
+    assert(area->step == DEVICE_CHANNELS * 16);
+    assert(area->first % 8 == 0);
+
+    return (signed short*)((char*)area->addr
+                           + (area->first + offset * area->step) / 8);
+}
+
+
+/* Render a period of audio directly into the device buffer, for
+ * playback */
+
+static int mmap_playback(struct device *dv)
+{
+    int r;
+    snd_pcm_uframes_t done;
+    struct alsa *alsa = (struct alsa*)dv->local;
+    struct alsa_pcm *pcm = &alsa->playback;
+
+    r = snd_pcm_avail_update(pcm->pcm);
+    if (r < 0)
+        return r;
+
+    /* The buffer may wrap, so take two parts */
+
+    for (done = 0; done < pcm->period;) {
+        const snd_pcm_channel_area_t *area;
+        snd_pcm_uframes_t offset, frames;
+        snd_pcm_sframes_t c;
+
+        frames = pcm->period - done;
+        r = snd_pcm_mmap_begin(pcm->pcm, &area, &offset, &frames);
+        if (r < 0)
+            return r;
+
+        if (frames == 0)
+            break;
+
+        device_collect(dv, pcm->collect, frames);
+        device_to_s16(area_frame(area, offset), pcm->collect, frames);
+
+        c = snd_pcm_mmap_commit(pcm->pcm, offset, frames);
+        if (c < 0)
+            return c;
+
+        done += frames;
+    }
+
+    if (done < pcm->period)
+        stats_underrun(&dv->stats);
+
+    /* Unlike snd_pcm_writei(), a commit does not start the device */
+
+    if (snd_pcm_state(pcm->pcm) == SND_PCM_STATE_PREPARED) {
+        r = snd_pcm_start(pcm->pcm);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+
+/* Pass all the captured audio in the device buffer through to the
+ * timecoder */
+
+static int mmap_capture(struct device *dv)
+{
+    snd_pcm_sframes_t avail;
+    struct alsa *alsa = (struct alsa*)dv->local;
+    struct alsa_pcm *pcm = &alsa->capture;
+
+    avail = snd_pcm_avail_update(pcm->pcm);
+    if (avail < 0)
+        return avail;
+
+    while (avail > 0) {
+        int r;
+        const snd_pcm_channel_area_t *area;
+        snd_pcm_uframes_t offset, frames;
+        snd_pcm_sframes_t c;
+
+        frames = avail;
+        r = snd_pcm_mmap_begin(pcm->pcm, &area, &offset, &frames);
+        if (r < 0)
+            return r;
+
+        if (frames == 0)
+            break;
+
+        device_submit(dv, area_frame(area, offset), frames);
+
+        c = snd_pcm_mmap_commit(pcm->pcm, offset, frames);
+        if (c < 0)
+            return c;
+
+        avail -= frames;
+    }
+
+    return 0;
+}
+
+
 /* Collect audio from the player and push it into the device's buffer,
  * for playback */
 
@@ -249,17 +385,20 @@ static int playback(struct device *dv)
     int r;
     struct alsa *alsa = (struct alsa*)dv->local;
 
-    device_collect(dv, alsa->playback.buf, alsa->playback.period);
+    if (alsa->playback.mmap)
+        return mmap_playback(dv);
+
+    device_collect(dv, alsa->playback.collect, alsa->playback.period);
+    device_to_s16(alsa->playback.buf, alsa->playback.collect,
+                  alsa->playback.period);
 
     r = snd_pcm_writei(alsa->playback.pcm, alsa->playback.buf,
                        alsa->playback.period);
     if (r < 0)
         return r;
         
-    if (r < alsa->playback.period) {
-        fprintf(stderr, "alsa: playback underrun %d/%ld.\n", r,
-                alsa->playback.period);
-    }
+    if (r < alsa->playback.period)
+        stats_underrun(&dv->stats);
 
     return 0;
 }
@@ -273,15 +412,16 @@ static int capture(struct device *dv)
     int r;
     struct alsa *alsa = (struct alsa*)dv->local;
 
+    if (alsa->capture.mmap)
+        return mmap_capture(dv);
+
     r = snd_pcm_readi(alsa->capture.pcm, alsa->capture.buf,
                       alsa->capture.period);
     if (r < 0)
         return r;
     
-    if (r < alsa->capture.period) {
-        fprintf(stderr, "alsa: capture underrun %d/%ld.\n",
-                r, alsa->capture.period);
-    }
+    if (r < alsa->capture.period)
+        stats_underrun(&dv->stats);
 
     device_submit(dv, alsa->capture.buf, r);
 
@@ -309,7 +449,7 @@ static int handle(struct device *dv)
         
         if (r < 0) {
             if (r == -EPIPE) {
-                fputs("ALSA: capture xrun.\n", stderr);
+                stats_xrun(&dv->stats);
 
                 r = snd_pcm_prepare(alsa->capture.pcm);
                 if (r < 0) {
@@ -341,7 +481,7 @@ static int handle(struct device *dv)
         
         if (r < 0) {
             if (r == -EPIPE) {
-                fputs("ALSA: playback xrun.\n", stderr);
+                stats_xrun(&dv->stats);
                 
                 r = snd_pcm_prepare(alsa->playback.pcm);
                 if (r < 0) {
@@ -0,0 +1,608 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Records which the scanner gave no tempo are imported again, at a
+ * low sample rate and a low priority, to find one. Where there is a
+ * cache directory, what is found is kept there, against the size and
+ * modification time of each file, so each is only analysed once.
+ *
+ * The results are given to the library in batches, with the rig lock
+ * held, so the rest of the program is never held up for long.
+ *
+ * Only the records in the library at the start are analysed.
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "analysis.h"
+#include "bpm.h"
+#include "debug.h"
+#include "external.h"
+#include "library.h"
+#include "mutex.h"
+#include "rig.h"
+#include "track.h"
+
+#define RATE 11025 /* Hz, of the audio analysed */
+
+/* Lower in priority than any import of a track; see ioprio_set(2) */
+
+#define NICE 19
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define BATCH 256 /* results given to the library at once */
+#define FRAME (TRACK_CHANNELS * sizeof(signed short)) /* bytes */
+
+/* Result from a previous run */
+
+struct known {
+    char *pathname;
+    long long size, sec, nsec;
+    double bpm;
+    size_t line; /* later lines replace earlier ones */
+};
+
+struct worker {
+    pthread_t ph;
+    pid_t pid; /* of the importer, or 0 if not running */
+};
+
+struct result {
+    struct record *record;
+    double bpm;
+};
+
+static const char *dir = NULL, *importer;
+static struct library *library;
+
+static struct known *known;
+static size_t nknown;
+static int results = -1; /* file to add to, or -1 if none */
+
+static struct record **job;
+static size_t jobs, next;
+
+static mutex lock; /* of the pids */
+static struct worker worker[ANALYSIS_MAX_THREADS];
+static unsigned int workers;
+static bool stopping;
+
+/*
+ * Keep what is found in the given directory; otherwise each record is
+ * analysed on every run
+ */
+
+void analysis_set_dir(const char *d)
+{
+    dir = d;
+}
+
+static int known_cmp(const void *a, const void *b)
+{
+    const struct known *x = a, *y = b;
+    int r;
+
+    r = strcmp(x->pathname, y->pathname);
+    if (r != 0)
+        return r;
+
+    if (x->line < y->line)
+        return -1;
+    else
+        return x->line > y->line;
+}
+
+/*
+ * Read the results of previous runs, one to a line:
+ *
+ *   <bpm> <size> <seconds> <nanoseconds> <pathname>
+ *
+ * Return: -1 on memory allocation failure, otherwise 0
+ */
+
+static int read_known(FILE *f)
+{
+    char *buf;
+    size_t size, n, m;
+    ssize_t z;
+
+    buf = NULL;
+    size = 0;
+
+    while ((z = getline(&buf, &size, f)) != -1) {
+        struct known *k;
+        int offset;
+
+        if (z > 0 && buf[z - 1] == '\n')
+            buf[z - 1] = '\0';
+
+        if (nknown % 1024 == 0) {
+            k = realloc(known, sizeof *k * (nknown + 1024));
+            if (k == NULL) {
+                perror("realloc");
+                free(buf);
+                return -1;
+            }
+            known = k;
+        }
+
+        k = &known[nknown];
+
+        if (sscanf(buf, "%lf %lld %lld %lld %n", &k->bpm, &k->size,
+                   &k->sec, &k->nsec, &offset) != 4)
+        {
+            continue; /* ignore what cannot be read */
+        }
+
+        k->pathname = strdup(buf + offset);
+        if (k->pathname == NULL) {
+            perror("strdup");
+            free(buf);
+            return -1;
+        }
+
+        k->line = nknown++;
+    }
+
+    free(buf);
+
+    /* Keep only the latest result for each file */
+
+    if (nknown == 0)
+        return 0;
+
+    qsort(known, nknown, sizeof *known, known_cmp);
+
+    for (n = 0, m = 0; n < nknown; n++) {
+        if (n + 1 < nknown
+            && strcmp(known[n].pathname, known[n + 1].pathname) == 0)
+        {
+            free(known[n].pathname);
+            continue;
+        }
+
+        known[m++] = known[n];
+    }
+
+    nknown = m;
+    return 0;
+}
+
+/*
+ * Open the file of results in the cache directory, and read what is
+ * in it already
+ *
+ * Return: -1 on fatal error, otherwise 0
+ */
+
+static int open_results(void)
+{
+    char *pathname;
+    FILE *f;
+    int r;
+
+    if (dir == NULL)
+        return 0;
+
+    if (asprintf(&pathname, "%s/bpm", dir) == -1) {
+        perror("asprintf");
+        return -1;
+    }
+
+    r = 0;
+
+    results = open(pathname, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (results == -1) {
+        perror(pathname); /* not fatal, nothing is kept */
+        goto done;
+    }
+
+    f = fopen(pathname, "r");
+    if (f == NULL) {
+        perror(pathname);
+        goto done;
+    }
+
+    r = read_known(f);
+    fclose(f);
+
+ done:
+    free(pathname);
+    return r;
+}
+
+/*
+ * Return: previous result for the file as it is now, or NULL if none
+ */
+
+static const struct known* find_known(const char *pathname,
+                                      const struct stat *st)
+{
+    size_t lo, hi;
+
+    lo = 0;
+    hi = nknown;
+
+    while (lo < hi) {
+        size_t mid;
+        const struct known *k;
+        int r;
+
+        mid = lo + (hi - lo) / 2;
+        k = &known[mid];
+
+        r = strcmp(pathname, k->pathname);
+        if (r == 0) {
+            if (k->size != st->st_size
+                || k->sec != st->st_mtim.tv_sec
+                || k->nsec != st->st_mtim.tv_nsec)
+            {
+                return NULL; /* file has changed */
+            }
+            return k;
+        }
+
+        if (r < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Keep the result for a file, for future runs
+ *
+ * Each line is a single write to a file opened for appending, so
+ * workers do not mix up their lines.
+ */
+
+static void keep(const char *pathname, const struct stat *st, double bpm)
+{
+    char *line;
+    int z;
+
+    if (results == -1)
+        return;
+
+    if (strchr(pathname, '\n') != NULL)
+        return;
+
+    z = asprintf(&line, "%.3f %lld %lld %lld %s\n", bpm,
+                 (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+                 (long long)st->st_mtim.tv_nsec, pathname);
+    if (z == -1) {
+        perror("asprintf");
+        return;
+    }
+
+    if (write(results, line, z) != z)
+        perror("write");
+
+    free(line);
+}
+
+/*
+ * Give results to the library
+ */
+
+static void apply(struct result *r, size_t *n)
+{
+    size_t m;
+
+    if (*n == 0)
+        return;
+
+    rig_lock();
+
+    for (m = 0; m < *n; m++)
+        library_set_bpm(library, r[m].record, r[m].bpm);
+
+    rig_unlock();
+
+    *n = 0;
+}
+
+/*
+ * Import a file and find its tempo
+ *
+ * Return: tempo, 0.0 if it has none or -1.0 on error
+ */
+
+static double analyse(struct worker *w, const char *pathname)
+{
+    char rate[16];
+    unsigned char buf[65536];
+    size_t fill;
+    int fd, status;
+    bool full;
+    pid_t pid;
+    struct bpm b;
+    double r;
+
+    snprintf(rate, sizeof rate, "%d", RATE);
+
+    pid = fork_pipe(&fd, importer, "import", pathname, rate, NULL);
+    if (pid == -1)
+        return -1.0;
+
+    /* From now on, analysis_stop() can end the import */
+
+    mutex_lock(&lock);
+    w->pid = pid;
+    if (stopping)
+        kill(pid, SIGTERM);
+    mutex_unlock(&lock);
+
+    full = false;
+
+    if (bpm_init(&b, RATE) == -1) {
+        r = -1.0;
+        goto done;
+    }
+
+    r = 0.0;
+    fill = 0;
+
+    for (;;) {
+        ssize_t z;
+        size_t frames;
+
+        z = read(fd, buf + fill, sizeof buf - fill);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            r = -1.0;
+            break;
+        }
+
+        if (z == 0)
+            break;
+
+        fill += z;
+        frames = fill / FRAME;
+
+        if (bpm_add(&b, (signed short*)buf, frames) == -1) {
+            r = -1.0;
+            break;
+        }
+
+        if (bpm_is_full(&b)) {
+            full = true;
+            break;
+        }
+
+        fill -= frames * FRAME;
+        memmove(buf, buf + frames * FRAME, fill);
+    }
+
+    if (r == 0.0)
+        r = bpm_result(&b);
+
+    bpm_clear(&b);
+
+ done:
+    mutex_lock(&lock);
+    if (full || r == -1.0)
+        kill(pid, SIGTERM); /* the rest of the audio is not needed */
+    w->pid = 0;
+    mutex_unlock(&lock);
+
+    if (close(fd) == -1)
+        abort();
+
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return -1.0;
+    }
+
+    if (!full && (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS))
+        return -1.0;
+
+    return r;
+}
+
+/*
+ * The thread of each worker, which takes records from the list until
+ * there are none left
+ */
+
+static void* launch(void *p)
+{
+    struct worker *w = p;
+    struct result result[BATCH];
+    size_t n, nresult;
+    pid_t tid;
+
+    /* The importer runs with the same priority */
+
+    tid = syscall(SYS_gettid);
+
+    if (setpriority(PRIO_PROCESS, tid, NICE) == -1)
+        debug("setpriority: %s", strerror(errno));
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+    {
+        debug("ioprio_set: %s", strerror(errno));
+    }
+
+    nresult = 0;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        struct record *re;
+        const struct known *k;
+        struct stat st;
+        double bpm;
+
+        n = __sync_fetch_and_add(&next, 1);
+        if (n >= jobs)
+            break;
+
+        re = job[n];
+
+        if (stat(re->pathname, &st) == -1)
+            continue;
+
+        k = find_known(re->pathname, &st);
+        if (k != NULL) {
+            bpm = k->bpm;
+        } else {
+            apply(result, &nresult); /* rather than wait for the import */
+
+            bpm = analyse(w, re->pathname);
+            if (bpm == -1.0)
+                continue;
+
+            keep(re->pathname, &st, bpm);
+        }
+
+        if (bpm == 0.0)
+            continue;
+
+        result[nresult].record = re;
+        result[nresult].bpm = bpm;
+        nresult++;
+
+        if (k == NULL || nresult == BATCH)
+            apply(result, &nresult);
+    }
+
+    apply(result, &nresult);
+
+    return NULL;
+}
+
+/*
+ * Find the tempo of the records in the library which do not have one
+ *
+ * Return: -1 on error, otherwise 0
+ * Pre: the library is not in use by another thread
+ */
+
+int analysis_start(struct library *lib, const char *imp, unsigned int threads)
+{
+    size_t n;
+    const struct listing *all;
+
+    library = lib;
+    importer = imp;
+    stopping = false;
+    workers = 0;
+    mutex_init(&lock);
+
+    if (open_results() == -1) {
+        mutex_clear(&lock);
+        return -1;
+    }
+
+    all = &lib->all.by_order;
+
+    job = malloc(sizeof *job * (all->entries + 1)); /* never zero bytes */
+    if (job == NULL) {
+        perror("malloc");
+        analysis_stop();
+        return -1;
+    }
+
+    jobs = 0;
+    next = 0;
+
+    for (n = 0; n < all->entries; n++) {
+        if (all->record[n]->bpm == 0.0)
+            job[jobs++] = all->record[n];
+    }
+
+    fprintf(stderr, "Finding the tempo of %zu records...\n", jobs);
+
+    for (workers = 0; workers < threads; workers++) {
+        struct worker *w = &worker[workers];
+        int r;
+
+        w->pid = 0;
+
+        r = pthread_create(&w->ph, NULL, launch, w);
+        if (r != 0) {
+            errno = r;
+            perror("pthread_create");
+            analysis_stop();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the workers, including any import they are waiting on
+ */
+
+void analysis_stop(void)
+{
+    size_t n;
+
+    mutex_lock(&lock);
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+
+    for (n = 0; n < workers; n++) {
+        if (worker[n].pid != 0)
+            kill(worker[n].pid, SIGTERM);
+    }
+
+    mutex_unlock(&lock);
+
+    for (n = 0; n < workers; n++) {
+        if (pthread_join(worker[n].ph, NULL) != 0)
+            abort();
+    }
+
+    for (n = 0; n < nknown; n++)
+        free(known[n].pathname);
+    free(known);
+    known = NULL;
+    nknown = 0;
+
+    if (results != -1) {
+        if (close(results) == -1)
+            abort();
+        results = -1;
+    }
+
+    free(job);
+    mutex_clear(&lock);
+}
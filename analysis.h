@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Pool of background workers which find the tempo of records from
+ * their audio
+ */
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#define ANALYSIS_MAX_THREADS 8
+
+struct library;
+
+void analysis_set_dir(const char *dir);
+
+int analysis_start(struct library *lib, const char *importer,
+                   unsigned int threads);
+void analysis_stop(void);
+
+#endif
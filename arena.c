@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Objects are placed one after another in large chunks, so they are
+ * close together in memory and there is no overhead per object. An
+ * arena is freed as a whole, never an object at a time.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define CHUNK_BYTES 262144
+#define ALIGN 16 /* suitable for any type */
+#define MIN_INTERN 1024 /* power of two */
+
+struct chunk {
+    struct chunk *next;
+    size_t size; /* bytes available for objects */
+};
+
+#define HEADER ((sizeof(struct chunk) + ALIGN - 1) & ~(size_t)(ALIGN - 1))
+
+void arena_init(struct arena *a)
+{
+    a->chunk = NULL;
+    a->used = 0;
+    a->intern = NULL;
+    a->interns = 0;
+    a->intern_size = 0;
+}
+
+/*
+ * Free the arena and every object allocated from it
+ */
+
+void arena_clear(struct arena *a)
+{
+    struct chunk *c, *next;
+
+    for (c = a->chunk; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+
+    free(a->intern);
+    arena_init(a);
+}
+
+/*
+ * Take on the objects of another arena, to be freed with this one
+ *
+ * Strings interned in the other arena are not shared with this one.
+ *
+ * Post: from is empty
+ */
+
+void arena_take(struct arena *a, struct arena *from)
+{
+    struct chunk *c;
+
+    if (from->chunk != NULL) {
+
+        /* Put the other chunks after the most recent, so it can still
+         * be filled */
+
+        for (c = from->chunk; c->next != NULL; c = c->next);
+
+        if (a->chunk == NULL) {
+            c->next = NULL;
+            a->chunk = from->chunk;
+            a->used = from->used;
+        } else {
+            c->next = a->chunk->next;
+            a->chunk->next = from->chunk;
+        }
+
+        from->chunk = NULL;
+    }
+
+    arena_clear(from);
+}
+
+/*
+ * Allocate memory from the arena
+ *
+ * Return: pointer to memory, or NULL on memory allocation failure
+ */
+
+void* arena_alloc(struct arena *a, size_t bytes)
+{
+    struct chunk *c;
+    size_t size;
+
+    bytes = (bytes + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+    c = a->chunk;
+    if (c != NULL && a->used + bytes <= c->size) {
+        void *p = (char*)c + HEADER + a->used;
+        a->used += bytes;
+        return p;
+    }
+
+    size = bytes > CHUNK_BYTES ? bytes : CHUNK_BYTES;
+
+    c = malloc(HEADER + size);
+    if (c == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    c->size = size;
+    c->next = a->chunk;
+    a->chunk = c;
+    a->used = bytes;
+
+    return (char*)c + HEADER;
+}
+
+/*
+ * Return: copy of the string, or NULL on memory allocation failure
+ */
+
+char* arena_strdup(struct arena *a, const char *s)
+{
+    char *p;
+    size_t len;
+
+    len = strlen(s) + 1;
+
+    p = arena_alloc(a, len);
+    if (p == NULL)
+        return NULL;
+
+    memcpy(p, s, len);
+    return p;
+}
+
+static size_t hash(const char *s)
+{
+    uint32_t h;
+
+    /* FNV-1a */
+
+    for (h = 2166136261U; *s != '\0'; s++)
+        h = (h ^ (unsigned char)*s) * 16777619U;
+
+    return h;
+}
+
+/*
+ * Return: the slot in the table which holds the given string, or
+ *     where it would go
+ */
+
+static char** find(char **table, size_t size, const char *s)
+{
+    size_t n;
+
+    for (n = hash(s) & (size - 1);; n = (n + 1) & (size - 1)) {
+        if (table[n] == NULL || strcmp(table[n], s) == 0)
+            return &table[n];
+    }
+}
+
+/*
+ * Double the size of the table of interned strings
+ *
+ * Return: -1 on memory allocation failure, otherwise 0
+ */
+
+static int grow(struct arena *a)
+{
+    size_t n, size;
+    char **table;
+
+    size = a->intern_size ? a->intern_size * 2 : MIN_INTERN;
+
+    table = calloc(size, sizeof *table);
+    if (table == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (n = 0; n < a->intern_size; n++) {
+        if (a->intern[n] != NULL)
+            *find(table, size, a->intern[n]) = a->intern[n];
+    }
+
+    free(a->intern);
+    a->intern = table;
+    a->intern_size = size;
+    return 0;
+}
+
+/*
+ * Copy a string which is likely to be repeated, such as the name of
+ * an artist, sharing any copy which is already in the arena
+ *
+ * The string is not to be modified, as it may be shared.
+ *
+ * Return: copy of the string, or NULL on memory allocation failure
+ */
+
+char* arena_intern(struct arena *a, const char *s)
+{
+    char **slot;
+
+    if (a->interns * 2 >= a->intern_size) {
+        if (grow(a) == -1)
+            return NULL;
+    }
+
+    slot = find(a->intern, a->intern_size, s);
+    if (*slot != NULL)
+        return *slot;
+
+    *slot = arena_strdup(a, s);
+    if (*slot == NULL)
+        return NULL;
+
+    a->interns++;
+    return *slot;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Allocation of many small objects which are all freed together
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct chunk;
+
+struct arena {
+    struct chunk *chunk; /* most recent first */
+    size_t used; /* bytes of the most recent chunk */
+
+    /* Strings which can be shared; see arena_intern() */
+
+    char **intern;
+    size_t interns, intern_size;
+};
+
+void arena_init(struct arena *a);
+void arena_clear(struct arena *a);
+void arena_take(struct arena *a, struct arena *from);
+
+void* arena_alloc(struct arena *a, size_t bytes);
+char* arena_strdup(struct arena *a, const char *s);
+char* arena_intern(struct arena *a, const char *s);
+
+#endif
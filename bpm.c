@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * The tempo is found from how the loudness of the audio rises at
+ * each beat. The rises are measured at a low rate, in a band for the
+ * kick drum and across all of the audio, and the period at which
+ * they best repeat (by autocorrelation) is the beat. Multiples of
+ * the beat, to several bars, make the period more precise than one
+ * value of the onsets.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bpm.h"
+#include "track.h"
+
+#define ONSET_RATE 172 /* Hz, roughly */
+#define LOW_BAND 150.0 /* Hz */
+#define FLOOR 1e-4 /* energy below which is taken as silence */
+
+#define MIN_SECONDS 10
+#define MIN_BPM 60.0
+#define MAX_BPM 200.0
+
+#define CENTRE_BPM 120.0 /* tempo preferred among multiples */
+#define SPREAD 1.0 /* in octaves */
+#define MULTIPLES 16
+#define MIN_STRENGTH 0.1 /* of the beat, relative to the whole */
+
+/*
+ * Start estimating the tempo of audio at the given sample rate
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+int bpm_init(struct bpm *b, unsigned int rate)
+{
+    b->hop = (rate + ONSET_RATE / 2) / ONSET_RATE;
+    if (b->hop == 0)
+        b->hop = 1;
+    b->rate = (double)rate / b->hop;
+
+    b->count = 0;
+    b->low = 0.0;
+    b->energy[0] = 0.0;
+    b->energy[1] = 0.0;
+    b->previous[0] = log(FLOOR);
+    b->previous[1] = log(FLOOR);
+
+    b->onset = NULL;
+    b->onsets = 0;
+    b->size = 0;
+
+    return 0;
+}
+
+void bpm_clear(struct bpm *b)
+{
+    free(b->onset);
+}
+
+static size_t max_onsets(const struct bpm *b)
+{
+    return b->rate * BPM_MAX_SECONDS;
+}
+
+/*
+ * Return: true if no more audio is needed
+ */
+
+bool bpm_is_full(const struct bpm *b)
+{
+    return b->onsets >= max_onsets(b);
+}
+
+/*
+ * Finish a hop, and work out how much louder it is than the last
+ *
+ * Return: 0 on success, -1 on memory allocation failure
+ */
+
+static int push(struct bpm *b)
+{
+    unsigned int n;
+    double o;
+
+    if (b->onsets == b->size) {
+        size_t size;
+        float *p;
+
+        size = b->size ? b->size * 2 : 4096;
+        p = realloc(b->onset, sizeof *p * size);
+        if (p == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        b->onset = p;
+        b->size = size;
+    }
+
+    o = 0.0;
+
+    for (n = 0; n < 2; n++) {
+        double e;
+
+        e = log(b->energy[n] / b->hop + FLOOR);
+        if (e > b->previous[n])
+            o += e - b->previous[n];
+
+        b->previous[n] = e;
+        b->energy[n] = 0.0;
+    }
+
+    b->onset[b->onsets++] = o;
+    b->count = 0;
+
+    return 0;
+}
+
+/*
+ * Add audio, as from an import, in order
+ *
+ * Audio beyond BPM_MAX_SECONDS is ignored.
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+int bpm_add(struct bpm *b, const signed short *pcm, size_t samples)
+{
+    double alpha;
+    size_t s;
+
+    alpha = 1.0 - exp(-2.0 * M_PI * LOW_BAND / (b->rate * b->hop));
+
+    for (s = 0; s < samples && !bpm_is_full(b); s++) {
+        double m;
+
+        m = (pcm[0] + pcm[1]) / 65536.0;
+        pcm += TRACK_CHANNELS;
+
+        b->low += alpha * (m - b->low);
+        b->energy[0] += b->low * b->low;
+        b->energy[1] += m * m;
+
+        if (++b->count == b->hop && push(b) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return: autocorrelation of the onsets, less their mean, at the
+ * given lag
+ */
+
+static double autocorrelate(const struct bpm *b, double mean,
+                            unsigned int lag)
+{
+    size_t n, z;
+    double sum;
+
+    z = b->onsets - lag;
+    sum = 0.0;
+
+    for (n = 0; n < z; n++)
+        sum += (b->onset[n] - mean) * (b->onset[n + lag] - mean);
+
+    return sum / z;
+}
+
+/*
+ * Return: position of the peak between three equally spaced values,
+ * relative to the middle one
+ */
+
+static double interpolate(double before, double at, double after)
+{
+    double d;
+
+    d = before - 2.0 * at + after;
+    if (d >= 0.0)
+        return 0.0; /* not a peak */
+
+    return 0.5 * (before - after) / d;
+}
+
+/*
+ * Return: the best peak of the autocorrelation within the given lags,
+ * or 0.0 if there is none
+ */
+
+static double find_peak(const struct bpm *b, double mean, unsigned int lo,
+                        unsigned int hi, bool weighted)
+{
+    unsigned int lag, best;
+    double r, weight, score, best_score, before, after;
+
+    best = 0;
+    best_score = 0.0;
+
+    for (lag = lo; lag <= hi; lag++) {
+        r = autocorrelate(b, mean, lag);
+
+        if (weighted) {
+            double octaves;
+
+            octaves = log2(60.0 * b->rate / lag / CENTRE_BPM) / SPREAD;
+            weight = exp(-0.5 * octaves * octaves);
+        } else {
+            weight = 1.0;
+        }
+
+        score = r * weight;
+        if (score > best_score) {
+            best = lag;
+            best_score = score;
+        }
+    }
+
+    if (best == 0)
+        return 0.0;
+
+    before = autocorrelate(b, mean, best - 1);
+    after = autocorrelate(b, mean, best + 1);
+
+    return best + interpolate(before, autocorrelate(b, mean, best), after);
+}
+
+/*
+ * Return: tempo of the audio added so far in beats per minute, or
+ * 0.0 if it has none which can be found
+ */
+
+double bpm_result(const struct bpm *b)
+{
+    unsigned int k, lo, hi;
+    size_t n;
+    double mean, period, sum, weight;
+
+    if (b->onsets < b->rate * MIN_SECONDS)
+        return 0.0;
+
+    mean = 0.0;
+    for (n = 0; n < b->onsets; n++)
+        mean += b->onset[n];
+    mean /= b->onsets;
+
+    lo = floor(60.0 * b->rate / MAX_BPM);
+    hi = ceil(60.0 * b->rate / MIN_BPM);
+    if (lo < 2)
+        lo = 2;
+
+    period = find_peak(b, mean, lo, hi, true);
+    if (period == 0.0)
+        return 0.0;
+
+    /* A beat repeats much of the rise in loudness; audio without one
+     * repeats little, at any period */
+
+    if (autocorrelate(b, mean, lround(period))
+        < MIN_STRENGTH * autocorrelate(b, mean, 0))
+    {
+        return 0.0;
+    }
+
+    /* Each multiple is another measure of the period, with an error
+     * which is smaller in proportion */
+
+    sum = period;
+    weight = 1.0;
+
+    for (k = 2; k <= MULTIPLES; k++) {
+        double p, at;
+
+        at = k * sum / weight;
+        if (at + 3 >= b->onsets / 2)
+            break;
+
+        p = find_peak(b, mean, lround(at) - 2, lround(at) + 2, false);
+        if (p == 0.0)
+            continue;
+
+        sum += p * k;
+        weight += k * k;
+    }
+
+    return 60.0 * b->rate / (sum / weight);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Estimate the tempo of a track from its audio
+ */
+
+#ifndef BPM_H
+#define BPM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BPM_MAX_SECONDS 600 /* of audio looked at */
+
+struct bpm {
+    unsigned int hop; /* samples to each value of the onsets */
+    double rate; /* of the onsets, in Hz */
+
+    unsigned int count; /* samples in the current hop */
+    double low, /* state of the filter */
+        energy[2], previous[2]; /* of the low band, and all of it */
+
+    float *onset;
+    size_t onsets, size; /* used, and allocated */
+};
+
+int bpm_init(struct bpm *b, unsigned int rate);
+void bpm_clear(struct bpm *b);
+
+int bpm_add(struct bpm *b, const signed short *pcm, size_t samples);
+bool bpm_is_full(const struct bpm *b);
+
+double bpm_result(const struct bpm *b);
+
+#endif
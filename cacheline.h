@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Layout of structures which are shared between threads
+ */
+
+#ifndef CACHELINE_H
+#define CACHELINE_H
+
+/* Fields written by one thread are kept apart from those used by
+ * another, on cache lines of their own, so that a write does not take
+ * the line away from a thread which only uses its neighbours */
+
+#define CACHE_LINE 64 /* bytes */
+
+#endif
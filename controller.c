@@ -18,18 +18,19 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "controller.h"
 #include "deck.h"
 #include "debug.h"
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
-
 void controller_init(struct controller *c, struct controller_ops *ops)
 {
     debug("%p", c);
     c->fault = false;
     c->ops = ops;
+    c->output = false;
 }
 
 void controller_clear(struct controller *c)
@@ -40,18 +41,33 @@ void controller_clear(struct controller *c)
 
 /*
  * Add a deck to this controller, if possible
+ *
+ * Return: -1 on error, otherwise 0 (even if the controller has no
+ *     room for the deck)
  */
 
-void controller_add_deck(struct controller *c, struct deck *d)
+int controller_add_deck(struct controller *c, struct deck *d)
 {
+    struct controller **p;
+
     debug("%p adding deck %p", c, d);
 
+    /* Make room for the callback first, so a deck is never added
+     * without one */
+
+    p = realloc(d->control, sizeof *p * (d->ncontrol + 1));
+    if (p == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    d->control = p;
+
     if (c->ops->add_deck(c, d) == 0) {
         debug("deck was added");
-
-        assert(d->ncontrol < ARRAY_SIZE(d->control)); /* FIXME: report error */
         d->control[d->ncontrol++] = c; /* for callbacks */
     }
+
+    return 0;
 }
 
 /*
@@ -82,3 +98,33 @@ void controller_handle(struct controller *c)
         fputs("Error handling hardware controller; disabling it\n", stderr);
     }
 }
+
+/*
+ * Ask for the output of the controller to be written, such as a
+ * change to its LEDs
+ *
+ * The realtime thread only sets a flag; the rig calls the flush
+ * function of the controller soon after, to do the work.
+ */
+
+void controller_post_output(struct controller *c)
+{
+    __atomic_store_n(&c->output, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write any output which has been posted
+ *
+ * Pre: not called from a realtime thread
+ */
+
+void controller_flush(struct controller *c)
+{
+    if (c->ops->flush == NULL)
+        return;
+
+    if (!__atomic_exchange_n(&c->output, false, __ATOMIC_ACQUIRE))
+        return;
+
+    c->ops->flush(c);
+}
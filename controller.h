@@ -25,6 +25,8 @@
 #include <sys/poll.h>
 #include <sys/types.h>
 
+#include "list.h"
+
 struct deck;
 
 /*
@@ -36,6 +38,12 @@ struct controller {
     bool fault;
     void *local;
     struct controller_ops *ops;
+
+    /* Output is written by the rig, so the realtime thread does not
+     * spend its time on it; see controller_post_output() */
+
+    struct list rig;
+    bool output; /* posted, and not yet written */
 };
 
 /*
@@ -47,6 +55,7 @@ struct controller_ops {
 
     ssize_t (*pollfds)(struct controller *c, struct pollfd *pe, size_t z);
     int (*realtime)(struct controller *c);
+    void (*flush)(struct controller *c); /* optional; not realtime */
 
     void (*clear)(struct controller *c);
 };
@@ -54,8 +63,11 @@ struct controller_ops {
 void controller_init(struct controller *c, struct controller_ops *t);
 void controller_clear(struct controller *c);
 
-void controller_add_deck(struct controller *c, struct deck *d);
+int controller_add_deck(struct controller *c, struct deck *d);
 ssize_t controller_pollfds(struct controller *c, struct pollfd *pe, size_t z);
 void controller_handle(struct controller *c);
 
+void controller_post_output(struct controller *c);
+void controller_flush(struct controller *c);
+
 #endif
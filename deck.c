@@ -18,6 +18,7 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 
 #include "controller.h"
 #include "cues.h"
@@ -40,23 +41,31 @@ static const struct record no_record = {
  * A deck is a logical grouping of the various components which
  * reflects the user's view on a deck in the system.
  *
- * Pre: deck->device, deck->timecoder, deck->importer are valid
+ * The deck's audio is handled by the given realtime thread.
+ *
+ * Pre: deck->device, deck->timecoder, deck->importer,
+ *     deck->resampler, deck->recording are valid
  */
 
-int deck_init(struct deck *deck, struct rt *rt)
+int deck_init(struct deck *deck, struct rt *rt, unsigned int thread)
 {
     unsigned int rate;
 
     assert(deck->importer != NULL);
+    assert(deck->resampler != NULL);
+
+    if (stats_register(&deck->device.stats) == -1)
+        return -1;
 
-    if (rt_add_device(rt, &deck->device) == -1)
+    if (rt_add_device(rt, &deck->device, thread) == -1)
         return -1;
 
     deck->ncontrol = 0;
+    deck->control = NULL;
     deck->record = &no_record;
-    deck->punch = NO_PUNCH;
     rate = device_sample_rate(&deck->device);
     player_init(&deck->player, rate, track_get_empty(), &deck->timecoder);
+    player_set_resampler(&deck->player, deck->resampler);
     cues_reset(&deck->cues);
 
     /* The timecoder and player are driven by requests from
@@ -65,15 +74,28 @@ int deck_init(struct deck *deck, struct rt *rt)
     device_connect_timecoder(&deck->device, &deck->timecoder);
     device_connect_player(&deck->device, &deck->player);
 
+    /* Optionally, what the player outputs is also recorded */
+
+    if (deck->recording != NULL) {
+        if (recorder_init(&deck->recorder, deck->recording, rate) == -1)
+            return -1;
+        device_connect_recorder(&deck->device, &deck->recorder);
+    } else {
+        device_connect_recorder(&deck->device, NULL);
+    }
+
     return 0;
 }
 
 void deck_clear(struct deck *deck)
 {
     /* FIXME: remove from rig and rt */
+    free(deck->control);
     player_clear(&deck->player);
     timecoder_clear(&deck->timecoder);
     device_clear(&deck->device);
+    if (deck->recording != NULL)
+        recorder_clear(&deck->recorder);
 }
 
 bool deck_is_locked(const struct deck *deck)
@@ -92,10 +114,13 @@ void deck_load(struct deck *deck, struct record *record)
     if (deck_is_locked(deck))
         return;
 
-    t = track_get_by_import(deck->importer, record->pathname);
+    t = track_get_by_import(deck->importer, record->pathname,
+                            device_sample_rate(&deck->device), false);
     if (t == NULL)
         return;
 
+    track_keep(t);
+
     deck->record = record;
     player_set_track(&deck->player, t); /* passes reference */
 }
@@ -146,20 +171,13 @@ void deck_cue(struct deck *d, unsigned int label)
 
 void deck_punch_in(struct deck *d, unsigned int label)
 {
-    double p, e;
+    double p;
 
-    e = player_get_elapsed(&d->player);
     p = cues_get(&d->cues, label);
-    if (p == CUE_UNSET) {
-        cues_set(&d->cues, label, e);
-        return;
-    }
-
-    if (d->punch != NO_PUNCH)
-        e -= d->punch;
-
-    player_seek_to(&d->player, p);
-    d->punch = p - e;
+    if (p == CUE_UNSET)
+        cues_set(&d->cues, label, player_get_elapsed(&d->player));
+    else
+        player_punch_in(&d->player, p);
 }
 
 /*
@@ -168,12 +186,5 @@ void deck_punch_in(struct deck *d, unsigned int label)
 
 void deck_punch_out(struct deck *d)
 {
-    double e;
-
-    if (d->punch == NO_PUNCH)
-        return;
-
-    e = player_get_elapsed(&d->player);
-    player_seek_to(&d->player, e - d->punch);
-    d->punch = NO_PUNCH;
+    player_punch_out(&d->player);
 }
@@ -20,38 +20,48 @@
 #ifndef DECK_H
 #define DECK_H
 
-#include <math.h>
-
+#include "cacheline.h"
 #include "cues.h"
 #include "device.h"
 #include "listing.h"
 #include "player.h"
 #include "realtime.h"
+#include "recorder.h"
 #include "timecoder.h"
 
-#define NO_PUNCH (HUGE_VAL)
+/* Decks are next to each other in an array, and may be handled by
+ * different realtime threads; each part of a deck begins on a cache
+ * line of its own, and so does each deck */
 
 struct deck {
+    /* The work of the realtime thread, every period */
+
     struct device device;
     struct timecoder timecoder;
+    struct player player;
+
+    /* Set when the deck is created, then only read */
+
     const char *importer;
+    struct resampler *resampler;
     bool protect;
+    const char *recording; /* pathname, or NULL */
 
-    struct player player;
-    const struct record *record;
-    struct cues cues;
+    struct recorder recorder;
 
-    /* Punch */
+    /* Changed by the interface and the controllers */
 
-    double punch;
+    const struct record *record
+        __attribute__ ((aligned(CACHE_LINE)));
+    struct cues cues;
 
     /* A controller adds itself here */
 
     size_t ncontrol;
-    struct controller *control[4];
+    struct controller **control;
 };
 
-int deck_init(struct deck *deck, struct rt *rt);
+int deck_init(struct deck *deck, struct rt *rt, unsigned int thread);
 void deck_clear(struct deck *deck);
 
 bool deck_is_locked(const struct deck *deck);
@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * WAV and AIFF files hold audio which needs no decoding, only
+ * conversion to the format of a track. These are read directly, and
+ * any file which is not recognised, or which would need resampling,
+ * is left for the external importer.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "decoder.h"
+#include "pack.h"
+#include "track.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+struct decoder {
+    const char *name;
+    const char magic[4], type[2][4]; /* at bytes 0 and 8 */
+    int (*open)(struct decode *d, unsigned int rate);
+};
+
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static unsigned int be16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Read from the file until the buffer is full, or the end of file
+ *
+ * Return: number of bytes read, or -1 on error
+ */
+
+static ssize_t read_fully(int fd, void *buf, size_t len)
+{
+    size_t t;
+
+    t = 0;
+
+    while (t < len) {
+        ssize_t z;
+
+        z = read(fd, (char*)buf + t, len - t);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return -1;
+        }
+
+        if (z == 0)
+            break;
+
+        t += z;
+    }
+
+    return t;
+}
+
+/*
+ * Read the body of a chunk, which must fit in the buffer
+ *
+ * Return: -1 if it could not be read in full, otherwise 0
+ */
+
+static int read_chunk(struct decode *d, uint32_t size)
+{
+    if (size > sizeof d->buf)
+        return -1;
+
+    if (read_fully(d->fd, d->buf, size) != size)
+        return -1;
+
+    if (size & 1) /* chunks are padded to an even length */
+        return lseek(d->fd, 1, SEEK_CUR) == -1 ? -1 : 0;
+
+    return 0;
+}
+
+static int skip_chunk(struct decode *d, uint32_t size)
+{
+    if (lseek(d->fd, (off_t)size + (size & 1), SEEK_CUR) == -1)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Return: -1 if the format is not one which is read natively,
+ *     otherwise 0
+ * Post: if 0, d->frame is the size of one frame
+ */
+
+static int check_format(struct decode *d, unsigned int rate,
+                        unsigned int r)
+{
+    if (r != rate) {
+        debug("sample rate is %u, not %u", r, rate);
+        return -1;
+    }
+
+    if (d->channels < 1 || d->channels > TRACK_CHANNELS)
+        return -1;
+
+    if (d->is_float) {
+        if (d->bits != 32)
+            return -1;
+    } else {
+        if (d->bits != 8 && d->bits != 16 && d->bits != 24 && d->bits != 32)
+            return -1;
+    }
+
+    d->frame = d->channels * d->bits / 8;
+    return 0;
+}
+
+/*
+ * Read the header of a RIFF WAVE file, after its type
+ *
+ * Return: -1 if the file is not read natively, otherwise 0
+ * Post: if 0, the file is at the start of the audio
+ */
+
+static int open_wav(struct decode *d, unsigned int rate)
+{
+    bool fmt;
+    unsigned int tag, r;
+
+    fmt = false;
+    tag = 0;
+    r = 0;
+
+    for (;;) {
+        unsigned char c[8];
+        uint32_t size;
+
+        if (read_fully(d->fd, c, sizeof c) != sizeof c)
+            return -1;
+
+        size = le32(c + 4);
+
+        if (!memcmp(c, "fmt ", 4)) {
+            if (size < 16 || read_chunk(d, size) == -1)
+                return -1;
+
+            tag = le16(d->buf);
+            d->channels = le16(d->buf + 2);
+            r = le32(d->buf + 4);
+            d->bits = le16(d->buf + 14);
+
+            if (tag == 0xfffe) { /* WAVE_FORMAT_EXTENSIBLE */
+                if (size < 26)
+                    return -1;
+                tag = le16(d->buf + 24); /* from the GUID */
+            }
+
+            fmt = true;
+
+        } else if (!memcmp(c, "data", 4)) {
+            if (!fmt)
+                return -1;
+
+            /* A file which was streamed may not give its length */
+
+            if (size == 0 || size == 0xffffffff)
+                d->remain = UINT64_MAX;
+            else
+                d->remain = size;
+
+            break;
+
+        } else {
+            if (skip_chunk(d, size) == -1)
+                return -1;
+        }
+    }
+
+    d->big_endian = false;
+
+    switch (tag) {
+    case 1: /* PCM */
+        d->is_float = false;
+        d->is_unsigned = (d->bits == 8);
+        break;
+
+    case 3: /* IEEE float */
+        d->is_float = true;
+        d->is_unsigned = false;
+        break;
+
+    default:
+        return -1;
+    }
+
+    return check_format(d, rate, r);
+}
+
+/*
+ * Return: the sample rate given as an 80-bit extended precision
+ *     number, or 0 if it is not valid
+ */
+
+static unsigned int extended_rate(const unsigned char *p)
+{
+    int e;
+    uint64_t m;
+
+    if (p[0] & 0x80) /* negative */
+        return 0;
+
+    e = be16(p) - 16383 - 63;
+    m = (uint64_t)be32(p + 2) << 32 | be32(p + 6);
+
+    if (e > 0 || e < -63)
+        return 0;
+
+    return m >> -e;
+}
+
+/*
+ * Read the header of an AIFF or AIFF-C file, after its type
+ *
+ * Return: -1 if the file is not read natively, otherwise 0
+ * Post: if 0, the file is at the start of the audio
+ */
+
+static int open_aiff(struct decode *d, unsigned int rate)
+{
+    bool comm;
+    unsigned int r;
+
+    comm = false;
+    r = 0;
+
+    d->big_endian = true;
+    d->is_unsigned = false;
+    d->is_float = false;
+
+    for (;;) {
+        unsigned char c[8];
+        uint32_t size, offset;
+
+        if (read_fully(d->fd, c, sizeof c) != sizeof c)
+            return -1;
+
+        size = be32(c + 4);
+
+        if (!memcmp(c, "COMM", 4)) {
+            if (size < 18 || read_chunk(d, size) == -1)
+                return -1;
+
+            d->channels = be16(d->buf);
+            d->bits = (be16(d->buf + 6) + 7) / 8 * 8; /* left-justified */
+            r = extended_rate(d->buf + 8);
+
+            /* AIFF-C gives a compression type; only those which are
+             * not compressed at all are read */
+
+            if (size >= 22) {
+                const unsigned char *type = d->buf + 18;
+
+                if (!memcmp(type, "sowt", 4)) {
+                    d->big_endian = false;
+                } else if (!memcmp(type, "fl32", 4)
+                           || !memcmp(type, "FL32", 4))
+                {
+                    d->is_float = true;
+                } else if (memcmp(type, "NONE", 4)
+                           && memcmp(type, "twos", 4))
+                {
+                    return -1;
+                }
+            }
+
+            comm = true;
+
+        } else if (!memcmp(c, "SSND", 4)) {
+            if (!comm || size < 8)
+                return -1;
+
+            if (read_fully(d->fd, c, sizeof c) != sizeof c)
+                return -1;
+
+            offset = be32(c);
+            if (offset > size - 8)
+                return -1;
+
+            if (lseek(d->fd, offset, SEEK_CUR) == -1)
+                return -1;
+
+            d->remain = size - 8 - offset;
+            break;
+
+        } else {
+            if (skip_chunk(d, size) == -1)
+                return -1;
+        }
+    }
+
+    return check_format(d, rate, r);
+}
+
+static const struct decoder decoders[] = {
+    {
+        .name = "WAV",
+        .magic = "RIFF",
+        .type = { "WAVE", "WAVE" },
+        .open = open_wav
+    },
+    {
+        .name = "AIFF",
+        .magic = "FORM",
+        .type = { "AIFF", "AIFC" },
+        .open = open_aiff
+    }
+};
+
+/*
+ * Note where the audio begins, now the header has been read, and
+ * limit it to what is in the file
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int find_audio(struct decode *d)
+{
+    struct stat st;
+
+    d->offset = lseek(d->fd, 0, SEEK_CUR);
+    if (d->offset == -1)
+        return -1;
+
+    if (fstat(d->fd, &st) == -1)
+        return -1;
+
+    if (st.st_size < d->offset)
+        return -1;
+
+    if (d->remain > (uint64_t)(st.st_size - d->offset))
+        d->remain = st.st_size - d->offset;
+
+    d->remain -= d->remain % d->frame;
+    d->samples = d->remain / d->frame;
+
+    return 0;
+}
+
+/*
+ * Open a file to read natively, if it is of a format which can be
+ *
+ * Return: -1 if the file is not read natively, otherwise 0
+ * Post: if 0, d is open for decode_read() and must be closed
+ */
+
+int decode_open(struct decode *d, const char *pathname, unsigned int rate)
+{
+    unsigned char head[12];
+    size_t n;
+
+    d->pack = NULL;
+
+    d->fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (d->fd == -1)
+        return -1; /* the importer can report on it */
+
+    if (read_fully(d->fd, head, sizeof head) != sizeof head)
+        goto fail;
+
+    for (n = 0; n < ARRAY_SIZE(decoders); n++) {
+        const struct decoder *x = &decoders[n];
+
+        if (memcmp(head, x->magic, 4))
+            continue;
+
+        if (memcmp(head + 8, x->type[0], 4) && memcmp(head + 8, x->type[1], 4))
+            continue;
+
+        if (x->open(d, rate) == -1)
+            goto fail;
+
+        if (find_audio(d) == -1)
+            goto fail;
+
+        debug("reading %s natively as %s", pathname, x->name);
+        d->decoder = x;
+        return 0;
+    }
+
+ fail:
+    if (close(d->fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Open audio which is packed in memory, to be read as a file is
+ *
+ * Pre: the pack outlives d
+ * Post: d is open for decode_read() and must be closed
+ */
+
+void decode_open_pack(struct decode *d, const struct pack *p)
+{
+    d->fd = -1;
+    d->decoder = NULL;
+    d->pack = p;
+
+    d->channels = TRACK_CHANNELS;
+    d->frame = TRACK_CHANNELS * sizeof(signed short);
+    d->offset = 0;
+    d->samples = p->length;
+    d->remain = d->samples * d->frame;
+}
+
+void decode_close(struct decode *d)
+{
+    if (d->pack != NULL)
+        return;
+
+    if (close(d->fd) == -1)
+        abort();
+}
+
+/*
+ * Move to the given sample, to read from there onwards
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int decode_seek(struct decode *d, uint64_t sample)
+{
+    off_t pos;
+
+    if (sample > d->samples)
+        sample = d->samples;
+
+    if (d->pack != NULL) {
+        d->remain = (d->samples - sample) * d->frame;
+        return 0;
+    }
+
+    pos = d->offset + sample * d->frame;
+
+    if (lseek(d->fd, pos, SEEK_SET) == -1) {
+        perror("lseek");
+        return -1;
+    }
+
+    d->remain = (d->samples - sample) * d->frame;
+    return 0;
+}
+
+/*
+ * Return: one sample of audio, converted to 16-bit
+ */
+
+static signed short convert(const struct decode *d, const unsigned char *p)
+{
+    unsigned int bytes;
+
+    if (d->is_float) {
+        float f;
+        uint32_t u;
+
+        u = d->big_endian ? be32(p) : le32(p);
+        memcpy(&f, &u, sizeof f);
+
+        if (f >= 1.0f)
+            return 32767;
+        if (f <= -1.0f)
+            return -32768;
+        return f * 32768.0f;
+    }
+
+    bytes = d->bits / 8;
+
+    if (bytes == 1) {
+        if (d->is_unsigned)
+            return (p[0] - 128) * 256;
+        else
+            return (signed char)p[0] * 256;
+    }
+
+    /* Only the most significant 16 bits are used */
+
+    if (d->big_endian)
+        return (signed short)(p[0] << 8 | p[1]);
+    else
+        return (signed short)(p[bytes - 1] << 8 | p[bytes - 2]);
+}
+
+/*
+ * Read audio from the file, in the format of a track
+ *
+ * Return: number of samples read, 0 at the end of the file, or -1 on
+ *     error
+ * Post: pcm contains the samples read, in stereo
+ */
+
+ssize_t decode_read(struct decode *d, signed short *pcm, size_t samples)
+{
+    size_t n, s;
+    ssize_t z;
+    const unsigned char *p;
+
+    if (d->pack != NULL) {
+        if (samples > d->remain / d->frame)
+            samples = d->remain / d->frame;
+
+        pack_read(d->pack, d->samples - d->remain / d->frame, pcm, samples);
+        d->remain -= samples * d->frame;
+        return samples;
+    }
+
+    if (samples > sizeof d->buf / d->frame)
+        samples = sizeof d->buf / d->frame;
+    if (samples > d->remain / d->frame)
+        samples = d->remain / d->frame;
+
+    z = read_fully(d->fd, d->buf, samples * d->frame);
+    if (z == -1)
+        return -1;
+
+    n = z / d->frame; /* a file which is cut short ends here */
+    d->remain -= n * d->frame;
+
+    p = d->buf;
+
+    for (s = 0; s < n; s++) {
+        pcm[0] = convert(d, p);
+        if (d->channels == 1) {
+            pcm[1] = pcm[0];
+        } else {
+            pcm[1] = convert(d, p + d->bits / 8);
+        }
+
+        pcm += TRACK_CHANNELS;
+        p += d->frame;
+    }
+
+    return n;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Native readers of uncompressed audio files, used to import tracks
+ * within the program rather than through an external importer; and
+ * of audio packed in memory (see pack.c), which is imported the same
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DECODER_BUFFER 65536 /* bytes */
+
+struct decoder;
+struct pack;
+
+struct decode {
+    int fd;
+    const struct decoder *decoder;
+    const struct pack *pack; /* or NULL if reading a file */
+
+    unsigned int channels, bits, frame; /* bytes per frame */
+    bool big_endian, is_unsigned, is_float;
+    off_t offset; /* of the audio in the file */
+    uint64_t samples, /* length of the audio */
+        remain; /* bytes of audio still to read */
+
+    unsigned char buf[DECODER_BUFFER];
+};
+
+int decode_open(struct decode *d, const char *pathname, unsigned int rate);
+void decode_open_pack(struct decode *d, const struct pack *p);
+void decode_close(struct decode *d);
+
+int decode_seek(struct decode *d, uint64_t sample);
+
+ssize_t decode_read(struct decode *d, signed short *pcm, size_t samples);
+
+#endif
@@ -18,10 +18,12 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stddef.h>
 
 #include "device.h"
 #include "player.h"
+#include "recorder.h"
 #include "timecoder.h"
 
 void device_connect_timecoder(struct device *dv, struct timecoder *tc)
@@ -34,6 +36,11 @@ void device_connect_player(struct device *dv, struct player *pl)
     dv->player = pl;
 }
 
+void device_connect_recorder(struct device *dv, struct recorder *r)
+{
+    dv->recorder = r;
+}
+
 /*
  * Return: the sample rate of the device in Hz
  */
@@ -103,8 +110,15 @@ ssize_t device_pollfds(struct device *dv, struct pollfd *pe, size_t z)
 
 int device_handle(struct device *dv)
 {
+    int r;
+
     assert(dv->ops->handle != NULL);
-    return dv->ops->handle(dv);
+
+    stats_handle_start(&dv->stats);
+    r = dv->ops->handle(dv);
+    stats_handle_end(&dv->stats);
+
+    return r;
 }
 
 /*
@@ -115,18 +129,117 @@ int device_handle(struct device *dv)
 
 void device_submit(struct device *dv, signed short *pcm, size_t n)
 {
+    uint64_t t;
+
     assert(dv->timecoder != NULL);
+
+    t = stats_clock();
     timecoder_submit(dv->timecoder, pcm, n);
+    stats_add(&dv->stats.submit_ns, stats_clock() - t);
+}
+
+/*
+ * Send audio from a device for processing, as device_submit()
+ *
+ * Pre: each buffer of pcm contains n samples of one channel, at a
+ *     full scale of 1.0
+ */
+
+void device_submit_planar(struct device *dv,
+                          const float *pcm[DEVICE_CHANNELS], size_t n)
+{
+    uint64_t t;
+
+    assert(dv->timecoder != NULL);
+
+    t = stats_clock();
+    timecoder_submit_planar(dv->timecoder, pcm[0], pcm[1], n);
+    stats_add(&dv->stats.submit_ns, stats_clock() - t);
 }
 
 /*
  * Collect audio from the processing to send to a device
  *
- * Post: buffer pcm is filled with n stereo samples
+ * Post: buffer pcm is filled with n stereo samples at a full scale
+ *     of 1.0
  */
 
-void device_collect(struct device *dv, signed short *pcm, size_t n)
+void device_collect(struct device *dv, float *pcm, size_t n)
 {
+    uint64_t t;
+
     assert(dv->player != NULL);
+
+    t = stats_clock();
     player_collect(dv->player, pcm, n);
+    stats_add(&dv->stats.collect_ns, stats_clock() - t);
+
+    if (dv->recorder != NULL && !recorder_add(dv->recorder, pcm, n))
+        stats_unrecorded(&dv->stats);
+}
+
+/*
+ * Collect audio, as device_collect(), into a buffer for each channel
+ *
+ * Post: each buffer of pcm is filled with n samples of one channel
+ */
+
+void device_collect_planar(struct device *dv, float *pcm[DEVICE_CHANNELS],
+                           size_t n)
+{
+    uint64_t t;
+
+    assert(dv->player != NULL);
+
+    t = stats_clock();
+    player_collect_planar(dv->player, pcm, n);
+    stats_add(&dv->stats.collect_ns, stats_clock() - t);
+
+    if (dv->recorder != NULL && !recorder_add_planar(dv->recorder, pcm, n))
+        stats_unrecorded(&dv->stats);
+}
+
+/*
+ * Return: Random dither, between -0.5 and 0.5
+ */
+
+static double dither(void)
+{
+    short bit;
+    static short x = 0xbabe;
+
+    /* Use a 16-bit maximal-length LFSR as our random number.
+     * This is faster than rand() */
+
+    bit = (x ^ (x >> 2) ^ (x >> 3) ^ (x >> 5)) & 1;
+    x = x >> 1 | (bit << 15);
+
+    return (double)x / 65536 - 0.5; /* not quite whole range */
+}
+
+/*
+ * Convert collected audio for a device which is 16-bit
+ *
+ * This is the only place the output is quantised, so it is dithered
+ * and clipped here.
+ *
+ * Post: buffer out contains the n stereo samples from in
+ */
+
+void device_to_s16(signed short *out, const float *in, size_t n)
+{
+    n *= DEVICE_CHANNELS;
+
+    while (n--) {
+        double v;
+
+        v = *in++ * 32768.0 + dither();
+
+        if (v > SHRT_MAX)
+            *out++ = SHRT_MAX;
+        else if (v < SHRT_MIN)
+            *out++ = SHRT_MIN;
+        else
+            *out++ = (signed short)v;
+    }
 }
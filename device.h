@@ -23,6 +23,8 @@
 #include <sys/poll.h>
 #include <sys/types.h>
 
+#include "stats.h"
+
 #define DEVICE_CHANNELS 2
 
 struct device {
@@ -31,6 +33,9 @@ struct device {
 
     struct timecoder *timecoder;
     struct player *player;
+    struct recorder *recorder; /* or NULL */
+
+    struct stats stats; /* of the realtime work */
 };
 
 struct device_ops {
@@ -46,6 +51,7 @@ struct device_ops {
 
 void device_connect_timecoder(struct device *dv, struct timecoder *tc);
 void device_connect_player(struct device *dv, struct player *pl);
+void device_connect_recorder(struct device *dv, struct recorder *r);
 
 unsigned int device_sample_rate(struct device *dv);
 
@@ -57,7 +63,16 @@ void device_clear(struct device *dv);
 ssize_t device_pollfds(struct device *dv, struct pollfd *pe, size_t z);
 int device_handle(struct device *dv);
 
+/* Audio is processed at a full scale of 1.0, with conversion only
+ * for devices which are 16-bit */
+
 void device_submit(struct device *dv, signed short *pcm, size_t npcm);
-void device_collect(struct device *dv, signed short *pcm, size_t npcm);
+void device_submit_planar(struct device *dv,
+                          const float *pcm[DEVICE_CHANNELS], size_t npcm);
+void device_collect(struct device *dv, float *pcm, size_t npcm);
+void device_collect_planar(struct device *dv, float *pcm[DEVICE_CHANNELS],
+                           size_t npcm);
+
+void device_to_s16(signed short *out, const float *in, size_t npcm);
 
 #endif
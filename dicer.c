@@ -30,6 +30,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "controller.h"
 #include "debug.h"
@@ -58,12 +59,20 @@ typedef unsigned char led_t;
 
 #define ON      0x1
 #define PRESSED 0x2
-#define SYNCED  0x4
+#define UNKNOWN 0xff /* state of the hardware, before it is set */
+
+/* The realtime thread reads input and sets the state of the LEDs.
+ * The rig writes to the device only those which differ from the
+ * hardware, which it keeps a record of */
 
 struct dicer {
     struct midi midi;
     struct deck *left, *right;
-    led_t left_led[NBUTTONS], right_led[NBUTTONS];
+    led_t left_led[NBUTTONS], right_led[NBUTTONS], /* realtime thread */
+        left_sent[NBUTTONS], right_sent[NBUTTONS]; /* rig */
+
+    unsigned char ibuf[192]; /* 64 events */
+    size_t ifill;
 
     char obuf[180];
     size_t ofill;
@@ -146,19 +155,22 @@ static ssize_t led_cmd(led_t led, char *buf, size_t len,
 }
 
 /*
- * Push control code for a particular output LED
+ * Push control code for a particular output LED, if it differs from
+ * what the hardware shows
  *
  * Return: n, or -1 if not enough buffer space
  * Post: if buf is large enough, LED is synced and n bytes are written
  */
 
-static ssize_t sync_one_led(led_t *led, char *buf, size_t len,
-                            bool right, unsigned char button)
+static ssize_t sync_one_led(const led_t *led, led_t *sent, char *buf,
+                            size_t len, bool right, unsigned char button)
 {
     unsigned int a;
     size_t t;
+    led_t l;
 
-    if (*led & SYNCED)
+    l = __atomic_load_n(led, __ATOMIC_RELAXED);
+    if (l == *sent)
         return 0;
 
     debug("syncing LED: %s %d", right ? "right" : "left", button);
@@ -171,7 +183,7 @@ static ssize_t sync_one_led(led_t *led, char *buf, size_t len,
     for (a = 0; a <= ROLL; a++) {
         ssize_t z;
 
-        z = led_cmd(*led, buf, len, right, a, false, button);
+        z = led_cmd(l, buf, len, right, a, false, button);
         if (z == -1)
             return -1;
 
@@ -179,7 +191,7 @@ static ssize_t sync_one_led(led_t *led, char *buf, size_t len,
         len -= z;
         t += z;
 
-        z = led_cmd(*led, buf, len, right, a, true, button);
+        z = led_cmd(l, buf, len, right, a, true, button);
         if (z == -1)
             return -1;
 
@@ -188,17 +200,20 @@ static ssize_t sync_one_led(led_t *led, char *buf, size_t len,
         t += z;
     }
 
-    *led |= SYNCED;
+    *sent = l;
 
     return t;
 }
 
 /*
  * Return: number of bytes written to the buffer
+ * Post: if the buffer is full, *full is true and some LEDs are still
+ *     to be synced
  */
 
-static size_t sync_one_dicer(led_t led[NBUTTONS], bool right,
-                             char *buf, size_t len)
+static size_t sync_one_dicer(const led_t led[NBUTTONS],
+                             led_t sent[NBUTTONS], bool right,
+                             char *buf, size_t len, bool *full)
 {
     size_t n, t;
 
@@ -207,9 +222,9 @@ static size_t sync_one_dicer(led_t led[NBUTTONS], bool right,
     for (n = 0; n < NBUTTONS; n++) {
         ssize_t z;
 
-        z = sync_one_led(&led[n], buf, len, right, n);
+        z = sync_one_led(&led[n], &sent[n], buf, len, right, n);
         if (z == -1) {
-            debug("output buffer full; expect incorrect LEDs");
+            *full = true;
             break;
         }
 
@@ -228,28 +243,32 @@ static size_t sync_one_dicer(led_t led[NBUTTONS], bool right,
  * The Dicer first appears to only have five output LEDs on two
  * controllers. But there are three modes for each, and then shift
  * on/off modes: total (5 * 2 * 3 * 2) = 60
+ *
+ * Only the LEDs which have changed are written, so a burst of presses
+ * costs no more than the LEDs it leaves changed. Anything which does
+ * not fit in the buffer is tried again later.
  */
 
-static void sync_all_leds(struct dicer *d)
+static void flush(struct controller *c)
 {
-    size_t w;
-    char *buf;
-    size_t len;
-
-    buf = d->obuf + d->ofill;
-    len = sizeof(d->obuf) - d->ofill;
+    bool full;
+    struct dicer *d = c->local;
 
     /* Top-up the buffer, even if not empty */
 
-    w = sync_one_dicer(d->left_led, false, buf, len);
-    buf += w;
-    len -= w;
-    d->ofill += w;
+    full = false;
 
-    w = sync_one_dicer(d->right_led, true, buf, len);
-    buf += w;
-    len -= w;
-    d->ofill += w;
+    d->ofill += sync_one_dicer(d->left_led, d->left_sent, false,
+                               d->obuf + d->ofill,
+                               sizeof(d->obuf) - d->ofill, &full);
+    d->ofill += sync_one_dicer(d->right_led, d->right_sent, true,
+                               d->obuf + d->ofill,
+                               sizeof(d->obuf) - d->ofill, &full);
+
+    if (full) {
+        debug("output buffer full; LEDs will follow");
+        controller_post_output(c);
+    }
 
     if (d->ofill > 0) {
         ssize_t z;
@@ -260,8 +279,10 @@ static void sync_all_leds(struct dicer *d)
         if (z == -1)
             return;
 
-        if (z < d->ofill)
-            memmove(d->obuf, d->obuf + z, z);
+        if (z < d->ofill) {
+            memmove(d->obuf, d->obuf + z, d->ofill - z);
+            controller_post_output(c);
+        }
 
         d->ofill -= z;
     }
@@ -279,7 +300,7 @@ static void set_led(led_t *led, unsigned char set, unsigned char clear)
 
     n = (*led & ~clear) | set;
     if (n != *led)
-        *led = n & ~SYNCED;
+        __atomic_store_n(led, n, __ATOMIC_RELAXED);
 }
 
 /*
@@ -417,30 +438,51 @@ static ssize_t pollfds(struct controller *c, struct pollfd *pe, size_t z)
 }
 
 /*
- * Handler in the realtime thread, which polls on both input
- * and output
+ * Handler in the realtime thread
+ *
+ * All the input which is waiting is read in as few calls as
+ * possible, and the events acted on. Changes to the LEDs are left
+ * for the rig to write; see flush().
  */
 
 static int realtime(struct controller *c)
 {
+    bool events;
     struct dicer *d = c->local;
 
+    events = false;
+
     for (;;) {
-        unsigned char buf[3];
+        size_t n, len;
         ssize_t z;
 
-        z = midi_read(&d->midi, buf, sizeof buf);
+        len = sizeof(d->ibuf) - d->ifill;
+
+        z = midi_read(&d->midi, d->ibuf + d->ifill, len);
         if (z == -1)
             return -1;
         if (z == 0)
             break;
 
-        debug("got event");
+        d->ifill += z;
+
+        /* Keep any part of an event until the rest of it arrives */
+
+        for (n = 0; n + 3 <= d->ifill; n += 3) {
+            debug("got event");
+            event(d, &d->ibuf[n]);
+            events = true;
+        }
+
+        memmove(d->ibuf, d->ibuf + n, d->ifill - n);
+        d->ifill -= n;
 
-        event(d, buf);
+        if (z < len) /* nothing more waiting */
+            break;
     }
 
-    sync_all_leds(d);
+    if (events)
+        controller_post_output(c);
 
     return 0;
 }
@@ -459,7 +501,9 @@ static void clear(struct controller *c)
         set_led(&d->left_led[n], 0, ON);
         set_led(&d->right_led[n], 0, ON);
     }
-    sync_all_leds(d);
+
+    controller_post_output(c);
+    controller_flush(c);
 
     midi_close(&d->midi);
     free(c->local);
@@ -469,6 +513,7 @@ static struct controller_ops dicer_ops = {
     .add_deck = add_deck,
     .pollfds = pollfds,
     .realtime = realtime,
+    .flush = flush,
     .clear = clear,
 };
 
@@ -490,15 +535,19 @@ int dicer_init(struct controller *c, struct rt *rt, const char *hw)
 
     d->left = NULL;
     d->right = NULL;
+    d->ifill = 0;
     d->ofill = 0;
 
     for (n = 0; n < NBUTTONS; n++) {
         d->left_led[n] = 0;
         d->right_led[n] = 0;
+        d->left_sent[n] = UNKNOWN;
+        d->right_sent[n] = UNKNOWN;
     }
 
     controller_init(c, &dicer_ops);
     c->local = d;
+    controller_post_output(c); /* bring the hardware to our state */
 
     return 0;
 
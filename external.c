@@ -17,52 +17,82 @@
  *
  */
 
-#define _BSD_SOURCE /* vfork() */
+#define _GNU_SOURCE /* pipe2(), environ */
 #include <assert.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "external.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
 /*
- * Fork a child process, attaching stdout to the given pipe
+ * Start a child process, attaching stdout to the given pipe
+ *
+ * posix_spawn() does not copy the page tables of this process, so the
+ * cost does not grow with the audio held in memory (or locked there).
+ * Both ends of the pipe are close-on-exec; only the copy made onto
+ * stdout survives in the child
  *
  * Return: -1 on error, or pid on success
  * Post: on success, *fd is file handle for reading
  */
 
-static pid_t do_fork(int pp[2], const char *path, char *argv[])
+static pid_t do_fork(int pp[2], bool group, const char *path, char *argv[])
 {
+    int r;
     pid_t pid;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
 
-    pid = vfork();
-    if (pid == -1) {
-        perror("vfork");
+    r = posix_spawn_file_actions_init(&actions);
+    if (r != 0) {
+        fprintf(stderr, "posix_spawn_file_actions_init: %s\n", strerror(r));
         return -1;
     }
 
-    if (pid == 0) { /* child */
-        if (close(pp[0]) != 0)
-            abort();
-
-        if (dup2(pp[1], STDOUT_FILENO) == -1) {
-            perror("dup2");
-            _exit(EXIT_FAILURE); /* vfork() was used */
-        }
+    r = posix_spawn_file_actions_adddup2(&actions, pp[1], STDOUT_FILENO);
+    if (r != 0) {
+        fprintf(stderr, "posix_spawn_file_actions_adddup2: %s\n",
+                strerror(r));
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
 
-        if (close(pp[1]) != 0)
-            abort();
+    r = posix_spawnattr_init(&attr);
+    if (r != 0) {
+        fprintf(stderr, "posix_spawnattr_init: %s\n", strerror(r));
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
 
-        if (execv(path, argv) == -1) {
-            perror(path);
-            _exit(EXIT_FAILURE); /* vfork() was used */
+    /* A process group of its own, led by the child */
+
+    if (group) {
+        r = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        if (r == 0)
+            r = posix_spawnattr_setpgroup(&attr, 0);
+        if (r != 0) {
+            fprintf(stderr, "posix_spawnattr: %s\n", strerror(r));
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
         }
+    }
 
-        abort(); /* execv() does not return */
+    r = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (r != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(r));
+        return -1;
     }
 
     if (close(pp[1]) != 0)
@@ -80,7 +110,8 @@ static pid_t do_fork(int pp[2], const char *path, char *argv[])
  * forked.
  */
 
-static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
+static pid_t vext(int pp[2], bool group, const char *path, char *arg,
+                  va_list ap)
 {
     char *args[16];
     size_t n;
@@ -101,7 +132,31 @@ static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
             break;
     }
 
-    return do_fork(pp, path, args);
+    return do_fork(pp, group, path, args);
+}
+
+static pid_t vpipe(int *fd, bool group, const char *path, char *arg,
+                   va_list ap)
+{
+    int pp[2];
+    pid_t r;
+
+    if (pipe2(pp, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    r = vext(pp, group, path, arg, ap);
+
+    if (r == -1) {
+        if (close(pp[0]) != 0)
+            abort();
+        if (close(pp[1]) != 0)
+            abort();
+    }
+
+    *fd = pp[0];
+    return r;
 }
 
 /*
@@ -114,27 +169,33 @@ static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
 
 pid_t fork_pipe(int *fd, const char *path, char *arg, ...)
 {
-    int pp[2];
     pid_t r;
     va_list va;
 
-    if (pipe(pp) == -1) {
-        perror("pipe");
-        return -1;
-    }
-
     va_start(va, arg);
-    r = vext(pp, path, arg, va);
+    r = vpipe(fd, false, path, arg, va);
     va_end(va);
 
-    if (r == -1) {
-        if (close(pp[0]) != 0)
-            abort();
-        if (close(pp[1]) != 0)
-            abort();
-    }
+    return r;
+}
+
+/*
+ * As fork_pipe(), but the child leads a process group of its own so
+ * that it can be signalled along with any processes it starts
+ *
+ * Return: PID (and process group) on success, otherwise -1
+ * Post: on success, *fd is file descriptor for reading
+ */
+
+pid_t fork_pipe_group(int *fd, const char *path, char *arg, ...)
+{
+    pid_t r;
+    va_list va;
+
+    va_start(va, arg);
+    r = vpipe(fd, true, path, arg, va);
+    va_end(va);
 
-    *fd = pp[0];
     return r;
 }
 
@@ -169,8 +230,8 @@ pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...)
     pid_t r;
     va_list va;
 
-    if (pipe(pp) == -1) {
-        perror("pipe");
+    if (pipe2(pp, O_CLOEXEC) == -1) {
+        perror("pipe2");
         return -1;
     }
 
@@ -178,7 +239,7 @@ pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...)
         goto fail;
 
     va_start(va, arg);
-    r = vext(pp, path, arg, va);
+    r = vext(pp, false, path, arg, va);
     va_end(va);
 
     assert(r != 0);
@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 pid_t fork_pipe(int *fd, const char *path, char *arg, ...);
+pid_t fork_pipe_group(int *fd, const char *path, char *arg, ...);
 pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...);
 
 #endif
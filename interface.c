@@ -19,9 +19,12 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,9 +37,13 @@
 
 #include "interface.h"
 #include "layout.h"
+#include "list.h"
 #include "player.h"
+#include "preload.h"
 #include "rig.h"
 #include "selector.h"
+#include "startup.h"
+#include "stats.h"
 #include "status.h"
 #include "timecoder.h"
 #include "xwax.h"
@@ -90,9 +97,11 @@
 #define LIBRARY_MIN_WIDTH 64
 #define LIBRARY_MIN_HEIGHT 64
 
-#define DEFAULT_METER_SCALE 8
+#define METER_STEPS 4 /* scales for each doubling of the close-up */
 
-#define MAX_METER_SCALE 11
+#define DEFAULT_METER_SCALE (8 * METER_STEPS)
+
+#define MAX_METER_SCALE (11 * METER_STEPS)
 
 #define SEARCH_HEIGHT (FONT_SPACE)
 #define STATUS_HEIGHT (DETAIL_FONT_SPACE)
@@ -118,6 +127,15 @@
 #define FUNC_RECUE 1
 #define FUNC_TIMECODE 2
 
+/* Rendered text which is kept for drawing again */
+
+#define TEXT_CACHE 1024 /* strings */
+#define TEXT_BUCKETS 2048 /* power of two */
+
+/* Areas of the screen to be updated after the decks are drawn */
+
+#define MAX_DIRTY 64
+
 /* Types of SDL_USEREVENT */
 
 #define EVENT_TICKER 0
@@ -162,6 +180,58 @@ static SDL_Color background_col = {0, 0, 0, 255},
 
 static unsigned short *spinner_angle, spinner_size;
 
+/* What is currently on screen for each deck, so an element is drawn
+ * only when it changes; see draw_deck() */
+
+struct shown_clock {
+    char hms[8], deci[8];
+    SDL_Color col;
+};
+
+struct shown_column {
+    unsigned short height;
+    unsigned char fade;
+    SDL_Color col;
+};
+
+struct shown {
+    bool valid; /* or everything must be drawn */
+    bool timecode_control;
+    const struct record *record;
+    struct shown_clock elapsed, remain;
+    int rangle;
+    SDL_Color spinner_col;
+    char status[128];
+    struct shown_column *column; /* of the overview */
+    int columns;
+    struct shown_column *closeup_column;
+    int closeup_columns;
+    struct track *closeup;
+    int closeup_position, closeup_span;
+    unsigned int closeup_length;
+};
+
+static struct shown *shown;
+
+/* Areas of the decks drawn since the screen was last updated */
+
+static SDL_Rect dirty[MAX_DIRTY];
+static unsigned int ndirty;
+
+/* Each string recently drawn, so a steady display does not render
+ * or allocate; see draw_text() */
+
+struct text {
+    struct list lru, bucket;
+    TTF_Font *font; /* or NULL if not used */
+    SDL_Color fg, bg;
+    char *buf;
+    SDL_Surface *rendered;
+};
+
+static struct text text[TEXT_CACHE];
+static struct list text_lru, text_bucket[TEXT_BUCKETS];
+
 static int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT,
     meter_scale = DEFAULT_METER_SCALE;
 static pthread_t ph;
@@ -375,6 +445,119 @@ static void clear_fonts(void)
     TTF_CloseFont(detail_font);
 }
 
+static void init_text_cache(void)
+{
+    size_t n;
+
+    list_init(&text_lru);
+
+    for (n = 0; n < TEXT_BUCKETS; n++)
+        list_init(&text_bucket[n]);
+
+    for (n = 0; n < TEXT_CACHE; n++) {
+        text[n].font = NULL;
+        list_init(&text[n].bucket);
+        list_add_tail(&text[n].lru, &text_lru);
+    }
+}
+
+/*
+ * Forget a string which has been rendered
+ */
+
+static void text_free(struct text *t)
+{
+    if (t->font == NULL)
+        return;
+
+    list_del(&t->bucket);
+    list_init(&t->bucket);
+    SDL_FreeSurface(t->rendered);
+    free(t->buf);
+    t->font = NULL;
+}
+
+static void clear_text_cache(void)
+{
+    size_t n;
+
+    for (n = 0; n < TEXT_CACHE; n++)
+        text_free(&text[n]);
+}
+
+/*
+ * Return: hash of the given string, drawn in the given style
+ */
+
+static unsigned int text_hash(const char *buf, const TTF_Font *font,
+                              SDL_Color fg, SDL_Color bg)
+{
+    unsigned int h;
+
+    h = 2166136261u ^ (unsigned int)(uintptr_t)font;
+    h = (h ^ (fg.r | fg.g << 8 | fg.b << 16)) * 16777619u;
+    h = (h ^ (bg.r | bg.g << 8 | bg.b << 16)) * 16777619u;
+
+    while (*buf != '\0')
+        h = (h ^ (unsigned char)*buf++) * 16777619u;
+
+    return h;
+}
+
+/*
+ * Find the rendering of a string, or render it in place of the
+ * string which was least recently drawn
+ *
+ * Return: surface, which is valid until the next call, or NULL on error
+ */
+
+static SDL_Surface* render_text(const char *buf, TTF_Font *font,
+                                SDL_Color fg, SDL_Color bg)
+{
+    struct list *bucket;
+    struct text *t;
+
+    bucket = &text_bucket[text_hash(buf, font, fg, bg) & (TEXT_BUCKETS - 1)];
+
+    list_for_each(t, bucket, bucket) {
+        if (t->font == font
+            && t->fg.r == fg.r && t->fg.g == fg.g && t->fg.b == fg.b
+            && t->bg.r == bg.r && t->bg.g == bg.g && t->bg.b == bg.b
+            && !strcmp(t->buf, buf))
+        {
+            list_del(&t->lru);
+            list_add(&t->lru, &text_lru);
+            return t->rendered;
+        }
+    }
+
+    t = list_entry(text_lru.prev, struct text, lru);
+    text_free(t);
+
+    t->buf = strdup(buf);
+    if (t->buf == NULL) {
+        perror("strdup");
+        return NULL;
+    }
+
+    t->rendered = TTF_RenderText_Shaded(font, buf, fg, bg);
+    if (t->rendered == NULL) {
+        fprintf(stderr, "%s\n", TTF_GetError());
+        free(t->buf);
+        return NULL;
+    }
+
+    t->font = font;
+    t->fg = fg;
+    t->bg = bg;
+
+    list_add(&t->bucket, bucket);
+    list_del(&t->lru);
+    list_add(&t->lru, &text_lru);
+
+    return t->rendered;
+}
+
 static Uint32 palette(SDL_Surface *sf, SDL_Color *col)
 {
     return SDL_MapRGB(sf->format, col->r, col->g, col->b);
@@ -401,9 +584,11 @@ static int draw_text(SDL_Surface *sf, const struct rect *rect,
         src.w = 0;
         src.h = 0;
 
-    } else {
-        rendered = TTF_RenderText_Shaded(font, buf, fg, bg);
+    } else if ((rendered = render_text(buf, font, fg, bg)) == NULL) {
+        src.w = 0;
+        src.h = 0;
 
+    } else {
         src.x = 0;
         src.y = 0;
         src.w = MIN(rect->w, rendered->w);
@@ -413,7 +598,6 @@ static int draw_text(SDL_Surface *sf, const struct rect *rect,
         dst.y = rect->y;
 
         SDL_BlitSurface(rendered, &src, sf, &dst);
-        SDL_FreeSurface(rendered);
     }
 
     /* Complete the remaining space with a blank rectangle */
@@ -437,6 +621,39 @@ static int draw_text(SDL_Surface *sf, const struct rect *rect,
     return src.w;
 }
 
+/*
+ * Note that the given area of the decks has been drawn, and needs
+ * updating on the screen
+ */
+
+static void mark_dirty(const struct rect *rect)
+{
+    SDL_Rect *r;
+
+    if (ndirty > MAX_DIRTY) /* already updating everything */
+        return;
+
+    if (ndirty == MAX_DIRTY) {
+        ndirty++;
+        return;
+    }
+
+    r = &dirty[ndirty++];
+    r->x = rect->x;
+    r->y = rect->y;
+    r->w = rect->w;
+    r->h = rect->h;
+}
+
+/*
+ * Return: true if the two colours are the same, otherwise false
+ */
+
+static bool same_col(SDL_Color a, SDL_Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
 /*
  * Given a rectangle and font, calculate rendering bounds
  * for another font so that the baseline matches.
@@ -629,7 +846,7 @@ static void draw_record(SDL_Surface *surface, const struct rect *rect,
  */
 
 static void draw_clock(SDL_Surface *surface, const struct rect *rect, int t,
-                       SDL_Color col)
+                       SDL_Color col, struct shown_clock *shown, bool valid)
 {
     char hms[8], deci[8];
     short int v;
@@ -637,6 +854,20 @@ static void draw_clock(SDL_Surface *surface, const struct rect *rect, int t,
 
     time_to_clock(hms, deci, t);
 
+    /* Text rendering is expensive, and the clock of a deck which is
+     * not playing does not change */
+
+    if (valid && !strcmp(hms, shown->hms) && !strcmp(deci, shown->deci)
+        && same_col(col, shown->col))
+    {
+        return;
+    }
+
+    strcpy(shown->hms, hms);
+    strcpy(shown->deci, deci);
+    shown->col = col;
+    mark_dirty(rect);
+
     v = draw_text(surface, rect, hms, clock_font, col, background_col);
 
     split(*rect, pixels(from_left(v, 0)), NULL, &sr);
@@ -655,6 +886,8 @@ static void draw_scope(SDL_Surface *surface, const struct rect *rect,
     int r, c, v, mid;
     Uint8 *p;
 
+    timecoder_monitor_update(tc);
+
     mid = tc->mon_size / 2;
 
     for (r = 0; r < tc->mon_size; r++) {
@@ -683,7 +916,8 @@ static void draw_scope(SDL_Surface *surface, const struct rect *rect,
  */
 
 static void draw_spinner(SDL_Surface *surface, const struct rect *rect,
-                         struct player *pl)
+                         struct player *pl, const struct player_state *st,
+                         struct track *track, struct shown *shown)
 {
     int x, y, r, c, rangle, pangle;
     double elapsed, remain, rps;
@@ -693,17 +927,27 @@ static void draw_spinner(SDL_Surface *surface, const struct rect *rect,
     x = rect->x;
     y = rect->y;
 
-    elapsed = player_get_elapsed(pl);
-    remain = player_get_remain(pl);
+    elapsed = st->position - st->offset;
+    remain = (double)track->length / track->rate - elapsed;
 
     rps = timecoder_revs_per_sec(pl->timecoder);
-    rangle = (int)(player_get_position(pl) * 1024 * rps) % 1024;
+    rangle = (int)(st->position * 1024 * rps) % 1024;
 
     if (elapsed < 0 || remain < 0)
         col = warn_col;
     else
         col = ok_col;
 
+    if (shown->valid && rangle == shown->rangle
+        && same_col(col, shown->spinner_col))
+    {
+        return;
+    }
+
+    shown->rangle = rangle;
+    shown->spinner_col = col;
+    mark_dirty(rect);
+
     for (r = 0; r < spinner_size; r++) {
 
         /* Store a pointer to this row of the framebuffer */
@@ -739,7 +983,8 @@ static void draw_spinner(SDL_Surface *surface, const struct rect *rect,
  */
 
 static void draw_deck_clocks(SDL_Surface *surface, const struct rect *rect,
-                             struct player *pl, struct track *track)
+                             const struct player_state *st,
+                             struct track *track, struct shown *shown)
 {
     int elapse, remain;
     struct rect upper, lower;
@@ -747,8 +992,9 @@ static void draw_deck_clocks(SDL_Surface *surface, const struct rect *rect,
 
     split(*rect, from_top(CLOCK_FONT_SIZE, 0), &upper, &lower);
 
-    elapse = player_get_elapsed(pl) * 1000;
-    remain = player_get_remain(pl) * 1000;
+    elapse = (st->position - st->offset) * 1000;
+    remain = ((double)track->length / track->rate
+              + st->offset - st->position) * 1000;
 
     if (elapse < 0)
         col = warn_col;
@@ -757,7 +1003,7 @@ static void draw_deck_clocks(SDL_Surface *surface, const struct rect *rect,
     else
         col = text_col;
 
-    draw_clock(surface, &upper, elapse, col);
+    draw_clock(surface, &upper, elapse, col, &shown->elapsed, shown->valid);
 
     if (remain <= 0)
         col = warn_col;
@@ -767,7 +1013,33 @@ static void draw_deck_clocks(SDL_Surface *surface, const struct rect *rect,
     if (track_is_importing(track))
         col = dim(col, 2);
 
-    draw_clock(surface, &lower, -remain, col);
+    draw_clock(surface, &lower, -remain, col, &shown->remain, shown->valid);
+}
+
+/*
+ * Draw one column of a meter, from the top, faded above its height
+ */
+
+static void draw_column(Uint8 *p, int pitch, int h, int height,
+                        SDL_Color col, int fade)
+{
+    int r;
+
+    r = h;
+    while (r > height) {
+        p[0] = col.b >> fade;
+        p[1] = col.g >> fade;
+        p[2] = col.r >> fade;
+        p += pitch;
+        r--;
+    }
+    while (r) {
+        p[0] = col.b;
+        p[1] = col.g;
+        p[2] = col.r;
+        p += pitch;
+        r--;
+    }
 }
 
 /*
@@ -776,12 +1048,14 @@ static void draw_deck_clocks(SDL_Surface *surface, const struct rect *rect,
  */
 
 static void draw_overview(SDL_Surface *surface, const struct rect *rect,
-                          struct track *tr, int position)
+                          struct track *tr, int position, struct shown *shown)
 {
-    int x, y, w, h, r, c, sp, fade, bytes_per_pixel, pitch, height,
-        current_position;
+    int x, y, w, h, c, fade, bytes_per_pixel, pitch, height,
+        current_position, left, right;
+    unsigned int length, sp, end;
     Uint8 *pixels, *p;
     SDL_Color col;
+    struct shown_column *column;
 
     x = rect->x;
     y = rect->y;
@@ -792,31 +1066,52 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
     bytes_per_pixel = surface->format->BytesPerPixel;
     pitch = surface->pitch;
 
-    if (tr->length)
-        current_position = (long long)position * w / tr->length;
+    length = tr->length;
+
+    if (length)
+        current_position = (long long)position * w / length;
     else
         current_position = 0;
 
+    /* Keep what is drawn in each column. Without memory to do so,
+     * every column is drawn */
+
+    if (w != shown->columns) {
+        column = realloc(shown->column, sizeof *column * w);
+        if (column == NULL && w > 0) {
+            free(shown->column);
+            shown->columns = 0;
+        } else {
+            shown->columns = w;
+        }
+        shown->column = column;
+        shown->valid = false;
+    }
+
+    left = w;
+    right = 0;
+
     for (c = 0; c < w; c++) {
 
-        /* Collect the correct meter value for this column */
+        /* Take the peak of the meter over the whole of this column,
+         * so that nothing is missed between columns */
 
-        sp = (long long)tr->length * c / w;
+        sp = (unsigned long long)length * c / w;
+        end = (unsigned long long)length * (c + 1) / w;
+        if (end == sp)
+            end = sp + 1;
 
-        if (sp < tr->length) /* account for rounding */
-            height = track_get_overview(tr, sp) * h / 256;
-        else
-            height = 0;
+        height = track_get_overview_peak(tr, sp, end) * h / 256;
 
         /* Choose a base colour to display in */
 
-        if (!tr->length) {
+        if (!length) {
             col = background_col;
             fade = 0;
         } else if (c == current_position) {
             col = needle_col;
             fade = 1;
-        } else if (position > tr->length - tr->rate * METER_WARNING_TIME) {
+        } else if (position > (int)length - tr->rate * METER_WARNING_TIME) {
             col = warn_col;
             fade = 3;
         } else {
@@ -830,39 +1125,117 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
         if (c < current_position)
             col = dim(col, 1);
 
+        /* Most columns are the same as when they were last drawn */
+
+        if (shown->column != NULL) {
+            struct shown_column *s = &shown->column[c];
+
+            if (shown->valid && s->height == height && s->fade == fade
+                && same_col(s->col, col))
+            {
+                continue;
+            }
+
+            s->height = height;
+            s->fade = fade;
+            s->col = col;
+        }
+
+        if (c < left)
+            left = c;
+        right = c + 1;
+
         /* Store a pointer to this column of the framebuffer */
 
         p = pixels + y * pitch + (x + c) * bytes_per_pixel;
+        draw_column(p, pitch, h, height, col, fade);
+    }
 
-        r = h;
-        while (r > height) {
-            p[0] = col.b >> fade;
-            p[1] = col.g >> fade;
-            p[2] = col.r >> fade;
-            p += pitch;
-            r--;
-        }
-        while (r) {
-            p[0] = col.b;
-            p[1] = col.g;
-            p[2] = col.r;
-            p += pitch;
-            r--;
-        }
+    if (right > left) {
+        struct rect changed;
+
+        changed = *rect;
+        changed.x += left;
+        changed.w = right - left;
+        mark_dirty(&changed);
+    }
+}
+
+/*
+ * Move the columns of the close-up meter which stay in view when the
+ * track moves by the given number of columns, to the left if positive
+ *
+ * Post: the columns uncovered are marked as not drawn
+ */
+
+static void scroll_closeup(SDL_Surface *surface, const struct rect *rect,
+                           int shift, struct shown *shown)
+{
+    int r, c, w, from, to, n;
+    size_t bytes_per_pixel, pitch;
+    Uint8 *row;
+
+    w = rect->w;
+    assert(abs(shift) < w);
+
+    bytes_per_pixel = surface->format->BytesPerPixel;
+    pitch = surface->pitch;
+
+    if (shift > 0) {
+        from = shift;
+        to = 0;
+    } else {
+        from = 0;
+        to = -shift;
+    }
+    n = w - abs(shift);
+
+    row = (Uint8*)surface->pixels + rect->y * pitch
+        + rect->x * bytes_per_pixel;
+
+    for (r = 0; r < rect->h; r++) {
+        memmove(row + to * bytes_per_pixel, row + from * bytes_per_pixel,
+                n * bytes_per_pixel);
+        row += pitch;
     }
+
+    memmove(shown->closeup_column + to, shown->closeup_column + from,
+            n * sizeof *shown->closeup_column);
+
+    for (c = (shift > 0 ? n : 0); c < (shift > 0 ? w : -shift); c++)
+        shown->closeup_column[c].height = USHRT_MAX;
 }
 
 /*
  * Draw the close-up meter, which can be zoomed to a level set by
  * 'scale'
+ *
+ * Most of the meter is the same as in the previous frame, but moved
+ * by some number of columns; it is moved on the surface, and only the
+ * columns which differ are drawn.
  */
 
 static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
-                         struct track *tr, int position, int scale)
+                         struct track *tr, int position, int span,
+                         struct shown *shown)
 {
-    int x, y, w, h, c;
+    int x, y, w, h, c, shift, left, right;
     size_t bytes_per_pixel, pitch;
     Uint8 *pixels;
+    bool redraw;
+
+    /* The columns change only when the position moves by a whole
+     * column, or more of the track is imported */
+
+    position -= position % span;
+
+    if (shown->valid && tr == shown->closeup
+        && position == shown->closeup_position
+        && span == shown->closeup_span
+        && tr->length == shown->closeup_length)
+    {
+        return;
+    }
 
     x = rect->x;
     y = rect->y;
@@ -873,24 +1246,65 @@ static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
     bytes_per_pixel = surface->format->BytesPerPixel;
     pitch = surface->pitch;
 
-    /* Draw in columns. This may seem like a performance hit,
-     * but oprofile shows it makes no difference */
+    /* Keep what is drawn in each column. Without memory to do so,
+     * every column is drawn */
+
+    redraw = !shown->valid || tr != shown->closeup
+        || span != shown->closeup_span;
+
+    if (w != shown->closeup_columns) {
+        struct shown_column *column;
+
+        column = realloc(shown->closeup_column, sizeof *column * w);
+        if (column == NULL && w > 0) {
+            free(shown->closeup_column);
+            shown->closeup_columns = 0;
+        } else {
+            shown->closeup_columns = w;
+        }
+        shown->closeup_column = column;
+        redraw = true;
+    }
+
+    if (shown->closeup_column == NULL)
+        redraw = true;
+
+    left = w;
+    right = 0;
+
+    if (!redraw) {
+        shift = (position - shown->closeup_position) / span;
+
+        if (abs(shift) >= w) {
+            redraw = true;
+        } else if (shift != 0) {
+            scroll_closeup(surface, rect, shift, shown);
+            left = 0;
+            right = w;
+        }
+    }
+
+    shown->closeup = tr;
+    shown->closeup_position = position;
+    shown->closeup_span = span;
+    shown->closeup_length = tr->length;
 
     for (c = 0; c < w; c++) {
-        int r, sp, height, fade;
-        Uint8 *p;
+        int sp, height, fade;
         SDL_Color col;
 
-        /* Work out the meter height in pixels for this column */
+        /* Work out the meter height in pixels for this column, from
+         * the peak of all the audio it covers */
 
-        sp = position - (position % (1 << scale))
-            + ((c - w / 2) << scale);
+        sp = position + (c - w / 2) * span;
 
-        if (sp < tr->length && sp > 0)
-            height = track_get_ppm(tr, sp) * h / 256;
+        if (sp + span > 0)
+            height = track_get_ppm_peak(tr, sp > 0 ? sp : 0, sp + span);
         else
             height = 0;
 
+        height = height * h / 256;
+
         /* Select the appropriate colour */
 
         if (c == w / 2) {
@@ -901,46 +1315,67 @@ static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
             fade = 3;
         }
 
-        /* Get a pointer to the top of the column, and increment
-         * it for each row */
+        if (shown->closeup_column != NULL) {
+            struct shown_column *s = &shown->closeup_column[c];
 
-        p = pixels + y * pitch + (x + c) * bytes_per_pixel;
+            if (!redraw && s->height == height && s->fade == fade
+                && same_col(s->col, col))
+            {
+                continue;
+            }
 
-        r = h;
-        while (r > height) {
-            p[0] = col.b >> fade;
-            p[1] = col.g >> fade;
-            p[2] = col.r >> fade;
-            p += pitch;
-            r--;
-        }
-        while (r) {
-            p[0] = col.b;
-            p[1] = col.g;
-            p[2] = col.r;
-            p += pitch;
-            r--;
+            s->height = height;
+            s->fade = fade;
+            s->col = col;
         }
+
+        if (c < left)
+            left = c;
+        if (c + 1 > right)
+            right = c + 1;
+
+        draw_column(pixels + y * pitch + (x + c) * bytes_per_pixel, pitch,
+                    h, height, col, fade);
+    }
+
+    if (right > left) {
+        struct rect changed;
+
+        changed = *rect;
+        changed.x += left;
+        changed.w = right - left;
+        mark_dirty(&changed);
     }
 }
 
+/*
+ * Return: the number of samples in each column of the close-up at
+ * the given scale, which doubles every METER_STEPS
+ */
+
+static int meter_span(int scale)
+{
+    return lround(exp2((double)scale / METER_STEPS));
+}
+
 /*
  * Draw the audio meters for a deck
  */
 
 static void draw_meters(SDL_Surface *surface, const struct rect *rect,
-                        struct track *tr, int position, int scale)
+                        struct track *tr, int position, int scale,
+                        struct shown *shown)
 {
     struct rect overview, closeup;
 
     split(*rect, from_top(OVERVIEW_HEIGHT, SPACER), &overview, &closeup);
 
     if (closeup.h > OVERVIEW_HEIGHT)
-        draw_overview(surface, &overview, tr, position);
+        draw_overview(surface, &overview, tr, position, shown);
     else
         closeup = *rect;
 
-    draw_closeup(surface, &closeup, tr, position, scale);
+    draw_closeup(surface, &closeup, tr, position, meter_span(scale), shown);
 }
 
 /*
@@ -948,7 +1383,8 @@ static void draw_meters(SDL_Surface *surface, const struct rect *rect,
  */
 
 static void draw_deck_top(SDL_Surface *surface, const struct rect *rect,
-                          struct player *pl, struct track *track)
+                          struct player *pl, const struct player_state *st,
+                          struct track *track, struct shown *shown)
 {
     struct rect clocks, left, right, spinner, scope;
 
@@ -957,24 +1393,51 @@ static void draw_deck_top(SDL_Surface *surface, const struct rect *rect,
     /* If there is no timecoder to display information on, or not enough
      * available space, just draw clocks which span the overall space */
 
-    if (!pl->timecode_control || right.w < 0) {
-        draw_deck_clocks(surface, rect, pl, track);
+    if (!st->timecode_control || right.w < 0) {
+        draw_deck_clocks(surface, rect, st, track, shown);
         return;
     }
 
-    draw_deck_clocks(surface, &clocks, pl, track);
+    draw_deck_clocks(surface, &clocks, st, track, shown);
 
     split(right, from_right(SPINNER_SIZE, SPACER), &left, &spinner);
     if (left.w < 0)
         return;
     split(spinner, from_bottom(SPINNER_SIZE, 0), NULL, &spinner);
-    draw_spinner(surface, &spinner, pl);
+    draw_spinner(surface, &spinner, pl, st, track, shown);
 
     split(left, from_right(SCOPE_SIZE, SPACER), &clocks, &scope);
     if (clocks.w < 0)
         return;
     split(scope, from_bottom(SCOPE_SIZE, 0), NULL, &scope);
     draw_scope(surface, &scope, pl->timecoder);
+    mark_dirty(&scope);
+}
+
+/*
+ * Add formatted text to the end of a string, truncating it to fit
+ *
+ * Return: the new end of the string
+ * Pre: c < end
+ */
+
+static char* append(char *c, char *end, const char *fmt, ...)
+{
+    int r;
+    va_list va;
+
+    va_start(va, fmt);
+    r = vsnprintf(c, end - c, fmt, va);
+    va_end(va);
+
+    if (r < 0) {
+        *c = '\0';
+        return c;
+    }
+    if (r >= end - c)
+        return end - 1; /* at the terminator */
+
+    return c + r;
 }
 
 /*
@@ -984,30 +1447,52 @@ static void draw_deck_top(SDL_Surface *surface, const struct rect *rect,
 
 static void draw_deck_status(SDL_Surface *surface,
                              const struct rect *rect,
-                             const struct deck *deck)
+                             const struct deck *deck,
+                             const struct player_state *st,
+                             struct shown *shown)
 {
-    char buf[128], *c;
+    char buf[128], *c, *end;
     int tc;
     const struct player *pl = &deck->player;
 
     c = buf;
+    end = buf + sizeof buf;
 
-    c += sprintf(c, "%s: ", pl->timecoder->def->name);
+    if (timecoder_is_detecting(pl->timecoder))
+        c = append(c, end, "auto: ");
+    else
+        c = append(c, end, "%s: ", pl->timecoder->def->name);
 
     tc = timecoder_get_position(pl->timecoder, NULL);
-    if (pl->timecode_control && tc != -1) {
-        c += sprintf(c, "%7d ", tc);
+    if (st->timecode_control && tc != -1) {
+        c = append(c, end, "%7d ", tc);
     } else {
-        c += sprintf(c, "        ");
+        c = append(c, end, "        ");
     }
 
-    sprintf(c, "pitch:%+0.2f (sync %0.2f %+.5fs = %+0.2f)  %s%s",
-            pl->pitch,
-            pl->sync_pitch,
-            pl->last_difference,
-            pl->pitch * pl->sync_pitch,
-            pl->recalibrate ? "RCAL  " : "",
-            deck_is_locked(deck) ? "LOCK  " : "");
+    c = append(c, end, "pitch:%+0.2f (sync %0.2f %+.5fs = %+0.2f)  ",
+               st->pitch,
+               st->sync_pitch,
+               st->last_difference,
+               st->pitch * st->sync_pitch);
+
+    /* A resampler below the one chosen is a step down under load */
+
+    if (st->resampler != st->chosen)
+        c = append(c, end, "%s<%s ", st->resampler->name, st->chosen->name);
+    else
+        c = append(c, end, "%s ", st->resampler->name);
+
+    (void)append(c, end, "%2.0f%%  %s%s",
+                 st->load * 100.0,
+                 st->recalibrate ? "RCAL  " : "",
+                 deck_is_locked(deck) ? "LOCK  " : "");
+
+    if (shown->valid && !strcmp(buf, shown->status))
+        return;
+
+    strcpy(shown->status, buf);
+    mark_dirty(rect);
 
     draw_text(surface, rect, buf, detail_font, detail_col, background_col);
 }
@@ -1017,37 +1502,53 @@ static void draw_deck_status(SDL_Surface *surface,
  */
 
 static void draw_deck(SDL_Surface *surface, const struct rect *rect,
-                      struct deck *deck, int meter_scale)
+                      struct deck *deck, int meter_scale, struct shown *shown)
 {
     int position;
     struct rect track, top, meters, status, rest, lower;
     struct player *pl;
+    struct player_state st;
     struct track *t;
 
+    /* One snapshot for all of the deck, so that its parts agree */
+
     pl = &deck->player;
+    player_get_state(pl, &st);
     t = pl->track;
 
-    position = player_get_elapsed(pl) * t->rate;
+    /* A change to the layout of the deck top draws over the others */
+
+    if (st.timecode_control != shown->timecode_control) {
+        shown->timecode_control = st.timecode_control;
+        shown->valid = false;
+    }
+
+    position = (st.position - st.offset) * t->rate;
 
     split(*rect, from_top(FONT_SPACE + BIG_FONT_SPACE, 0), &track, &rest);
     if (rest.h < 160)
         rest = *rect;
-    else
+    else if (!shown->valid || deck->record != shown->record) {
         draw_record(surface, &track, deck->record);
+        shown->record = deck->record;
+        mark_dirty(&track);
+    }
 
     split(rest, from_top(CLOCK_FONT_SIZE * 2, SPACER), &top, &lower);
     if (lower.h < 64)
         lower = rest;
     else
-        draw_deck_top(surface, &top, pl, t);
+        draw_deck_top(surface, &top, pl, &st, t, shown);
 
     split(lower, from_bottom(FONT_SPACE, SPACER), &meters, &status);
     if (meters.h < 64)
         meters = lower;
     else
-        draw_deck_status(surface, &status, deck);
+        draw_deck_status(surface, &status, deck, &st, shown);
+
+    draw_meters(surface, &meters, t, position, meter_scale, shown);
 
-    draw_meters(surface, &meters, t, position, meter_scale);
+    shown->valid = true;
 }
 
 /*
@@ -1064,7 +1565,7 @@ static void draw_decks(SDL_Surface *surface, const struct rect *rect,
 
     for (d = 0; d < ndecks; d++) {
         split(right, columns(d, ndecks, BORDER), &left, &right);
-        draw_deck(surface, &left, &deck[d], meter_scale);
+        draw_deck(surface, &left, &deck[d], meter_scale, &shown[d]);
     }
 }
 
@@ -1442,7 +1943,7 @@ static bool handle_key(SDLKey key, SDLMod mod)
                 if (mod & KMOD_CTRL) {
                     timecoder_cycle_definition(tc);
                 } else {
-                    (void)player_toggle_timecode_control(pl);
+                    player_toggle_timecode_control(pl);
                 }
                 break;
             }
@@ -1511,6 +2012,7 @@ static void status_change(void)
 static int interface_main(void)
 {
     bool library_update, decks_update, status_update;
+    size_t n;
 
     SDL_Event event;
     SDL_TimerID timer;
@@ -1530,17 +2032,18 @@ static int interface_main(void)
 
     timer = SDL_AddTimer(REFRESH, ticker, NULL);
 
-    rig_lock();
-
     for (;;) {
-
-        rig_unlock();
-
         if (SDL_WaitEvent(&event) < 0)
             break;
 
+        /* The lock is held whilst the state of the rig is used, which
+         * is to handle the event and draw to the surface */
+
         rig_lock();
 
+        if (selector_update(&selector))
+            library_update = true;
+
         switch(event.type) {
         case SDL_QUIT: /* user request to quit application; eg. window close */
             if (rig_quit() == -1)
@@ -1552,6 +2055,9 @@ static int interface_main(void)
             if (!surface)
                 return -1;
 
+            for (n = 0; n < ndeck; n++)
+                shown[n].valid = false;
+
             library_update = true;
             decks_update = true;
             status_update = true;
@@ -1562,9 +2068,11 @@ static int interface_main(void)
             switch (event.user.code) {
             case EVENT_TICKER: /* request to poll the clocks */
                 decks_update = true;
+                stats_poll();
                 break;
 
             case EVENT_QUIT: /* internal request to finish this thread */
+                rig_unlock();
                 goto finish;
 
             case EVENT_STATUS:
@@ -1588,6 +2096,10 @@ static int interface_main(void)
                     status_set(STATUS_VERBOSE, "No search results found");
                 }
 
+                preload_listing(selector.view_listing,
+                                selector.records.selected, deck[0].importer,
+                                device_sample_rate(&deck[0].device));
+
                 library_update = true;
             }
 
@@ -1624,6 +2136,11 @@ static int interface_main(void)
 
         UNLOCK(surface);
 
+        /* Showing the surface on the display can be slow, and needs
+         * only what was drawn */
+
+        rig_unlock();
+
         if (library_update) {
             UPDATE(surface, &rlibrary);
             library_update = false;
@@ -1635,15 +2152,17 @@ static int interface_main(void)
         }
 
         if (decks_update) {
-            UPDATE(surface, &rplayers);
+            if (ndirty > MAX_DIRTY)
+                UPDATE(surface, &rplayers);
+            else if (ndirty > 0)
+                SDL_UpdateRects(surface, ndirty, dirty);
+            ndirty = 0;
             decks_update = false;
         }
 
     } /* main loop */
 
  finish:
-    rig_unlock();
-
     SDL_RemoveTimer(timer);
 
     return 0;
@@ -1702,6 +2221,7 @@ static int parse_geometry(const char *s)
 
 int interface_start(struct library *lib, const char *geo)
 {
+    int p, r;
     size_t n;
 
     if (parse_geometry(geo) == -1) {
@@ -1714,16 +2234,26 @@ int interface_start(struct library *lib, const char *geo)
             return -1;
     }
 
+    shown = calloc(ndeck, sizeof *shown);
+    if (shown == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
     if (init_spinner(zoom(SPINNER_SIZE)) == -1)
         return -1;
 
+    init_text_cache();
     selector_init(&selector, lib);
     status_notify(status_change);
     status_set(STATUS_VERBOSE, banner);
 
     fprintf(stderr, "Initialising SDL...\n");
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) == -1) {
+    p = startup_begin("SDL", NULL);
+    r = SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
+    startup_end(p);
+    if (r == -1) {
         fprintf(stderr, "%s\n", SDL_GetError());
         return -1;
     }
@@ -1737,7 +2267,10 @@ int interface_start(struct library *lib, const char *geo)
         return -1;
     }
 
-    if (load_fonts() == -1)
+    p = startup_begin("fonts", NULL);
+    r = load_fonts();
+    startup_end(p);
+    if (r == -1)
         return -1;
 
     fprintf(stderr, "Launching interface thread...\n");
@@ -1767,11 +2300,16 @@ void interface_stop(void)
     if (pthread_join(ph, NULL) != 0)
         abort();
 
-    for (n = 0; n < ndeck; n++)
+    for (n = 0; n < ndeck; n++) {
         timecoder_monitor_clear(&deck[n].timecoder);
+        free(shown[n].column);
+        free(shown[n].closeup_column);
+    }
+    free(shown);
 
     clear_spinner();
     selector_clear(&selector);
+    clear_text_cache();
     clear_fonts();
 
     TTF_Quit();
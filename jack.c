@@ -26,53 +26,28 @@
 #include "device.h"
 #include "jack.h"
 
-#define MAX_BLOCK 512 /* samples */
-#define SCALE 32768
+#define MAX_DECKS 4 /* per client */
 
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+/* A client of the JACK server, and the decks it processes in its
+ * callback. Decks share one client, unless they are given their own so
+ * the server can process them in parallel */
+
+struct client {
+    jack_client_t *client;
+    unsigned int rate, ndeck, nstarted;
+    struct device *device[MAX_DECKS];
+};
 
 struct jack {
     bool started;
+    struct client *client;
     jack_port_t *input_port[DEVICE_CHANNELS],
         *output_port[DEVICE_CHANNELS];
 };
 
-static jack_client_t *client = NULL;
-static unsigned rate,
-    ndeck = 0,
-    nstarted = 0;
-static struct device *device[4];
-
-
-/* Interleave samples from a set of JACK buffers into a local buffer */
-
-static void interleave(signed short *buf, jack_default_audio_sample_t *jbuf[],
-                       jack_nframes_t nframes)
-{
-    int n;
-    while (nframes--) {
-        for (n = 0; n < DEVICE_CHANNELS; n++) {
-            *buf = (signed short)(*jbuf[n] * SCALE);
-            buf++;
-            jbuf[n]++;
-        }
-    }
-}
-
-
-/* Uninterleave samples from a local buffer into a set of JACK buffers */
-
-static void uninterleave(jack_default_audio_sample_t *jbuf[],
-                         signed short *buf, jack_nframes_t nframes)
-{
-    int n;
-    while (nframes--) {
-        for (n = 0; n < DEVICE_CHANNELS; n++) {
-            *jbuf[n] = (jack_default_audio_sample_t)*buf / SCALE;
-            buf++;
-            jbuf[n]++;
-        }
-    }
-}
+static struct client *shared = NULL;
 
 
 /* Process the given number of frames of audio on input and output
@@ -81,13 +56,15 @@ static void uninterleave(jack_default_audio_sample_t *jbuf[],
 static void process_deck(struct device *dv, jack_nframes_t nframes)
 {
     int n;
-    jack_default_audio_sample_t *in[DEVICE_CHANNELS], *out[DEVICE_CHANNELS];
-    jack_nframes_t remain;
+    const jack_default_audio_sample_t *in[DEVICE_CHANNELS];
+    jack_default_audio_sample_t *out[DEVICE_CHANNELS];
     struct jack *jack = (struct jack*)dv->local;
 
     assert(dv->timecoder != NULL);
     assert(dv->player != NULL);
 
+    stats_handle_start(&dv->stats);
+
     for (n = 0; n < DEVICE_CHANNELS; n++) {
         in[n] = jack_port_get_buffer(jack->input_port[n], nframes);
         assert(in[n] != NULL);
@@ -95,52 +72,50 @@ static void process_deck(struct device *dv, jack_nframes_t nframes)
         assert(out[n] != NULL);
     }
 
-    /* For large values of nframes, communicate with the timecoder and
-     * player in smaller blocks */
-
-    remain = nframes;
-    while (remain > 0) {
-        signed short buf[MAX_BLOCK * DEVICE_CHANNELS];
-        jack_nframes_t block;
-
-        if (remain < MAX_BLOCK)
-            block = remain;
-        else
-            block = MAX_BLOCK;
-
-        /* Timecode input */
-
-        interleave(buf, in, block);
-        device_submit(dv, buf, block);
+    /* The timecoder and player take the port buffers as they are,
+     * for the whole period */
 
-        /* Audio output -- handle in the same loop for finer granularity */
+    device_submit_planar(dv, in, nframes);
+    device_collect_planar(dv, out, nframes);
 
-        device_collect(dv, buf, block);
-        uninterleave(out, buf, block);
-
-        remain -= block;
-    }
+    stats_handle_end(&dv->stats);
 }
 
 
 /* Process callback, which triggers the processing of audio on all
- * decks controlled by this file */
+ * decks of the client */
 
 static int process_callback(jack_nframes_t nframes, void *local)
 {
     size_t n;
+    struct client *c = local;
     struct jack *jack;
 
-    for (n = 0; n < ndeck; n++) {
-        jack = (struct jack*)device[n]->local;
+    for (n = 0; n < c->ndeck; n++) {
+        jack = (struct jack*)c->device[n]->local;
         if (jack->started)
-            process_deck(device[n], nframes);
+            process_deck(c->device[n], nframes);
     }
 
     return 0;
 }
 
 
+/* Callback when the JACK server misses a deadline, which affects
+ * every deck */
+
+static int xrun_callback(void *local)
+{
+    size_t n;
+    struct client *c = local;
+
+    for (n = 0; n < c->ndeck; n++)
+        stats_xrun(&c->device[n]->stats);
+
+    return 0;
+}
+
+
 /* Shutdown callback */
 
 static void shutdown_callback(void *local)
@@ -148,47 +123,74 @@ static void shutdown_callback(void *local)
 }
 
 
-/* Initialise ourselves as a JACK client, called once per xwax
- * session, not per deck */
+/* Open a client of the JACK server with the given name
+ *
+ * Return: pointer to client, or NULL on error */
 
-static int start_jack_client(void)
+static struct client* start_jack_client(const char *name)
 {
     const char *server_name;
     jack_status_t status;
+    struct client *c;
 
-    client = jack_client_open("xwax", JackNullOption, &status, &server_name);
-    if (client == NULL) {
+    c = malloc(sizeof *c);
+    if (c == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    c->ndeck = 0;
+    c->nstarted = 0;
+
+    c->client = jack_client_open(name, JackNullOption, &status, &server_name);
+    if (c->client == NULL) {
         if (status & JackServerFailed)
             fprintf(stderr, "JACK: Failed to connect\n");
         else
             fprintf(stderr, "jack_client_open: Failed (0x%x)\n", status);
-        return -1;
+        goto fail;
     }
 
-    if (jack_set_process_callback(client, process_callback, NULL) != 0) {
+    if (jack_set_process_callback(c->client, process_callback, c) != 0) {
         fprintf(stderr, "JACK: Failed to set process callback\n");
-        return -1;
+        goto fail_close;
     }
 
-    jack_on_shutdown(client, shutdown_callback, NULL);
+    if (jack_set_xrun_callback(c->client, xrun_callback, c) != 0) {
+        fprintf(stderr, "JACK: Failed to set xrun callback\n");
+        goto fail_close;
+    }
 
-    rate = jack_get_sample_rate(client);
-    fprintf(stderr, "JACK: %dHz\n", rate);
+    jack_on_shutdown(c->client, shutdown_callback, NULL);
 
-    return 0;
+    c->rate = jack_get_sample_rate(c->client);
+    fprintf(stderr, "JACK: %dHz\n", c->rate);
+
+    return c;
+
+ fail_close:
+    jack_client_close(c->client);
+ fail:
+    free(c);
+    return NULL;
 }
 
 
-/* Close the JACK client, at which happens when all decks have been
- * cleared */
+/* Close the JACK client, at which happens when all its decks have
+ * been cleared */
 
-static int stop_jack_client(void)
+static int stop_jack_client(struct client *c)
 {
-    if (jack_client_close(client) != 0) {
+    if (c == shared)
+        shared = NULL;
+
+    if (jack_client_close(c->client) != 0) {
         fprintf(stderr, "jack_client_close: Failed\n");
+        free(c);
         return -1;
     }
-    client = NULL;
+
+    free(c);
     return 0;
 }
 
@@ -204,7 +206,8 @@ static int register_ports(struct jack *jack, const char *name)
     assert(DEVICE_CHANNELS == 2);
     for (n = 0; n < DEVICE_CHANNELS; n++) {
         sprintf(port_name, "%s_timecode_%c", name, channel[n]);
-        jack->input_port[n] = jack_port_register(client, port_name,
+        jack->input_port[n] = jack_port_register(jack->client->client,
+                                                 port_name,
                                                  JACK_DEFAULT_AUDIO_TYPE,
                                                  JackPortIsInput, 0);
         if (jack->input_port[n] == NULL) {
@@ -212,7 +215,8 @@ static int register_ports(struct jack *jack, const char *name)
             return -1;
         }
         sprintf(port_name, "%s_playback_%c", name, channel[n]);
-        jack->output_port[n] = jack_port_register(client, port_name,
+        jack->output_port[n] = jack_port_register(jack->client->client,
+                                                  port_name,
                                                   JACK_DEFAULT_AUDIO_TYPE,
                                                   JackPortIsOutput, 0);
         if (jack->output_port[n] == NULL) {
@@ -227,7 +231,9 @@ static int register_ports(struct jack *jack, const char *name)
 
 static unsigned int sample_rate(struct device *dv)
 {
-    return rate; /* the same rate is used for all decks */
+    struct jack *jack = (struct jack*)dv->local;
+
+    return jack->client->rate;
 }
 
 
@@ -236,18 +242,20 @@ static unsigned int sample_rate(struct device *dv)
 static void start(struct device *dv)
 {
     struct jack *jack = (struct jack*)dv->local;
+    struct client *c = jack->client;
 
     assert(dv->timecoder != NULL);
     assert(dv->player != NULL);
 
-    /* On the first call to start, start audio rolling for all decks */
+    /* On the first call to start, start audio rolling for all decks
+     * of the client */
 
-    if (nstarted == 0) {
-        if (jack_activate(client) != 0)
+    if (c->nstarted == 0) {
+        if (jack_activate(c->client) != 0)
             abort();
     }
 
-    nstarted++;
+    c->nstarted++;
     jack->started = true;
 }
 
@@ -257,14 +265,15 @@ static void start(struct device *dv)
 static void stop(struct device *dv)
 {
     struct jack *jack = (struct jack*)dv->local;
+    struct client *c = jack->client;
 
     jack->started = false;
-    nstarted--;
+    c->nstarted--;
 
     /* On the final stop call, stop JACK rolling */
 
-    if (nstarted == 0) {
-        if (jack_deactivate(client) != 0)
+    if (c->nstarted == 0) {
+        if (jack_deactivate(c->client) != 0)
             abort();
     }
 }
@@ -275,34 +284,34 @@ static void stop(struct device *dv)
 static void clear(struct device *dv)
 {
     struct jack *jack = (struct jack*)dv->local;
+    struct client *c = jack->client;
     int n;
 
     /* Unregister ports */
 
     for (n = 0; n < DEVICE_CHANNELS; n++) {
-        if (jack_port_unregister(client, jack->input_port[n]) != 0)
+        if (jack_port_unregister(c->client, jack->input_port[n]) != 0)
             abort();
-        if (jack_port_unregister(client, jack->output_port[n]) != 0)
+        if (jack_port_unregister(c->client, jack->output_port[n]) != 0)
             abort();
     }
 
     free(dv->local);
 
-    /* Remove this from the global list, so that potentially xwax could
+    /* Remove this from the client, so that potentially xwax could
      * continue to run even if a deck is removed */
 
-    for (n = 0; n < ndeck; n++) {
-        if (device[n] == dv)
+    for (n = 0; n < c->ndeck; n++) {
+        if (c->device[n] == dv)
             break;
     }
-    assert(n != ndeck);
+    assert(n != c->ndeck);
 
-    if (ndeck == 1) { /* this is the last remaining deck */
-        stop_jack_client();
-        ndeck = 0;
+    if (c->ndeck == 1) { /* this is the last remaining deck */
+        stop_jack_client(c);
     } else {
-        device[n] = device[ndeck - 1]; /* compact the list */
-        ndeck--;
+        c->device[n] = c->device[c->ndeck - 1]; /* compact the list */
+        c->ndeck--;
     }
 }
 
@@ -316,39 +325,63 @@ static struct device_ops jack_ops = {
 
 
 /* Initialise a new JACK deck, creating a new JACK client if required,
- * and the approporiate input and output ports */
+ * and the approporiate input and output ports
+ *
+ * A deck given its own client is processed in its own callback, which
+ * a server such as JACK2 can run in parallel with the others on a
+ * multi-core system */
 
-int jack_init(struct device *dv, const char *name)
+int jack_init(struct device *dv, const char *name, bool own_client)
 {
     struct jack *jack;
+    struct client *c;
 
-    /* If this is the first JACK deck, initialise the global JACK services */
+    /* Decks share one client, which is opened for the first */
 
-    if (client == NULL) {
-        if (start_jack_client() == -1)
+    if (own_client) {
+        char client_name[64];
+
+        snprintf(client_name, sizeof client_name, "xwax_%s", name);
+        c = start_jack_client(client_name);
+        if (c == NULL)
             return -1;
+
+    } else {
+        if (shared == NULL) {
+            shared = start_jack_client("xwax");
+            if (shared == NULL)
+                return -1;
+        }
+        c = shared;
+    }
+
+    if (c->ndeck == ARRAY_SIZE(c->device)) {
+        fprintf(stderr, "JACK: Too many decks for one client\n");
+        return -1;
     }
 
     jack = malloc(sizeof(struct jack));
     if (jack == NULL) {
         perror("malloc");
-        return -1;
+        goto fail;
     }
 
     jack->started = false;
+    jack->client = c;
     if (register_ports(jack, name) == -1)
-        goto fail;
+        goto fail_free;
 
     dv->local = jack;
     dv->ops = &jack_ops;
 
-    assert(ndeck < sizeof device);
-    device[ndeck] = dv;
-    ndeck++;
+    c->device[c->ndeck++] = dv;
 
     return 0;
 
- fail:
+ fail_free:
     free(jack);
+ fail:
+    if (c->ndeck == 0)
+        stop_jack_client(c);
     return -1;
 }
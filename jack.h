@@ -20,8 +20,10 @@
 #ifndef JACK_H
 #define JACK_H
 
+#include <stdbool.h>
+
 #include "device.h"
 
-int jack_init(struct device *dv, const char *name);
+int jack_init(struct device *dv, const char *name, bool own_client);
 
 #endif
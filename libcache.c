@@ -0,0 +1,607 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Each snapshot file holds the records from one scan, laid out so
+ * the file can be mapped and used without parsing:
+ *
+ *   [header][entries][items][by_artist][by_bpm][strings]
+ *
+ * Items are the records in the order of the scan. The by_artist and
+ * by_bpm arrays give the sorted orders as indexes into the items, so
+ * nothing needs to be sorted again. All strings are offsets into the
+ * string pool at the end.
+ *
+ * The entries are the scanner, every directory below the path (or
+ * the path itself, if it is a playlist) and their modification times.
+ * Any change to the files in a directory updates its time, so the
+ * snapshot is only used if none of them have changed.
+ *
+ * A file is named by a hash of the scanner and path. Files are
+ * written under a temporary name, so partial files are never used.
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "libcache.h"
+
+#define MAGIC "xwaxlib"
+#define VERSION 1
+#define MAX_FDS 16 /* used by nftw() */
+
+struct header {
+    char magic[8];
+    uint32_t version, entries, records,
+        strings; /* bytes in the pool */
+    uint32_t scan, path; /* offsets in the pool */
+};
+
+struct entry {
+    int64_t sec, nsec; /* modification time */
+    uint32_t name, pad;
+};
+
+struct item {
+    double bpm;
+    uint32_t pathname, artist, title, pad;
+};
+
+/* Snapshot being built before it is written out */
+
+struct snapshot {
+    struct header header;
+    struct entry *entry;
+    char *strings;
+    size_t size; /* allocated for strings */
+};
+
+static const char *dir = NULL;
+static struct snapshot *walking = NULL; /* nftw() has no context */
+
+/*
+ * Use the given directory for snapshots; otherwise every library is
+ * scanned in full
+ */
+
+void libcache_set_dir(const char *d)
+{
+    dir = d;
+}
+
+/*
+ * Return: pathname of the snapshot file, or NULL on error
+ * Post: if not NULL, the return value must be free'd
+ */
+
+static char* snapshot_pathname(const char *scan, const char *path)
+{
+    uint64_t hash;
+    const char *s;
+    char *p;
+
+    /* FNV-1a, over both strings including terminators */
+
+    hash = 14695981039346656037ULL;
+
+    for (s = scan;; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+        if (*s == '\0')
+            break;
+    }
+
+    for (s = path;; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+        if (*s == '\0')
+            break;
+    }
+
+    if (asprintf(&p, "%s/library-%016llx.lib", dir,
+                 (unsigned long long)hash) == -1)
+    {
+        perror("asprintf");
+        return NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Add a string to the pool of the snapshot
+ *
+ * Return: -1 on memory allocation failure, otherwise 0
+ * Post: if 0, *offset is the position of the string in the pool
+ */
+
+static int add_string(struct snapshot *s, const char *str, uint32_t *offset)
+{
+    size_t len;
+
+    len = strlen(str) + 1;
+
+    if (s->header.strings + len > s->size) {
+        char *p;
+        size_t size;
+
+        size = (s->size ? s->size : 65536);
+        while (size < s->header.strings + len)
+            size *= 2;
+
+        p = realloc(s->strings, size);
+        if (p == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        s->strings = p;
+        s->size = size;
+    }
+
+    memcpy(s->strings + s->header.strings, str, len);
+    *offset = s->header.strings;
+    s->header.strings += len;
+    return 0;
+}
+
+/*
+ * Add a file or directory whose modification time validates the
+ * snapshot
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int add_entry(struct snapshot *s, const char *name,
+                     const struct stat *st)
+{
+    struct entry *e;
+
+    e = realloc(s->entry, sizeof *e * (s->header.entries + 1));
+    if (e == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    s->entry = e;
+
+    e = &s->entry[s->header.entries];
+    e->sec = st->st_mtim.tv_sec;
+    e->nsec = st->st_mtim.tv_nsec;
+    e->pad = 0;
+
+    if (add_string(s, name, &e->name) == -1)
+        return -1;
+
+    s->header.entries++;
+    return 0;
+}
+
+/*
+ * Callback for nftw() to add each directory
+ */
+
+static int visit(const char *name, const struct stat *st, int type,
+                 struct FTW *ftw)
+{
+    if (ftw->level > 0 && type != FTW_D && type != FTW_DNR)
+        return 0;
+
+    if (type == FTW_NS)
+        return -1;
+
+    return add_entry(walking, name, st);
+}
+
+/*
+ * Return: true if the given entry is unchanged, otherwise false
+ */
+
+static bool entry_is_current(const struct entry *e, const char *strings)
+{
+    struct stat st;
+
+    if (stat(strings + e->name, &st) == -1)
+        return false;
+
+    return e->sec == st.st_mtim.tv_sec && e->nsec == st.st_mtim.tv_nsec;
+}
+
+/*
+ * Make a record from the snapshot
+ *
+ * Return: pointer to record in the arena, or NULL on error
+ */
+
+static struct record* get_record(const struct item *i, const char *strings,
+                                 struct arena *a)
+{
+    struct record *re;
+
+    re = arena_alloc(a, sizeof *re);
+    if (re == NULL)
+        return NULL;
+
+    re->pathname = arena_strdup(a, strings + i->pathname);
+    re->artist = arena_intern(a, strings + i->artist);
+    re->title = arena_strdup(a, strings + i->title);
+    re->bpm = i->bpm;
+
+    if (re->pathname == NULL || re->artist == NULL || re->title == NULL)
+        return NULL;
+
+    record_set_key(re);
+
+    return re;
+}
+
+/*
+ * Fill the listings of a crate from a snapshot
+ *
+ * Return: -1 if there is no usable snapshot, otherwise 0
+ * Post: if 0, the crate's listings are the records of the snapshot
+ */
+
+static int fill(struct crate *c, struct arena *a, const void *map,
+                size_t len, const char *scan, const char *path)
+{
+    unsigned int n;
+    uint64_t need;
+    const struct header *h;
+    const struct entry *entry;
+    const struct item *item;
+    const uint32_t *by_artist, *by_bpm;
+    const char *strings;
+
+    if (len < sizeof *h)
+        return -1;
+
+    h = map;
+    if (memcmp(h->magic, MAGIC, sizeof MAGIC) != 0 || h->version != VERSION)
+        return -1;
+
+    need = sizeof *h
+        + (uint64_t)h->entries * sizeof *entry
+        + (uint64_t)h->records * (sizeof *item + sizeof(uint32_t) * 2)
+        + h->strings;
+
+    if (need != len || h->strings == 0)
+        return -1;
+
+    entry = (const struct entry*)(h + 1);
+    item = (const struct item*)(entry + h->entries);
+    by_artist = (const uint32_t*)(item + h->records);
+    by_bpm = by_artist + h->records;
+    strings = (const char*)(by_bpm + h->records);
+
+    if (strings[h->strings - 1] != '\0'
+        || h->scan >= h->strings || h->path >= h->strings
+        || strcmp(strings + h->scan, scan) != 0
+        || strcmp(strings + h->path, path) != 0)
+    {
+        return -1;
+    }
+
+    for (n = 0; n < h->entries; n++) {
+        if (entry[n].name >= h->strings
+            || !entry_is_current(&entry[n], strings))
+        {
+            debug("library snapshot of %s is stale", path);
+            return -1;
+        }
+    }
+
+    for (n = 0; n < h->records; n++) {
+        if (item[n].pathname >= h->strings || item[n].artist >= h->strings
+            || item[n].title >= h->strings
+            || by_artist[n] >= h->records || by_bpm[n] >= h->records)
+        {
+            return -1;
+        }
+    }
+
+    for (n = 0; n < h->records; n++) {
+        struct record *re;
+
+        re = get_record(&item[n], strings, a);
+        if (re == NULL)
+            goto fail;
+
+        if (listing_add(&c->by_order, re) == -1)
+            goto fail;
+    }
+
+    for (n = 0; n < h->records; n++) {
+        if (listing_add(&c->by_artist, c->by_order.record[by_artist[n]]) == -1)
+            goto fail;
+        if (listing_add(&c->by_bpm, c->by_order.record[by_bpm[n]]) == -1)
+            goto fail;
+    }
+
+    return 0;
+
+ fail:
+    listing_blank(&c->by_order);
+    listing_blank(&c->by_artist);
+    listing_blank(&c->by_bpm);
+    return -1;
+}
+
+/*
+ * Use a snapshot of a previous scan of the given path
+ *
+ * Pre: crate is empty
+ * Return: -1 if there is no usable snapshot, otherwise 0
+ * Post: if 0, the crate's listings are the records of the scan, in
+ *     the order of the scan and sorted, allocated from the arena
+ */
+
+int libcache_load(const char *scan, const char *path, struct crate *c,
+                  struct arena *a)
+{
+    int fd, r;
+    char *pathname;
+    void *map;
+    struct stat st;
+
+    if (dir == NULL)
+        return -1;
+
+    pathname = snapshot_pathname(scan, path);
+    if (pathname == NULL)
+        return -1;
+
+    fd = open(pathname, O_RDONLY);
+    free(pathname);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror("open");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+
+    if (st.st_size == 0)
+        goto fail;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    if (close(fd) == -1)
+        abort();
+
+    r = fill(c, a, map, st.st_size, scan, path);
+
+    if (munmap(map, st.st_size) == -1)
+        abort();
+
+    return r;
+
+ fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Return: position of the given record in the order of the scan
+ */
+
+static uint32_t position(const uint32_t *pos, const struct record *re)
+{
+    return pos[re->id];
+}
+
+/*
+ * Write the snapshot to a file
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int write_snapshot(const struct snapshot *s, const struct crate *c,
+                          const uint32_t *pos, const struct item *item,
+                          const char *pathname)
+{
+    int fd;
+    size_t n;
+    char *tmpname;
+    FILE *f;
+
+    if (asprintf(&tmpname, "%s.XXXXXX", pathname) == -1) {
+        perror("asprintf");
+        return -1;
+    }
+
+    fd = mkstemp(tmpname);
+    if (fd == -1) {
+        perror("mkstemp");
+        free(tmpname);
+        return -1;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        perror("fdopen");
+        if (close(fd) == -1)
+            abort();
+        goto fail;
+    }
+
+    fwrite(&s->header, sizeof s->header, 1, f);
+    fwrite(s->entry, sizeof *s->entry, s->header.entries, f);
+    fwrite(item, sizeof *item, s->header.records, f);
+
+    for (n = 0; n < c->by_artist.entries; n++) {
+        uint32_t p = position(pos, c->by_artist.record[n]);
+        fwrite(&p, sizeof p, 1, f);
+    }
+
+    for (n = 0; n < c->by_bpm.entries; n++) {
+        uint32_t p = position(pos, c->by_bpm.record[n]);
+        fwrite(&p, sizeof p, 1, f);
+    }
+
+    fwrite(s->strings, 1, s->header.strings, f);
+
+    if (ferror(f)) {
+        perror("fwrite");
+        fclose(f);
+        goto fail;
+    }
+
+    if (fclose(f) == EOF) {
+        perror("fclose");
+        goto fail;
+    }
+
+    if (rename(tmpname, pathname) == -1) {
+        perror("rename");
+        goto fail;
+    }
+
+    free(tmpname);
+    return 0;
+
+ fail:
+    if (unlink(tmpname) == -1)
+        perror("unlink");
+    free(tmpname);
+    return -1;
+}
+
+/*
+ * Keep a snapshot of a completed scan, for next time
+ *
+ * Failure to write a snapshot is not an error; the path is just
+ * scanned again next time.
+ *
+ * Pre: crate contains exactly the records from the scan, each with
+ *     a unique id
+ */
+
+void libcache_save(const char *scan, const char *path, const struct crate *c)
+{
+    size_t n, ids;
+    char *pathname;
+    uint32_t *pos;
+    struct item *item;
+    struct stat st;
+    struct snapshot s;
+
+    if (dir == NULL)
+        return;
+
+    memset(&s, '\0', sizeof s);
+    memcpy(s.header.magic, MAGIC, sizeof MAGIC);
+    s.header.version = VERSION;
+
+    pos = NULL;
+    item = NULL;
+    pathname = NULL;
+
+    if (add_string(&s, scan, &s.header.scan) == -1
+        || add_string(&s, path, &s.header.path) == -1)
+    {
+        goto done;
+    }
+
+    /* A change to the scanner might change the result */
+
+    if (stat(scan, &st) == -1) {
+        perror("stat");
+        goto done;
+    }
+
+    if (add_entry(&s, scan, &st) == -1)
+        goto done;
+
+    walking = &s;
+    if (nftw(path, visit, MAX_FDS, 0) != 0) {
+        fprintf(stderr, "Not keeping a snapshot of %s\n", path);
+        walking = NULL;
+        goto done;
+    }
+    walking = NULL;
+
+    /* Records are stored in the order of the scan, once each; a
+     * playlist can give a record more than once */
+
+    ids = 0;
+    for (n = 0; n < c->by_order.entries; n++) {
+        if (c->by_order.record[n]->id >= ids)
+            ids = c->by_order.record[n]->id + 1;
+    }
+
+    pos = malloc(sizeof *pos * (ids + 1));
+    item = malloc(sizeof *item * (c->by_order.entries + 1));
+    if (pos == NULL || item == NULL) {
+        perror("malloc");
+        goto done;
+    }
+
+    for (n = 0; n < ids; n++)
+        pos[n] = UINT32_MAX;
+
+    for (n = 0; n < c->by_order.entries; n++) {
+        const struct record *re = c->by_order.record[n];
+        struct item *i;
+
+        if (pos[re->id] != UINT32_MAX)
+            continue;
+
+        pos[re->id] = s.header.records;
+        i = &item[s.header.records++];
+        i->bpm = re->bpm;
+        i->pad = 0;
+
+        if (add_string(&s, re->pathname, &i->pathname) == -1
+            || add_string(&s, re->artist, &i->artist) == -1
+            || add_string(&s, re->title, &i->title) == -1)
+        {
+            goto done;
+        }
+    }
+
+    pathname = snapshot_pathname(scan, path);
+    if (pathname == NULL)
+        goto done;
+
+    if (write_snapshot(&s, c, pos, item, pathname) == 0)
+        debug("library snapshot of %s is %s", path, pathname);
+
+ done:
+    free(pathname);
+    free(item);
+    free(pos);
+    free(s.entry);
+    free(s.strings);
+}
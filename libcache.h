@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Persistent snapshot of the result of each library scan, so that an
+ * unchanged music collection does not need to be scanned again
+ */
+
+#ifndef LIBCACHE_H
+#define LIBCACHE_H
+
+#include "arena.h"
+#include "library.h"
+
+void libcache_set_dir(const char *dir);
+
+int libcache_load(const char *scan, const char *path, struct crate *c,
+                  struct arena *a);
+void libcache_save(const char *scan, const char *path,
+                   const struct crate *c);
+
+#endif
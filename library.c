@@ -17,23 +17,64 @@
  *
  */
 
-#define _GNU_SOURCE /* getdelim(), strdupa() */
+#define _GNU_SOURCE /* strdupa() */
 #include <assert.h>
 #include <errno.h>
 #include <libgen.h> /*  basename() */
 #include <math.h> /* isfinite() */
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "arena.h"
 #include "external.h"
+#include "libcache.h"
 #include "library.h"
 
 #define CRATE_ALL "All records"
+#define MAX_SCANS 4 /* scanners running at once */
+#define MAX_FDS 16 /* used by nftw() */
+
+#define WATCH_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE \
+                      | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* A scan of one path, which can run alongside others */
+
+struct scan {
+    const char *scanner, *path;
+    struct crate found; /* records of the scan */
+    struct arena arena; /* holding the records */
+    bool from_snapshot; /* otherwise only found.by_order is valid */
+    int result;
+    pid_t pid; /* of the scanner, or 0 if not running */
+};
+
+/* A directory of a crate which is watched for changes */
+
+struct watched {
+    int wd;
+    char *dir;
+    const char *scanner;
+    struct crate *crate;
+};
+
+/* A change to the files of a crate, to apply to the library */
+
+struct change {
+    bool removed; /* otherwise, records are added from the scan */
+    char *path;
+    struct crate *crate;
+    struct scan scan;
+};
 
 /*
  * Initialise a crate
@@ -88,33 +129,117 @@ static int crate_cmp(const struct crate *a, const struct crate *b)
     return strcmp(a->name, b->name);
 }
 
+/* A record being added to a crate, and its position in the batch */
+
+struct pending {
+    struct record *re;
+    size_t pos;
+};
+
+/*
+ * Comparison function, see qsort(3)
+ *
+ * Equal records are in the order they were given, so the first of
+ * them is the one kept.
+ */
+
+static int pending_cmp(const void *a, const void *b)
+{
+    const struct pending *x = a, *y = b;
+    int r;
+
+    r = record_cmp(x->re, y->re, SORT_ARTIST);
+    if (r != 0)
+        return r;
+
+    if (x->pos < y->pos)
+        return -1;
+    else
+        return x->pos > y->pos;
+}
+
 /*
- * Add a record into a crate and its various indexes
+ * Add records into a crate and its various indexes
  *
- * FIXME: not all out-of-memory cases are implemented
+ * The result is as if each record was added in turn, where one equal
+ * to an existing entry is not added, unless it is that entry. But the
+ * records are sorted once and merged in, rather than inserted one at
+ * a time.
  *
- * Return: Pointer to existing entry, NULL if out of memory
- * Post: Record added to the crate
+ * Return: 0 on success, -1 on memory allocation failure
+ * Post: if 0, entry[n] is the crate's entry for re[n]
  */
 
-static struct record* crate_add(struct crate *c, struct record *r)
+static int crate_add_many(struct crate *c, struct record **re, size_t n,
+                          struct record **entry)
 {
-    struct record *x;
+    int r;
+    size_t m;
+    struct pending *p;
+    struct record *prev;
+    struct listing fresh;
+
+    p = malloc(sizeof *p * (n + 1));
+    if (p == NULL) {
+        perror("malloc");
+        return -1;
+    }
 
-    assert(r != NULL);
+    for (m = 0; m < n; m++) {
+        p[m].re = re[m];
+        p[m].pos = m;
+    }
 
-    x = listing_insert(&c->by_artist, r, SORT_ARTIST);
-    if (x != r) /* may be NULL */
-        return x;
+    qsort(p, n, sizeof *p, pending_cmp);
 
-    x = listing_insert(&c->by_bpm, r, SORT_BPM);
-    if (x == NULL)
-        abort(); /* FIXME: remove from all listings and return */
-    assert(x == r);
+    /* Find which records are new, in the order of the crate */
+
+    r = -1;
+    listing_init(&fresh);
+    prev = NULL;
+
+    for (m = 0; m < n; m++) {
+        struct record *x = p[m].re;
+        size_t z, pos = p[m].pos;
+
+        if (prev != NULL && record_cmp(prev, x, SORT_ARTIST) == 0) {
+            entry[pos] = prev;
+            continue;
+        }
+
+        z = listing_find(&c->by_artist, x, SORT_ARTIST);
+        if (z < c->by_artist.entries
+            && record_cmp(c->by_artist.record[z], x, SORT_ARTIST) == 0)
+        {
+            prev = c->by_artist.record[z];
+            entry[pos] = prev;
+            continue;
+        }
+
+        if (listing_add(&fresh, x) == -1)
+            goto done;
+
+        prev = x;
+        entry[pos] = x;
+    }
+
+    if (listing_merge(&c->by_artist, &fresh, SORT_ARTIST) == -1)
+        goto done;
 
-    if (listing_add(&c->by_order, r) != 0)
+    listing_sort(&fresh, SORT_BPM);
+    if (listing_merge(&c->by_bpm, &fresh, SORT_BPM) == -1)
         abort(); /* FIXME: remove from all listings and return */
 
+    for (m = 0; m < n; m++) {
+        if (entry[m] == re[m] && listing_add(&c->by_order, re[m]) == -1)
+            abort(); /* FIXME: remove from all listings and return */
+    }
+
+    r = 0;
+
+ done:
+    listing_clear(&fresh);
+    free(p);
     return r;
 }
 
@@ -228,6 +353,20 @@ int library_init(struct library *li)
 {
     li->crate = NULL;
     li->crates = 0;
+    trigram_init(&li->index);
+    li->scan = NULL;
+    li->scans = 0;
+    if (pthread_mutex_init(&li->stop_lock, NULL) != 0)
+        abort();
+    li->stopped = false;
+    arena_init(&li->arena);
+
+    li->inotify = -1;
+    li->watch = NULL;
+    li->watches = 0;
+    li->change = NULL;
+    li->changes = 0;
+    li->generation = 0;
 
     if (crate_init(&li->all, CRATE_ALL, true) == -1)
         return -1;
@@ -241,14 +380,32 @@ int library_init(struct library *li)
 }
 
 /*
- * Free resources associated with a record
+ * Free the scans in the queue, and any records they found which were
+ * not added to the library
+ *
+ * Post: queue is empty
  */
 
-static void record_clear(struct record *re)
+static void clear_scans(struct library *li)
 {
-    free(re->pathname);
-    free(re->artist);
-    free(re->title);
+    size_t n;
+
+    for (n = 0; n < li->scans; n++) {
+        crate_clear(&li->scan[n].found);
+        arena_clear(&li->scan[n].arena);
+    }
+
+    /* The queue may be being read by library_stop() */
+
+    if (pthread_mutex_lock(&li->stop_lock) != 0)
+        abort();
+
+    free(li->scan);
+    li->scan = NULL;
+    li->scans = 0;
+
+    if (pthread_mutex_unlock(&li->stop_lock) != 0)
+        abort();
 }
 
 /*
@@ -259,15 +416,18 @@ void library_clear(struct library *li)
 {
     int n;
 
-    /* This object is responsible for all the record pointers */
+    clear_scans(li);
 
-    for (n = 0; n < li->all.by_artist.entries; n++) {
-        struct record *re;
+    /* Changes are always applied as soon as they are read */
 
-        re = li->all.by_artist.record[n];
-        record_clear(re);
-        free(re);
-    }
+    assert(li->changes == 0);
+
+    if (li->inotify != -1 && close(li->inotify) == -1)
+        abort();
+
+    for (n = 0; n < li->watches; n++)
+        free(li->watch[n].dir);
+    free(li->watch);
 
     /* Clear crates */
 
@@ -281,54 +441,13 @@ void library_clear(struct library *li)
     free(li->crate);
 
     crate_clear(&li->all);
-}
-
-/*
- * Read the next string from the file up to a valid delimeter
- *
- * Return: pointer to alloc'd string
- * Post: *delim is set
- */
-
-static char* get_field(FILE *f, char *delim)
-{
-    char *s;
-    size_t len;
-
-    s = NULL;
-    len = 0;
-
-    for (;;) {
-        int c;
-        void *x;
-
-        x = realloc(s, len + 1);
-        if (x == NULL) {
-            perror("realloc");
-            free(s);
-            return NULL;
-        }
-        s = x;
-
-        c = fgetc(f);
-        switch (c) {
-        case EOF:
-            *delim = '\0';
-            goto done;
+    trigram_clear(&li->index);
+    if (pthread_mutex_destroy(&li->stop_lock) != 0)
+        abort();
 
-        case '\n':
-        case '\t':
-            *delim = c;
-            goto done;
-        }
-
-        s[len] = c;
-        len++;
-    }
+    /* This object is responsible for all the records */
 
-done:
-    s[len] = '\0';
-    return s;
+    arena_clear(&li->arena);
 }
 
 /*
@@ -353,128 +472,255 @@ static double parse_bpm(const char *s)
     return bpm;
 }
 
+/*
+ * Split the next field from a line
+ *
+ * Return: pointer to the field, or NULL if there are no more
+ * Post: *line is the remainder of the line
+ */
+
+static char* next_field(char **line)
+{
+    char *s, *t;
+
+    s = *line;
+    if (s == NULL)
+        return NULL;
+
+    t = strchr(s, '\t');
+    if (t == NULL) {
+        *line = NULL;
+    } else {
+        *t = '\0';
+        *line = t + 1;
+    }
+
+    return s;
+}
+
 /*
  * Read the next record from the file
  *
  * Return: 0 on success, otherwise -1
- * Post: if 0 is returned, *r points to an alloc'd record or NULL
+ * Post: if 0 is returned, *r points to a record in the arena, or NULL
  *     if EOF was found
  */
 
-static int get_record(FILE *f, struct record **r)
+static int get_record(FILE *f, char **buf, size_t *size, struct arena *a,
+                      struct record **r)
 {
-    struct record x, *y;
-    char delim, *s;
+    ssize_t len;
+    char *line, *pathname, *artist, *title, *bpm;
+    struct record *x;
 
-    x.pathname = NULL;
-    x.artist = NULL;
-    x.title = NULL;
-    x.bpm = 0.0;
+    errno = 0;
+    len = getline(buf, size, f);
+    if (len == -1) {
+        if (errno != 0) {
+            perror("getline");
+            return -1;
+        }
 
-    x.pathname = get_field(f, &delim);
-    if (x.pathname == NULL)
-        goto fail;
+        *r = NULL; /* clean EOF */
+        return 0;
+    }
+
+    line = *buf;
+    if (line[len - 1] != '\n') {
+        fprintf(stderr, "Malformed record '%s'\n", line);
+        return -1;
+    }
+    line[len - 1] = '\0';
 
-    /* Check for clean EOF */
+    pathname = next_field(&line);
+    artist = next_field(&line);
+    title = next_field(&line);
+    bpm = next_field(&line); /* optional */
 
-    if (delim == '\0' && x.pathname[0] == '\0') {
-        free(x.pathname);
-        *r = NULL;
-        return 0;
+    if (title == NULL || line != NULL) {
+        fprintf(stderr, "Malformed record '%s'\n", pathname);
+        return -1;
     }
 
-    if (delim != '\t') {
-        fprintf(stderr, "Malformed record '%s'\n", x.pathname);
-        goto fail;
+    x = arena_alloc(a, sizeof *x);
+    if (x == NULL)
+        return -1;
+
+    x->pathname = arena_strdup(a, pathname);
+    x->artist = arena_intern(a, artist);
+    x->title = arena_strdup(a, title);
+    x->bpm = 0.0;
+
+    if (x->pathname == NULL || x->artist == NULL || x->title == NULL)
+        return -1;
+
+    record_set_key(x);
+
+    /* Beats-per-minute (BPM) */
+
+    if (bpm != NULL) {
+        x->bpm = parse_bpm(bpm);
+        if (!isfinite(x->bpm)) {
+            fprintf(stderr, "%s: Ignoring malformed BPM '%s'\n",
+                    x->pathname, bpm);
+            x->bpm = 0.0;
+        }
     }
 
-    x.artist = get_field(f, &delim);
-    if (x.artist == NULL)
-        goto fail;
+    *r = x;
+    return 0;
+}
 
-    if (delim != '\t') {
-        fprintf(stderr, "Malformed record '%s'\n", x.pathname);
-        goto fail;
+/*
+ * Add the records from a scan to the library, and the given crates
+ *
+ * Return: 0 on success, -1 on fatal error (may leak)
+ * Post: if 0, records are the library's entries for each record from
+ *     the scan, and the records given are the library's responsibility
+ */
+
+static int add_records(struct library *li, struct crate *crate,
+                       struct crate *scanned, struct listing *records)
+{
+    int r;
+    size_t n;
+    struct record **entry, **re;
+
+    re = records->record;
+    n = records->entries;
+
+    entry = malloc(sizeof *entry * (n + 1));
+    if (entry == NULL) {
+        perror("malloc");
+        return -1;
     }
 
-    x.title = get_field(f, &delim);
-    if (x.title == NULL)
-        goto fail;
+    r = -1;
+
+    /* Add to the crate of all records */
 
-    if (delim == '\n') /* other fields are optional */
+    if (crate_add_many(&li->all, re, n, entry) == -1)
         goto done;
 
-    if (delim != '\t') {
-        fprintf(stderr, "Malformed record '%s'\n", x.pathname);
-        goto fail;
+    /* Where there is an existing entry, use it instead */
+
+    for (n = 0; n < records->entries; n++) {
+        if (entry[n] != re[n]) {
+            re[n] = entry[n];
+            continue;
+        }
+
+        if (trigram_add(&li->index, re[n]) == -1)
+            goto done;
     }
 
-    /* Beats-per-minute (BPM) */
+    /* Insert into the user's crate */
 
-    s = get_field(f, &delim);
-    if (s == NULL)
-        goto fail;
+    if (crate_add_many(crate, re, records->entries, entry) == -1)
+        goto done;
 
-    x.bpm = parse_bpm(s);
-    if (!isfinite(x.bpm)) {
-        fprintf(stderr, "%s: Ignoring malformed BPM '%s'\n", x.pathname, s);
-        x.bpm = 0.0;
+    if (scanned != NULL
+        && crate_add_many(scanned, re, records->entries, entry) == -1)
+    {
+        goto done;
     }
 
-    free(s);
+    r = 0;
 
-    if (delim != '\n') {
-        fprintf(stderr, "Malformed record '%s'\n", x.pathname);
-        goto fail;
-    }
+ done:
+    free(entry);
+    return r;
+}
 
-done:
-    y = malloc(sizeof *y);
-    if (y == NULL) {
-        perror("malloc");
-        goto fail;
+/*
+ * Add the records of a snapshot of a previous scan, in place of
+ * scanning again
+ *
+ * Return: 0 on success, -1 on fatal error (may leak)
+ */
+
+static int use_snapshot(struct library *li, struct crate *crate,
+                        struct crate *snapshot)
+{
+    size_t n;
+
+    fprintf(stderr, "Using snapshot of '%s'...\n", snapshot->name);
+
+    /* Into an empty library the records can go as they are, already
+     * sorted; otherwise they are merged in as if from the scan */
+
+    if (li->all.by_order.entries == 0 && crate->by_order.entries == 0) {
+        for (n = 0; n < snapshot->by_order.entries; n++) {
+            if (trigram_add(&li->index, snapshot->by_order.record[n]) == -1)
+                return -1;
+        }
+
+        if (listing_copy(&snapshot->by_artist, &li->all.by_artist) == -1
+            || listing_copy(&snapshot->by_bpm, &li->all.by_bpm) == -1
+            || listing_copy(&snapshot->by_order, &li->all.by_order) == -1
+            || listing_copy(&snapshot->by_artist, &crate->by_artist) == -1
+            || listing_copy(&snapshot->by_bpm, &crate->by_bpm) == -1
+            || listing_copy(&snapshot->by_order, &crate->by_order) == -1)
+        {
+            return -1;
+        }
+
+    } else {
+        if (add_records(li, crate, NULL, &snapshot->by_order) == -1)
+            return -1;
     }
 
-    *y = x;
-    *r = y;
     return 0;
+}
+
+/*
+ * Start the scanner, unless the library is being stopped
+ *
+ * Return: pid of the scanner, or -1 on error
+ */
+
+static pid_t start_scanner(struct library *li, struct scan *s, int *fd)
+{
+    pid_t pid;
+
+    if (pthread_mutex_lock(&li->stop_lock) != 0)
+        abort();
+
+    if (li->stopped) {
+        pid = -1;
+    } else {
+        pid = fork_pipe_group(fd, s->scanner, "scan", s->path, NULL);
+        if (pid != -1)
+            s->pid = pid;
+    }
 
-fail:
-    /* no-op on NULL */
-    free(x.pathname);
-    free(x.artist);
-    free(x.title);
+    if (pthread_mutex_unlock(&li->stop_lock) != 0)
+        abort();
 
-    return -1;
+    return pid;
 }
 
 /*
- * Scan a record library
+ * Run the scanner, and read its records
  *
- * Launch the given scan script and pass it the path argument.
- * Parse the results into the crates.
+ * This function does not touch the library, other than to be
+ * stopped, so scans can run in parallel.
  *
- * Return: 0 on success, -1 on fatal error (may leak)
+ * Return: 0 on success, -1 on error
+ * Post: records read are in s->found.by_order, even on error
  */
 
-int library_import(struct library *li, const char *scan, const char *path)
+static int scan_records(struct library *li, struct scan *s)
 {
-    int fd, status;
-    char *cratename, *pathname;
+    int fd, r, status;
+    char *buf;
+    size_t size;
     pid_t pid;
     FILE *fp;
-    struct crate *crate;
-
-    fprintf(stderr, "Scanning '%s'...\n", path);
 
-    pathname = strdupa(path);
-    cratename = basename(pathname); /* POSIX version, see basename(3) */
-    assert(cratename != NULL);
-    crate = use_crate(li, cratename);
-    if (crate == NULL)
-        return -1;
+    fprintf(stderr, "Scanning '%s'...\n", s->path);
 
-    pid = fork_pipe(&fd, scan, "scan", path, NULL);
+    pid = start_scanner(li, s, &fd);
     if (pid == -1)
         return -1;
 
@@ -484,45 +730,51 @@ int library_import(struct library *li, const char *scan, const char *path)
         abort(); /* recovery not implemented */
     }
 
+    buf = NULL;
+    size = 0;
+    r = 0;
+
     for (;;) {
-        struct record *d, *x;
+        struct record *d;
 
-        if (get_record(fp, &d) == -1)
-            return -1;
+        if (get_record(fp, &buf, &size, &s->arena, &d) == -1) {
+            r = -1;
+            break;
+        }
 
         if (d == NULL)
             break;
 
-        /* Add to the crate of all records */
-
-        x = crate_add(&li->all, d);
-        if (x == NULL)
-            return -1;
-
-        /* If there is an existing entry, use it instead */
-
-        if (x != d) {
-            record_clear(d);
-            free(d);
-            d = x;
+        if (listing_add(&s->found.by_order, d) == -1) {
+            r = -1;
+            break;
         }
-
-        /* Insert into the user's crate */
-
-        if (crate_add(crate, d) == NULL)
-            return -1;
     }
 
+    free(buf);
+
     if (fclose(fp) == -1) {
         perror("close");
         abort(); /* assumption fclose() can't on read-only descriptor */
     }
 
+    /* Until the scanner is reaped its process group cannot be re-used,
+     * so it is safe for library_stop() to signal it */
+
+    if (pthread_mutex_lock(&li->stop_lock) != 0)
+        abort();
+    s->pid = 0;
+    if (pthread_mutex_unlock(&li->stop_lock) != 0)
+        abort();
+
     if (waitpid(pid, &status, 0) == -1) {
         perror("waitpid");
         return -1;
     }
 
+    if (r == -1)
+        return -1;
+
     if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
         fputs("Library scan exited reporting failure.\n", stderr);
         return -1;
@@ -530,3 +782,721 @@ int library_import(struct library *li, const char *scan, const char *path)
 
     return 0;
 }
+
+/*
+ * Find the records of a library, from a snapshot if there is one, or
+ * otherwise by running the scanner
+ *
+ * Return: 0 on success, -1 on error
+ * Post: records found are in s->found, even on error
+ */
+
+static int run_scan(struct library *li, struct scan *s)
+{
+    if (libcache_load(s->scanner, s->path, &s->found, &s->arena) == 0) {
+        s->from_snapshot = true;
+        return 0;
+    }
+
+    return scan_records(li, s);
+}
+
+/*
+ * Watch a directory, and all those below it, for changes to the
+ * files in a crate
+ *
+ * Failure to watch is not an error; the crate just does not follow
+ * changes.
+ */
+
+static struct library *watching; /* nftw() has no context */
+static const char *watch_scanner;
+static struct crate *watch_crate;
+
+static int visit(const char *name, const struct stat *st, int type,
+                 struct FTW *ftw)
+{
+    int wd;
+    size_t n;
+    struct watched *w;
+    struct library *li = watching;
+
+    if (type != FTW_D)
+        return 0;
+
+    wd = inotify_add_watch(li->inotify, name, WATCH_EVENTS);
+    if (wd == -1) {
+        perror("inotify_add_watch");
+        return 0;
+    }
+
+    /* A directory can be reached more than once, by a link */
+
+    for (n = 0; n < li->watches; n++) {
+        if (li->watch[n].wd == wd)
+            return 0;
+    }
+
+    w = realloc(li->watch, sizeof *w * (li->watches + 1));
+    if (w == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    li->watch = w;
+
+    w = &li->watch[li->watches];
+    w->dir = strdup(name);
+    if (w->dir == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    w->wd = wd;
+    w->scanner = watch_scanner;
+    w->crate = watch_crate;
+    li->watches++;
+
+    return 0;
+}
+
+static void add_watches(struct library *li, const char *scanner,
+                        const char *path, struct crate *crate)
+{
+    struct stat st;
+
+    if (li->inotify == -1)
+        return;
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return; /* a playlist */
+
+    watching = li;
+    watch_scanner = scanner;
+    watch_crate = crate;
+
+    if (nftw(path, visit, MAX_FDS, 0) != 0)
+        fprintf(stderr, "Not following all changes to %s\n", path);
+}
+
+/*
+ * Add the records from a completed scan into the library
+ *
+ * Return: 0 on success, -1 on fatal error (may leak)
+ * Post: the records are the responsibility of the library
+ */
+
+static int merge_scan(struct library *li, struct scan *s)
+{
+    char *cratename, *pathname;
+    struct crate *crate, scanned;
+
+    pathname = strdupa(s->path);
+    cratename = basename(pathname); /* POSIX version, see basename(3) */
+    assert(cratename != NULL);
+    crate = use_crate(li, cratename);
+    if (crate == NULL)
+        return -1;
+
+    add_watches(li, s->scanner, s->path, crate);
+
+    if (s->from_snapshot)
+        return use_snapshot(li, crate, &s->found);
+
+    /* Keep the records of this scan, for a snapshot */
+
+    if (crate_init(&scanned, s->path, false) == -1)
+        return -1;
+
+    if (add_records(li, crate, &scanned, &s->found.by_order) == -1)
+        return -1;
+
+    libcache_save(s->scanner, s->path, &scanned);
+    crate_clear(&scanned);
+
+    return 0;
+}
+
+/*
+ * Queue a record library to be scanned
+ *
+ * Nothing is scanned until library_scan() or library_wait(), when all
+ * the queued scans run together.
+ *
+ * Return: 0 on success, -1 on memory allocation failure
+ */
+
+int library_queue(struct library *li, const char *scan, const char *path)
+{
+    struct scan *s;
+
+    s = realloc(li->scan, sizeof *s * (li->scans + 1));
+    if (s == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    li->scan = s;
+
+    s = &li->scan[li->scans];
+    s->scanner = scan;
+    s->path = path;
+    s->from_snapshot = false;
+    s->result = -1;
+    s->pid = 0;
+
+    if (crate_init(&s->found, path, false) == -1)
+        return -1;
+    arena_init(&s->arena);
+
+    li->scans++;
+    return 0;
+}
+
+/* Scans shared between the threads of library_scan() */
+
+struct queue {
+    struct library *library;
+    struct scan *scan;
+    size_t scans, next;
+};
+
+static void* worker(void *arg)
+{
+    struct queue *q = arg;
+
+    for (;;) {
+        size_t n;
+
+        n = __sync_fetch_and_add(&q->next, 1);
+        if (n >= q->scans)
+            break;
+
+        q->scan[n].result = run_scan(q->library, &q->scan[n]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the queued scans, several at once
+ *
+ * The library itself is not changed, so it can be in use by other
+ * threads; see library_merge().
+ */
+
+void library_scan(struct library *li)
+{
+    size_t n, threads;
+    pthread_t ph[MAX_SCANS];
+    struct queue q;
+
+    q.library = li;
+    q.scan = li->scan;
+    q.scans = li->scans;
+    q.next = 0;
+
+    for (threads = 0; threads < MAX_SCANS && threads < q.scans; threads++) {
+        int r;
+
+        r = pthread_create(&ph[threads], NULL, worker, &q);
+        if (r != 0) {
+            errno = r;
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    if (threads == 0) /* do the work here instead */
+        (void)worker(&q);
+
+    for (n = 0; n < threads; n++) {
+        if (pthread_join(ph[n], NULL) != 0)
+            abort();
+    }
+}
+
+/*
+ * Bring library_scan() to an end as soon as possible
+ *
+ * Scanners which are running are killed, and no more are started, so
+ * their scans fail. This can be called from any thread, and more than
+ * once.
+ */
+
+void library_stop(struct library *li)
+{
+    size_t n;
+
+    if (pthread_mutex_lock(&li->stop_lock) != 0)
+        abort();
+
+    li->stopped = true;
+
+    for (n = 0; n < li->scans; n++) {
+        pid_t pid = li->scan[n].pid;
+
+        if (pid == 0)
+            continue;
+
+        if (kill(-pid, SIGTERM) == -1 && errno != ESRCH) /* and children */
+            perror("kill");
+    }
+
+    if (pthread_mutex_unlock(&li->stop_lock) != 0)
+        abort();
+}
+
+/*
+ * Add the records found by library_scan() to the library
+ *
+ * Records are added in the order the scans were queued, so the result
+ * is the same as scanning one after another.
+ *
+ * Return: 0 on success, -1 on fatal error (may leak)
+ * Post: queue is empty
+ */
+
+int library_merge(struct library *li)
+{
+    size_t n;
+
+    for (n = 0; n < li->scans; n++) {
+        struct scan *s = &li->scan[n];
+
+        if (s->result == -1) {
+            clear_scans(li);
+            return -1;
+        }
+
+        arena_take(&li->arena, &s->arena);
+
+        if (merge_scan(li, s) == -1) {
+            clear_scans(li);
+            return -1;
+        }
+    }
+
+    if (li->scans > 0)
+        li->generation++;
+
+    clear_scans(li);
+    return 0;
+}
+
+/*
+ * Run the queued scans, and add their records to the library
+ *
+ * Return: 0 on success, -1 on fatal error (may leak)
+ * Post: queue is empty
+ */
+
+int library_wait(struct library *li)
+{
+    library_scan(li);
+    return library_merge(li);
+}
+
+/*
+ * Scan a record library
+ *
+ * Launch the given scan script and pass it the path argument.
+ * Parse the results into the crates.
+ *
+ * Return: 0 on success, -1 on fatal error (may leak)
+ */
+
+int library_import(struct library *li, const char *scan, const char *path)
+{
+    if (library_queue(li, scan, path) == -1)
+        return -1;
+
+    return library_wait(li);
+}
+
+/*
+ * Follow changes to the files of subsequent libraries, as they happen
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+int library_watch(struct library *li)
+{
+    if (li->inotify != -1)
+        return 0;
+
+    li->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (li->inotify == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop watching a directory
+ */
+
+static void forget(struct library *li, struct watched *w, bool rm)
+{
+    if (rm && inotify_rm_watch(li->inotify, w->wd) == -1)
+        perror("inotify_rm_watch");
+
+    free(w->dir);
+    *w = li->watch[--li->watches];
+}
+
+/*
+ * Return: the watched directory with the given descriptor, or NULL
+ */
+
+static struct watched* find_watch(struct library *li, int wd)
+{
+    size_t n;
+
+    for (n = 0; n < li->watches; n++) {
+        if (li->watch[n].wd == wd)
+            return &li->watch[n];
+    }
+
+    return NULL;
+}
+
+/*
+ * Return: true if the pathname is the given path, or within it
+ */
+
+static bool is_within(const char *pathname, const char *path)
+{
+    size_t len;
+
+    len = strlen(path);
+
+    if (strncmp(pathname, path, len) != 0)
+        return false;
+
+    return pathname[len] == '\0' || pathname[len] == '/';
+}
+
+/*
+ * Add a change to be applied to the library
+ *
+ * Return: pointer to the change, or NULL on error
+ */
+
+static struct change* add_change(struct library *li, struct crate *crate,
+                                 const char *path, bool removed)
+{
+    struct change *c;
+
+    c = realloc(li->change, sizeof *c * (li->changes + 1));
+    if (c == NULL) {
+        perror("realloc");
+        return NULL;
+    }
+    li->change = c;
+
+    c = &li->change[li->changes];
+    c->removed = removed;
+    c->crate = crate;
+    c->path = strdup(path);
+    if (c->path == NULL) {
+        perror("strdup");
+        return NULL;
+    }
+
+    li->changes++;
+    return c;
+}
+
+/*
+ * Note that the given path, a file or directory, has gone
+ */
+
+static void removed(struct library *li, struct watched *w, const char *path,
+                    bool moved)
+{
+    size_t n;
+
+    if (add_change(li, w->crate, path, true) == NULL)
+        return;
+
+    /* The kernel stops watching a directory which is deleted, but not
+     * one which is moved away */
+
+    if (!moved)
+        return;
+
+    n = 0;
+    while (n < li->watches) {
+        struct watched *x = &li->watch[n];
+
+        if (is_within(x->dir, path))
+            forget(li, x, true);
+        else
+            n++;
+    }
+}
+
+/*
+ * Note that the given path, a file or directory, is new or has changed
+ */
+
+static void added(struct library *li, struct watched *w, const char *path,
+                  bool is_dir)
+{
+    const char *dir, *scanner;
+    struct crate *crate;
+    struct change *c;
+    size_t n;
+
+    scanner = w->scanner;
+    crate = w->crate;
+
+    /* The scanner finds a file by looking in its directory, so any
+     * number of changes to one directory need only one scan. A file
+     * which has changed is taken out first, so the new record does
+     * not sit alongside the old one */
+
+    if (is_dir) {
+        add_watches(li, scanner, path, crate); /* can move w */
+        dir = path;
+    } else {
+        if (add_change(li, crate, path, true) == NULL)
+            return;
+        dir = w->dir;
+    }
+
+    for (n = 0; n < li->changes; n++) {
+        c = &li->change[n];
+        if (!c->removed && c->crate == crate && strcmp(c->path, dir) == 0)
+            return;
+    }
+
+    c = add_change(li, crate, dir, false);
+    if (c == NULL)
+        return;
+
+    c->scan.scanner = scanner;
+    c->scan.path = c->path;
+    c->scan.from_snapshot = false;
+    c->scan.result = -1;
+    c->scan.pid = 0;
+
+    if (crate_init(&c->scan.found, c->path, false) == -1) {
+        free(c->path);
+        li->changes--;
+        return;
+    }
+    arena_init(&c->scan.arena);
+}
+
+/*
+ * Read the changes to the files of the library, and find the new
+ * records
+ *
+ * This function runs the scanner, but does not touch the records or
+ * crates, so it does not need to hold up the user of the library.
+ *
+ * Pre: no changes are waiting to be applied
+ */
+
+void library_read_changes(struct library *li)
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    size_t n;
+
+    for (;;) {
+        ssize_t z;
+        char *p;
+
+        z = read(li->inotify, buf, sizeof buf);
+        if (z == -1) {
+            if (errno != EAGAIN)
+                perror("read");
+            break;
+        }
+
+        for (p = buf; p < buf + z;
+             p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+        {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            struct watched *w;
+            char *path;
+            bool is_dir;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                fputs("Too many changes to the library to follow.\n", stderr);
+                continue;
+            }
+
+            w = find_watch(li, ev->wd);
+            if (w == NULL)
+                continue;
+
+            if (ev->mask & IN_IGNORED) {
+                forget(li, w, false);
+                continue;
+            }
+
+            if (ev->len == 0)
+                continue;
+
+            if (asprintf(&path, "%s/%s", w->dir, ev->name) == -1) {
+                perror("asprintf");
+                continue;
+            }
+
+            is_dir = ev->mask & IN_ISDIR;
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                removed(li, w, path, is_dir && ev->mask & IN_MOVED_FROM);
+            else if (is_dir ? ev->mask & (IN_CREATE | IN_MOVED_TO)
+                            : ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                added(li, w, path, is_dir);
+
+            free(path);
+        }
+    }
+
+    for (n = 0; n < li->changes; n++) {
+        if (!li->change[n].removed)
+            li->change[n].scan.result = scan_records(li, &li->change[n].scan);
+    }
+}
+
+/*
+ * Take the records of a path out of a listing, keeping its order
+ */
+
+static void remove_from(struct listing *ls, const char *path)
+{
+    size_t n, m;
+
+    for (n = 0, m = 0; n < ls->entries; n++) {
+        if (!is_within(ls->record[n]->pathname, path))
+            ls->record[m++] = ls->record[n];
+    }
+
+    ls->entries = m;
+}
+
+/*
+ * Move a record to its place in a listing by tempo, for a new tempo
+ *
+ * Pre: listing is in order of the record's current tempo
+ */
+
+static void move_bpm(struct listing *ls, struct record *re, double bpm,
+                     double was)
+{
+    size_t z;
+
+    re->bpm = was;
+    z = listing_find(ls, re, SORT_BPM);
+    re->bpm = bpm;
+
+    if (z == ls->entries || ls->record[z] != re)
+        return; /* not in this crate */
+
+    memmove(ls->record + z, ls->record + z + 1,
+            sizeof *ls->record * (ls->entries - z - 1));
+    ls->entries--;
+
+    if (listing_insert(ls, re, SORT_BPM) == NULL)
+        abort(); /* there is always space for the record taken out */
+}
+
+/*
+ * Give a record of the library a tempo, such as one found from its
+ * audio
+ */
+
+void library_set_bpm(struct library *li, struct record *re, double bpm)
+{
+    size_t n;
+    double was;
+
+    was = re->bpm;
+    if (bpm == was)
+        return;
+
+    for (n = 0; n < li->crates; n++)
+        move_bpm(&li->crate[n]->by_bpm, re, bpm, was);
+
+    li->generation++;
+}
+
+/*
+ * Apply the changes found by library_read_changes() to the crates
+ *
+ * The records taken out of the library stay in memory until it is
+ * cleared, so they can still be referred to.
+ *
+ * Return: true if the library has changed, otherwise false
+ * Post: no changes are waiting to be applied
+ */
+
+bool library_apply_changes(struct library *li)
+{
+    size_t n, m;
+    bool changed;
+
+    changed = false;
+
+    /* The scans were run after all the changes were read, so they
+     * describe the files as they are now. Take out what has gone
+     * before adding what was found */
+
+    for (n = 0; n < li->changes; n++) {
+        struct change *c = &li->change[n];
+
+        if (!c->removed)
+            continue;
+
+        for (m = 0; m < li->crates; m++) {
+            struct crate *crate = li->crate[m];
+
+            remove_from(&crate->by_artist, c->path);
+            remove_from(&crate->by_bpm, c->path);
+            remove_from(&crate->by_order, c->path);
+        }
+
+        changed = true;
+    }
+
+    for (n = 0; n < li->changes; n++) {
+        struct change *c = &li->change[n];
+
+        if (!c->removed) {
+            if (c->scan.result == 0) {
+                /* Records already in the crate are added to its order
+                 * again, so this directory is placed at the end */
+
+                remove_from(&c->crate->by_order, c->path);
+
+                arena_take(&li->arena, &c->scan.arena);
+                if (add_records(li, c->crate, NULL,
+                                &c->scan.found.by_order) == -1)
+                {
+                    fputs("Library could not be updated.\n", stderr);
+                }
+                changed = true;
+            }
+
+            crate_clear(&c->scan.found);
+            arena_clear(&c->scan.arena);
+        }
+
+        free(c->path);
+    }
+
+    free(li->change);
+    li->change = NULL;
+    li->changes = 0;
+
+    if (changed)
+        li->generation++;
+
+    return changed;
+}
@@ -20,10 +20,13 @@
 #ifndef LIBRARY_H
 #define LIBRARY_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "arena.h"
 #include "listing.h"
+#include "trigram.h"
 
 /* A single crate of records */
 
@@ -33,16 +36,47 @@ struct crate {
     struct listing by_artist, by_bpm, by_order;
 };
 
+struct scan;
+struct watched;
+struct change;
+
 /* The complete music library, which consists of multiple crates */
 
 struct library {
     struct crate all, **crate;
     size_t crates;
+    struct trigram index; /* of all records, for searching */
+    struct arena arena; /* holding the records */
+
+    struct scan *scan; /* see library_queue() */
+    size_t scans;
+    pthread_mutex_t stop_lock; /* scanners cannot be started once stopped */
+    bool stopped; /* see library_stop() */
+
+    /* Changes to the files; see library_watch() */
+
+    int inotify; /* or -1 if not watching */
+    struct watched *watch;
+    size_t watches;
+    struct change *change; /* read, but not yet applied */
+    size_t changes;
+    unsigned int generation; /* incremented on every change */
 };
 
 int library_init(struct library *li);
 void library_clear(struct library *li);
 
+int library_queue(struct library *lib, const char *scan, const char *path);
+void library_scan(struct library *lib);
+void library_stop(struct library *lib);
+int library_merge(struct library *lib);
+int library_wait(struct library *lib);
 int library_import(struct library *lib, const char *scan, const char *path);
 
+int library_watch(struct library *lib);
+void library_read_changes(struct library *lib);
+bool library_apply_changes(struct library *lib);
+
+void library_set_bpm(struct library *lib, struct record *re, double bpm);
+
 #endif
@@ -17,19 +17,27 @@
  *
  */
 
-#define _GNU_SOURCE /* strcasestr(), strdupa() */
+#define _GNU_SOURCE /* strcasestr(), strdupa(), strndupa() */
 #include <ctype.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "listing.h"
+#include "trigram.h"
 
 #define BLOCK 1024
 #define MAX_WORDS 32
 #define SEPARATOR ' '
 
+/* A range of tempo, as given in a match string */
+
+struct range {
+    double min, max;
+};
+
 /*
  * Initialise a record listing
  */
@@ -114,16 +122,50 @@ int listing_add(struct listing *ls, struct record *lr)
  * Standard comparison function between two records
  */
 
+/*
+ * Work out the key which orders a record by the start of the artist
+ * name, to save comparing strings
+ *
+ * Pre: artist is set
+ */
+
+void record_set_key(struct record *re)
+{
+    unsigned int n;
+    const char *s;
+
+    /* Case-folded characters, as strcasecmp(); a shorter name is
+     * padded with zeroes and so orders first, as it should */
+
+    re->key = 0;
+    s = re->artist;
+
+    for (n = 0; n < sizeof re->key; n++) {
+        re->key <<= 8;
+        if (*s != '\0')
+            re->key |= (unsigned char)tolower((unsigned char)*s++);
+    }
+}
+
 static int record_cmp_artist(const struct record *a, const struct record *b)
 {
     int r;
 
-    r = strcasecmp(a->artist, b->artist);
-    if (r < 0)
+    if (a->key < b->key)
         return -1;
-    else if (r > 0)
+    else if (a->key > b->key)
         return 1;
 
+    /* Artist names are often shared */
+
+    if (a->artist != b->artist) {
+        r = strcasecmp(a->artist, b->artist);
+        if (r < 0)
+            return -1;
+        else if (r > 0)
+            return 1;
+    }
+
     r = strcasecmp(a->title, b->title);
     if (r < 0)
         return -1;
@@ -149,6 +191,39 @@ static int record_cmp_bpm(const struct record *a, const struct record *b)
     return record_cmp_artist(a, b);
 }
 
+/*
+ * Compare two records in the given sort order
+ *
+ * Return: less than, equal to or greater than zero, as strcmp()
+ */
+
+int record_cmp(const struct record *a, const struct record *b, int sort)
+{
+    switch (sort) {
+    case SORT_ARTIST:
+        return record_cmp_artist(a, b);
+    case SORT_BPM:
+        return record_cmp_bpm(a, b);
+    case SORT_PLAYLIST:
+    default:
+        abort();
+    }
+}
+
+/*
+ * Comparison functions, see qsort(3)
+ */
+
+static int qcompar_artist(const void *a, const void *b)
+{
+    return record_cmp_artist(*(struct record**)a, *(struct record**)b);
+}
+
+static int qcompar_bpm(const void *a, const void *b)
+{
+    return record_cmp_bpm(*(struct record**)a, *(struct record**)b);
+}
+
 /*
  * Check if a record matches the given string. This function is the
  * definitive code which defines what constitutes a 'match'.
@@ -216,14 +291,105 @@ int listing_copy(const struct listing *src, struct listing *dest)
 
 int listing_match(struct listing *src, struct listing *dest,
                   const char *match)
+{
+    return listing_match_index(src, dest, match, NULL);
+}
+
+/*
+ * Return: true if the given characters are a number, which is given
+ *     in *x
+ */
+
+static bool parse_number(const char *s, size_t len, double *x)
+{
+    size_t n, points;
+    char *copy;
+
+    if (len == 0)
+        return false;
+
+    points = 0;
+    for (n = 0; n < len; n++) {
+        if (s[n] == '.')
+            points++;
+        else if (!isdigit((unsigned char)s[n]))
+            return false;
+    }
+
+    if (points > 1 || len == points)
+        return false;
+
+    copy = strndupa(s, len);
+    *x = strtod(copy, NULL);
+    return true;
+}
+
+/*
+ * Parse a word which gives a range of tempo, as "<min>..<max>" where
+ * either, but not both, can be left out
+ *
+ * Return: true if the word is a range, otherwise false
+ * Post: if true, the range is narrowed to what the word gives
+ */
+
+static bool parse_range(const char *word, struct range *r)
+{
+    const char *dots, *max;
+    double x, y;
+
+    dots = strstr(word, "..");
+    if (dots == NULL)
+        return false;
+
+    max = dots + 2;
+
+    if (dots == word) {
+        if (!parse_number(max, strlen(max), &y))
+            return false;
+        x = 0.0;
+    } else if (*max == '\0') {
+        if (!parse_number(word, dots - word, &x))
+            return false;
+        y = INFINITY;
+    } else {
+        if (!parse_number(word, dots - word, &x)
+            || !parse_number(max, strlen(max), &y))
+        {
+            return false;
+        }
+    }
+
+    if (x > y) {
+        double t = x;
+        x = y;
+        y = t;
+    }
+
+    if (x > r->min)
+        r->min = x;
+    if (y < r->max)
+        r->max = y;
+
+    return true;
+}
+
+/*
+ * Split a match string into its words, and the range of tempo which
+ * any of them give
+ *
+ * Return: true if a range of tempo is given, otherwise false
+ * Post: words is a NULL-terminated list of the other words
+ */
+
+static bool split(char *buf, char **words, struct range *r)
 {
     int n;
-    char *buf, *words[MAX_WORDS];
-    struct record *re;
+    bool ranged;
 
-    fprintf(stderr, "Matching '%s'\n", match);
+    r->min = 0.0;
+    r->max = INFINITY;
+    ranged = false;
 
-    buf = strdupa(match);
     n = 0;
     for (;;) {
         char *s;
@@ -233,28 +399,197 @@ int listing_match(struct listing *src, struct listing *dest,
             break;
         }
 
-        words[n] = buf;
-        n++;
-
         s = strchr(buf, SEPARATOR);
+        if (s != NULL)
+            *s = '\0';
+
+        if (parse_range(buf, r))
+            ranged = true;
+        else
+            words[n++] = buf;
+
         if (s == NULL)
             break;
-        *s = '\0';
         buf = s + 1; /* skip separator */
     }
     words[n] = NULL; /* terminate list */
 
-    listing_blank(dest);
+    return ranged;
+}
 
-    for (n = 0; n < src->entries; n++) {
-        re = src->record[n];
+/*
+ * Return: true if the last word of the match string is a range of
+ *     tempo; a longer string then does not only narrow the match
+ */
+
+bool listing_ends_in_range(const char *match)
+{
+    const char *s;
+    struct range r;
+
+    s = strrchr(match, SEPARATOR);
+    if (s == NULL)
+        s = match;
+    else
+        s++;
+
+    r.min = 0.0;
+    r.max = INFINITY;
+
+    return parse_range(s, &r);
+}
+
+/*
+ * Return: true if the record's tempo is known, and within the range
+ */
+
+static bool in_range(const struct record *re, const struct range *r)
+{
+    return re->bpm > 0.0 && re->bpm >= r->min && re->bpm <= r->max;
+}
+
+/*
+ * Add the records which match to the destination
+ *
+ * Return: 0 on success, or -1 on memory allocation failure
+ */
+
+static int match_records(struct record **record, size_t entries,
+                         struct listing *dest, char **words,
+                         const struct range *range, bool ranged,
+                         const struct trigram *index)
+{
+    size_t n;
+    unsigned char *selected;
+
+    /* Without a selection, every record is a candidate */
+
+    if (index == NULL)
+        selected = NULL;
+    else
+        selected = trigram_select(index, words);
+
+    for (n = 0; n < entries; n++) {
+        struct record *re = record[n];
+
+        if (selected != NULL && !trigram_selected(selected, re))
+            continue;
+
+        if (ranged && !in_range(re, range))
+            continue;
 
         if (record_match_all(re, words)) {
-            if (listing_add(dest, re) == -1)
+            if (listing_add(dest, re) == -1) {
+                free(selected);
                 return -1;
+            }
         }
     }
 
+    free(selected);
+    return 0;
+}
+
+/*
+ * Find entries which match the given string, as listing_match(), but
+ * using an index of the records to skip those which cannot match
+ *
+ * A word which is a range of tempo, such as "124..128", "170.." or
+ * "..90", matches the records with a known tempo in that range.
+ *
+ * Pre: if index is not NULL, all records in src are in the index
+ * Return: 0 on success, or -1 on memory allocation failure
+ * Post: on failure, dest is valid but incomplete
+ */
+
+int listing_match_index(struct listing *src, struct listing *dest,
+                        const char *match, const struct trigram *index)
+{
+    char *words[MAX_WORDS];
+    struct range range;
+    bool ranged;
+
+    fprintf(stderr, "Matching '%s'\n", match);
+
+    ranged = split(strdupa(match), words, &range);
+
+    listing_blank(dest);
+    return match_records(src->record, src->entries, dest, words, &range,
+                         ranged, index);
+}
+
+/*
+ * Return: the first entry of a listing by tempo which is slower than
+ * the given tempo, or no faster if or_equal is true
+ */
+
+static size_t slower_than(const struct listing *ls, double bpm, bool or_equal)
+{
+    size_t lo, hi;
+
+    lo = 0;
+    hi = ls->entries;
+
+    while (lo < hi) {
+        size_t mid;
+        double x;
+
+        mid = lo + (hi - lo) / 2;
+        x = ls->record[mid]->bpm;
+
+        if (x < bpm || (or_equal && x == bpm))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+/*
+ * Find entries which match the given string, as listing_match_index(),
+ * from a listing by tempo
+ *
+ * The range of tempo is found by binary search, so only the records
+ * in it are looked at. The result is in the given order.
+ *
+ * Pre: by_bpm is sorted by SORT_BPM
+ * Pre: sort is SORT_ARTIST or SORT_BPM
+ * Return: 0 on success, 1 if the match gives no range of tempo (and
+ *     dest is untouched), or -1 on memory allocation failure
+ * Post: on failure, dest is valid but incomplete
+ */
+
+int listing_match_bpm(const struct listing *by_bpm, struct listing *dest,
+                      const char *match, const struct trigram *index,
+                      int sort)
+{
+    char *words[MAX_WORDS];
+    struct range range;
+    size_t start, end;
+
+    if (!split(strdupa(match), words, &range))
+        return 1;
+
+    fprintf(stderr, "Matching '%s' from %.1f to %.1fBPM\n", match,
+            range.min, range.max);
+
+    /* The fastest records are first */
+
+    start = slower_than(by_bpm, range.max, true);
+    end = slower_than(by_bpm, range.min, false);
+
+    listing_blank(dest);
+
+    if (start < end && match_records(by_bpm->record + start, end - start,
+                                     dest, words, &range, true, index) == -1)
+    {
+        return -1;
+    }
+
+    if (sort == SORT_ARTIST)
+        listing_sort(dest, SORT_ARTIST);
+
     return 0;
 }
 
@@ -288,18 +623,7 @@ static size_t bin_search(struct record **base, size_t n,
     mid = n / 2;
     x = base[mid];
 
-    switch (sort) {
-    case SORT_ARTIST:
-        r = record_cmp_artist(item, x);
-        break;
-    case SORT_BPM:
-        r = record_cmp_bpm(item, x);
-        break;
-    case SORT_PLAYLIST:
-    default:
-        abort();
-    }
-
+    r = record_cmp(item, x, sort);
     if (r < 0)
         return bin_search(base, mid, item, sort, found);
     if (r > 0) {
@@ -342,6 +666,68 @@ struct record* listing_insert(struct listing *ls, struct record *item,
     return item;
 }
 
+/*
+ * Sort a listing
+ *
+ * The order of records which compare equal is not defined, so use
+ * this on a listing with no duplicates.
+ */
+
+void listing_sort(struct listing *ls, int sort)
+{
+    if (ls->entries == 0)
+        return;
+
+    switch (sort) {
+    case SORT_ARTIST:
+        qsort(ls->record, ls->entries, sizeof *ls->record, qcompar_artist);
+        break;
+    case SORT_BPM:
+        qsort(ls->record, ls->entries, sizeof *ls->record, qcompar_bpm);
+        break;
+    case SORT_PLAYLIST:
+    default:
+        abort();
+    }
+}
+
+/*
+ * Insert many records into a sorted listing at once, in time
+ * proportional to the size of both
+ *
+ * Pre: listing and items are sorted, and no item is equal to an
+ *     entry in the listing
+ * Return: 0 on success or -1 on memory allocation failure
+ * Post: listing is sorted and contains the items
+ */
+
+int listing_merge(struct listing *ls, const struct listing *items, int sort)
+{
+    size_t n, m, z;
+
+    if (enlarge(ls, ls->entries + items->entries) == -1)
+        return -1;
+
+    /* Work from the end backwards, to merge in place */
+
+    n = ls->entries;
+    m = items->entries;
+    z = n + m;
+
+    while (m > 0) {
+        if (n > 0 && record_cmp(ls->record[n - 1],
+                                items->record[m - 1], sort) > 0)
+        {
+            ls->record[--z] = ls->record[--n];
+        } else {
+            ls->record[--z] = items->record[--m];
+        }
+    }
+
+    ls->entries += items->entries;
+    return 0;
+}
+
 /*
  * Find an identical entry, or the nearest match
  */
@@ -20,7 +20,9 @@
 #ifndef LISTING_H
 #define LISTING_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define SORT_ARTIST   0
 #define SORT_BPM      1
@@ -30,10 +32,14 @@
 struct record {
     char *pathname, *artist, *title;
     double bpm; /* or 0.0 if not known */
+    unsigned int id; /* in the library's search index */
+    uint64_t key; /* see record_set_key() */
 };
 
 /* Listing points to records, but does not manage those pointers */
 
+struct trigram;
+
 struct listing {
     struct record **record;
     size_t size, entries;
@@ -46,9 +52,20 @@ int listing_add(struct listing *li, struct record *lr);
 int listing_copy(const struct listing *src, struct listing *dest);
 int listing_match(struct listing *src, struct listing *dest,
                   const char *match);
+int listing_match_index(struct listing *src, struct listing *dest,
+                        const char *match, const struct trigram *index);
+int listing_match_bpm(const struct listing *by_bpm, struct listing *dest,
+                      const char *match, const struct trigram *index,
+                      int sort);
+bool listing_ends_in_range(const char *match);
 struct record* listing_insert(struct listing *ls, struct record *item,
                               int sort);
+void listing_sort(struct listing *ls, int sort);
+int listing_merge(struct listing *ls, const struct listing *items, int sort);
 size_t listing_find(struct listing *ls, struct record *item, int sort);
 void listing_debug(struct listing *ls);
 
+void record_set_key(struct record *re);
+int record_cmp(const struct record *a, const struct record *b, int sort);
+
 #endif
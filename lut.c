@@ -17,44 +17,113 @@
  *
  */
 
+#define _GNU_SOURCE /* asprintf() */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lut.h"
 
-/* The number of bits to form the hash, which governs the overall size
- * of the hash lookup table, and hence the amount of chaining */
+/* A table is indexed directly by timecode where it fits in this
+ * many bits; this is one memory access per lookup, at a cost of 4
+ * bytes for every possible code (32Mb at 23 bits). Otherwise it is
+ * a hash table of chained slots, of about one slot per hash */
 
-#define HASH_BITS 16
+#define DIRECT_BITS 23
+
+#define MIN_HASH_BITS 16
 
-#define HASH(timecode) ((timecode) & ((1 << HASH_BITS) - 1))
 #define NO_SLOT ((unsigned)-1)
 
+/* A saved table is this header, followed by the slots and then the
+ * hash table, exactly as they are in memory */
+
+#define MAGIC "xwaxlut"
+#define VERSION 2
+
+struct header {
+    char magic[8];
+    uint32_t version, hash_bits, slot_bytes, nslots;
+};
+
+
+/* Return the number of hash bits for a table of the given size; if
+ * this equals bits, the table is indexed directly */
+
+static unsigned int hash_bits(unsigned int nslots, unsigned int bits)
+{
+    unsigned int h;
+
+    if (bits <= DIRECT_BITS)
+        return bits;
+
+    h = MIN_HASH_BITS;
+    while ((1U << h) < nslots && h < bits - 1)
+        h++;
+
+    return h;
+}
+
+
+static bool is_direct(const struct lut *lut)
+{
+    return lut->slot == NULL;
+}
+
 
-/* Initialise an empty hash lookup table to store the given number
- * of timecode -> position lookups */
+/* Initialise an empty lookup table to store the given number of
+ * timecode -> position lookups, for timecodes of the given number of
+ * bits */
 
-int lut_init(struct lut *lut, int nslots)
+int lut_init(struct lut *lut, int nslots, int bits)
+{
+    return lut_init_as(lut, nslots, bits, hash_bits(nslots, bits));
+}
+
+
+/* Initialise an empty lookup table as lut_init(), but with the given
+ * number of hash bits. If this equals bits, the table is indexed
+ * directly by timecode */
+
+int lut_init_as(struct lut *lut, int nslots, int bits, int hbits)
 {
     int n, hashes;
+    bool direct;
     size_t bytes;
 
-    hashes = 1 << HASH_BITS;
-    bytes = sizeof(struct slot) * nslots + sizeof(slot_no_t) * hashes;
+    direct = (hbits == bits);
+    lut->hash_bits = hbits;
 
-    fprintf(stderr, "Lookup table has %d hashes to %d slots"
-            " (%d slots per hash, %zuKb)\n",
-            hashes, nslots, nslots / hashes, bytes / 1024);
+    hashes = 1 << lut->hash_bits;
+    bytes = sizeof(slot_no_t) * hashes;
 
-    lut->slot = malloc(sizeof(struct slot) * nslots);
-    if (lut->slot == NULL) {
-        perror("malloc");
-        return -1;
+    if (direct) {
+        fprintf(stderr, "Lookup table is indexed by %d bits (%zuKb)\n",
+                bits, bytes / 1024);
+        lut->slot = NULL;
+    } else {
+        bytes += sizeof(struct slot) * nslots;
+        fprintf(stderr, "Lookup table has %d hashes to %d slots"
+                " (%d slots per hash, %zuKb)\n",
+                hashes, nslots, nslots / hashes, bytes / 1024);
+
+        lut->slot = malloc(sizeof(struct slot) * nslots);
+        if (lut->slot == NULL) {
+            perror("malloc");
+            return -1;
+        }
     }
 
     lut->table = malloc(sizeof(slot_no_t) * hashes);
     if (lut->table == NULL) {
         perror("malloc");
+        free(lut->slot);
         return -1;
     }
 
@@ -62,6 +131,7 @@ int lut_init(struct lut *lut, int nslots)
         lut->table[n] = NO_SLOT;
 
     lut->avail = 0;
+    lut->map = NULL;
 
     return 0;
 }
@@ -69,6 +139,12 @@ int lut_init(struct lut *lut, int nslots)
 
 void lut_clear(struct lut *lut)
 {
+    if (lut->map != NULL) {
+        if (munmap(lut->map, lut->map_bytes) == -1)
+            abort();
+        return;
+    }
+
     free(lut->table);
     free(lut->slot);
 }
@@ -82,10 +158,15 @@ void lut_push(struct lut *lut, unsigned int timecode)
 
     slot_no = lut->avail++; /* take the next available slot */
 
+    if (is_direct(lut)) {
+        lut->table[timecode] = slot_no;
+        return;
+    }
+
     slot = &lut->slot[slot_no];
     slot->timecode = timecode;
 
-    hash = HASH(timecode);
+    hash = timecode & ((1 << lut->hash_bits) - 1);
     slot->next = lut->table[hash];
     lut->table[hash] = slot_no;
 }
@@ -97,7 +178,13 @@ unsigned int lut_lookup(struct lut *lut, unsigned int timecode)
     slot_no_t slot_no;
     struct slot *slot;
 
-    hash = HASH(timecode);
+    if (is_direct(lut)) {
+        if (timecode >> lut->hash_bits)
+            return (unsigned)-1;
+        return lut->table[timecode];
+    }
+
+    hash = timecode & ((1 << lut->hash_bits) - 1);
     slot_no = lut->table[hash];
 
     while (slot_no != NO_SLOT) {
@@ -109,3 +196,159 @@ unsigned int lut_lookup(struct lut *lut, unsigned int timecode)
 
     return (unsigned)-1;
 }
+
+
+/* Return the header of a saved table, as lut_init() would create
+ * for the given number of slots and bits */
+
+static void expected_header(struct header *h, unsigned int nslots,
+                            unsigned int bits)
+{
+    memset(h, '\0', sizeof *h);
+    memcpy(h->magic, MAGIC, sizeof MAGIC);
+    h->version = VERSION;
+    h->hash_bits = hash_bits(nslots, bits);
+    h->slot_bytes = (h->hash_bits == bits) ? 0 : sizeof(struct slot);
+    h->nslots = nslots;
+}
+
+
+static size_t file_bytes(const struct header *h)
+{
+    return sizeof *h + (size_t)h->slot_bytes * h->nslots
+        + sizeof(slot_no_t) * ((size_t)1 << h->hash_bits);
+}
+
+
+/* Initialise a full lookup table from a file written by lut_save(),
+ * mapped read-only. Return -1 if the file does not exist or is not
+ * the table which lut_init() would create */
+
+int lut_load(struct lut *lut, const char *pathname, unsigned int nslots,
+             unsigned int bits)
+{
+    int fd;
+    void *map;
+    size_t len;
+    struct stat st;
+    struct header want;
+
+    fd = open(pathname, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror("open");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+
+    expected_header(&want, nslots, bits);
+
+    len = file_bytes(&want);
+    if (st.st_size != len)
+        goto fail;
+
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    if (close(fd) == -1)
+        abort();
+
+    if (memcmp(map, &want, sizeof want) != 0) {
+        if (munmap(map, len) == -1)
+            abort();
+        return -1;
+    }
+
+    lut->map = map;
+    lut->map_bytes = len;
+    lut->hash_bits = want.hash_bits;
+    lut->avail = nslots;
+
+    if (want.slot_bytes == 0) {
+        lut->slot = NULL;
+        lut->table = (slot_no_t*)((char*)map + sizeof want);
+    } else {
+        lut->slot = (struct slot*)((char*)map + sizeof want);
+        lut->table = (slot_no_t*)(lut->slot + nslots);
+    }
+
+    return 0;
+
+ fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+
+/* Write a lookup table to the given file, for use by lut_load().
+ * The file is written under a temporary name and then moved into
+ * place, so an incomplete file is never loaded */
+
+int lut_save(const struct lut *lut, const char *pathname)
+{
+    int fd;
+    char *tmpname;
+    size_t slots, table;
+    struct header h;
+
+    if (asprintf(&tmpname, "%s.XXXXXX", pathname) == -1) {
+        perror("asprintf");
+        return -1;
+    }
+
+    fd = mkstemp(tmpname);
+    if (fd == -1) {
+        perror("mkstemp");
+        free(tmpname);
+        return -1;
+    }
+
+    memset(&h, '\0', sizeof h);
+    memcpy(h.magic, MAGIC, sizeof MAGIC);
+    h.version = VERSION;
+    h.hash_bits = lut->hash_bits;
+    h.slot_bytes = is_direct(lut) ? 0 : sizeof(struct slot);
+    h.nslots = lut->avail;
+
+    slots = (size_t)h.slot_bytes * h.nslots;
+    table = sizeof(slot_no_t) * ((size_t)1 << h.hash_bits);
+
+    if (write(fd, &h, sizeof h) != sizeof h
+        || (slots > 0 && write(fd, lut->slot, slots) != slots)
+        || write(fd, lut->table, table) != table)
+    {
+        perror("write");
+        goto fail;
+    }
+
+    if (close(fd) == -1) {
+        perror("close");
+        fd = -1;
+        goto fail;
+    }
+
+    if (rename(tmpname, pathname) == -1) {
+        perror("rename");
+        fd = -1;
+        goto fail;
+    }
+
+    free(tmpname);
+    return 0;
+
+ fail:
+    if (fd != -1 && close(fd) == -1)
+        abort();
+    if (unlink(tmpname) == -1)
+        perror("unlink");
+    free(tmpname);
+    return -1;
+}
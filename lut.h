@@ -20,6 +20,9 @@
 #ifndef LUT_H
 #define LUT_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef unsigned int slot_no_t;
 
 struct slot {
@@ -28,14 +31,23 @@ struct slot {
 };
 
 struct lut {
-    struct slot *slot;
-    slot_no_t *table, /* hash -> slot lookup */
+    struct slot *slot; /* or NULL if indexed directly by timecode */
+    slot_no_t *table, /* hash (or timecode) -> slot lookup */
         avail; /* next available slot */
+    unsigned int hash_bits;
+
+    void *map; /* table is mapped from a file by lut_load(), or NULL */
+    size_t map_bytes;
 };
 
-int lut_init(struct lut *lut, int nslots);
+int lut_init(struct lut *lut, int nslots, int bits);
+int lut_init_as(struct lut *lut, int nslots, int bits, int hash_bits);
 void lut_clear(struct lut *lut);
 
+int lut_load(struct lut *lut, const char *pathname, unsigned int nslots,
+             unsigned int bits);
+int lut_save(const struct lut *lut, const char *pathname);
+
 void lut_push(struct lut *lut, unsigned int timecode);
 unsigned int lut_lookup(struct lut *lut, unsigned int timecode);
 
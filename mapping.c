@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Each line of a mapping file binds one message to one action:
+ *
+ *   <status> <data1> <deck> <action> [<cue>]
+ *
+ * where status and data1 are the first two bytes of the message (in
+ * decimal, or hex with a leading 0x), deck counts from 1 amongst the
+ * decks given to the controller, and cue from 1. Anything after a '#'
+ * is a comment.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cues.h"
+#include "mapping.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+static const struct {
+    const char *name;
+    enum action action;
+    bool cue; /* takes a cue point */
+} actions[] = {
+    { "cue", ACTION_CUE, true },
+    { "unset", ACTION_UNSET, true },
+    { "punch", ACTION_PUNCH, true },
+    { "recue", ACTION_RECUE, false },
+    { "timecode", ACTION_TIMECODE, false },
+};
+
+/*
+ * Return: the value of a number in the range [min, max], or -1 if not
+ *     valid
+ */
+
+static long number(const char *s, long min, long max)
+{
+    long v;
+    char *end;
+
+    if (s == NULL)
+        return -1;
+
+    errno = 0;
+    v = strtol(s, &end, 0);
+    if (errno != 0 || *end != '\0' || v < min || v > max)
+        return -1;
+
+    return v;
+}
+
+/*
+ * Add the binding given by one line of a mapping file
+ *
+ * Return: -1 if the line is not valid, otherwise 0
+ */
+
+static int parse(struct mapping *m, char *line)
+{
+    char *status, *data1, *deck, *action, *cue, *extra;
+    long s, d, k, c;
+    size_t n;
+    struct binding *b;
+
+    status = strtok(line, " \t");
+    if (status == NULL)
+        return 0; /* blank line */
+
+    data1 = strtok(NULL, " \t");
+    deck = strtok(NULL, " \t");
+    action = strtok(NULL, " \t");
+    cue = strtok(NULL, " \t");
+    extra = strtok(NULL, " \t");
+
+    /* A note off is bound along with its note on */
+
+    s = number(status, 0x90, 0xef);
+    d = number(data1, 0, 127);
+    k = number(deck, 1, MAPPING_MAX_DECKS);
+    if (s == -1 || d == -1 || k == -1 || action == NULL || extra != NULL)
+        return -1;
+
+    for (n = 0; n < ARRAY_SIZE(actions); n++) {
+        if (!strcmp(actions[n].name, action))
+            break;
+    }
+
+    if (n == ARRAY_SIZE(actions))
+        return -1;
+
+    if (actions[n].cue) {
+        c = number(cue, 1, MAX_CUES);
+        if (c == -1)
+            return -1;
+    } else {
+        if (cue != NULL)
+            return -1;
+        c = 1;
+    }
+
+    b = &m->binding[s & 0x7f][d];
+    b->action = actions[n].action;
+    b->deck = k - 1;
+    b->cue = c - 1;
+
+    return 0;
+}
+
+/*
+ * Load a mapping from the given file
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0, the mapping is filled; bindings not in the file are
+ *     ACTION_NONE
+ */
+
+int mapping_load(struct mapping *m, const char *pathname)
+{
+    unsigned int n;
+    char line[256];
+    FILE *f;
+
+    f = fopen(pathname, "r");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    memset(m, '\0', sizeof *m);
+
+    for (n = 1; fgets(line, sizeof line, f) != NULL; n++) {
+        char *x;
+        bool whole;
+
+        x = strchr(line, '\n');
+        if (x != NULL)
+            *x = '\0';
+
+        whole = (x != NULL || feof(f)); /* or too long to be valid */
+
+        x = strchr(line, '#');
+        if (x != NULL)
+            *x = '\0';
+
+        if (!whole || parse(m, line) == -1) {
+            fprintf(stderr, "%s:%u: Not a valid binding.\n", pathname, n);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    if (ferror(f)) {
+        perror(pathname);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * A mapping from MIDI messages to actions on the decks, loaded from a
+ * file and held as a table which is indexed directly by the first two
+ * bytes of a message
+ */
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#define MAPPING_MAX_DECKS 8
+
+enum action {
+    ACTION_NONE = 0,
+    ACTION_CUE, /* set, or seek to, a cue point */
+    ACTION_UNSET, /* remove a cue point */
+    ACTION_PUNCH, /* to a cue point, returning when released */
+    ACTION_RECUE,
+    ACTION_TIMECODE /* toggle timecode control */
+};
+
+struct binding {
+    unsigned char action, deck, cue;
+};
+
+/* Indexed by status (without its top bit) and the first data byte.
+ * A note off is looked up as a note on */
+
+struct mapping {
+    struct binding binding[128][128];
+};
+
+int mapping_load(struct mapping *m, const char *pathname);
+
+/*
+ * Return: the binding for a message, which may be ACTION_NONE
+ */
+
+static inline const struct binding* mapping_lookup(const struct mapping *m,
+                                                   unsigned char status,
+                                                   unsigned char data1)
+{
+    if ((status & 0xf0) == 0x80) /* note off */
+        status += 0x10;
+
+    return &m->binding[status & 0x7f][data1 & 0x7f];
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * A MIDI controller of any kind, following a mapping from a file
+ *
+ * Each message is looked up directly in the table compiled from the
+ * file, so the cost in the realtime thread is the same however large
+ * the mapping.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "controller.h"
+#include "debug.h"
+#include "deck.h"
+#include "mapping.h"
+#include "midi.h"
+#include "midimap.h"
+
+struct midimap {
+    struct midi midi;
+    struct mapping mapping;
+
+    size_t ndeck;
+    struct deck *deck[MAPPING_MAX_DECKS];
+
+    /* State of the incoming stream, which may use running status */
+
+    unsigned char status, data[2]; /* status is 0 if not known */
+    size_t ndata;
+};
+
+static int add_deck(struct controller *c, struct deck *k)
+{
+    struct midimap *m = c->local;
+
+    debug("%p add deck %p", m, k);
+
+    if (m->ndeck == MAPPING_MAX_DECKS)
+        return -1;
+
+    m->deck[m->ndeck++] = k;
+    return 0;
+}
+
+/*
+ * Act on a message from the device
+ */
+
+static void dispatch(struct midimap *m, unsigned char status,
+                     unsigned char data1, unsigned char data2)
+{
+    bool on;
+    struct deck *d;
+    const struct binding *b;
+
+    b = mapping_lookup(&m->mapping, status, data1);
+    if (b->action == ACTION_NONE)
+        return;
+
+    if (b->deck >= m->ndeck) /* no deck assigned */
+        return;
+
+    d = m->deck[b->deck];
+
+    /* A note off, or a note on or controller at zero, is a release */
+
+    on = (status & 0xf0) != 0x80 && data2 != 0;
+
+    debug("action %d %s, deck %p", b->action, on ? "ON" : "OFF", d);
+
+    switch (b->action) {
+    case ACTION_CUE:
+        if (on)
+            deck_cue(d, b->cue);
+        break;
+
+    case ACTION_UNSET:
+        if (on)
+            deck_unset_cue(d, b->cue);
+        break;
+
+    case ACTION_PUNCH:
+        if (on)
+            deck_punch_in(d, b->cue);
+        else
+            deck_punch_out(d);
+        break;
+
+    case ACTION_RECUE:
+        if (on)
+            deck_recue(d);
+        break;
+
+    case ACTION_TIMECODE:
+        if (on)
+            player_toggle_timecode_control(&d->player);
+        break;
+
+    default:
+        abort();
+    }
+}
+
+/*
+ * Take the next byte of the incoming stream
+ */
+
+static void receive(struct midimap *m, unsigned char b)
+{
+    size_t len;
+
+    if (b >= 0xf8) /* system realtime, which may come at any point */
+        return;
+
+    if (b & 0x80) {
+        m->status = (b < 0xf0) ? b : 0; /* system common is ignored */
+        m->ndata = 0;
+        return;
+    }
+
+    if (m->status == 0)
+        return;
+
+    m->data[m->ndata++] = b;
+
+    switch (m->status & 0xf0) {
+    case 0xc0: /* program change */
+    case 0xd0: /* channel pressure */
+        len = 1;
+        m->data[1] = 0x7f; /* a press */
+        break;
+
+    default:
+        len = 2;
+    }
+
+    if (m->ndata < len)
+        return;
+
+    m->ndata = 0; /* the next message may have the same status */
+    dispatch(m, m->status, m->data[0], m->data[1]);
+}
+
+static ssize_t pollfds(struct controller *c, struct pollfd *pe, size_t z)
+{
+    struct midimap *m = c->local;
+
+    return midi_pollfds(&m->midi, pe, z);
+}
+
+/*
+ * Handler in the realtime thread
+ *
+ * All the input which is waiting is read in as few calls as possible.
+ */
+
+static int realtime(struct controller *c)
+{
+    struct midimap *m = c->local;
+
+    for (;;) {
+        unsigned char buf[256];
+        ssize_t n, z;
+
+        z = midi_read(&m->midi, buf, sizeof buf);
+        if (z == -1)
+            return -1;
+
+        for (n = 0; n < z; n++)
+            receive(m, buf[n]);
+
+        if (z < sizeof buf) /* nothing more waiting */
+            break;
+    }
+
+    return 0;
+}
+
+static void clear(struct controller *c)
+{
+    struct midimap *m = c->local;
+
+    debug("%p", m);
+
+    midi_close(&m->midi);
+    free(c->local);
+}
+
+static struct controller_ops midimap_ops = {
+    .add_deck = add_deck,
+    .pollfds = pollfds,
+    .realtime = realtime,
+    .clear = clear,
+};
+
+/*
+ * Use the given MIDI device, following the mapping in the given file
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int midimap_init(struct controller *c, struct rt *rt, const char *hw,
+                 const char *pathname)
+{
+    struct midimap *m;
+
+    debug("init %p from %s with %s", c, hw, pathname);
+
+    m = malloc(sizeof *m);
+    if (m == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (mapping_load(&m->mapping, pathname) == -1)
+        goto fail;
+
+    if (midi_open(&m->midi, hw) == -1)
+        goto fail;
+
+    m->ndeck = 0;
+    m->status = 0;
+    m->ndata = 0;
+
+    controller_init(c, &midimap_ops);
+    c->local = m;
+
+    return 0;
+
+fail:
+    free(m);
+    return -1;
+}
@@ -68,9 +68,6 @@ static int push(int fd, signed short *pcm, int samples)
         return -1;
     }
     
-    if (r < bytes)
-        fprintf(stderr, "Device output overrun.\n");
-
     return r / DEVICE_CHANNELS / sizeof(short);
 }
 
@@ -90,9 +87,6 @@ static int pull(int fd, signed short *pcm, int samples)
         return -1;
     }
 
-    if (r < bytes)
-        fprintf(stderr, "Device input underrun.\n");
-
     return r / DEVICE_CHANNELS / sizeof(short);
 }
 
@@ -100,6 +94,7 @@ static int pull(int fd, signed short *pcm, int samples)
 static int handle(struct device *dv)
 {
     signed short pcm[FRAME * DEVICE_CHANNELS];
+    float collect[FRAME * DEVICE_CHANNELS];
     int samples;
     struct oss *oss = (struct oss*)dv->local;
 
@@ -109,16 +104,21 @@ static int handle(struct device *dv)
         samples = pull(oss->fd, pcm, FRAME);
         if (samples == -1)
             return -1;
+        if (samples < FRAME)
+            stats_underrun(&dv->stats);
         device_submit(dv, pcm, samples);
     }
 
     /* Check the output buffer for playback */
     
     if (oss->pe->revents & POLLOUT) {
-        device_collect(dv, pcm, FRAME);
+        device_collect(dv, collect, FRAME);
+        device_to_s16(pcm, collect, FRAME);
         samples = push(oss->fd, pcm, FRAME);
         if (samples == -1)
             return -1;
+        if (samples < FRAME)
+            stats_underrun(&dv->stats);
     }
 
     return 0;
@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Each chunk of audio is packed on its own, so that audio can be
+ * read from anywhere in the track. The channels after the first are
+ * taken as the difference from it, and each is predicted from the
+ * samples before; what remains is Rice coded, with a predictor and
+ * parameter chosen to suit the chunk.
+ *
+ * A chunk is of the form:
+ *
+ *   unsigned char header[TRACK_CHANNELS]; (order << 5 | k)
+ *   bits, of each channel in turn, to the end of a byte
+ *
+ * or, where this would be larger than the audio itself (eg. noise),
+ * of the header VERBATIM followed by the samples as they are.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+#include "track.h"
+
+#define ESCAPE 16 /* quotient at which a value is instead written in full */
+#define VALUE_BITS 20 /* enough for any residual, see residual() */
+#define MAX_ORDER 2
+#define VERBATIM 0xff
+
+/* Bytes of a chunk at most, whilst it is packed, and after the end of
+ * the data which a reader loads, but does not use */
+
+#define CHUNK_BYTES (TRACK_CHANNELS + (PACK_CHUNK * TRACK_CHANNELS \
+                                       * (ESCAPE + 1 + VALUE_BITS) + 7) / 8)
+#define SLACK sizeof(uint64_t)
+
+struct writer {
+    unsigned char *out;
+    uint64_t acc;
+    unsigned int n; /* bits in acc which are not yet written */
+};
+
+void pack_init(struct pack *p)
+{
+    p->length = 0;
+    p->data = NULL;
+    p->bytes = 0;
+    p->size = 0;
+    p->chunk = NULL;
+    p->chunks = 0;
+    p->chunks_size = 0;
+}
+
+void pack_clear(struct pack *p)
+{
+    free(p->data);
+    free(p->chunk);
+}
+
+/*
+ * Return: the value predicted by the given order, from the two
+ *     values before it
+ */
+
+static inline int predict(unsigned int order, int x1, int x2)
+{
+    switch (order) {
+    case 0:
+        return 0;
+    case 1:
+        return x1;
+    default:
+        return 2 * x1 - x2;
+    }
+}
+
+/*
+ * Return: the difference of a value from its prediction, mapped to an
+ *     unsigned value, small for either sign
+ *
+ * A channel value is within 17 bits, and its prediction 19, so the
+ * result is within VALUE_BITS.
+ */
+
+static inline unsigned int residual(int x, int predicted)
+{
+    int r;
+
+    r = x - predicted;
+    if (r < 0)
+        return ((unsigned int)-r << 1) - 1;
+    else
+        return (unsigned int)r << 1;
+}
+
+static inline int unresidual(unsigned int u)
+{
+    return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+static void put_bits(struct writer *w, uint64_t v, unsigned int bits)
+{
+    w->acc = w->acc << bits | v;
+    w->n += bits;
+
+    while (w->n >= 8) {
+        w->n -= 8;
+        *w->out++ = w->acc >> w->n;
+    }
+}
+
+/*
+ * Choose the predictor and Rice parameter which best suit the given
+ * values of one channel
+ */
+
+static void choose(const int *x, unsigned int n,
+                   unsigned int *order, unsigned int *k)
+{
+    unsigned int i, o;
+    uint64_t sum[MAX_ORDER + 1], best;
+
+    for (o = 0; o <= MAX_ORDER; o++) {
+        int x1 = 0, x2 = 0;
+
+        sum[o] = 0;
+        for (i = 0; i < n; i++) {
+            sum[o] += residual(x[i], predict(o, x1, x2));
+            x2 = x1;
+            x1 = x[i];
+        }
+    }
+
+    *order = 0;
+    for (o = 1; o <= MAX_ORDER; o++) {
+        if (sum[o] < sum[*order])
+            *order = o;
+    }
+
+    /* Near to the log of the mean value */
+
+    best = sum[*order];
+    for (*k = 0; *k < VALUE_BITS && ((uint64_t)n << *k) < best; (*k)++);
+}
+
+/*
+ * Pack one chunk of audio
+ *
+ * Return: number of bytes written
+ * Pre: out has room for CHUNK_BYTES
+ */
+
+static size_t pack_chunk(unsigned char *out, const signed short *pcm,
+                         unsigned int n)
+{
+    unsigned int c, i;
+    struct writer w;
+    int x[PACK_CHUNK];
+
+    w.out = out + TRACK_CHANNELS;
+    w.acc = 0;
+    w.n = 0;
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        unsigned int order, k;
+        int x1 = 0, x2 = 0;
+
+        for (i = 0; i < n; i++) {
+            const signed short *s = pcm + i * TRACK_CHANNELS;
+
+            if (c == 0)
+                x[i] = s[0];
+            else
+                x[i] = s[c] - s[0];
+        }
+
+        choose(x, n, &order, &k);
+        out[c] = order << 5 | k;
+
+        for (i = 0; i < n; i++) {
+            unsigned int u, q;
+
+            u = residual(x[i], predict(order, x1, x2));
+            q = u >> k;
+
+            if (q < ESCAPE) {
+                put_bits(&w, 1, q + 1);
+                put_bits(&w, u & ((1 << k) - 1), k);
+            } else {
+                put_bits(&w, 1, ESCAPE + 1);
+                put_bits(&w, u, VALUE_BITS);
+            }
+
+            x2 = x1;
+            x1 = x[i];
+        }
+    }
+
+    if (w.n > 0)
+        *w.out++ = w.acc << (8 - w.n);
+
+    if (w.out - out <= 1 + n * TRACK_CHANNELS * sizeof *pcm)
+        return w.out - out;
+
+    out[0] = VERBATIM;
+    memcpy(out + 1, pcm, n * TRACK_CHANNELS * sizeof *pcm);
+    return 1 + n * TRACK_CHANNELS * sizeof *pcm;
+}
+
+/*
+ * Return: the next 57 bits or more from the given bit position
+ *     onwards, in the most significant bits
+ */
+
+static inline uint64_t peek(const unsigned char *in, size_t pos)
+{
+    uint64_t v;
+
+    memcpy(&v, in + pos / 8, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v << (pos & 7);
+}
+
+/*
+ * Unpack one chunk of audio
+ *
+ * Post: pcm holds the given number of samples
+ */
+
+static void unpack_chunk(const unsigned char *in, signed short *pcm,
+                         unsigned int n)
+{
+    unsigned int c, i;
+    size_t pos;
+
+    if (in[0] == VERBATIM) {
+        memcpy(pcm, in + 1, n * TRACK_CHANNELS * sizeof *pcm);
+        return;
+    }
+
+    pos = TRACK_CHANNELS * 8;
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        unsigned int order, k;
+        int x1 = 0, x2 = 0;
+
+        order = in[c] >> 5;
+        k = in[c] & 0x1f;
+
+        for (i = 0; i < n; i++) {
+            unsigned int u, q;
+            uint64_t v;
+            int x;
+
+            v = peek(in, pos);
+            q = __builtin_clzll(v);
+
+            if (q < ESCAPE) {
+                u = q << k | (v << q << 1 >> 1 >> (63 - k));
+                pos += q + 1 + k;
+            } else {
+                u = v << (ESCAPE + 1) >> (64 - VALUE_BITS);
+                pos += ESCAPE + 1 + VALUE_BITS;
+            }
+
+            x = unresidual(u) + predict(order, x1, x2);
+            x2 = x1;
+            x1 = x;
+
+            if (c == 0)
+                pcm[i * TRACK_CHANNELS] = x;
+            else
+                pcm[i * TRACK_CHANNELS + c] = pcm[i * TRACK_CHANNELS] + x;
+        }
+    }
+}
+
+/*
+ * Make room for another chunk
+ *
+ * Return: -1 if memory could not be allocated, otherwise 0
+ */
+
+static int more_space(struct pack *p)
+{
+    if (p->bytes + CHUNK_BYTES + SLACK > p->size) {
+        size_t size;
+        unsigned char *data;
+
+        size = p->size * 2;
+        if (size < p->bytes + CHUNK_BYTES + SLACK)
+            size = p->bytes + CHUNK_BYTES + SLACK;
+
+        data = realloc(p->data, size);
+        if (data == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        p->data = data;
+        p->size = size;
+    }
+
+    if (p->chunks == p->chunks_size) {
+        unsigned int size;
+        size_t *chunk;
+
+        size = p->chunks_size * 2;
+        if (size == 0)
+            size = 256;
+
+        chunk = realloc(p->chunk, sizeof *chunk * size);
+        if (chunk == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        p->chunk = chunk;
+        p->chunks_size = size;
+    }
+
+    return 0;
+}
+
+/*
+ * Add audio to the end of the pack
+ *
+ * Return: -1 if memory could not be allocated, otherwise 0
+ * Pre: the length is a whole number of chunks
+ */
+
+int pack_add(struct pack *p, const signed short *pcm, unsigned int samples)
+{
+    while (samples > 0) {
+        unsigned int n;
+
+        n = samples;
+        if (n > PACK_CHUNK)
+            n = PACK_CHUNK;
+
+        if (more_space(p) == -1)
+            return -1;
+
+        p->chunk[p->chunks++] = p->bytes;
+        p->bytes += pack_chunk(p->data + p->bytes, pcm, n);
+        p->length += n;
+
+        /* So that the reader only ever loads data which is set */
+
+        memset(p->data + p->bytes, 0, SLACK);
+
+        pcm += n * TRACK_CHANNELS;
+        samples -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Return memory which was allocated ahead of need, once all audio is
+ * added
+ */
+
+void pack_finish(struct pack *p)
+{
+    void *x;
+
+    x = realloc(p->data, p->bytes + SLACK);
+    if (x != NULL) {
+        p->data = x;
+        p->size = p->bytes + SLACK;
+    }
+
+    if (p->chunks == 0)
+        return;
+
+    x = realloc(p->chunk, sizeof *p->chunk * p->chunks);
+    if (x != NULL) {
+        p->chunk = x;
+        p->chunks_size = p->chunks;
+    }
+}
+
+/*
+ * Read audio from anywhere in the pack
+ *
+ * Pre: sample + samples is no more than the length
+ * Post: pcm holds the given number of samples
+ */
+
+void pack_read(const struct pack *p, unsigned int sample, signed short *pcm,
+               unsigned int samples)
+{
+    while (samples > 0) {
+        unsigned int c, offset, len, n;
+        signed short buf[PACK_CHUNK * TRACK_CHANNELS];
+        const unsigned char *in;
+
+        c = sample / PACK_CHUNK;
+        offset = sample % PACK_CHUNK;
+        in = p->data + p->chunk[c];
+
+        len = p->length - c * PACK_CHUNK;
+        if (len > PACK_CHUNK)
+            len = PACK_CHUNK;
+
+        n = len - offset;
+        if (n > samples)
+            n = samples;
+
+        if (offset == 0 && n == len) {
+            unpack_chunk(in, pcm, len);
+        } else {
+            unpack_chunk(in, buf, len);
+            memcpy(pcm, buf + offset * TRACK_CHANNELS,
+                   n * TRACK_CHANNELS * sizeof *pcm);
+        }
+
+        sample += n;
+        pcm += n * TRACK_CHANNELS;
+        samples -= n;
+    }
+}
+
+/*
+ * Return: memory used by the pack, in bytes
+ */
+
+size_t pack_bytes(const struct pack *p)
+{
+    return p->size + sizeof *p->chunk * p->chunks_size;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Lossless packing of the audio of a track, so that a track which is
+ * kept in memory, but not in use, takes less of it
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+
+#define PACK_CHUNK 4096 /* samples, each chunk can be read on its own */
+
+struct pack {
+    unsigned int length; /* in samples */
+    unsigned char *data;
+    size_t bytes, size; /* of the data used, and allocated */
+
+    size_t *chunk; /* offset into data of each chunk */
+    unsigned int chunks, chunks_size;
+};
+
+void pack_init(struct pack *p);
+void pack_clear(struct pack *p);
+
+int pack_add(struct pack *p, const signed short *pcm, unsigned int samples);
+void pack_finish(struct pack *p);
+
+void pack_read(const struct pack *p, unsigned int sample, signed short *pcm,
+               unsigned int samples);
+
+size_t pack_bytes(const struct pack *p);
+
+#endif
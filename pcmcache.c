@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Each cache file holds one track, as a header followed by the
+ * track's blocks exactly as they are laid out in memory:
+ *
+ *   [header][block 0][block 1]...
+ *
+ * so a cached track is used by pointing tr->block[] into a read-only
+ * mapping of the file. The unused end of the last block is never
+ * written, and is left as a hole in the file.
+ *
+ * A file is named by a hash of the importer, path and sample rate; the
+ * header records these, along with the modification time and size of
+ * the original file, to validate the entry. Files are written under a
+ * temporary name during import, and the header is written last, so
+ * partial files are never used.
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "pcmcache.h"
+#include "realtime.h"
+#include "track.h"
+
+#define MAGIC "xwaxpcm"
+#define VERSION 3
+#define HEADER_BYTES 4096
+
+#define SAMPLE (sizeof(signed short) * TRACK_CHANNELS) /* bytes per sample */
+
+struct header {
+    char magic[8];
+    int64_t mtime, size; /* of the source file */
+    uint32_t version,
+        channels, block_shift_min, block_shift_max, /* layout in memory */
+        rate, length, blocks;
+    uint32_t importer_len, path_len; /* strings follow the header */
+};
+
+struct pcmcache {
+    int fd;
+    bool failed; /* a write went wrong; abandon when finished */
+    char *pathname, *tmpname;
+    struct header header;
+};
+
+static const char *dir = NULL;
+
+/*
+ * Use the given directory for the cache; otherwise the cache is not
+ * used at all
+ */
+
+void pcmcache_set_dir(const char *d)
+{
+    dir = d;
+}
+
+/*
+ * Return: offset in the file of the given block
+ */
+
+static off_t block_offset(unsigned int n)
+{
+    return HEADER_BYTES + track_bytes(track_block_start(n));
+}
+
+/*
+ * Work out the header which a valid cache file must have
+ *
+ * Return: -1 if the source cannot be cached, otherwise 0
+ * Post: *h is the expected header
+ */
+
+static int expected_header(struct header *h, const char *importer,
+                           const char *path, int rate)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1)
+        return -1;
+
+    memset(h, '\0', sizeof *h);
+    memcpy(h->magic, MAGIC, sizeof MAGIC);
+    h->version = VERSION;
+    h->channels = TRACK_CHANNELS;
+    h->block_shift_min = TRACK_BLOCK_SHIFT_MIN;
+    h->block_shift_max = TRACK_BLOCK_SHIFT_MAX;
+    h->rate = rate;
+    h->mtime = st.st_mtime;
+    h->size = st.st_size;
+    h->importer_len = strlen(importer) + 1;
+    h->path_len = strlen(path) + 1;
+
+    if (sizeof *h + h->importer_len + h->path_len > HEADER_BYTES)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Return: pathname of the cache file, or NULL on error
+ * Post: if not NULL, the return value must be free'd
+ */
+
+static char* cache_pathname(const char *importer, const char *path, int rate)
+{
+    uint64_t hash;
+    const char *s;
+    char *p;
+
+    /* FNV-1a, over both strings including terminators */
+
+    hash = 14695981039346656037ULL;
+
+    for (s = importer;; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+        if (*s == '\0')
+            break;
+    }
+
+    for (s = path;; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+        if (*s == '\0')
+            break;
+    }
+
+    if (asprintf(&p, "%s/%016llx-%d.pcm", dir,
+                 (unsigned long long)hash, rate) == -1)
+    {
+        perror("asprintf");
+        return NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Map a previously cached copy of a track into memory
+ *
+ * Return: -1 if not in the cache, otherwise 0
+ * Post: if 0, the track's audio and meters are available
+ */
+
+int pcmcache_map(struct track *t, const char *importer, const char *path,
+                 int rate)
+{
+    int fd;
+    unsigned int n;
+    char *pathname, *strings;
+    void *map;
+    size_t len;
+    struct stat st;
+    struct header want;
+    const struct header *h;
+
+    rt_not_allowed();
+
+    if (dir == NULL)
+        return -1;
+
+    if (expected_header(&want, importer, path, rate) == -1)
+        return -1;
+
+    pathname = cache_pathname(importer, path, rate);
+    if (pathname == NULL)
+        return -1;
+
+    fd = open(pathname, O_RDONLY);
+    free(pathname);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror("open");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+
+    if (st.st_size < HEADER_BYTES)
+        goto fail;
+
+    len = st.st_size;
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    if (close(fd) == -1)
+        abort();
+
+    /* Everything but the track length must be as expected */
+
+    h = map;
+    want.length = h->length;
+    want.blocks = h->blocks;
+
+    if (memcmp(h, &want, sizeof want) != 0)
+        goto stale;
+
+    strings = (char*)map + sizeof *h;
+    if (strcmp(strings, importer) != 0
+        || strcmp(strings + h->importer_len, path) != 0)
+    {
+        goto stale;
+    }
+
+    if (h->blocks > TRACK_MAX_BLOCKS
+        || h->length > track_block_start(h->blocks)
+        || len < block_offset(h->blocks))
+    {
+        goto stale;
+    }
+
+    t->map = map;
+    t->map_bytes = len;
+
+    t->blocks = h->blocks;
+    for (n = 0; n < t->blocks; n++)
+        t->block[n] = (signed short*)((char*)map + block_offset(n));
+
+    t->length = h->length;
+    t->bytes = (size_t)h->length * SAMPLE;
+
+    return 0;
+
+ stale:
+    debug("cache entry for %s is stale", path);
+    if (munmap(map, len) == -1)
+        abort();
+    return -1;
+
+ fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Pre: track was mapped by pcmcache_map()
+ * Post: track's audio is no longer accessible
+ */
+
+void pcmcache_unmap(struct track *t)
+{
+    assert(t->map != NULL);
+
+    if (munmap(t->map, t->map_bytes) == -1)
+        abort();
+
+    t->map = NULL;
+}
+
+/*
+ * Abandon the cache file being written
+ *
+ * Post: t->cache is NULL
+ */
+
+static void abandon(struct track *t)
+{
+    struct pcmcache *c = t->cache;
+
+    if (close(c->fd) == -1)
+        abort();
+
+    if (unlink(c->tmpname) == -1)
+        perror("unlink");
+
+    free(c->tmpname);
+    free(c->pathname);
+    free(c);
+
+    t->cache = NULL;
+}
+
+/*
+ * Begin writing a track, which is about to be imported, to the cache
+ *
+ * Post: if t->cache is not NULL, the track is being cached
+ */
+
+void pcmcache_create(struct track *t)
+{
+    struct pcmcache *c;
+
+    rt_not_allowed();
+
+    t->cache = NULL;
+
+    if (dir == NULL)
+        return;
+
+    c = malloc(sizeof *c);
+    if (c == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    if (expected_header(&c->header, t->importer, t->path, t->rate) == -1)
+        goto fail_alloc;
+
+    c->pathname = cache_pathname(t->importer, t->path, t->rate);
+    if (c->pathname == NULL)
+        goto fail_alloc;
+
+    if (asprintf(&c->tmpname, "%s.XXXXXX", c->pathname) == -1) {
+        perror("asprintf");
+        goto fail_pathname;
+    }
+
+    c->fd = mkstemp(c->tmpname);
+    if (c->fd == -1) {
+        perror("mkstemp");
+        goto fail_tmpname;
+    }
+
+    c->failed = false;
+    t->cache = c;
+    return;
+
+ fail_tmpname:
+    free(c->tmpname);
+ fail_pathname:
+    free(c->pathname);
+ fail_alloc:
+    free(c);
+}
+
+/*
+ * Write incoming audio to the cache
+ *
+ * An import may write from more than one thread at once, to different
+ * blocks, so the cache is only abandoned when it is finished.
+ *
+ * Pre: len bytes of audio from the given offset have been imported,
+ *     and lie within one block
+ */
+
+void pcmcache_write(struct track *t, size_t offset, size_t len)
+{
+    unsigned int block, sample;
+    size_t fill;
+    const char *pcm;
+
+    if (t->cache == NULL)
+        return;
+
+    if (__atomic_load_n(&t->cache->failed, __ATOMIC_RELAXED))
+        return;
+
+    block = track_block(offset / SAMPLE, &sample);
+    fill = sample * SAMPLE + offset % SAMPLE;
+    assert(fill + len <= track_block_samples(block) * SAMPLE);
+
+    pcm = (const char*)t->block[block] + fill;
+
+    if (pwrite(t->cache->fd, pcm, len, block_offset(block) + fill) != len) {
+        perror("pwrite");
+        __atomic_store_n(&t->cache->failed, true, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Complete the cache file, now the import has finished
+ *
+ * If the import was unsuccessful, the file is discarded.
+ *
+ * Post: t->cache is NULL
+ */
+
+void pcmcache_finish(struct track *t, bool success)
+{
+    unsigned int n;
+    struct pcmcache *c = t->cache;
+    struct header *h;
+
+    rt_not_allowed();
+
+    if (c == NULL)
+        return;
+
+    if (!success || c->failed || t->blocks == 0) {
+        abandon(t);
+        return;
+    }
+
+    /* The meters were still changing until now */
+
+    for (n = 0; n < t->blocks; n++) {
+        const char *meters;
+        unsigned int samples;
+        size_t len;
+        off_t pos;
+
+        samples = track_block_samples(n);
+
+        meters = (const char*)track_block_ppm(t, n);
+        len = track_bytes(samples) - samples * SAMPLE;
+        pos = block_offset(n) + samples * SAMPLE;
+
+        if (pwrite(c->fd, meters, len, pos) != len) {
+            perror("pwrite");
+            abandon(t);
+            return;
+        }
+    }
+
+    if (ftruncate(c->fd, block_offset(t->blocks)) == -1) {
+        perror("ftruncate");
+        abandon(t);
+        return;
+    }
+
+    h = &c->header;
+    h->length = t->length;
+    h->blocks = t->blocks;
+
+    if (pwrite(c->fd, h, sizeof *h, 0) != sizeof *h
+        || pwrite(c->fd, t->importer, h->importer_len, sizeof *h)
+            != h->importer_len
+        || pwrite(c->fd, t->path, h->path_len, sizeof *h + h->importer_len)
+            != h->path_len)
+    {
+        perror("pwrite");
+        abandon(t);
+        return;
+    }
+
+    if (rename(c->tmpname, c->pathname) == -1) {
+        perror("rename");
+        abandon(t);
+        return;
+    }
+
+    debug("cached %s as %s", t->path, c->pathname);
+
+    if (close(c->fd) == -1)
+        abort();
+
+    free(c->tmpname);
+    free(c->pathname);
+    free(c);
+
+    t->cache = NULL;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Persistent cache of decoded audio, so that a track which has been
+ * imported before can be mapped into memory instead
+ */
+
+#ifndef PCMCACHE_H
+#define PCMCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct track;
+
+void pcmcache_set_dir(const char *dir);
+
+int pcmcache_map(struct track *t, const char *importer, const char *path,
+                 int rate);
+void pcmcache_unmap(struct track *t);
+
+void pcmcache_create(struct track *t);
+void pcmcache_write(struct track *t, size_t offset, size_t len);
+void pcmcache_finish(struct track *t, bool success);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * The Kalman filter models the record with a position, speed and
+ * acceleration, and is updated only when the record is seen to move.
+ * Its gain adapts to the time between movements, so it follows the
+ * attack of a scratch more quickly than the fixed filter.
+ */
+
+#include <string.h>
+
+#include "pitch.h"
+
+/* Values for the Kalman filter concluded using tests/replay */
+
+#define JERK 3e2 /* variance of the change in acceleration, per second */
+#define JITTER 16.0 /* variance of a movement's time, in samples^2 */
+#define JITTER_MIN_SPEED 0.1 /* below which jitter is not reduced */
+#define INITIAL_SPEED 4.0 /* uncertainty of the first movement */
+
+#define SQ(x) ((x)*(x))
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+static const char *names[] = {
+    [PITCH_ALPHA_BETA] = "alpha-beta",
+    [PITCH_KALMAN] = "kalman",
+};
+
+/*
+ * Return: the filter of the given name, or -1 if not known
+ */
+
+int pitch_find_filter(const char *name)
+{
+    int n;
+
+    for (n = 0; n < (int)ARRAY_SIZE(names); n++) {
+        if (!strcmp(names[n], name))
+            return n;
+    }
+
+    return -1;
+}
+
+/*
+ * Prepare the filter for observations every dt seconds
+ */
+
+void pitch_init(struct pitch *p, double dt, int filter)
+{
+    p->filter = filter;
+    p->dt = dt;
+    p->x = 0.0;
+    p->v = 0.0;
+
+    p->a = 0.0;
+    p->t = 0.0;
+    p->step = 0.0;
+
+    memset(p->p, '\0', sizeof p->p);
+    p->p[1][1] = SQ(INITIAL_SPEED);
+}
+
+/*
+ * Update the Kalman filter; since the last movement, the record has
+ * moved by dx in p->t seconds
+ */
+
+void pitch_kalman_observation(struct pitch *p, double dx)
+{
+    int i, j;
+    double t, x, v, r, s, y, k[3], f[3][3], fp[3][3], q[3][3];
+
+    t = p->t;
+
+    /* Predict the state now, as a constant acceleration */
+
+    x = p->x + p->v * t + p->a * t * t / 2;
+    v = p->v + p->a * t;
+
+    /* Covariance of the prediction is F.P.F' + Q, where the change in
+     * acceleration is white noise */
+
+    memset(f, '\0', sizeof f);
+    f[0][0] = 1.0;
+    f[0][1] = t;
+    f[0][2] = t * t / 2;
+    f[1][1] = 1.0;
+    f[1][2] = t;
+    f[2][2] = 1.0;
+
+    q[0][0] = JERK * pow(t, 5) / 20;
+    q[0][1] = q[1][0] = JERK * pow(t, 4) / 8;
+    q[0][2] = q[2][0] = JERK * pow(t, 3) / 6;
+    q[1][1] = JERK * pow(t, 3) / 3;
+    q[1][2] = q[2][1] = JERK * t * t / 2;
+    q[2][2] = JERK * t;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            fp[i][j] = f[i][0] * p->p[0][j] + f[i][1] * p->p[1][j]
+                + f[i][2] * p->p[2][j];
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            p->p[i][j] = fp[i][0] * f[j][0] + fp[i][1] * f[j][1]
+                + fp[i][2] * f[j][2] + q[i][j];
+        }
+    }
+
+    /* The place of the movement is exact, but its time is only known
+     * to the sample; so the error is in proportion to the speed */
+
+    r = JITTER * SQ(p->dt) * (SQ(v) + SQ(JITTER_MIN_SPEED));
+
+    s = p->p[0][0] + r;
+    for (i = 0; i < 3; i++)
+        k[i] = p->p[i][0] / s;
+
+    y = dx - x;
+    p->x = x + k[0] * y;
+    p->v = v + k[1] * y;
+    p->a = p->a + k[2] * y;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++)
+            fp[i][j] = p->p[i][j] - k[i] * p->p[0][j];
+    }
+    memcpy(p->p, fp, sizeof p->p);
+
+    p->x -= dx; /* relative to this movement */
+    p->t = 0.0;
+    p->step = fabs(dx);
+}
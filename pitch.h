@@ -20,25 +20,37 @@
 #ifndef PITCH_H
 #define PITCH_H
 
+#include <math.h>
+
 /* Values for the filter concluded experimentally */
 
 #define ALPHA (1.0/512)
 #define BETA (ALPHA/256)
 
+/* Types of filter, selectable per deck */
+
+#define PITCH_ALPHA_BETA 0 /* fixed coefficients, on every sample */
+#define PITCH_KALMAN 1 /* adaptive, with acceleration, at each movement */
+
+#define PITCH_DEFAULT PITCH_ALPHA_BETA
+
 /* State of the pitch calculation filter */
 
 struct pitch {
+    int filter;
     double dt, x, v;
-};
 
-/* Prepare the filter for observations every dt seconds */
+    /* Kalman filter only */
 
-static inline void pitch_init(struct pitch *p, double dt)
-{
-    p->dt = dt;
-    p->x = 0.0;
-    p->v = 0.0;
-}
+    double a,
+        t, /* since the last movement */
+        step, /* size of the last movement */
+        p[3][3]; /* covariance of x, v and a */
+};
+
+int pitch_find_filter(const char *name);
+void pitch_init(struct pitch *p, double dt, int filter);
+void pitch_kalman_observation(struct pitch *p, double dx);
 
 /* Input an observation to the filter; in the last dt seconds the
  * position has moved by dx.
@@ -50,6 +62,23 @@ static inline void pitch_dt_observation(struct pitch *p, double dx)
 {
     double predicted_x, predicted_v, residual_x;
 
+    /* The Kalman filter only does work when there is movement. Until
+     * then the record can be no faster than the time since the last
+     * movement allows */
+
+    if (p->filter == PITCH_KALMAN) {
+        p->t += p->dt;
+
+        if (dx != 0.0) {
+            pitch_kalman_observation(p, dx);
+        } else if (fabs(p->v) * p->t > p->step) {
+            p->v = copysign(p->step / p->t, p->v);
+            p->a = 0.0;
+        }
+
+        return;
+    }
+
     predicted_x = p->x + p->v * p->dt;
     predicted_v = p->v;
 
@@ -18,7 +18,6 @@
  */
 
 #include <assert.h>
-#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +26,8 @@
 
 #include "device.h"
 #include "player.h"
+#include "rig.h"
+#include "stats.h"
 #include "track.h"
 #include "timecoder.h"
 
@@ -48,9 +49,42 @@
 
 #define VOLUME (7.0/8)
 
+/* Track audio is 16-bit, but the resamplers output at a full scale of
+ * 1.0; the conversion is part of the volume */
+
+#define TRACK_SCALE (1.0 / 32768)
+
+/* Step down to a cheaper resampler when building the audio takes
+ * too much of the period, which must also fit the timecoder and the
+ * other decks; step back up after a time with plenty of headroom,
+ * as the resamplers differ in cost by up to ten times */
+
+#define LOAD_HIGH 0.5 /* share of the period */
+#define LOAD_LOW 0.05
+#define LOAD_RC 0.05 /* seconds */
+#define LOAD_SETTLE (4 * LOAD_RC) /* after a change */
+#define WAIT_MIN 2.0 /* seconds of headroom before a step up */
+#define WAIT_MAX 64.0
+
 #define SQ(x) ((x)*(x))
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 #define TARGET_UNKNOWN INFINITY
 
+/* A jump in the position, such as a cue, is crossfaded to avoid a
+ * click */
+
+#define FADE_TIME 0.002 /* seconds */
+#define MAX_FADE 512 /* samples */
+
+/* Compile the vector code for more than one instruction set where
+ * the toolchain can select between them at runtime */
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define MULTIVERSION __attribute__((target_clones("avx2", "default")))
+#else
+#define MULTIVERSION
+#endif
+
 /*
  * Return: the cubic interpolation of the sample at position 2 + mu
  */
@@ -69,39 +103,243 @@ static inline double cubic_interpolate(double y[4], double mu)
 }
 
 /*
- * Return: Random dither, between -0.5 and 0.5
+ * Return: pointer to the given sample of a channel of the output
+ */
+
+static inline float* output(const struct player_output *out,
+                            unsigned int c, unsigned int s)
+{
+    return &out->channel[c][s * out->stride];
+}
+
+/*
+ * Scalar resampling of a single output frame
+ *
+ * This is the reference implementation; the vector path below is
+ * only used where it gives finished results within a known bound of
+ * this code.
+ *
+ * Post: sample s of each channel is written to out
+ */
+
+static void build_frame(const struct player_output *out, unsigned int s,
+                        struct track *tr, double sample, double vol)
+{
+    int c, sa, q;
+    double f, i[PLAYER_CHANNELS][4];
+
+    /* 4-sample window for interpolation */
+
+    sa = (int)sample;
+    if (sample < 0.0)
+        sa--;
+    f = sample - sa;
+    sa--;
+
+    for (q = 0; q < 4; q++, sa++) {
+        if (!track_is_ready(tr, tr->length, sa)) {
+            for (c = 0; c < PLAYER_CHANNELS; c++)
+                i[c][q] = 0.0;
+        } else {
+            signed short *ts;
+            int c;
+
+            ts = track_get_sample(tr, sa);
+            for (c = 0; c < PLAYER_CHANNELS; c++)
+                i[c][q] = (double)ts[c];
+        }
+    }
+
+    for (c = 0; c < PLAYER_CHANNELS; c++)
+        *output(out, c, s) = vol * cubic_interpolate(i[c], f);
+}
+
+/*
+ * Vector resampling of GROUP output frames at once
+ *
+ * Each lane of the vector is one channel of one output frame, and the
+ * interpolation is done in single precision. The compiler maps the
+ * vector types to whatever SIMD is available (SSE2, NEON) and, where
+ * supported, an AVX2 clone is selected at runtime.
+ *
+ * The result differs from build_frame() only by the rounding of
+ * single precision, which is well below that of the 16-bit track.
+ *
+ * Pre: ts[n] points to the 4-frame interpolation window for frame n
+ * Post: GROUP samples from s, of each channel, are written to out
  */
 
-double dither(void)
+#define GROUP 4
+#define LANES (GROUP * PLAYER_CHANNELS)
+
+typedef float vf __attribute__((vector_size(LANES * sizeof(float))));
+
+MULTIVERSION
+static void build_group(const struct player_output *out, unsigned int s,
+                        signed short *ts[GROUP], const double f[GROUP],
+                        const double vol[GROUP])
 {
-    short bit;
-    static short x = 0xbabe;
+    int n, c, l;
+    vf y0, y1, y2, y3, mu, gain, a0, a1, a2, v;
+
+    for (n = 0; n < GROUP; n++) {
+        for (c = 0; c < PLAYER_CHANNELS; c++) {
+            l = n * PLAYER_CHANNELS + c;
+
+            y0[l] = ts[n][c];
+            y1[l] = ts[n][c + TRACK_CHANNELS];
+            y2[l] = ts[n][c + TRACK_CHANNELS * 2];
+            y3[l] = ts[n][c + TRACK_CHANNELS * 3];
+
+            mu[l] = f[n];
+            gain[l] = vol[n];
+        }
+    }
 
-    /* Use a 16-bit maximal-length LFSR as our random number.
-     * This is faster than rand() */
+    /* Same cubic as cubic_interpolate(), in Horner form */
 
-    bit = (x ^ (x >> 2) ^ (x >> 3) ^ (x >> 5)) & 1;
-    x = x >> 1 | (bit << 15);
+    a0 = y3 - y2 - y0 + y1;
+    a1 = y0 - y1 - a0;
+    a2 = y2 - y0;
 
-    return (double)x / 65536 - 0.5; /* not quite whole range */
+    v = ((a0 * mu + a1) * mu + a2) * mu + y1;
+    v = gain * v;
+
+    for (n = 0; n < GROUP; n++) {
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            *output(out, c, s + n) = v[n * PLAYER_CHANNELS + c];
+    }
 }
 
 /*
- * Build a block of PCM audio, resampled from the track
+ * The contiguous region of the track most recently used by
+ * window(), so that the block lookup is only repeated when playback
+ * crosses a block boundary
+ */
+
+struct span {
+    signed short *pcm; /* audio for sample 'first' */
+    int first, last; /* range of samples available, [first, last) */
+};
+
+/*
+ * Move the span to the block which holds sample sa
+ *
+ * This is kept out of line; it is only needed as playback crosses a
+ * block boundary, and the readiness of the block is an atomic load
+ * which would otherwise constrain the loop around span_get().
  *
- * This is just a basic resampler which has a small amount of aliasing
+ * Return: false if n contiguous frames from sa are not available
+ *     (track edges, audio not yet imported, or across a block
+ *     boundary), otherwise true
+ */
+
+static __attribute__((noinline)) bool span_fill(struct track *tr,
+                                                struct span *span,
+                                                unsigned int length,
+                                                int sa, int n)
+{
+    unsigned int b, offset, ready;
+
+    if (sa < 0 || (sa + n > length && !tr->ahead))
+        return false;
+
+    b = track_block(sa, &offset);
+    ready = track_block_ready(tr, length, b);
+    if (offset + n > ready)
+        return false;
+
+    span->pcm = tr->block[b];
+    span->first = sa - offset;
+    span->last = span->first + ready;
+
+    return true;
+}
+
+/*
+ * Return: pointer to n contiguous frames of audio starting at sa, or
+ *     NULL if they are not all available
+ */
+
+static inline signed short* span_get(struct track *tr, struct span *span,
+                                     unsigned int length, int sa, int n)
+{
+    if (sa < span->first || sa + n > span->last) {
+        if (!span_fill(tr, span, length, sa, n))
+            return NULL;
+    }
+
+    return span->pcm + (sa - span->first) * TRACK_CHANNELS;
+}
+
+static inline void span_init(struct span *span)
+{
+    span->pcm = NULL;
+    span->first = 0;
+    span->last = 0;
+}
+
+/*
+ * Find the interpolation window for the given position in the track,
+ * for use by build_group()
+ *
+ * Return: pointer to the sample data, or NULL if the window is not
+ *     contiguous in memory
+ * Post: *f is the fractional offset
+ */
+
+static inline signed short* window(struct track *tr, struct span *span,
+                                   unsigned int length, double sample,
+                                   double *f)
+{
+    int sa;
+
+    sa = (int)sample;
+    if (sample < 0.0)
+        sa--;
+    *f = sample - sa;
+
+    return span_get(tr, span, length, sa - 1, 4);
+}
+
+/*
+ * Return: the value of the given channel at sample sa, or silence
+ *     outside of the track
+ */
+
+static inline double get_sample(struct track *tr, unsigned int length,
+                                int sa, int c)
+{
+    if (!track_is_ready(tr, length, sa))
+        return 0.0;
+
+    return track_get_sample(tr, sa)[c];
+}
+
+/*
+ * Build a block of PCM audio, resampled from the track using cubic
+ * interpolation
+ *
+ * This is the default resampler, which has a small amount of aliasing
  * where pitch > 1.0.
  *
+ * Frames are built in groups using build_group() wherever possible,
+ * falling back to build_frame() at track edges, block boundaries and
+ * for any remainder at the end of the buffer.
+ *
  * Return: number of seconds advanced in the source audio track
- * Post: buffer at pcm is filled with the given number of samples
+ * Post: out is filled with the given number of samples
  */
 
-static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
-                        struct track *tr, double position, double pitch,
-                        double start_vol, double end_vol)
+static double build_cubic(const struct player_output *out,
+                          unsigned samples, double sample_dt,
+                          struct track *tr, double position, double pitch,
+                          double start_vol, double end_vol)
 {
     int s;
+    unsigned int length;
     double sample, step, vol, gradient;
+    struct span span;
 
     sample = position * tr->rate;
     step = sample_dt * pitch * tr->rate;
@@ -109,46 +347,274 @@ static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
     vol = start_vol;
     gradient = (end_vol - start_vol) / samples;
 
-    for (s = 0; s < samples; s++) {
-        int c, sa, q;
-        double f, i[PLAYER_CHANNELS][4];
+    length = tr->length; /* may be growing as we import */
+
+    span_init(&span);
+
+    s = 0;
+    while (s < samples) {
+        int n;
+        signed short *ts[GROUP];
+        double f[GROUP], v[GROUP], x, y;
+
+        /* Work out the next group of positions, without committing
+         * to them, so the rounding is identical to the scalar path */
+
+        x = sample;
+        y = vol;
+        for (n = 0; n < GROUP && s + n < samples; n++) {
+            ts[n] = window(tr, &span, length, x, &f[n]);
+            if (ts[n] == NULL)
+                break;
+            v[n] = y;
+            x += step;
+            y += gradient;
+        }
+
+        if (n == GROUP) {
+            build_group(out, s, ts, f, v);
+        } else {
+            n = 1;
+            build_frame(out, s, tr, sample, vol);
+        }
+
+        s += n;
+
+        while (n--) {
+            sample += step;
+            vol += gradient;
+        }
+    }
+
+    return sample_dt * pitch * samples;
+}
+
+/*
+ * Build a block of PCM audio, resampled from the track using linear
+ * interpolation
+ *
+ * This is the cheapest resampler, for hardware which cannot keep up
+ * with the others. High frequencies are attenuated, and it aliases
+ * at any pitch other than 1.0.
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: out is filled with the given number of samples
+ */
+
+static double build_linear(const struct player_output *out,
+                           unsigned samples, double sample_dt,
+                           struct track *tr, double position, double pitch,
+                           double start_vol, double end_vol)
+{
+    int s, c, sa;
+    unsigned int length;
+    double sample, step, vol, gradient, f;
+    signed short *ts;
+    struct span span;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
 
-        /* 4-sample window for interpolation */
+    length = tr->length; /* may be growing as we import */
+    span_init(&span);
 
+    for (s = 0; s < samples; s++) {
         sa = (int)sample;
         if (sample < 0.0)
             sa--;
         f = sample - sa;
-        sa--;
 
-        for (q = 0; q < 4; q++, sa++) {
-            if (sa < 0 || sa >= tr->length) {
-                for (c = 0; c < PLAYER_CHANNELS; c++)
-                    i[c][q] = 0.0;
-            } else {
-                signed short *ts;
-                int c;
+        ts = span_get(tr, &span, length, sa, 2);
 
-                ts = track_get_sample(tr, sa);
-                for (c = 0; c < PLAYER_CHANNELS; c++)
-                    i[c][q] = (double)ts[c];
+        for (c = 0; c < PLAYER_CHANNELS; c++) {
+            double a, b;
+
+            if (ts != NULL) {
+                a = ts[c];
+                b = ts[c + TRACK_CHANNELS];
+            } else {
+                a = get_sample(tr, length, sa, c);
+                b = get_sample(tr, length, sa + 1, c);
             }
+
+            *output(out, c, s) = vol * (a + (b - a) * f);
         }
 
-        for (c = 0; c < PLAYER_CHANNELS; c++) {
-            double v;
+        sample += step;
+        vol += gradient;
+    }
 
-            v = vol * cubic_interpolate(i[c], f) + dither();
+    return sample_dt * pitch * samples;
+}
 
-            if (v > SHRT_MAX) {
-                *pcm++ = SHRT_MAX;
-            } else if (v < SHRT_MIN) {
-                *pcm++ = SHRT_MIN;
-            } else {
-                *pcm++ = (signed short)v;
+/*
+ * Band-limited interpolation using a windowed sinc
+ *
+ * The kernel is precomputed for SINC_PHASES positions between each of
+ * its zero crossings. At pitch above 1.0 the cutoff is lowered to the
+ * new Nyquist frequency by stretching the kernel over more input
+ * samples; this costs proportionally more, so the cutoff does not go
+ * below SINC_MIN_CUTOFF (larger pitch, such as spinbacks, alias).
+ */
+
+#define SINC_ZEROS 8 /* zero crossings either side of centre */
+#define SINC_PHASES 256 /* table entries per zero crossing */
+#define SINC_TABLE (SINC_ZEROS * SINC_PHASES)
+#define SINC_ROLLOFF 0.95 /* relative to Nyquist */
+#define SINC_MIN_CUTOFF 0.25
+
+static float sinc_table[SINC_TABLE + 1];
+
+/*
+ * Calculate the kernel of the sinc resampler, if it is not already
+ *
+ * Post: sinc_table is valid
+ */
+
+static void sinc_init(void)
+{
+    int n;
+    static bool done = false;
+
+    if (done)
+        return;
+
+    for (n = 0; n <= SINC_TABLE; n++) {
+        double x, w;
+
+        x = M_PI * n / SINC_PHASES;
+        w = M_PI * n / SINC_TABLE; /* Blackman window, 0 to pi */
+        w = 0.42 + 0.5 * cos(w) + 0.08 * cos(2 * w);
+
+        sinc_table[n] = (n == 0) ? 1.0 : w * sin(x) / x;
+    }
+
+    sinc_table[SINC_TABLE] = 0.0;
+    done = true;
+}
+
+/*
+ * Return: the kernel value at distance d from the centre, in
+ *     units of the table
+ */
+
+static inline double sinc_coeff(double d)
+{
+    int i;
+
+    i = (int)d;
+    return sinc_table[i] + (d - i) * (sinc_table[i + 1] - sinc_table[i]);
+}
+
+/*
+ * Accumulate one side of the sinc kernel, moving away from the
+ * centre in steps of 'dir' frames
+ *
+ * Pre: d is the distance of the first frame from the centre, in units
+ *     of the table
+ */
+
+static inline void sinc_side(double acc[PLAYER_CHANNELS],
+                             const signed short *ts, int dir,
+                             double d, double dd)
+{
+    int c;
+
+    while (d < SINC_TABLE) {
+        double h;
+
+        h = sinc_coeff(d);
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            acc[c] += h * ts[c];
+
+        ts += dir * TRACK_CHANNELS;
+        d += dd;
+    }
+}
+
+/*
+ * Build a block of PCM audio, resampled from the track using the
+ * sinc kernel
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: out is filled with the given number of samples
+ */
+
+static double build_sinc(const struct player_output *out,
+                         unsigned samples, double sample_dt,
+                         struct track *tr, double position, double pitch,
+                         double start_vol, double end_vol)
+{
+    int s, c, sa, reach;
+    unsigned int length;
+    double sample, step, vol, gradient, f, cutoff, dd;
+    struct span span;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    /* Filter at the lower of the source and destination Nyquist
+     * frequencies */
+
+    cutoff = SINC_ROLLOFF;
+    if (fabs(step) > 1.0)
+        cutoff /= fabs(step);
+    if (cutoff < SINC_MIN_CUTOFF)
+        cutoff = SINC_MIN_CUTOFF;
+
+    dd = cutoff * SINC_PHASES; /* table entries per input frame */
+    reach = SINC_ZEROS / cutoff + 1; /* frames either side */
+
+    length = tr->length; /* may be growing as we import */
+    span_init(&span);
+
+    for (s = 0; s < samples; s++) {
+        signed short *ts;
+        double acc[PLAYER_CHANNELS];
+
+        sa = (int)sample;
+        if (sample < 0.0)
+            sa--;
+        f = sample - sa;
+
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            acc[c] = 0.0;
+
+        ts = span_get(tr, &span, length, sa - reach, reach * 2 + 1);
+
+        if (ts != NULL) {
+            ts += reach * TRACK_CHANNELS;
+            sinc_side(acc, ts, -1, f * dd, dd);
+            sinc_side(acc, ts + TRACK_CHANNELS, 1, (1.0 - f) * dd, dd);
+
+        } else {
+            int k;
+            double d, h;
+
+            /* Near the track edges; the slow path */
+
+            for (k = 0, d = f * dd; d < SINC_TABLE; k++, d += dd) {
+                h = sinc_coeff(d);
+                for (c = 0; c < PLAYER_CHANNELS; c++)
+                    acc[c] += h * get_sample(tr, length, sa - k, c);
+            }
+
+            for (k = 1, d = (1.0 - f) * dd; d < SINC_TABLE; k++, d += dd) {
+                h = sinc_coeff(d);
+                for (c = 0; c < PLAYER_CHANNELS; c++)
+                    acc[c] += h * get_sample(tr, length, sa + k, c);
             }
         }
 
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            *output(out, c, s) = vol * cutoff * acc[c];
+
         sample += step;
         vol += gradient;
     }
@@ -156,19 +622,41 @@ static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
     return sample_dt * pitch * samples;
 }
 
+static struct resampler resamplers[] = {
+    {
+        .name = "linear",
+        .desc = "Linear interpolation",
+        .build = build_linear
+    },
+    {
+        .name = "cubic",
+        .desc = "Cubic interpolation",
+        .build = build_cubic
+    },
+    {
+        .name = "sinc",
+        .desc = "Band-limited windowed sinc",
+        .init = sinc_init,
+        .build = build_sinc
+    }
+};
+
 /*
- * Equivalent to build_pcm, but for use when the track is
- * not available
+ * Find a resampler by its name
  *
- * Return: number of seconds advanced in the audio track
- * Post: buffer at pcm is filled with silence
+ * Return: pointer to resampler, or NULL if not found
  */
 
-static double build_silence(signed short *pcm, unsigned samples,
-                            double sample_dt, double pitch)
+struct resampler* player_find_resampler(const char *name)
 {
-    memset(pcm, '\0', sizeof(*pcm) * PLAYER_CHANNELS * samples);
-    return sample_dt * pitch * samples;
+    unsigned int n;
+
+    for (n = 0; n < ARRAY_SIZE(resamplers); n++) {
+        if (!strcmp(resamplers[n].name, name))
+            return &resamplers[n];
+    }
+
+    return NULL;
 }
 
 /*
@@ -183,6 +671,68 @@ void player_set_timecoder(struct player *pl, struct timecoder *tc)
     pl->timecode_control = true;
 }
 
+/*
+ * Change the resampler used by this playback
+ *
+ * The resamplers are in order of cost, and any which are cheaper than
+ * the one given may be stepped down to under load; see adapt().
+ *
+ * Pre: not called while the player is in use by the realtime thread
+ */
+
+void player_set_resampler(struct player *pl, struct resampler *r)
+{
+    struct resampler *t;
+
+    assert(r >= resamplers && r < resamplers + ARRAY_SIZE(resamplers));
+
+    for (t = resamplers; t <= r; t++) {
+        if (t->init != NULL)
+            t->init();
+    }
+
+    pl->resampler = r;
+    pl->chosen = r;
+
+    pl->load = 0.0;
+    pl->wait = WAIT_MIN;
+    pl->since = 0.0;
+    pl->quiet = 0.0;
+    pl->raised = false;
+}
+
+/*
+ * Publish the state of the playback to other threads
+ *
+ * A sequence lock, written only by the realtime thread, which never
+ * waits; a reader retries if it overlaps a write. See
+ * player_get_state().
+ */
+
+static void publish(struct player *pl)
+{
+    unsigned int seq;
+    struct player_state *s;
+
+    seq = pl->published.sequence;
+    __atomic_store_n(&pl->published.sequence, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s = &pl->published.state;
+    s->position = pl->position;
+    s->offset = pl->offset;
+    s->last_difference = pl->last_difference;
+    s->pitch = pl->pitch;
+    s->sync_pitch = pl->sync_pitch;
+    s->load = pl->load;
+    s->resampler = pl->resampler;
+    s->chosen = pl->chosen;
+    s->timecode_control = pl->timecode_control;
+    s->recalibrate = pl->recalibrate;
+
+    __atomic_store_n(&pl->published.sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
 /*
  * Post: player is initialised
  */
@@ -190,14 +740,16 @@ void player_set_timecoder(struct player *pl, struct timecoder *tc)
 void player_init(struct player *pl, unsigned int sample_rate,
                  struct track *track, struct timecoder *tc)
 {
+    unsigned int n;
+
     assert(track != NULL);
     assert(sample_rate != 0);
 
-    spin_init(&pl->lock);
-
     pl->sample_dt = 1.0 / sample_rate;
     pl->track = track;
+    pl->collecting = 0;
     player_set_timecoder(pl, tc);
+    player_set_resampler(pl, player_find_resampler(DEFAULT_RESAMPLER));
 
     pl->position = 0.0;
     pl->offset = 0.0;
@@ -207,6 +759,16 @@ void player_init(struct player *pl, unsigned int sample_rate,
     pl->pitch = 0.0;
     pl->sync_pitch = 1.0;
     pl->volume = 0.0;
+    pl->punch = NO_PUNCH;
+
+    pl->collected = 0;
+    pl->command_head = 0;
+    pl->command_tail = 0;
+    for (n = 0; n < PLAYER_COMMANDS; n++)
+        pl->command[n].sequence = n;
+
+    pl->published.sequence = 0;
+    publish(pl);
 }
 
 /*
@@ -216,54 +778,125 @@ void player_init(struct player *pl, unsigned int sample_rate,
 
 void player_clear(struct player *pl)
 {
-    spin_clear(&pl->lock);
     track_put(pl->track);
 }
 
 /*
- * Enable or disable timecode control
+ * Queue a command to be applied by the realtime thread
+ *
+ * Any thread can add commands, and none of them wait. A slot is
+ * claimed by moving the tail, and handed to the realtime thread by
+ * its sequence number once the command is written; see Vyukov's
+ * bounded queue.
+ *
+ * Each command is stamped with the time it was made, so that it can
+ * be applied at the same point in the audio.
+ *
+ * If the queue is full the command is dropped; the realtime thread
+ * has stopped, or the user is faster than the audio.
+ */
+
+static void send(struct player *pl, int type, double seconds)
+{
+    unsigned int tail;
+    struct player_slot *slot;
+
+    tail = __atomic_load_n(&pl->command_tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int d;
+
+        slot = &pl->command[tail % PLAYER_COMMANDS];
+        d = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - tail;
+
+        if (d < 0)
+            return; /* full */
+
+        if (d == 0 && __atomic_compare_exchange_n(&pl->command_tail, &tail,
+                                                  tail + 1, true,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED))
+        {
+            break;
+        }
+
+        if (d > 0)
+            tail = __atomic_load_n(&pl->command_tail, __ATOMIC_RELAXED);
+    }
+
+    slot->command.type = type;
+    slot->command.seconds = seconds;
+    slot->command.when = stats_clock();
+    __atomic_store_n(&slot->sequence, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Toggle timecode control, at the start of the next period
  */
 
-void player_set_timecode_control(struct player *pl, bool on)
+void player_toggle_timecode_control(struct player *pl)
 {
-    if (on && !pl->timecode_control)
-        pl->recalibrate = true;
-    pl->timecode_control = on;
+    send(pl, PLAYER_TOGGLE_TIMECODE, 0.0);
 }
 
 /*
- * Toggle timecode control
+ * Take a copy of the playback, as of the end of the latest period
+ *
+ * For use by any thread other than the realtime one; the fields of
+ * the player itself are not read, as they can be part way through a
+ * change.
  *
- * Return: the new state of timecode control
+ * Post: s is a consistent copy of the published state
  */
 
-bool player_toggle_timecode_control(struct player *pl)
+void player_get_state(const struct player *pl, struct player_state *s)
 {
-    pl->timecode_control = !pl->timecode_control;
-    if (pl->timecode_control)
-        pl->recalibrate = true;
-    return pl->timecode_control;
+    unsigned int seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&pl->published.sequence, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue; /* being written */
+
+        *s = pl->published.state;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pl->published.sequence, __ATOMIC_RELAXED) == seq)
+            break;
+    }
 }
 
-double player_get_position(struct player *pl)
+double player_get_position(const struct player *pl)
 {
-    return pl->position;
+    struct player_state s;
+
+    player_get_state(pl, &s);
+    return s.position;
 }
 
-double player_get_elapsed(struct player *pl)
+double player_get_elapsed(const struct player *pl)
 {
-    return pl->position - pl->offset;
+    struct player_state s;
+
+    player_get_state(pl, &s);
+    return s.position - s.offset;
 }
 
-double player_get_remain(struct player *pl)
+double player_get_remain(const struct player *pl)
 {
+    struct player_state s;
+
+    player_get_state(pl, &s);
     return (double)pl->track->length / pl->track->rate
-        + pl->offset - pl->position;
+        + s.offset - s.position;
 }
 
 bool player_is_active(const struct player *pl)
 {
-    return (fabs(pl->pitch) > 0.01);
+    struct player_state s;
+
+    player_get_state(pl, &s);
+    return (fabs(s.pitch) > 0.01);
 }
 
 /*
@@ -272,7 +905,26 @@ bool player_is_active(const struct player *pl)
 
 void player_recue(struct player *pl)
 {
-    pl->offset = pl->position;
+    send(pl, PLAYER_RECUE, 0.0);
+}
+
+/*
+ * Change the track used for the playback
+ *
+ * The realtime thread does not take a lock to use the track, so the
+ * old one is released by the rig once player_collect() is done with
+ * it.
+ *
+ * Pre: caller holds reference on track, and the rig lock
+ * Post: caller does not hold reference on track
+ */
+
+static void swap_track(struct player *pl, struct track *track)
+{
+    struct track *x;
+
+    x = __atomic_exchange_n(&pl->track, track, __ATOMIC_SEQ_CST);
+    rig_post_release(x, &pl->collecting);
 }
 
 /*
@@ -284,17 +936,10 @@ void player_recue(struct player *pl)
 
 void player_set_track(struct player *pl, struct track *track)
 {
-    struct track *x;
-
     assert(track != NULL);
     assert(track->refcount > 0);
 
-    spin_lock(&pl->lock); /* Synchronise with the playback thread */
-    x = pl->track;
-    pl->track = track;
-    spin_unlock(&pl->lock);
-
-    track_put(x); /* discard the old track */
+    swap_track(pl, track);
 }
 
 /*
@@ -304,21 +949,13 @@ void player_set_track(struct player *pl, struct track *track)
 
 void player_clone(struct player *pl, const struct player *from)
 {
-    double elapsed;
-    struct track *x, *t;
-
-    elapsed = from->position - from->offset;
-    pl->offset = pl->position - elapsed;
+    struct track *t;
 
     t = from->track;
     track_get(t);
 
-    spin_lock(&pl->lock);
-    x = pl->track;
-    pl->track = t;
-    spin_unlock(&pl->lock);
-
-    track_put(x);
+    swap_track(pl, t);
+    send(pl, PLAYER_SEEK, player_get_elapsed(from));
 }
 
 /*
@@ -406,7 +1043,303 @@ void retarget(struct player *pl)
 
 void player_seek_to(struct player *pl, double seconds)
 {
-    pl->offset = pl->position - seconds;
+    send(pl, PLAYER_SEEK, seconds);
+}
+
+/*
+ * Seek to the given position ready to return from it later, as if
+ * playback had continued. Overrides an existing punch.
+ */
+
+void player_punch_in(struct player *pl, double seconds)
+{
+    send(pl, PLAYER_PUNCH_IN, seconds);
+}
+
+/*
+ * Return from a punch
+ */
+
+void player_punch_out(struct player *pl)
+{
+    send(pl, PLAYER_PUNCH_OUT, 0.0);
+}
+
+/*
+ * Apply a command from another thread
+ */
+
+static void apply(struct player *pl, const struct player_command *c)
+{
+    double e;
+
+    switch (c->type) {
+    case PLAYER_SEEK:
+        pl->offset = pl->position - c->seconds;
+        break;
+
+    case PLAYER_RECUE:
+        pl->offset = pl->position;
+        break;
+
+    case PLAYER_TOGGLE_TIMECODE:
+        pl->timecode_control = !pl->timecode_control;
+        if (pl->timecode_control)
+            pl->recalibrate = true;
+        break;
+
+    case PLAYER_PUNCH_IN:
+        e = pl->position - pl->offset;
+        if (pl->punch != NO_PUNCH)
+            e -= pl->punch;
+
+        pl->offset = pl->position - c->seconds;
+        pl->punch = c->seconds - e;
+        break;
+
+    case PLAYER_PUNCH_OUT:
+        if (pl->punch == NO_PUNCH)
+            break;
+
+        e = pl->position - pl->offset;
+        pl->offset = pl->position - (e - pl->punch);
+        pl->punch = NO_PUNCH;
+        break;
+    }
+}
+
+/*
+ * Return: the next command which is queued, or NULL if none
+ */
+
+static struct player_slot* peek_command(struct player *pl)
+{
+    unsigned int head;
+    struct player_slot *slot;
+
+    head = pl->command_head;
+    slot = &pl->command[head % PLAYER_COMMANDS];
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1)
+        return NULL;
+
+    return slot;
+}
+
+/*
+ * Remove the command returned by peek_command(), so its slot can be
+ * used again
+ */
+
+static void pop_command(struct player *pl, struct player_slot *slot)
+{
+    __atomic_store_n(&slot->sequence, pl->command_head + PLAYER_COMMANDS,
+                     __ATOMIC_RELEASE);
+    pl->command_head++;
+}
+
+/*
+ * A block of audio being built, which commands are applied within
+ */
+
+struct block {
+    const struct player_output *out;
+    unsigned int samples;
+    struct track *tr;
+    double pitch, start_volume, end_volume;
+    uint64_t start, end; /* time of the previous and of this block */
+};
+
+/*
+ * Return: the output of the block from sample s onwards
+ */
+
+static struct player_output output_from(const struct block *b,
+                                        unsigned int s)
+{
+    unsigned int c;
+    struct player_output o;
+
+    for (c = 0; c < PLAYER_CHANNELS; c++)
+        o.channel[c] = output(b->out, c, s);
+    o.stride = b->out->stride;
+
+    return o;
+}
+
+static double volume_at(const struct block *b, unsigned int s)
+{
+    return b->start_volume
+        + (b->end_volume - b->start_volume) * s / b->samples;
+}
+
+/*
+ * Return: the sample in the block at which a command made at time
+ *     'when' is applied, or b->samples if it is for the next block
+ *
+ * Commands made during the previous block are spread across this one
+ * in the same proportion; they are heard a block late, but their
+ * timing relative to each other is kept.
+ */
+
+static unsigned int command_offset(const struct block *b, uint64_t when)
+{
+    if (b->start == 0 || when <= b->start)
+        return 0;
+
+    if (when >= b->end)
+        return b->samples;
+
+    return (when - b->start) * b->samples / (b->end - b->start);
+}
+
+/*
+ * Build audio in the block from the current position, for the given
+ * range of samples
+ */
+
+static void build_range(struct player *pl, const struct block *b,
+                        unsigned int from, unsigned int to)
+{
+    struct player_output o;
+
+    if (to == from)
+        return;
+
+    o = output_from(b, from);
+    pl->position += pl->resampler->build(&o, to - from, pl->sample_dt, b->tr,
+                                         pl->position - pl->offset, b->pitch,
+                                         volume_at(b, from) * TRACK_SCALE,
+                                         volume_at(b, to) * TRACK_SCALE);
+}
+
+/*
+ * Crossfade from the given elapsed time to the current one, where
+ * the position has jumped at sample s
+ *
+ * Return: the sample after the crossfade
+ */
+
+static unsigned int crossfade(struct player *pl, const struct block *b,
+                              unsigned int s, double from)
+{
+    unsigned int n, c, f;
+    float old[MAX_FADE * PLAYER_CHANNELS];
+    struct player_output o, fade;
+
+    f = FADE_TIME / pl->sample_dt;
+    if (f > MAX_FADE)
+        f = MAX_FADE;
+    if (f > b->samples - s)
+        f = b->samples - s;
+    if (f == 0)
+        return s;
+
+    o = output_from(b, s);
+
+    fade.stride = PLAYER_CHANNELS;
+    for (c = 0; c < PLAYER_CHANNELS; c++)
+        fade.channel[c] = old + c;
+
+    pl->position += pl->resampler->build(&o, f, pl->sample_dt, b->tr,
+                                         pl->position - pl->offset, b->pitch,
+                                         0.0,
+                                         volume_at(b, s + f) * TRACK_SCALE);
+
+    (void)pl->resampler->build(&fade, f, pl->sample_dt, b->tr,
+                               from, b->pitch,
+                               volume_at(b, s) * TRACK_SCALE, 0.0);
+
+    for (n = 0; n < f; n++) {
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            *output(&o, c, n) += *output(&fade, c, n);
+    }
+
+    return s + f;
+}
+
+/*
+ * Build the block of audio, applying each command which is queued at
+ * its place in the block
+ */
+
+static void build_block(struct player *pl, const struct block *b)
+{
+    unsigned int s;
+    struct player_slot *slot;
+
+    s = 0;
+
+    while ((slot = peek_command(pl)) != NULL) {
+        unsigned int o;
+        double before;
+
+        o = command_offset(b, slot->command.when);
+        if (o >= b->samples)
+            break;
+
+        if (o < s) /* within a crossfade, or out of order */
+            o = s;
+
+        build_range(pl, b, s, o);
+        s = o;
+
+        before = pl->position - pl->offset;
+        apply(pl, &slot->command);
+        pop_command(pl, slot);
+
+        if (pl->position - pl->offset != before)
+            s = crossfade(pl, b, s, before);
+    }
+
+    build_range(pl, b, s, b->samples);
+}
+
+/*
+ * Account for the cost of building a block of audio, and change the
+ * resampler for the next block if need be
+ *
+ * A step down is soon after the load is too high, so that audio is
+ * not dropped; a step up waits for a length of time with headroom,
+ * which doubles each time a step up does not last.
+ */
+
+static void adapt(struct player *pl, double dt, uint64_t cost)
+{
+    if (dt == 0.0)
+        return;
+
+    pl->load += dt / (LOAD_RC + dt) * (cost * 1e-9 / dt - pl->load);
+    pl->since += dt;
+
+    if (pl->load < LOAD_LOW)
+        pl->quiet += dt;
+    else
+        pl->quiet = 0.0;
+
+    /* Let the measurement settle on the resampler now in use */
+
+    if (pl->since < LOAD_SETTLE)
+        return;
+
+    if (pl->load > LOAD_HIGH && pl->resampler > resamplers) {
+        if (pl->raised && pl->since < pl->wait) {
+            pl->wait *= 2;
+            if (pl->wait > WAIT_MAX)
+                pl->wait = WAIT_MAX;
+        }
+
+        pl->resampler--;
+        pl->raised = false;
+        pl->since = 0.0;
+        pl->quiet = 0.0;
+
+    } else if (pl->quiet >= pl->wait && pl->resampler < pl->chosen) {
+        pl->resampler++;
+        pl->raised = true;
+        pl->since = 0.0;
+        pl->quiet = 0.0;
+    }
 }
 
 /*
@@ -416,12 +1349,15 @@ void player_seek_to(struct player *pl, double seconds)
  * clock of playback is decoupled from the clock of the timecode
  * signal.
  *
- * Post: buffer at pcm is filled with the given number of samples
+ * Post: out is filled with the given number of samples, at a full
+ *     scale of 1.0
  */
 
-void player_collect(struct player *pl, signed short *pcm, unsigned samples)
+static void collect(struct player *pl, const struct player_output *out,
+                    unsigned samples)
 {
-    double r, pitch, dt, target_volume;
+    double dt, target_volume;
+    struct block b;
 
     dt = pl->sample_dt * samples;
 
@@ -450,19 +1386,69 @@ void player_collect(struct player *pl, signed short *pcm, unsigned samples)
     if (target_volume > 1.0)
         target_volume = 1.0;
 
+    b.out = out;
+    b.samples = samples;
+    b.start_volume = pl->volume;
+    b.end_volume = target_volume;
+    b.start = pl->collected;
+    b.end = stats_clock();
+
     /* Sync pitch is applied post-filtering */
 
-    pitch = pl->pitch * pl->sync_pitch;
+    b.pitch = pl->pitch * pl->sync_pitch;
 
-    if (!spin_try_lock(&pl->lock)) {
-        r = build_silence(pcm, samples, pl->sample_dt, pitch);
-    } else {
-        r = build_pcm(pcm, samples, pl->sample_dt, pl->track,
-                      pl->position - pl->offset, pitch,
-                      pl->volume, target_volume);
-        spin_unlock(&pl->lock);
-    }
+    /* The count is odd whilst the track is in use; this tells the
+     * rig when it is safe to release a track after a change. Never
+     * wait for the other threads */
+
+    __atomic_add_fetch(&pl->collecting, 1, __ATOMIC_SEQ_CST);
+
+    b.tr = __atomic_load_n(&pl->track, __ATOMIC_SEQ_CST);
+    build_block(pl, &b);
+
+    __atomic_add_fetch(&pl->collecting, 1, __ATOMIC_RELEASE);
+
+    adapt(pl, dt, stats_clock() - b.end);
 
-    pl->position += r;
     pl->volume = target_volume;
+    pl->collected = b.end;
+
+    publish(pl);
+}
+
+/*
+ * Get a block of audio, as collect(), interleaved
+ *
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+void player_collect(struct player *pl, float *pcm, unsigned samples)
+{
+    unsigned int c;
+    struct player_output out;
+
+    out.stride = PLAYER_CHANNELS;
+    for (c = 0; c < PLAYER_CHANNELS; c++)
+        out.channel[c] = pcm + c;
+
+    collect(pl, &out, samples);
+}
+
+/*
+ * Get a block of audio, as collect(), with a buffer for each channel
+ *
+ * Post: buffers at channel are filled with the given number of samples
+ */
+
+void player_collect_planar(struct player *pl, float *channel[PLAYER_CHANNELS],
+                           unsigned samples)
+{
+    unsigned int c;
+    struct player_output out;
+
+    out.stride = 1;
+    for (c = 0; c < PLAYER_CHANNELS; c++)
+        out.channel[c] = channel[c];
+
+    collect(pl, &out, samples);
 }
@@ -20,18 +20,83 @@
 #ifndef PLAYER_H
 #define PLAYER_H
 
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#include "spin.h"
+#include "cacheline.h"
 #include "track.h"
 
 #define PLAYER_CHANNELS 2
+#define PLAYER_COMMANDS 32 /* power of two */
+
+#define DEFAULT_RESAMPLER "cubic"
+
+#define NO_PUNCH (HUGE_VAL)
+
+/* Where audio is written: sample s of channel c is at
+ * channel[c][s * stride], so the same code writes to an interleaved
+ * buffer or to a separate buffer for each channel */
+
+struct player_output {
+    float *channel[PLAYER_CHANNELS];
+    unsigned int stride;
+};
+
+/* A method of resampling, selectable per deck */
+
+struct resampler {
+    const char *name, *desc;
+    void (*init)(void); /* optional, called before first use */
+    double (*build)(const struct player_output *out, unsigned samples,
+                    double sample_dt, struct track *tr, double position,
+                    double pitch, double start_vol, double end_vol);
+};
+
+/* A change to the playback, made by another thread. Commands are
+ * queued, and applied by the realtime thread in the next period, at
+ * the sample which corresponds to when they were made */
+
+struct player_command {
+    enum {
+        PLAYER_SEEK, /* to the given elapsed time */
+        PLAYER_RECUE,
+        PLAYER_TOGGLE_TIMECODE,
+        PLAYER_PUNCH_IN, /* to the given elapsed time */
+        PLAYER_PUNCH_OUT
+    } type;
+    double seconds;
+    uint64_t when; /* made, in ns; see stats_clock() */
+};
+
+struct player_slot {
+    unsigned int sequence;
+    struct player_command command;
+};
+
+/* The playback as seen by other threads; a copy is published by the
+ * realtime thread at the end of each period */
+
+struct player_state {
+    double position, /* seconds */
+        offset,
+        last_difference,
+        pitch,
+        sync_pitch,
+        load; /* share of the period spent building audio */
+    const struct resampler *resampler, /* in use */
+        *chosen;
+    bool timecode_control,
+        recalibrate;
+};
 
 struct player {
     double sample_dt;
 
-    spin lock;
-    struct track *track;
+    struct track *track; /* changed atomically */
+    unsigned int collecting; /* odd whilst the track is in use */
+    struct resampler *resampler, /* in use, the choice or cheaper */
+        *chosen;
 
     /* Current playback parameters */
 
@@ -48,27 +113,67 @@ struct player {
     struct timecoder *timecoder;
     bool timecode_control,
         recalibrate; /* re-sync offset at next opportunity */
+
+    /* Return from a punch, as the difference in elapsed time */
+
+    double punch;
+
+    /* Cost of building the audio, as a share of the period; the
+     * resampler is stepped down when it approaches the budget */
+
+    double load, /* smoothed */
+        wait, /* seconds of headroom needed to step up */
+        since, /* seconds since the resampler was changed */
+        quiet; /* seconds of headroom so far */
+    bool raised; /* the last change was a step up */
+
+    uint64_t collected; /* time of the previous block, or 0 */
+    unsigned int command_head; /* next to apply */
+
+    /* Everything above is the working state of the realtime thread;
+     * what follows is written by other threads, or read by them, so
+     * it is kept to cache lines of its own */
+
+    /* Commands from any thread, in a queue without locks */
+
+    unsigned int command_tail /* next to be added */
+        __attribute__ ((aligned(CACHE_LINE)));
+    struct player_slot command[PLAYER_COMMANDS];
+
+    /* Snapshot for other threads; see player_get_state() */
+
+    struct {
+        unsigned int sequence; /* odd whilst it is written */
+        struct player_state state;
+    } published __attribute__ ((aligned(CACHE_LINE)));
 };
 
 void player_init(struct player *pl, unsigned int sample_rate,
                  struct track *track, struct timecoder *timecoder);
 void player_clear(struct player *pl);
 
+struct resampler* player_find_resampler(const char *name);
+
 void player_set_timecoder(struct player *pl, struct timecoder *tc);
-void player_set_timecode_control(struct player *pl, bool on);
-bool player_toggle_timecode_control(struct player *pl);
+void player_set_resampler(struct player *pl, struct resampler *r);
+void player_toggle_timecode_control(struct player *pl);
 
 void player_set_track(struct player *pl, struct track *track);
 void player_clone(struct player *pl, const struct player *from);
 
-double player_get_position(struct player *pl);
-double player_get_elapsed(struct player *pl);
-double player_get_remain(struct player *pl);
+void player_get_state(const struct player *pl, struct player_state *s);
+double player_get_position(const struct player *pl);
+double player_get_elapsed(const struct player *pl);
+double player_get_remain(const struct player *pl);
 bool player_is_active(const struct player *pl);
 
 void player_seek_to(struct player *pl, double seconds);
 void player_recue(struct player *pl);
+void player_punch_in(struct player *pl, double seconds);
+void player_punch_out(struct player *pl);
 
-void player_collect(struct player *pl, signed short *pcm, unsigned samples);
+void player_collect(struct player *pl, float *pcm, unsigned samples);
+void player_collect_planar(struct player *pl, float *channel[PLAYER_CHANNELS],
+                           unsigned samples);
 
 #endif
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Track blocks are a power of two number of samples in size, between
+ * TRACK_BLOCK_SHIFT_MIN and TRACK_BLOCK_SHIFT_MAX, and track_bytes()
+ * doubles with them. So the pool is a buddy allocator over a single
+ * mapping, in units of the smallest block; a block of order k is
+ * 2^k units, and is split from, or merged back into, its buddy of the
+ * same order.
+ *
+ * The mapping is faulted in when it is created, and the pages stay
+ * resident as blocks are recycled, so a track loaded from the pool
+ * does not cause page faults when it is first played. It is on huge
+ * pages where the system allows.
+ */
+
+#define _GNU_SOURCE /* MAP_POPULATE, MAP_HUGETLB, MADV_HUGEPAGE */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "list.h"
+#include "mutex.h"
+#include "pool.h"
+#include "track.h"
+
+#define ORDERS (TRACK_BLOCK_SHIFT_MAX - TRACK_BLOCK_SHIFT_MIN + 1)
+#define UNIT_BYTES track_bytes(1 << TRACK_BLOCK_SHIFT_MIN)
+#define CHUNK_UNITS (1 << (ORDERS - 1)) /* a block of the largest size */
+
+#define NOT_FREE 0xff
+
+#define HUGE_PAGE_SHIFT 21 /* as POOL_HUGE_PAGE */
+
+static char *base = NULL;
+static size_t units, used,
+    map_bytes; /* of the mapping, a whole number of huge pages */
+static unsigned char *order; /* of each free block, by first unit */
+static struct list free_list[ORDERS];
+static mutex lock;
+
+/*
+ * Map the memory of the pool, on huge pages which are reserved if
+ * there are enough, otherwise on transparent huge pages if the kernel
+ * gives them
+ *
+ * Return: pointer to the memory, or MAP_FAILED on error
+ * Post: if not MAP_FAILED, the memory is faulted in
+ */
+
+static char* map_pool(size_t bytes)
+{
+    char *p;
+    size_t n, page;
+
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB
+             | HUGE_PAGE_SHIFT << MAP_HUGE_SHIFT, -1, 0);
+    if (p != MAP_FAILED) {
+        debug("pool is on reserved huge pages");
+        return p;
+    }
+
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return p;
+
+    if (madvise(p, bytes, MADV_HUGEPAGE) == -1)
+        debug("madvise: %s", strerror(errno));
+
+    /* Fault in the memory only now, so that it can be on huge pages */
+
+    page = sysconf(_SC_PAGESIZE);
+    for (n = 0; n < bytes; n += page)
+        p[n] = 0;
+
+    return p;
+}
+
+/*
+ * Create the pool, of up to the given size
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0, blocks are allocated from the pool
+ */
+
+int pool_init(size_t bytes)
+{
+    size_t n, chunks;
+    int k;
+
+    assert(base == NULL);
+
+    chunks = bytes / (UNIT_BYTES * CHUNK_UNITS);
+    if (chunks == 0) {
+        fprintf(stderr, "Pool must be at least %zuMb.\n",
+                UNIT_BYTES * CHUNK_UNITS / 1048576 + 1);
+        return -1;
+    }
+
+    units = chunks * CHUNK_UNITS;
+
+    order = malloc(units);
+    if (order == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    map_bytes = (units * UNIT_BYTES + POOL_HUGE_PAGE - 1)
+        / POOL_HUGE_PAGE * POOL_HUGE_PAGE;
+
+    base = map_pool(map_bytes);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        free(order);
+        base = NULL;
+        return -1;
+    }
+
+    for (k = 0; k < ORDERS; k++)
+        list_init(&free_list[k]);
+
+    for (n = 0; n < units; n++)
+        order[n] = NOT_FREE;
+
+    for (n = 0; n < units; n += CHUNK_UNITS) {
+        order[n] = ORDERS - 1;
+        list_add_tail((struct list*)(base + n * UNIT_BYTES),
+                      &free_list[ORDERS - 1]);
+    }
+
+    used = 0;
+    mutex_init(&lock);
+
+    fprintf(stderr, "Allocated %zuMb of memory for tracks\n",
+            units * UNIT_BYTES / 1048576);
+
+    return 0;
+}
+
+/*
+ * Pre: no blocks are allocated from the pool
+ */
+
+void pool_clear(void)
+{
+    if (base == NULL)
+        return;
+
+    if (used != 0)
+        debug("%zu units still in use", used);
+
+    mutex_clear(&lock);
+
+    if (munmap(base, map_bytes) == -1)
+        abort();
+
+    free(order);
+    base = NULL;
+}
+
+/*
+ * Return: order of a block of the given number of samples
+ */
+
+static int samples_order(unsigned int samples)
+{
+    int k;
+
+    k = __builtin_ctz(samples) - TRACK_BLOCK_SHIFT_MIN;
+    assert(k >= 0 && k < ORDERS);
+    assert(samples == 1U << (TRACK_BLOCK_SHIFT_MIN + k));
+
+    return k;
+}
+
+static size_t unit_of(const struct list *l)
+{
+    return ((const char*)l - base) / UNIT_BYTES;
+}
+
+static struct list* block_at(size_t unit)
+{
+    return (struct list*)(base + unit * UNIT_BYTES);
+}
+
+/*
+ * Take a block from the pool, which has room for the given number of
+ * samples and their meters, as track_bytes()
+ *
+ * Return: pointer to block, or NULL if the pool is empty or not used
+ */
+
+void* pool_alloc(unsigned int samples)
+{
+    int k, j;
+    size_t unit;
+    struct list *l;
+
+    if (base == NULL)
+        return NULL;
+
+    k = samples_order(samples);
+
+    mutex_lock(&lock);
+
+    for (j = k; j < ORDERS; j++) {
+        if (!list_empty(&free_list[j]))
+            break;
+    }
+
+    if (j == ORDERS) {
+        mutex_unlock(&lock);
+        return NULL;
+    }
+
+    l = free_list[j].next;
+    list_del(l);
+    unit = unit_of(l);
+    order[unit] = NOT_FREE;
+
+    /* Split down to the size needed, freeing the upper halves */
+
+    while (j > k) {
+        size_t buddy;
+
+        j--;
+        buddy = unit + (1 << j);
+        order[buddy] = j;
+        list_add(block_at(buddy), &free_list[j]);
+    }
+
+    used += 1 << k;
+
+    mutex_unlock(&lock);
+
+    return block_at(unit);
+}
+
+/*
+ * Return a block to the pool
+ *
+ * Return: false if the block was not allocated from the pool, and the
+ *     caller must free() it, otherwise true
+ */
+
+bool pool_free(void *block, unsigned int samples)
+{
+    int k;
+    size_t unit;
+
+    if (base == NULL || (char*)block < base
+        || (char*)block >= base + units * UNIT_BYTES)
+    {
+        return false;
+    }
+
+    k = samples_order(samples);
+    unit = unit_of(block);
+    assert(unit % (1 << k) == 0);
+
+    mutex_lock(&lock);
+
+    used -= 1 << k;
+
+    /* Merge with the buddy for as long as it is free */
+
+    while (k < ORDERS - 1) {
+        size_t buddy;
+
+        buddy = unit ^ (1 << k);
+        if (order[buddy] != k)
+            break;
+
+        list_del(block_at(buddy));
+        order[buddy] = NOT_FREE;
+
+        if (buddy < unit)
+            unit = buddy;
+        k++;
+    }
+
+    order[unit] = k;
+    list_add(block_at(unit), &free_list[k]);
+
+    mutex_unlock(&lock);
+
+    return true;
+}
+
+/*
+ * Post: *used and *total are the memory in use and size of the pool,
+ *     in bytes, or zero if there is no pool
+ */
+
+void pool_usage(size_t *u, size_t *total)
+{
+    if (base == NULL) {
+        *u = 0;
+        *total = 0;
+        return;
+    }
+
+    mutex_lock(&lock);
+    *u = used * UNIT_BYTES;
+    mutex_unlock(&lock);
+
+    *total = units * UNIT_BYTES;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Pool of memory for track blocks, allocated and faulted in once at
+ * startup and recycled between tracks
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int pool_init(size_t bytes);
+void pool_clear(void);
+
+/* Memory for blocks is on huge pages of this size where it can be,
+ * for fewer TLB misses as tracks are played */
+
+#define POOL_HUGE_PAGE (2 * 1048576)
+
+void* pool_alloc(unsigned int samples);
+bool pool_free(void *block, unsigned int samples);
+
+void pool_usage(size_t *used, size_t *total);
+
+#endif
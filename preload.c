@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stddef.h>
+
+#include "preload.h"
+#include "track.h"
+
+static unsigned int count = 0;
+
+/*
+ * Set the number of tracks to import ahead, or 0 for none
+ *
+ * Preloaded tracks are only kept if track_set_keep() allows it.
+ */
+
+void preload_set_count(unsigned int n)
+{
+    count = n;
+}
+
+/*
+ * Import the tracks at and following the given entry in a listing
+ *
+ * Each track is imported in the background, at the given sample
+ * rate, and kept once it is imported. The tracks closest to the given
+ * entry are the most recently used, so are the last to be evicted.
+ *
+ * Pre: rig lock is held
+ */
+
+void preload_listing(const struct listing *l, int from, const char *importer,
+                     unsigned int rate)
+{
+    size_t n, end;
+
+    if (count == 0 || from < 0)
+        return;
+
+    end = from + count;
+    if (end > l->entries)
+        end = l->entries;
+
+    /* Work backwards, so the nearest track is the most recently used
+     * and also the first to be imported */
+
+    for (n = end; n > (size_t)from; n--) {
+        struct track *t;
+
+        t = track_get_by_import(importer, l->record[n - 1]->pathname, rate,
+                                true);
+        if (t == NULL)
+            continue;
+
+        track_keep(t);
+        track_put(t);
+    }
+}
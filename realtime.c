@@ -17,8 +17,10 @@
  *
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -30,6 +32,9 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
+#define MIN_POLLFDS 8
+#define MAX_POLLFDS 1024
+
 /*
  * Raise the priority of the current thread
  *
@@ -65,18 +70,49 @@ static int raise_priority(int priority)
 }
 
 /*
- * The realtime thread
+ * Pin the current thread to the given CPU
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int set_affinity(int cpu)
+{
+    int r;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    r = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (r != 0) {
+        errno = r;
+        perror("pthread_setaffinity_np");
+        fprintf(stderr, "Failed to run realtime thread on CPU %d\n", cpu);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * A realtime thread
  */
 
-static void rt_main(struct rt *rt)
+static void rt_main(struct rt_thread *th)
 {
     int r;
     size_t n;
+    struct rt *rt = th->rt;
 
-    debug("%p", rt);
+    debug("%p", th);
 
     thread_to_realtime();
 
+    if (th->cpu != -1) {
+        if (set_affinity(th->cpu) == -1)
+            rt->finished = true;
+    }
+
     if (rt->priority != 0) {
         if (raise_priority(rt->priority) == -1)
             rt->finished = true;
@@ -85,8 +121,20 @@ static void rt_main(struct rt *rt)
     if (sem_post(&rt->sem) == -1)
         abort(); /* under our control; see sem_post(3) */
 
+    /* Wait until every thread is either ready, or has failed */
+
+    while (sem_wait(&rt->go) == -1) {
+        if (errno != EINTR)
+            abort();
+    }
+
+    /* Past the wait, so the semaphores can be destroyed */
+
+    if (sem_post(&rt->sem) == -1)
+        abort();
+
     while (!rt->finished) {
-        r = poll(rt->pt, rt->npt, -1);
+        r = poll(th->pt, th->npt, -1);
         if (r == -1) {
             if (errno == EINTR) {
                 continue;
@@ -96,11 +144,11 @@ static void rt_main(struct rt *rt)
             }
         }
 
-        for (n = 0; n < rt->nctl; n++)
-            controller_handle(rt->ctl[n]);
+        for (n = 0; n < th->nctl; n++)
+            controller_handle(th->ctl[n]);
 
-        for (n = 0; n < rt->ndv; n++)
-            device_handle(rt->dv[n]);
+        for (n = 0; n < th->ndv; n++)
+            device_handle(th->dv[n]);
     }
 }
 
@@ -116,12 +164,25 @@ static void* launch(void *p)
 
 void rt_init(struct rt *rt)
 {
+    size_t n;
+
     debug("%p", rt);
 
     rt->finished = false;
-    rt->ndv = 0;
-    rt->nctl = 0;
-    rt->npt = 0;
+
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        struct rt_thread *th = &rt->thread[n];
+
+        th->rt = rt;
+        th->cpu = -1;
+        th->launched = false;
+        th->ndv = 0;
+        th->dv = NULL;
+        th->nctl = 0;
+        th->ctl = NULL;
+        th->npt = 0;
+        th->pt = NULL;
+    }
 }
 
 /*
@@ -130,39 +191,71 @@ void rt_init(struct rt *rt)
 
 void rt_clear(struct rt *rt)
 {
+    size_t n;
+
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        struct rt_thread *th = &rt->thread[n];
+
+        free(th->dv);
+        free(th->ctl);
+        free(th->pt);
+    }
 }
 
 /*
- * Add a device to this realtime handler
+ * Pin a realtime thread to the given CPU
+ *
+ * Return: -1 if the thread is not valid, otherwise 0
+ */
+
+int rt_set_cpu(struct rt *rt, unsigned int thread, int cpu)
+{
+    if (thread >= ARRAY_SIZE(rt->thread)) {
+        fprintf(stderr, "Realtime thread %u is not valid\n", thread);
+        return -1;
+    }
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "CPU %d is not valid\n", cpu);
+        return -1;
+    }
+
+    rt->thread[thread].cpu = cpu;
+    return 0;
+}
+
+/*
+ * Add a device to be handled by the given realtime thread
+ *
+ * Devices which share a sound card clock are best handled by the
+ * same thread.
  *
  * Return: -1 if the device could not be added, otherwise 0
  * Post: if 0 is returned the device is added
  */
 
-int rt_add_device(struct rt *rt, struct device *dv)
+int rt_add_device(struct rt *rt, struct device *dv, unsigned int thread)
 {
-    ssize_t z;
+    struct device **p;
+    struct rt_thread *th;
 
-    debug("%p adding device %p", rt, dv);
+    debug("%p adding device %p to thread %u", rt, dv, thread);
 
-    if (rt->ndv == ARRAY_SIZE(rt->dv)) {
-        fprintf(stderr, "Too many audio devices\n");
+    if (thread >= ARRAY_SIZE(rt->thread)) {
+        fprintf(stderr, "Realtime thread %u is not valid\n", thread);
         return -1;
     }
 
-    /* The requested poll events never change, so populate the poll
-     * entry table before entering the realtime thread */
+    th = &rt->thread[thread];
 
-    z = device_pollfds(dv, &rt->pt[rt->npt], sizeof(rt->pt) - rt->npt);
-    if (z == -1) {
-        fprintf(stderr, "Device failed to return file descriptors.\n");
+    p = realloc(th->dv, sizeof *p * (th->ndv + 1));
+    if (p == NULL) {
+        perror("realloc");
         return -1;
     }
 
-    rt->npt += z;
-
-    rt->dv[rt->ndv] = dv;
-    rt->ndv++;
+    th->dv = p;
+    th->dv[th->ndv++] = dv;
 
     return 0;
 }
@@ -170,88 +263,235 @@ int rt_add_device(struct rt *rt, struct device *dv)
 /*
  * Add a controller to the realtime handler
  *
+ * Controllers are handled by the first realtime thread.
+ *
  * Return: -1 if the device could not be added, otherwise 0
  */
 
 int rt_add_controller(struct rt *rt, struct controller *c)
 {
-    ssize_t z;
+    struct controller **p;
+    struct rt_thread *th = &rt->thread[0];
 
     debug("%p adding controller %p", rt, c);
 
-    if (rt->nctl == ARRAY_SIZE(rt->ctl)) {
-        fprintf(stderr, "Too many controllers\n");
+    p = realloc(th->ctl, sizeof *p * (th->nctl + 1));
+    if (p == NULL) {
+        perror("realloc");
         return -1;
     }
 
-    /* Similar to adding a PCM device */
+    th->ctl = p;
+    th->ctl[th->nctl++] = c;
 
-    z = controller_pollfds(c, &rt->pt[rt->npt], sizeof(rt->pt) - rt->npt);
-    if (z == -1) {
-        fprintf(stderr, "Controller failed to return file descriptors.\n");
-        return -1;
+    return 0;
+}
+
+/*
+ * Fill the given poll table from the devices and controllers
+ *
+ * Return: the number of entries used, or -1 if they do not fit
+ */
+
+static ssize_t fill_pollfds(struct rt_thread *th, struct pollfd *pt, size_t z)
+{
+    size_t n, npt;
+    ssize_t r;
+
+    npt = 0;
+
+    for (n = 0; n < th->nctl; n++) {
+        r = controller_pollfds(th->ctl[n], &pt[npt], z - npt);
+        if (r == -1)
+            return -1;
+        npt += r;
     }
 
-    rt->npt += z;
-    rt->ctl[rt->nctl++] = c;
+    for (n = 0; n < th->ndv; n++) {
+        r = device_pollfds(th->dv[n], &pt[npt], z - npt);
+        if (r == -1)
+            return -1;
+        npt += r;
+    }
 
-    return 0;
+    return npt;
 }
 
 /*
- * Start realtime handling of the given devices
+ * Build the poll table for a realtime thread
  *
- * This forks the realtime thread if it is required (eg. ALSA). Some
- * devices (eg. JACK) start their own thread.
+ * The requested poll events never change, so the table is populated
+ * before entering the realtime thread. Devices keep pointers into the
+ * table, so it is not moved once it is filled.
  *
  * Return: -1 on error, otherwise 0
  */
 
-int rt_start(struct rt *rt, int priority)
+static int build_pollfds(struct rt_thread *th)
+{
+    size_t z;
+
+    assert(th->pt == NULL);
+
+    for (z = MIN_POLLFDS; z <= MAX_POLLFDS; z *= 2) {
+        ssize_t r;
+
+        th->pt = malloc(sizeof *th->pt * z);
+        if (th->pt == NULL) {
+            perror("malloc");
+            return -1;
+        }
+
+        r = fill_pollfds(th, th->pt, z);
+        if (r != -1) {
+            th->npt = r;
+            return 0;
+        }
+
+        free(th->pt);
+        th->pt = NULL;
+    }
+
+    fprintf(stderr, "Device failed to return file descriptors.\n");
+    return -1;
+}
+
+/*
+ * Wait for the launched realtime threads to finish
+ */
+
+static void join_threads(struct rt *rt)
 {
     size_t n;
 
-    assert(priority >= 0);
-    rt->priority = priority;
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        struct rt_thread *th = &rt->thread[n];
 
-    /* If there are any devices which returned file descriptors for
-     * poll() then launch the realtime thread to handle them */
+        if (!th->launched)
+            continue;
 
-    if (rt->npt > 0) {
-        int r;
+        if (pthread_join(th->ph, NULL) != 0)
+            abort();
+
+        th->launched = false;
+    }
+}
+
+/*
+ * Launch a thread for each set of devices which need one
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0, all threads are launched and waiting on rt->go
+ */
+
+static int launch_threads(struct rt *rt)
+{
+    size_t n;
 
-        fprintf(stderr, "Launching realtime thread to handle devices...\n");
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        int r;
+        struct rt_thread *th = &rt->thread[n];
 
-        if (sem_init(&rt->sem, 0, 0) == -1) {
-            perror("sem_init");
+        if (build_pollfds(th) == -1)
             return -1;
-        }
 
-        r = pthread_create(&rt->ph, NULL, launch, (void*)rt);
+        if (th->npt == 0)
+            continue;
+
+        fprintf(stderr, "Launching realtime thread %zu to handle devices...\n",
+                n);
+
+        r = pthread_create(&th->ph, NULL, launch, (void*)th);
         if (r != 0) {
             errno = r;
             perror("pthread_create");
-            if (sem_destroy(&rt->sem) == -1)
-                abort();
             return -1;
         }
 
+        th->launched = true;
+
         /* Wait for the realtime thread to declare it is initialised */
 
         if (sem_wait(&rt->sem) == -1)
             abort();
+
+        if (rt->finished)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Start realtime handling of the given devices
+ *
+ * This forks the realtime threads if they are required (eg. ALSA). Some
+ * devices (eg. JACK) start their own thread.
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int rt_start(struct rt *rt, int priority)
+{
+    size_t n, m;
+    int r;
+
+    assert(priority >= 0);
+    rt->priority = priority;
+
+    if (sem_init(&rt->sem, 0, 0) == -1) {
+        perror("sem_init");
+        return -1;
+    }
+
+    if (sem_init(&rt->go, 0, 0) == -1) {
+        perror("sem_init");
         if (sem_destroy(&rt->sem) == -1)
             abort();
+        return -1;
+    }
+
+    /* If there are any devices which returned file descriptors for
+     * poll() then launch realtime threads to handle them; they do not
+     * poll until all are ready, as a failed start cannot wake them */
 
-        if (rt->finished) {
-            if (pthread_join(rt->ph, NULL) != 0)
+    r = launch_threads(rt);
+    if (r == -1)
+        rt->finished = true;
+
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        if (rt->thread[n].launched) {
+            if (sem_post(&rt->go) == -1)
                 abort();
-            return -1;
         }
     }
 
-    for (n = 0; n < rt->ndv; n++)
-        device_start(rt->dv[n]);
+    /* Each thread must be past sem_wait() before it is destroyed */
+
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        if (rt->thread[n].launched) {
+            while (sem_wait(&rt->sem) == -1) {
+                if (errno != EINTR)
+                    abort();
+            }
+        }
+    }
+
+    if (r == -1)
+        join_threads(rt);
+
+    if (sem_destroy(&rt->go) == -1)
+        abort();
+    if (sem_destroy(&rt->sem) == -1)
+        abort();
+
+    if (r == -1)
+        return -1;
+
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        for (m = 0; m < rt->thread[n].ndv; m++)
+            device_start(rt->thread[n].dv[m]);
+    }
 
     return 0;
 }
@@ -262,17 +502,16 @@ int rt_start(struct rt *rt, int priority)
 
 void rt_stop(struct rt *rt)
 {
-    size_t n;
+    size_t n, m;
 
     rt->finished = true;
 
     /* Stop audio rolling on devices */
 
-    for (n = 0; n < rt->ndv; n++)
-        device_stop(rt->dv[n]);
-
-    if (rt->npt > 0) {
-        if (pthread_join(rt->ph, NULL) != 0)
-            abort();
+    for (n = 0; n < ARRAY_SIZE(rt->thread); n++) {
+        for (m = 0; m < rt->thread[n].ndv; m++)
+            device_stop(rt->thread[n].dv[m]);
     }
+
+    join_threads(rt);
 }
@@ -25,25 +25,39 @@
 #include <semaphore.h>
 #include <stdbool.h>
 
+#define RT_MAX_THREADS 4
+
 /*
- * State data for the realtime thread, maintained during rt_start and
- * rt_stop
+ * A realtime thread, with its own set of devices and poll entries
  */
 
-struct rt {
+struct rt_thread {
     pthread_t ph;
-    sem_t sem;
-    bool finished;
-    int priority;
+    struct rt *rt;
+    int cpu; /* or -1 for any */
+    bool launched;
 
     size_t ndv;
-    struct device *dv[3];
+    struct device **dv;
 
     size_t nctl;
-    struct controller *ctl[3];
+    struct controller **ctl;
 
     size_t npt;
-    struct pollfd pt[32];
+    struct pollfd *pt; /* filled in by rt_start() */
+};
+
+/*
+ * State data for the realtime threads, maintained during rt_start and
+ * rt_stop
+ */
+
+struct rt {
+    sem_t sem, go;
+    bool finished;
+    int priority;
+
+    struct rt_thread thread[RT_MAX_THREADS];
 };
 
 int rt_global_init();
@@ -52,7 +66,8 @@ void rt_not_allowed();
 void rt_init(struct rt *rt);
 void rt_clear(struct rt *rt);
 
-int rt_add_device(struct rt *rt, struct device *dv);
+int rt_set_cpu(struct rt *rt, unsigned int thread, int cpu);
+int rt_add_device(struct rt *rt, struct device *dv, unsigned int thread);
 int rt_add_controller(struct rt *rt, struct controller *c);
 
 int rt_start(struct rt *rt, int priority);
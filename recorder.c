@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+#define MASK (RECORDER_FRAMES - 1)
+#define FRAME (DEVICE_CHANNELS * sizeof(float)) /* bytes */
+
+#define HEADER 58 /* bytes */
+#define INTERVAL 100 /* ms */
+#define ALIGN 4096
+
+static void le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void le32(unsigned char *p, uint32_t v)
+{
+    le16(p, v & 0xffff);
+    le16(p + 2, v >> 16);
+}
+
+/*
+ * Write the header of a WAV file of 32-bit float samples
+ *
+ * The sizes in the header are 32-bit, so a file which is too large
+ * has them saturate; most software reads to the end of the file
+ * regardless. Samples are written as they are, so in the byte order
+ * WAV expects only on a little-endian host.
+ */
+
+static int write_header(struct recorder *r)
+{
+    unsigned char h[HEADER];
+    uint64_t bytes;
+    uint32_t frames, data;
+
+    bytes = r->written * FRAME;
+    if (bytes > UINT32_MAX - HEADER)
+        bytes = (UINT32_MAX - HEADER) / FRAME * FRAME;
+    data = bytes;
+    frames = bytes / FRAME;
+
+    memcpy(h, "RIFF", 4);
+    le32(h + 4, HEADER - 8 + data);
+    memcpy(h + 8, "WAVE", 4);
+
+    memcpy(h + 12, "fmt ", 4);
+    le32(h + 16, 18);
+    le16(h + 20, 3); /* IEEE float */
+    le16(h + 22, DEVICE_CHANNELS);
+    le32(h + 24, r->rate);
+    le32(h + 28, r->rate * FRAME);
+    le16(h + 32, FRAME);
+    le16(h + 34, 32);
+    le16(h + 36, 0);
+
+    memcpy(h + 38, "fact", 4);
+    le32(h + 42, 4);
+    le32(h + 46, frames);
+
+    memcpy(h + 50, "data", 4);
+    le32(h + 54, data);
+
+    if (pwrite(r->fd, h, sizeof h, 0) != sizeof h) {
+        perror("pwrite");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write what is in the ring to the file
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int drain(struct recorder *r)
+{
+    size_t head, tail, n;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    tail = r->tail;
+
+    while (tail != head) {
+        const char *p;
+        size_t z;
+        ssize_t w;
+
+        /* Up to the end of the ring at most, so that each write is
+         * large and contiguous */
+
+        n = head - tail;
+        if (n > RECORDER_FRAMES - (tail & MASK))
+            n = RECORDER_FRAMES - (tail & MASK);
+
+        p = (const char*)&r->ring[(tail & MASK) * DEVICE_CHANNELS];
+        z = n * FRAME;
+
+        while (z > 0) {
+            w = write(r->fd, p, z);
+            if (w == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("write");
+                return -1;
+            }
+            p += w;
+            z -= w;
+        }
+
+        r->written += n;
+        tail += n;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/*
+ * The thread which writes to the file until recorder_clear()
+ *
+ * After an error the ring is no longer emptied, and the realtime
+ * thread counts the audio it is unable to add.
+ */
+
+static void* launch(void *p)
+{
+    struct recorder *r = p;
+    struct pollfd pe;
+
+    pe.fd = r->stop[0];
+    pe.events = POLLIN;
+
+    for (;;) {
+        int z;
+
+        z = poll(&pe, 1, INTERVAL);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return NULL;
+        }
+
+        if (drain(r) == -1) {
+            fprintf(stderr, "Recording to %s has stopped.\n", r->pathname);
+            return NULL;
+        }
+
+        if (z > 0)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Start recording to the given file, which is replaced
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int recorder_init(struct recorder *r, const char *pathname, unsigned int rate)
+{
+    int e;
+
+    r->pathname = pathname;
+    r->rate = rate;
+    r->head = 0;
+    r->tail = 0;
+    r->written = 0;
+
+    e = posix_memalign((void**)&r->ring, ALIGN, RECORDER_FRAMES * FRAME);
+    if (e != 0) {
+        errno = e;
+        perror("posix_memalign");
+        return -1;
+    }
+
+    r->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (r->fd == -1) {
+        perror(pathname);
+        goto fail;
+    }
+
+    /* The header is written again with the correct sizes at the
+     * end */
+
+    if (write_header(r) == -1)
+        goto fail_fd;
+
+    if (lseek(r->fd, HEADER, SEEK_SET) == -1) {
+        perror("lseek");
+        goto fail_fd;
+    }
+
+    if (pipe(r->stop) == -1) {
+        perror("pipe");
+        goto fail_fd;
+    }
+
+    if (pthread_create(&r->ph, NULL, launch, r)) {
+        perror("pthread_create");
+        goto fail_pipe;
+    }
+
+    return 0;
+
+ fail_pipe:
+    if (close(r->stop[1]) == -1)
+        abort();
+    if (close(r->stop[0]) == -1)
+        abort();
+ fail_fd:
+    if (close(r->fd) == -1)
+        abort();
+ fail:
+    free(r->ring);
+    return -1;
+}
+
+/*
+ * Finish the recording
+ *
+ * Pre: the realtime thread is no longer adding to the recorder
+ */
+
+void recorder_clear(struct recorder *r)
+{
+    if (close(r->stop[1]) == -1) /* wakes the thread */
+        abort();
+
+    if (pthread_join(r->ph, NULL) != 0)
+        abort();
+
+    if (close(r->stop[0]) == -1)
+        abort();
+
+    (void)write_header(r);
+
+    if (close(r->fd) == -1)
+        perror("close");
+
+    free(r->ring);
+}
+
+/*
+ * Reserve space in the ring for the given number of frames
+ *
+ * Return: false if there is not space, otherwise true
+ */
+
+static inline bool reserve(struct recorder *r, size_t n)
+{
+    size_t tail;
+
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return (r->head + n - tail <= RECORDER_FRAMES);
+}
+
+/*
+ * Add audio to the recording
+ *
+ * A buffer which does not fit is not recorded at all, rather than
+ * in part, so that the gap is at a boundary the device also saw.
+ *
+ * Return: false if the audio was not recorded, otherwise true
+ */
+
+bool recorder_add(struct recorder *r, const float *pcm, size_t n)
+{
+    size_t s, a;
+
+    if (!reserve(r, n))
+        return false;
+
+    s = r->head & MASK;
+    a = RECORDER_FRAMES - s;
+    if (a > n)
+        a = n;
+
+    memcpy(&r->ring[s * DEVICE_CHANNELS], pcm, a * FRAME);
+    memcpy(r->ring, pcm + a * DEVICE_CHANNELS, (n - a) * FRAME);
+
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Add audio to the recording, as recorder_add(), from a buffer for
+ * each channel
+ */
+
+bool recorder_add_planar(struct recorder *r,
+                         float *pcm[DEVICE_CHANNELS], size_t n)
+{
+    size_t s;
+
+    if (!reserve(r, n))
+        return false;
+
+    for (s = 0; s < n; s++) {
+        float *f;
+        unsigned int c;
+
+        f = &r->ring[((r->head + s) & MASK) * DEVICE_CHANNELS];
+        for (c = 0; c < DEVICE_CHANNELS; c++)
+            f[c] = pcm[c][s];
+    }
+
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+    return true;
+}
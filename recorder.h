@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Record the audio of a deck to a file, without blocking the
+ * realtime thread
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cacheline.h"
+#include "device.h"
+
+#define RECORDER_FRAMES 262144 /* power of two; a few seconds of audio */
+
+/* The realtime thread adds to the head of the ring, and the writer
+ * thread takes from the tail. Each is the only writer of its own
+ * index, so neither side needs a lock */
+
+struct recorder {
+    int fd, stop[2]; /* pipe to ask the writer to finish */
+    const char *pathname;
+    unsigned int rate;
+    pthread_t ph;
+
+    float *ring; /* interleaved */
+    size_t head; /* in frames, and only ever increases */
+
+    /* Written by the writer thread, on a cache line apart from the
+     * head */
+
+    size_t tail /* in frames, as the head */
+        __attribute__ ((aligned(CACHE_LINE)));
+    uint64_t written; /* used by the writer thread only */
+};
+
+int recorder_init(struct recorder *r, const char *pathname, unsigned int rate);
+void recorder_clear(struct recorder *r);
+
+/* Functions used by the realtime thread */
+
+bool recorder_add(struct recorder *r, const float *pcm, size_t npcm);
+bool recorder_add_planar(struct recorder *r,
+                         float *pcm[DEVICE_CHANNELS], size_t npcm);
+
+#endif
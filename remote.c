@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE /* strsep() */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "library.h"
+#include "remote.h"
+#include "rig.h"
+#include "stats.h"
+#include "xwax.h"
+
+#define LINE 512
+#define POLL 1000 /* ms between polls of the statistics */
+
+static int fd, stop[2]; /* pipe to ask the thread to finish */
+static struct library *library;
+static pthread_t ph;
+
+/*
+ * Return: the deck given as the next argument, or NULL if not valid
+ */
+
+static struct deck* parse_deck(char **args)
+{
+    char *s, *endptr;
+    unsigned long n;
+
+    s = strsep(args, " ");
+    if (s == NULL || *s == '\0') {
+        fputs("Command needs a deck number.\n", stderr);
+        return NULL;
+    }
+
+    n = strtoul(s, &endptr, 10);
+    if (*endptr != '\0' || n < 1 || n > ndeck) {
+        fprintf(stderr, "'%s' is not a deck.\n", s);
+        return NULL;
+    }
+
+    return &deck[n - 1];
+}
+
+/*
+ * Load the first record in the library which matches the search
+ */
+
+static void load(struct deck *d, const char *search)
+{
+    struct listing matches;
+
+    listing_init(&matches);
+
+    if (listing_match_index(&library->all.by_artist, &matches, search,
+                            &library->index) == 0)
+    {
+        if (matches.entries == 0) {
+            fprintf(stderr, "No record matches '%s'.\n", search);
+        } else {
+            fprintf(stderr, "Loading '%s'.\n", matches.record[0]->pathname);
+            deck_load(d, matches.record[0]);
+        }
+    }
+
+    listing_clear(&matches);
+}
+
+/*
+ * Carry out a single command
+ *
+ * Pre: lock is held
+ */
+
+static void command(char *line)
+{
+    char *name;
+    struct deck *d;
+
+    name = strsep(&line, " ");
+
+    if (*name == '\0') {
+        return;
+
+    } else if (!strcmp(name, "load")) {
+        d = parse_deck(&line);
+        if (d == NULL)
+            return;
+        if (line == NULL || *line == '\0') {
+            fputs("load needs a search.\n", stderr);
+            return;
+        }
+        load(d, line);
+
+    } else if (!strcmp(name, "recue")) {
+        d = parse_deck(&line);
+        if (d != NULL)
+            deck_recue(d);
+
+    } else if (!strcmp(name, "quit")) {
+        (void)rig_quit();
+
+    } else {
+        fprintf(stderr, "'%s' command is unknown.\n", name);
+    }
+}
+
+/*
+ * The thread which takes commands, one to a line, until the end of
+ * the stream; and in place of the display, polls the statistics until
+ * remote_stop()
+ */
+
+static void* launch(void *p)
+{
+    char line[LINE], *start, *end;
+    size_t fill;
+    int in;
+
+    fill = 0;
+    in = fd;
+
+    for (;;) {
+        int r;
+        ssize_t z;
+        struct pollfd pe[2];
+
+        pe[0].fd = in; /* ignored once negative */
+        pe[0].events = POLLIN;
+        pe[1].fd = stop[0];
+        pe[1].events = POLLIN;
+
+        r = poll(pe, 2, POLL);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (pe[1].revents != 0)
+            break;
+
+        rig_lock(); /* status as reported by the rig */
+        stats_poll();
+        rig_unlock();
+
+        if (r == 0)
+            continue;
+
+        z = read(fd, line + fill, sizeof line - fill - 1);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            break;
+        }
+
+        if (z == 0) { /* no more commands */
+            in = -1;
+            continue;
+        }
+
+        fill += z;
+        line[fill] = '\0';
+
+        rig_lock();
+
+        start = line;
+        for (;;) {
+            end = strchr(start, '\n');
+            if (end == NULL)
+                break;
+
+            *end = '\0';
+            command(start);
+            start = end + 1;
+        }
+
+        rig_unlock();
+
+        fill -= start - line;
+        memmove(line, start, fill);
+
+        /* A line which fills the buffer is too long to be a command */
+
+        if (fill == sizeof line - 1) {
+            fputs("Ignoring a command which is too long.\n", stderr);
+            fill = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Take commands from the given file descriptor, one to a line:
+ *
+ *   load <deck> <search>   load the first record which matches
+ *   recue <deck>           return to the start of the track
+ *   quit                   exit the program
+ *
+ * Decks are numbered from 1, in the order they were given.
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int remote_start(struct library *lib, int f)
+{
+    fd = f;
+    library = lib;
+
+    if (pipe(stop) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    if (pthread_create(&ph, NULL, launch, NULL)) {
+        perror("pthread_create");
+        if (close(stop[1]) == -1)
+            abort();
+        if (close(stop[0]) == -1)
+            abort();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Synchronise with the thread taking commands and exit
+ */
+
+void remote_stop(void)
+{
+    if (close(stop[1]) == -1) /* wakes the thread */
+        abort();
+
+    if (pthread_join(ph, NULL) != 0)
+        abort();
+
+    if (close(stop[0]) == -1)
+        abort();
+}
@@ -20,12 +20,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 
+#include "controller.h"
+#include "library.h"
 #include "list.h"
 #include "mutex.h"
 #include "realtime.h"
@@ -34,12 +37,64 @@
 #define EVENT_WAKE 0
 #define EVENT_QUIT 1
 
+#define RELEASE_INTERVAL 10 /* ms */
+#define MAX_EVENTS 32 /* per call to epoll_wait(); others follow */
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
-static int event[2]; /* pipe to wake up service thread */
-static struct list tracks = LIST_INIT(tracks);
+/* A track which is to be released once a realtime reader is done
+ * with it; see rig_post_release() */
+
+struct release {
+    struct list rig;
+    struct track *track;
+    const unsigned int *busy;
+    unsigned int seen;
+};
+
+static int event[2], /* pipe to wake up service thread */
+    epfd;
+static struct list tracks = LIST_INIT(tracks),
+    unwatched = LIST_INIT(unwatched), /* importing, but not in epfd */
+    queued = LIST_INIT(queued), /* waiting to import, in order */
+    releases = LIST_INIT(releases),
+    controllers = LIST_INIT(controllers); /* to write the output of */
+static unsigned int nimports, /* tracks in the two lists above */
+    max_imports = 0; /* or 0 for no limit */
+static struct library *library = NULL; /* following changes to its files */
 mutex lock;
 
+/*
+ * Add a file descriptor to the set the rig waits on
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int watch(int fd, void *ptr)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Remove a file descriptor which was added by watch()
+ */
+
+static void unwatch(int fd)
+{
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+        abort();
+}
+
 int rig_init()
 {
     /* Create a pipe which will be used to wake us from other threads */
@@ -58,21 +113,147 @@ int rig_init()
         return -1;
     }
 
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        goto fail;
+    }
+
+    /* The event pipe is the only entry without a track, other than
+     * the library; see rig_watch_library() */
+
+    if (watch(event[0], NULL) == -1) {
+        if (close(epfd) == -1)
+            abort();
+        goto fail;
+    }
+
     mutex_init(&lock);
 
     return 0;
+
+ fail:
+    if (close(event[1]) == -1)
+        abort();
+    if (close(event[0]) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Return: true if the reader has finished with the track
+ */
+
+static bool is_released(const struct release *r)
+{
+    unsigned int busy;
+
+    busy = __atomic_load_n(r->busy, __ATOMIC_SEQ_CST);
+    return (r->seen & 1) == 0 || busy != r->seen;
 }
 
+/*
+ * Release the tracks which nobody is using any more
+ *
+ * Pre: lock is held
+ */
+
+static void handle_releases(bool all)
+{
+    struct release *r, *x;
+
+    list_for_each_safe(r, x, &releases, rig) {
+        if (!all && !is_released(r))
+            continue;
+
+        list_del(&r->rig);
+        track_put(r->track);
+        free(r);
+    }
+}
+
+/*
+ * Pre: realtime thread is not running
+ */
+
 void rig_clear()
 {
+    handle_releases(true);
     mutex_clear(&lock);
 
+    if (close(epfd) == -1)
+        abort();
     if (close(event[0]) == -1)
         abort();
     if (close(event[1]) == -1)
         abort();
 }
 
+/*
+ * Limit the number of imports which run at any one time
+ *
+ * Other tracks are queued until an import finishes.
+ */
+
+void rig_set_max_imports(unsigned int n)
+{
+    max_imports = n;
+}
+
+/*
+ * Begin the import of a track which was queued
+ *
+ * Pre: lock is held
+ * Post: track is not queued
+ */
+
+static void start_import(struct track *t)
+{
+    list_del(&t->rig);
+
+    if (track_start_import(t) == -1) {
+        track_put(t);
+        return;
+    }
+
+    if (watch(t->fd, t) == 0)
+        list_add(&t->rig, &tracks);
+    else
+        list_add(&t->rig, &unwatched);
+
+    nimports++;
+}
+
+/*
+ * Start queued imports, up to the limit
+ *
+ * Tracks wanted in the foreground go first, in the order they were
+ * asked for. Otherwise the most recent request goes first, as it is
+ * likely to be the most relevant.
+ *
+ * Pre: lock is held
+ */
+
+static void schedule(void)
+{
+    while (!list_empty(&queued)
+           && (max_imports == 0 || nimports < max_imports))
+    {
+        struct track *t, *next;
+
+        next = list_entry(queued.prev, struct track, rig);
+
+        list_for_each(t, &queued, rig) {
+            if (!t->background) {
+                next = t;
+                break;
+            }
+        }
+
+        start_import(next);
+    }
+}
+
 /*
  * Main thread which handles input and output
  *
@@ -88,49 +269,73 @@ void rig_clear()
 
 int rig_main()
 {
-    struct pollfd pt[4];
-    const struct pollfd *px = pt + ARRAY_SIZE(pt);
-
-    /* Monitor event pipe from external threads */
-
-    pt[0].fd = event[0];
-    pt[0].revents = 0;
-    pt[0].events = POLLIN;
-
     mutex_lock(&lock);
 
     for (;;) { /* exit via EVENT_QUIT */
-        int r;
-        struct pollfd *pe;
+        int r, n, timeout;
+        bool wake, changes;
+        struct epoll_event ev[MAX_EVENTS];
         struct track *track, *xtrack;
-
-        pe = &pt[1];
-
-        /* Do our best if we run out of poll entries */
-
-        list_for_each(track, &tracks, rig) {
-            if (pe == px)
-                break;
-            track_pollfd(track, pe);
-            pe++;
+        struct controller *c;
+
+        /* There is no event to say when a track can be released, when
+         * an unwatched import has audio, or when a controller has
+         * output, so check back regularly */
+
+        if (list_empty(&releases) && list_empty(&unwatched)
+            && list_empty(&controllers))
+        {
+            timeout = -1;
+        } else {
+            timeout = RELEASE_INTERVAL;
         }
 
         mutex_unlock(&lock);
 
-        r = poll(pt, pe - pt, -1);
+        r = epoll_wait(epfd, ev, ARRAY_SIZE(ev), timeout);
         if (r == -1) {
             if (errno == EINTR) {
                 mutex_lock(&lock);
                 continue;
             } else {
-                perror("poll");
+                perror("epoll_wait");
                 return -1;
             }
         }
 
+        /* Output to the controllers is written here, so that the
+         * realtime thread does not wait on it */
+
+        list_for_each(c, &controllers, rig)
+            controller_flush(c);
+
+        /* Import audio without holding the lock, so that other
+         * threads are not held up by a long import. The rig holds a
+         * reference on each of these tracks until it is complete, and
+         * it alone changes the lists of them */
+
+        wake = false;
+        changes = false;
+
+        for (n = 0; n < r; n++) {
+            if (ev[n].data.ptr == NULL) {
+                wake = true;
+            } else if (ev[n].data.ptr == __atomic_load_n(&library,
+                                                         __ATOMIC_ACQUIRE))
+            {
+                library_read_changes(library);
+                changes = true;
+            } else {
+                track_import(ev[n].data.ptr);
+            }
+        }
+
+        list_for_each(track, &unwatched, rig)
+            track_import(track);
+
         /* Process all events on the event pipe */
 
-        if (pt[0].revents != 0) {
+        if (wake) {
             for (;;) {
                 char e;
                 size_t z;
@@ -160,14 +365,67 @@ int rig_main()
 
         mutex_lock(&lock);
 
-        list_for_each_safe(track, xtrack, &tracks, rig)
+        if (changes)
+            (void)library_apply_changes(library);
+
+        list_for_each_safe(track, xtrack, &tracks, rig) {
+            if (track->finished) {
+                unwatch(track->fd);
+                nimports--;
+            }
+            track_handle(track);
+        }
+
+        list_for_each_safe(track, xtrack, &unwatched, rig) {
+            if (track->finished)
+                nimports--;
             track_handle(track);
+        }
+
+        schedule();
+
+        handle_releases(false);
     }
  finish:
 
     return 0;
 }
 
+/*
+ * Follow changes to the files of the library, if it is watching them
+ *
+ * The library is changed with the lock held. This can be called from
+ * another thread whilst the rig is running, once.
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int rig_watch_library(struct library *lib)
+{
+    if (lib->inotify == -1)
+        return 0;
+
+    __atomic_store_n(&library, lib, __ATOMIC_RELEASE);
+
+    if (watch(lib->inotify, lib) == -1) {
+        __atomic_store_n(&library, NULL, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the output of a controller on behalf of the realtime thread
+ *
+ * Pre: rig_main() is not running
+ */
+
+void rig_watch_controller(struct controller *c)
+{
+    list_add_tail(&c->rig, &controllers);
+}
+
 /*
  * Post a simple event into the rig event loop
  */
@@ -204,12 +462,73 @@ void rig_unlock(void)
 }
 
 /*
- * Add a track to be handled until import has completed
+ * Add a track to be imported, and handled until import has completed
+ *
+ * Pre: lock is held
  */
 
 void rig_post_track(struct track *t)
 {
+    assert(t->queued);
+
     track_get(t);
-    list_add(&t->rig, &tracks);
+    list_add_tail(&t->rig, &queued);
+    post_event(EVENT_WAKE); /* to schedule() */
+}
+
+/*
+ * Abandon a track which is queued and no longer wanted
+ *
+ * Pre: lock is held
+ * Post: caller does not hold reference on track
+ */
+
+void rig_cancel_track(struct track *t)
+{
+    assert(t->queued);
+
+    list_del(&t->rig);
+    t->queued = false;
+    track_put(t);
+}
+
+/*
+ * Release a track once the realtime thread is no longer using it
+ *
+ * The reader increments the counter at busy before it begins to use
+ * the track, and again when it is done, so the count is odd whilst the
+ * track may be in use. A reader which begins after this call must not
+ * see the track.
+ *
+ * Pre: lock is held
+ * Post: caller does not hold reference on track
+ */
+
+void rig_post_release(struct track *t, const unsigned int *busy)
+{
+    struct release *r, wait;
+
+    r = malloc(sizeof *r);
+    if (r == NULL) {
+        perror("malloc");
+        r = &wait;
+    }
+
+    r->track = t;
+    r->busy = busy;
+    r->seen = __atomic_load_n(busy, __ATOMIC_SEQ_CST);
+
+    if (r == &wait) {
+
+        /* Wait for the reader here, at worst for one period of audio */
+
+        while (!is_released(r))
+            sched_yield();
+
+        track_put(t);
+        return;
+    }
+
+    list_add(&r->rig, &releases);
     post_event(EVENT_WAKE);
 }
@@ -22,6 +22,9 @@
 
 #include "track.h"
 
+struct controller;
+struct library;
+
 int rig_init();
 void rig_clear();
 
@@ -32,6 +35,12 @@ int rig_quit();
 void rig_lock();
 void rig_unlock();
 
+void rig_set_max_imports(unsigned int n);
+int rig_watch_library(struct library *lib);
+void rig_watch_controller(struct controller *c);
+
 void rig_post_track(struct track *t);
+void rig_cancel_track(struct track *t);
+void rig_post_release(struct track *t, const unsigned int *busy);
 
 #endif
@@ -215,7 +215,10 @@ static struct listing* initial(struct selector *sel)
 
 void selector_init(struct selector *sel, struct library *lib)
 {
+    size_t n;
+
     sel->library = lib;
+    sel->generation = lib->generation;
 
     scroll_reset(&sel->records);
     scroll_reset(&sel->crates);
@@ -227,20 +230,21 @@ void selector_init(struct selector *sel, struct library *lib)
     sel->search[0] = '\0';
     sel->search_len = 0;
 
-    listing_init(&sel->listing_a);
-    listing_init(&sel->listing_b);
-    sel->view_listing = &sel->listing_a;
-    sel->swap_listing = &sel->listing_b;
+    for (n = 0; n < SELECTOR_SEARCH; n++)
+        listing_init(&sel->result[n]);
+    sel->view_listing = initial(sel);
+    sel->base = 0;
 
-    (void)listing_copy(initial(sel), sel->view_listing);
     scroll_set_entries(&sel->records, sel->view_listing->entries);
 }
 
 
 void selector_clear(struct selector *sel)
 {
-    listing_clear(&sel->listing_a);
-    listing_clear(&sel->listing_b);
+    size_t n;
+
+    for (n = 0; n < SELECTOR_SEARCH; n++)
+        listing_clear(&sel->result[n]);
 }
 
 
@@ -322,17 +326,71 @@ void selector_bottom(struct selector *sel)
 }
 
 
+/* Fill the result for the current search from the crate. Results of
+ * shorter searches are now out of date. Without a search, the crate's
+ * own listing is used, so a change of crate or order is cheap. A
+ * search with a range of tempo starts from just that range of the
+ * crate's listing by tempo. */
+
+static void rematch(struct selector *sel)
+{
+    struct crate *c;
+
+    sel->base = sel->search_len;
+
+    if (sel->search_len == 0) {
+        sel->view_listing = initial(sel);
+        return;
+    }
+
+    sel->view_listing = &sel->result[sel->search_len];
+
+    if (sel->sort != SORT_PLAYLIST) {
+        c = sel->library->crate[sel->crates.selected];
+        if (listing_match_bpm(&c->by_bpm, sel->view_listing, sel->search,
+                              &sel->library->index, sel->sort) != 1)
+        {
+            return;
+        }
+    }
+
+    (void)listing_match_index(initial(sel), sel->view_listing, sel->search,
+                              &sel->library->index);
+}
+
+
 /* When the crate has changed, update the current listing to reflect
  * the crate and the search criteria */
 
 static void crate_has_changed(struct selector *sel)
 {
-    (void)listing_match(initial(sel), sel->view_listing, sel->search);
+    rematch(sel);
     scroll_set_entries(&sel->records, sel->view_listing->entries);
     retain_position(sel);
 }
 
 
+/*
+ * Follow any change to the library since the last update
+ *
+ * Pre: library is not being changed by another thread
+ * Return: true if the listing was changed, otherwise false
+ */
+
+bool selector_update(struct selector *sel)
+{
+    if (sel->generation == sel->library->generation)
+        return false;
+
+    /* Crates are added as the library is loaded */
+
+    sel->generation = sel->library->generation;
+    scroll_set_entries(&sel->crates, sel->library->crates);
+    crate_has_changed(sel);
+    return true;
+}
+
+
 void selector_prev(struct selector *sel)
 {
     scroll_up(&sel->crates, 1);
@@ -376,7 +434,8 @@ void selector_toggle_order(struct selector *sel)
 }
 
 
-/* Expand the search. Do not disrupt the running process on memory
+/* Expand the search. The result of the shorter search is usually
+ * still to hand. Do not disrupt the running process on memory
  * allocation failure, leave the view listing incomplete */
 
 void selector_search_expand(struct selector *sel)
@@ -385,7 +444,14 @@ void selector_search_expand(struct selector *sel)
         return;
 
     sel->search[--sel->search_len] = '\0';
-    crate_has_changed(sel);
+
+    if (sel->search_len < sel->base || sel->search_len == 0)
+        rematch(sel);
+    else
+        sel->view_listing = &sel->result[sel->search_len];
+
+    scroll_set_entries(&sel->records, sel->view_listing->entries);
+    retain_position(sel);
 }
 
 
@@ -394,19 +460,31 @@ void selector_search_expand(struct selector *sel)
 
 void selector_search_refine(struct selector *sel, char key)
 {
-    struct listing *tmp;
+    struct listing *prev;
+    bool ranged;
 
     if (sel->search_len >= sizeof(sel->search) - 1) /* would overflow */
         return;
 
+    /* A range of tempo which is being typed changes, rather than
+     * narrows, what matches */
+
+    ranged = listing_ends_in_range(sel->search);
+
     sel->search[sel->search_len] = key;
     sel->search[++sel->search_len] = '\0';
 
-    (void)listing_match(sel->view_listing, sel->swap_listing, sel->search);
+    if (ranged || listing_ends_in_range(sel->search)) {
+        rematch(sel);
+        scroll_set_entries(&sel->records, sel->view_listing->entries);
+        set_target(sel);
+        return;
+    }
 
-    tmp = sel->view_listing;
-    sel->view_listing = sel->swap_listing;
-    sel->swap_listing = tmp;
+    prev = sel->view_listing;
+    sel->view_listing = &sel->result[sel->search_len];
+    (void)listing_match_index(prev, sel->view_listing, sel->search,
+                              &sel->library->index);
 
     scroll_set_entries(&sel->records, sel->view_listing->entries);
     set_target(sel);
@@ -34,12 +34,16 @@ struct scroll {
     int lines, offset, entries, selected;
 };
 
+#define SELECTOR_SEARCH 256 /* bytes, including terminator */
+
 struct selector {
     struct library *library;
+    unsigned int generation; /* of the library, when last matched */
     struct listing
         *view_listing, /* base_listing + search filter applied */
-        *swap_listing, /* used to swap between a and b listings */
-        listing_a, listing_b;
+        result[SELECTOR_SEARCH]; /* for each length of search string,
+                                  * except none */
+    size_t base; /* results from here to search_len are current */
 
     struct scroll records, crates;
     bool toggled;
@@ -47,13 +51,14 @@ struct selector {
     struct record *target;
 
     size_t search_len;
-    char search[256];
+    char search[SELECTOR_SEARCH];
 };
 
 void selector_init(struct selector *sel, struct library *lib);
 void selector_clear(struct selector *sel);
 
 void selector_set_lines(struct selector *sel, unsigned int lines);
+bool selector_update(struct selector *sel);
 
 void selector_up(struct selector *sel);
 void selector_down(struct selector *sel);
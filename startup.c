@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Each phase is given a slot as it begins, and a thread fills in only
+ * the slots of its own phases. The report is made by a thread which
+ * has seen the end of every phase, so no lock is needed.
+ */
+
+#define _GNU_SOURCE /* gettid() */
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "startup.h"
+#include "stats.h"
+
+#define MAX_PHASES 128
+
+struct phase {
+    const char *name, *detail; /* detail may be NULL */
+    uint64_t start, end; /* ns, see stats_clock(); end is 0 if running */
+    long thread;
+};
+
+static struct phase phase[MAX_PHASES];
+static unsigned int phases;
+static uint64_t epoch;
+
+/*
+ * Start the clock which phases are reported against
+ */
+
+void startup_init(void)
+{
+    epoch = stats_clock();
+    phases = 0;
+}
+
+/*
+ * The name and detail are kept, not copied
+ *
+ * Return: handle of a phase which is now beginning, to give to
+ *     startup_end()
+ */
+
+int startup_begin(const char *name, const char *detail)
+{
+    unsigned int n;
+    struct phase *p;
+
+    n = __atomic_fetch_add(&phases, 1, __ATOMIC_RELAXED);
+    if (n >= MAX_PHASES)
+        return -1; /* not reported */
+
+    p = &phase[n];
+    p->thread = syscall(SYS_gettid);
+    p->end = 0;
+    p->name = name;
+    p->detail = detail;
+    p->start = stats_clock();
+
+    return n;
+}
+
+void startup_end(int n)
+{
+    if (n == -1)
+        return;
+
+    phase[n].end = stats_clock();
+}
+
+/*
+ * Return: the time in milliseconds from the epoch
+ */
+
+static double ms(uint64_t t)
+{
+    return (t - epoch) / 1e6;
+}
+
+/*
+ * Write a string so that it can be quoted, in JSON
+ */
+
+static void escape(FILE *f, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*s >= ' ')
+            fputc(*s, f);
+    }
+}
+
+/*
+ * Write the phases in the trace event format used by Chrome, which
+ * shows the phases of each thread alongside one another
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int write_trace(const char *pathname, unsigned int n)
+{
+    unsigned int i;
+    const char *sep;
+    FILE *f;
+
+    f = fopen(pathname, "w");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    fputs("{\"traceEvents\":[", f);
+    sep = "\n";
+
+    for (i = 0; i < n; i++) {
+        const struct phase *p = &phase[i];
+
+        if (p->end == 0)
+            continue;
+
+        fprintf(f, "%s{\"name\":\"", sep);
+        escape(f, p->name);
+        if (p->detail != NULL) {
+            fputc(' ', f);
+            escape(f, p->detail);
+        }
+        fprintf(f, "\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,"
+                "\"ts\":%.0f,\"dur\":%.0f}",
+                (long)getpid(), p->thread,
+                ms(p->start) * 1000, (p->end - p->start) / 1e3);
+        sep = ",\n";
+    }
+
+    fputs("\n]}\n", f);
+
+    if (fclose(f) == EOF) {
+        perror("fclose");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Print the phases of startup, and write them to a trace file
+ *
+ * Pre: the end of every phase is visible to this thread
+ */
+
+void startup_report(const char *pathname)
+{
+    unsigned int n, i;
+
+    n = __atomic_load_n(&phases, __ATOMIC_RELAXED);
+    if (n > MAX_PHASES)
+        n = MAX_PHASES;
+
+    fprintf(stderr, "Startup took %.1fms:\n", ms(stats_clock()));
+
+    for (i = 0; i < n; i++) {
+        const struct phase *p = &phase[i];
+
+        if (p->end == 0)
+            continue;
+
+        fprintf(stderr, "  %8.1fms %8.1fms  %s%s%s\n",
+                ms(p->start), (p->end - p->start) / 1e6, p->name,
+                p->detail != NULL ? " " : "",
+                p->detail != NULL ? p->detail : "");
+    }
+
+    if (pathname != NULL && write_trace(pathname, n) == 0)
+        fprintf(stderr, "Startup trace written to %s\n", pathname);
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * The realtime threads only count; nothing is printed from them. A
+ * thread which is not realtime polls the counters, and reports on
+ * each second to the status line and, if one is given, a file.
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "status.h"
+
+#define MAX_STATS 16
+#define PERIOD 1000000000 /* ns between reports */
+
+static struct stats *source[MAX_STATS],
+    before[MAX_STATS]; /* as of the previous report */
+static size_t nsources = 0;
+static uint64_t reported = 0; /* time of the previous report */
+static const char *file = NULL;
+
+/*
+ * Add the counters of a device to those reported
+ *
+ * Return: -1 if there are too many, otherwise 0
+ * Post: if 0, counters are initialised
+ */
+
+int stats_register(struct stats *s)
+{
+    if (nsources == MAX_STATS) {
+        fprintf(stderr, "Too many devices to keep statistics on.\n");
+        return -1;
+    }
+
+    memset(s, '\0', sizeof *s);
+    before[nsources] = *s;
+    source[nsources++] = s;
+
+    return 0;
+}
+
+/*
+ * Write the report to the given file, which is replaced each time
+ */
+
+void stats_set_file(const char *path)
+{
+    file = path;
+}
+
+/*
+ * Take a copy of counters which are being written
+ */
+
+static void read_stats(struct stats *copy, const struct stats *s)
+{
+    size_t n;
+
+    copy->handles = __atomic_load_n(&s->handles, __ATOMIC_RELAXED);
+    copy->handle_ns = __atomic_load_n(&s->handle_ns, __ATOMIC_RELAXED);
+    copy->collect_ns = __atomic_load_n(&s->collect_ns, __ATOMIC_RELAXED);
+    copy->submit_ns = __atomic_load_n(&s->submit_ns, __ATOMIC_RELAXED);
+
+    for (n = 0; n < STATS_BUCKETS; n++) {
+        copy->duration[n] = __atomic_load_n(&s->duration[n], __ATOMIC_RELAXED);
+        copy->interval[n] = __atomic_load_n(&s->interval[n], __ATOMIC_RELAXED);
+    }
+
+    copy->xruns = __atomic_load_n(&s->xruns, __ATOMIC_RELAXED);
+    copy->underruns = __atomic_load_n(&s->underruns, __ATOMIC_RELAXED);
+    copy->unrecorded = __atomic_load_n(&s->unrecorded, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return: the upper bound, in microseconds, of the highest bucket of
+ * a histogram with any entries since the previous report
+ */
+
+static unsigned int worst(const uint32_t now[], const uint32_t then[])
+{
+    int n;
+
+    for (n = STATS_BUCKETS - 1; n >= 0; n--) {
+        if (now[n] != then[n])
+            return 1 << n;
+    }
+
+    return 0;
+}
+
+static void print_histogram(FILE *f, const char *name, const uint32_t now[],
+                            const uint32_t then[])
+{
+    size_t n;
+
+    fprintf(f, "  %-9s", name);
+
+    for (n = 0; n < STATS_BUCKETS; n++)
+        fprintf(f, " %u", now[n] - then[n]);
+
+    fputc('\n', f);
+}
+
+/*
+ * Print the report for one device, over the given number of seconds
+ */
+
+static void print(FILE *f, size_t n, const struct stats *now,
+                  const struct stats *then, double seconds)
+{
+    uint64_t handles;
+    double mean, interval;
+    unsigned int w;
+
+    handles = now->handles - then->handles;
+
+    if (handles > 0) {
+        mean = (now->handle_ns - then->handle_ns) / 1e3 / handles;
+        interval = seconds * 1e6 / handles;
+    } else {
+        mean = 0.0;
+        interval = 0.0;
+    }
+
+    w = worst(now->duration, then->duration);
+
+    fprintf(f, "device %zu: %.1f/s, handle %.1fus mean, <%uus worst",
+            n, handles / seconds, mean, w);
+
+    if (interval > 0.0)
+        fprintf(f, " (%.0f%% of the interval)", 100.0 * w / interval);
+
+    fprintf(f, ", collect %.1fus, submit %.1fus, xruns %u, underruns %u,"
+            " unrecorded %u\n",
+            handles ? (now->collect_ns - then->collect_ns) / 1e3 / handles : 0,
+            handles ? (now->submit_ns - then->submit_ns) / 1e3 / handles : 0,
+            now->xruns - then->xruns, now->underruns - then->underruns,
+            now->unrecorded - then->unrecorded);
+
+    print_histogram(f, "duration", now->duration, then->duration);
+    print_histogram(f, "interval", now->interval, then->interval);
+}
+
+/*
+ * Write the report to the file, replacing it in one step so that a
+ * reader never sees it incomplete
+ */
+
+static void write_file(const struct stats now[], double seconds)
+{
+    size_t n;
+    char *tmp;
+    FILE *f;
+
+    if (asprintf(&tmp, "%s.tmp", file) == -1) {
+        perror("asprintf");
+        return;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        free(tmp);
+        return;
+    }
+
+    fprintf(f, "# histograms in powers of two, from <1us\n");
+
+    for (n = 0; n < nsources; n++)
+        print(f, n, &now[n], &before[n], seconds);
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+    } else if (rename(tmp, file) == -1) {
+        perror("rename");
+    }
+
+    free(tmp);
+}
+
+/*
+ * Report on the devices, if it is time to do so
+ *
+ * Pre: not called from a realtime thread
+ */
+
+void stats_poll(void)
+{
+    size_t n;
+    uint64_t t;
+    double seconds;
+    struct stats now[MAX_STATS];
+
+    t = stats_clock();
+    if (reported != 0 && t - reported < PERIOD)
+        return;
+
+    if (reported == 0) {
+        for (n = 0; n < nsources; n++)
+            read_stats(&before[n], source[n]);
+        reported = t;
+        return;
+    }
+
+    seconds = (t - reported) / 1e9;
+
+    for (n = 0; n < nsources; n++) {
+        unsigned int x, u;
+
+        read_stats(&now[n], source[n]);
+
+        x = now[n].xruns - before[n].xruns;
+        u = now[n].underruns - before[n].underruns;
+
+        if (x > 0 || u > 0) {
+            status_printf(STATUS_ERROR, "Device %zu: %u xruns and %u underruns"
+                          " in the last %.0f seconds", n, x, u, seconds);
+        }
+
+        x = now[n].unrecorded - before[n].unrecorded;
+
+        if (x > 0) {
+            status_printf(STATUS_ERROR, "Device %zu: %u buffers not recorded"
+                          " in the last %.0f seconds", n, x, seconds);
+        }
+    }
+
+    if (file != NULL)
+        write_file(now, seconds);
+
+    for (n = 0; n < nsources; n++)
+        before[n] = now[n];
+
+    reported = t;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Timing of the realtime work on each device
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_BUCKETS 16 /* powers of two, from 1us */
+
+/* Counters which only ever increase. They are written by the one
+ * realtime thread which handles the device, without locks, and read
+ * by another thread which takes the difference over some time */
+
+struct stats {
+    uint64_t handles, /* calls to handle the device */
+        handle_ns, collect_ns, submit_ns; /* total time spent */
+    uint32_t duration[STATS_BUCKETS], /* of each handle */
+        interval[STATS_BUCKETS]; /* from the start of the previous */
+    uint32_t xruns, underruns,
+        unrecorded; /* buffers which did not fit in the recorder */
+
+    uint64_t start, last; /* used by the realtime thread only */
+};
+
+int stats_register(struct stats *s);
+void stats_set_file(const char *path);
+void stats_poll(void);
+
+/* Functions used by the realtime thread */
+
+static inline uint64_t stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* There is only one writer, so a relaxed store is enough for a reader
+ * to never see a torn value */
+
+static inline void stats_add(uint64_t *x, uint64_t v)
+{
+    __atomic_store_n(x, *x + v, __ATOMIC_RELAXED);
+}
+
+static inline void stats_count(uint32_t *x)
+{
+    __atomic_store_n(x, *x + 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int stats_bucket(uint64_t ns)
+{
+    unsigned int b;
+    uint64_t us;
+
+    us = ns / 1000;
+    if (us == 0)
+        return 0;
+
+    b = 64 - __builtin_clzll(us);
+    if (b >= STATS_BUCKETS)
+        b = STATS_BUCKETS - 1;
+
+    return b;
+}
+
+static inline void stats_handle_start(struct stats *s)
+{
+    s->start = stats_clock();
+
+    if (s->last != 0)
+        stats_count(&s->interval[stats_bucket(s->start - s->last)]);
+
+    s->last = s->start;
+}
+
+static inline void stats_handle_end(struct stats *s)
+{
+    uint64_t ns;
+
+    ns = stats_clock() - s->start;
+
+    stats_add(&s->handles, 1);
+    stats_add(&s->handle_ns, ns);
+    stats_count(&s->duration[stats_bucket(ns)]);
+}
+
+static inline void stats_xrun(struct stats *s)
+{
+    stats_count(&s->xruns);
+}
+
+static inline void stats_underrun(struct stats *s)
+{
+    stats_count(&s->underruns);
+}
+
+static inline void stats_unrecorded(struct stats *s)
+{
+    stats_count(&s->unrecorded);
+}
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "player.h"
+#include "synth.h"
+#include "timecoder.h"
+#include "track.h"
+
+#define RATE 48000
+#define PERIOD 256 /* samples */
+#define PERIODS 2000
+#define LENGTH (44100 * 80)
+
+#define SIGNAL (RATE * 20) /* samples of synthesised timecode */
+#define OFFSET 100000 /* cycles into the timecode */
+
+#define MAX_RESULTS 64
+#define REGRESSION 1.2 /* slower than the baseline by this is a failure */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+static const char *resamplers[] = { "linear", "cubic", "sinc" };
+static const double pitches[] = { 1.0, 1.08, 2.0, -4.0, 8.0 };
+
+static const char *timecodes[] = { "serato_2a", "traktor_a" };
+static const double speeds[] = { 1.0, -1.0, 0.5, 2.0 };
+
+static struct result {
+    char name[64];
+    double ns; /* per frame */
+} results[MAX_RESULTS];
+
+static size_t nresults = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        abort();
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Cache misses are counted by the kernel where it allows; otherwise
+ * they are not reported
+ */
+
+static int misses = -1;
+
+static void misses_init(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, '\0', sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    misses = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (misses == -1)
+        perror("perf_event_open (cache misses not counted)");
+}
+
+static void misses_start(void)
+{
+    if (misses == -1)
+        return;
+
+    ioctl(misses, PERF_EVENT_IOC_RESET, 0);
+    ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/*
+ * Return: cache misses since misses_start(), or -1 if not known
+ */
+
+static long long misses_stop(void)
+{
+    long long count;
+
+    if (misses == -1)
+        return -1;
+
+    ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(misses, &count, sizeof count) != sizeof count)
+        return -1;
+
+    return count;
+}
+
+/*
+ * Record and print the result of one benchmark
+ */
+
+static void report(const char *name, double elapsed, unsigned long frames,
+                   long long count, const char *note)
+{
+    struct result *r;
+
+    assert(nresults < MAX_RESULTS);
+    r = &results[nresults++];
+
+    snprintf(r->name, sizeof r->name, "%s", name);
+    r->ns = elapsed * 1e9 / frames;
+
+    printf("%-28s %8.1f", r->name, r->ns);
+
+    if (count == -1)
+        printf(" %12s", "-");
+    else
+        printf(" %12.3f", (double)count / frames);
+
+    printf("  %s\n", note);
+}
+
+/*
+ * Return: a track of the given length filled with noise
+ */
+
+static struct track* synthesise_track(unsigned int length)
+{
+    unsigned int n, s;
+    static struct track tr;
+
+    tr.refcount = 2; /* never released */
+    tr.rate = 44100;
+    tr.blocks = track_block(length - 1, &s) + 1;
+
+    for (n = 0; n < tr.blocks; n++) {
+        tr.block[n] = malloc(track_bytes(track_block_samples(n)));
+        if (tr.block[n] == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (s = 0; s < length; s++) {
+        signed short *pcm;
+
+        pcm = track_get_sample(&tr, s);
+        pcm[0] = rand() % 65536 - 32768;
+        pcm[1] = rand() % 65536 - 32768;
+    }
+
+    tr.length = length;
+    return &tr;
+}
+
+/*
+ * Time player_collect() over a number of periods. With a scratch, the
+ * pitch is swung back and forth on each period, as a hand would
+ */
+
+static void bench_player(struct track *tr, const char *resampler,
+                         double pitch, bool scratch)
+{
+    unsigned int p;
+    char name[64];
+    double start, elapsed;
+    long long count;
+    float pcm[PERIOD * PLAYER_CHANNELS];
+    struct player pl;
+    struct resampler *r;
+    static struct timecoder tc; /* not used */
+
+    r = player_find_resampler(resampler);
+    assert(r != NULL);
+
+    track_get(tr);
+    player_init(&pl, RATE, tr, &tc);
+    player_set_resampler(&pl, r);
+    pl.timecode_control = false;
+    player_seek_to(&pl, 30.0);
+    pl.pitch = pitch;
+
+    misses_start();
+    start = now();
+
+    for (p = 0; p < PERIODS; p++) {
+        if (scratch)
+            pl.pitch = pitch * sin(2 * M_PI * p * PERIOD / (RATE / 4));
+
+        player_collect(&pl, pcm, PERIOD);
+    }
+
+    elapsed = now() - start;
+    count = misses_stop();
+
+    if (scratch)
+        snprintf(name, sizeof name, "player-%s-scratch", resampler);
+    else
+        snprintf(name, sizeof name, "player-%s-%.2f", resampler, pitch);
+
+    report(name, elapsed, (unsigned long)PERIODS * PERIOD, count, "");
+
+    player_clear(&pl);
+}
+
+/*
+ * Synthesise a timecode signal played at the given speed, starting
+ * at cycle OFFSET
+ *
+ * Return: the cycle of the timecode at the end of the signal
+ */
+
+static unsigned int synthesise_timecode(signed short *pcm,
+                                        struct timecode_def *def,
+                                        double speed)
+{
+    unsigned int s, cycles;
+    double phase;
+    struct synth synth;
+
+    cycles = fabs(speed) * SIGNAL * def->resolution / RATE + 2;
+
+    if (synth_init(&synth, def, OFFSET + cycles) == -1)
+        exit(EXIT_FAILURE);
+
+    /* Begin at the far end when going backwards, so the signal stays
+     * within the cycles prepared */
+
+    phase = speed > 0 ? OFFSET : OFFSET + cycles - 1;
+
+    for (s = 0; s < SIGNAL; s++) {
+        synth_sample(&synth, phase, &pcm[s * TIMECODER_CHANNELS]);
+        phase += speed * def->resolution / RATE;
+    }
+
+    synth_clear(&synth);
+    return phase;
+}
+
+/*
+ * Time timecoder_submit() on a synthesised signal, and check that it
+ * was decoded to where the signal ended
+ */
+
+static void bench_timecoder(const char *timecode, double speed)
+{
+    unsigned int s, end;
+    signed int position;
+    char name[64];
+    const char *note;
+    double start, elapsed;
+    long long count;
+    signed short *pcm;
+    struct timecode_def *def;
+    struct timecoder tc;
+
+    def = timecoder_find_definition(timecode);
+    assert(def != NULL);
+
+    pcm = malloc(sizeof(signed short) * SIGNAL * TIMECODER_CHANNELS);
+    if (pcm == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    end = synthesise_timecode(pcm, def, speed);
+    timecoder_init(&tc, def, 1.0, RATE);
+
+    misses_start();
+    start = now();
+
+    for (s = 0; s < SIGNAL; s += PERIOD)
+        timecoder_submit(&tc, pcm + s * TIMECODER_CHANNELS, PERIOD);
+
+    elapsed = now() - start;
+    count = misses_stop();
+
+    /* Going backwards, the code last read ends at the other side of
+     * its bits. Allow for the cycle still being read */
+
+    if (speed < 0)
+        end += def->bits - 1;
+
+    position = timecoder_get_position(&tc, NULL);
+    if (position == -1)
+        note = "no position";
+    else if (abs(position - (signed int)end) > 2)
+        note = "wrong position";
+    else
+        note = "";
+
+    snprintf(name, sizeof name, "timecoder-%s-%.2f", timecode, speed);
+    report(name, elapsed, SIGNAL, count, note);
+
+    timecoder_clear(&tc);
+    free(pcm);
+}
+
+/*
+ * Write the results as a baseline for a later run
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int write_baseline(const char *pathname)
+{
+    size_t n;
+    FILE *f;
+
+    f = fopen(pathname, "w");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    for (n = 0; n < nresults; n++)
+        fprintf(f, "%s %f\n", results[n].name, results[n].ns);
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Compare the results against a baseline
+ *
+ * Return: -1 on error, otherwise the number of regressions
+ */
+
+static int compare_baseline(const char *pathname)
+{
+    int regressions;
+    char name[64];
+    double ns;
+    FILE *f;
+
+    f = fopen(pathname, "r");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    regressions = 0;
+
+    while (fscanf(f, "%63s %lf", name, &ns) == 2) {
+        size_t n;
+
+        for (n = 0; n < nresults; n++) {
+            if (strcmp(results[n].name, name) != 0)
+                continue;
+
+            printf("%-28s %+7.1f%%", name, 100.0 * (results[n].ns / ns - 1));
+
+            if (results[n].ns > ns * REGRESSION) {
+                printf("  regression");
+                regressions++;
+            }
+
+            putchar('\n');
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-w <baseline>] [-c <baseline>]\n", argv0);
+}
+
+/*
+ * Benchmark of the realtime work: resampling in the player, and
+ * decoding of timecode. Times are per frame (one sample on every
+ * channel) of audio at the device.
+ *
+ * With "-w", write the results to a baseline file. With "-c", compare
+ * against a baseline file and fail if any result is slower by more
+ * than a given margin.
+ */
+
+int main(int argc, char *argv[])
+{
+    int c, r;
+    unsigned int n, m;
+    const char *write = NULL, *compare = NULL;
+    struct track *tr;
+
+    while ((c = getopt(argc, argv, "w:c:")) != -1) {
+        switch (c) {
+        case 'w':
+            write = optarg;
+            break;
+        case 'c':
+            compare = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    misses_init();
+    tr = synthesise_track(LENGTH);
+
+    /* Build the lookup tables up front, so they are not timed */
+
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        if (timecoder_find_definition(timecodes[n]) == NULL)
+            return EXIT_FAILURE;
+    }
+
+    printf("%-28s %8s %12s\n", "name", "ns/frame", "misses/frame");
+
+    for (n = 0; n < ARRAY_SIZE(resamplers); n++) {
+        for (m = 0; m < ARRAY_SIZE(pitches); m++)
+            bench_player(tr, resamplers[n], pitches[m], false);
+
+        bench_player(tr, resamplers[n], 4.0, true);
+    }
+
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        for (m = 0; m < ARRAY_SIZE(speeds); m++)
+            bench_timecoder(timecodes[n], speeds[m]);
+    }
+
+    timecoder_free_lookup();
+
+    if (write != NULL && write_baseline(write) == -1)
+        return EXIT_FAILURE;
+
+    if (compare != NULL) {
+        putchar('\n');
+        r = compare_baseline(compare);
+        if (r != 0)
+            return EXIT_FAILURE;
+    }
+
+    if (misses != -1)
+        close(misses);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Tests of the tempo found for synthesised beats
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bpm.h"
+#include "track.h"
+
+#define RATE 11025
+#define SECONDS 90
+
+/*
+ * Return: white noise, from -1.0 to 1.0
+ */
+
+static double noise(unsigned int *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (double)(*state >> 1) / 0x3fffffff - 1.0;
+}
+
+/*
+ * Synthesise a drum pattern: kick on every beat, snare on the second
+ * and fourth, and a hi-hat on every half beat
+ */
+
+static void synthesise(signed short *pcm, size_t samples, double bpm,
+                       double offset)
+{
+    size_t s;
+    unsigned int state;
+
+    state = 1;
+
+    for (s = 0; s < samples; s++) {
+        double t, beat, at, x;
+        unsigned int n;
+
+        t = (double)s / RATE + offset;
+        beat = t * bpm / 60.0;
+        n = floor(beat);
+        at = (beat - n) * 60.0 / bpm; /* seconds since the beat */
+
+        x = 0.6 * sin(2.0 * M_PI * 55.0 * at) * exp(-at * 20.0);
+
+        if (n % 2 == 1)
+            x += 0.3 * noise(&state) * exp(-at * 30.0);
+
+        at = fmod(beat, 0.5) * 60.0 / bpm;
+        x += 0.1 * noise(&state) * exp(-at * 200.0);
+
+        x += 0.02 * noise(&state);
+
+        pcm[s * TRACK_CHANNELS] = x * 32767;
+        pcm[s * TRACK_CHANNELS + 1] = x * 32767;
+    }
+}
+
+/*
+ * Check the tempo found for a pattern, given in uneven parts as the
+ * audio of an import is
+ *
+ * Where a pattern could be at either tempo, the one nearer 120BPM is
+ * expected.
+ */
+
+static void test(double bpm, double offset, double expect)
+{
+    size_t samples, s, z;
+    signed short *pcm;
+    struct bpm b;
+    double r;
+
+    samples = (size_t)RATE * SECONDS;
+    pcm = malloc(sizeof *pcm * samples * TRACK_CHANNELS);
+    assert(pcm != NULL);
+
+    synthesise(pcm, samples, bpm, offset);
+
+    assert(bpm_init(&b, RATE) == 0);
+
+    for (s = 0; s < samples; s += z) {
+        z = rand() % 5000;
+        if (z > samples - s)
+            z = samples - s;
+        assert(bpm_add(&b, pcm + s * TRACK_CHANNELS, z) == 0);
+    }
+
+    r = bpm_result(&b);
+    printf("%.2fBPM: found %.3fBPM\n", bpm, r);
+    assert(fabs(r - expect) < 0.01);
+
+    bpm_clear(&b);
+    free(pcm);
+}
+
+/*
+ * Audio which is too short, or has no beat, has no tempo
+ */
+
+static void test_none(void)
+{
+    size_t s;
+    unsigned int state;
+    struct bpm b;
+    signed short pcm[RATE * TRACK_CHANNELS];
+
+    for (s = 0; s < sizeof pcm / sizeof *pcm; s++)
+        pcm[s] = 0;
+
+    assert(bpm_init(&b, RATE) == 0);
+    assert(bpm_add(&b, pcm, RATE) == 0);
+    assert(bpm_result(&b) == 0.0); /* too short */
+
+    for (s = 0; s < 30; s++)
+        assert(bpm_add(&b, pcm, RATE) == 0);
+    assert(bpm_result(&b) == 0.0); /* silence */
+
+    bpm_clear(&b);
+
+    state = 1;
+    assert(bpm_init(&b, RATE) == 0);
+
+    for (s = 0; s < 30; s++) {
+        size_t n;
+
+        for (n = 0; n < sizeof pcm / sizeof *pcm; n++)
+            pcm[n] = noise(&state) * 3000;
+        assert(bpm_add(&b, pcm, RATE) == 0);
+    }
+
+    assert(bpm_result(&b) == 0.0); /* noise */
+
+    bpm_clear(&b);
+}
+
+int main(int argc, char *argv[])
+{
+    test(120.0, 0.0, 120.0);
+    test(128.0, 0.31, 128.0);
+    test(98.5, 0.02, 98.5);
+    test(140.0, 1.7, 140.0);
+    test(87.3, 0.5, 87.3);
+    test(174.0, 0.0, 87.0);
+    test_none();
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "decoder.h"
+
+#define RATE 44100
+#define SAMPLES 100000
+
+static void put(FILE *f, unsigned int v, int bytes)
+{
+    int n;
+
+    for (n = 0; n < bytes; n++)
+        fputc(v >> (8 * n) & 0xff, f);
+}
+
+static signed short value(unsigned int s, unsigned int c)
+{
+    return (s * 37 + c * 1001) % 65536 - 32768;
+}
+
+/*
+ * Write a WAV file of a known signal to a temporary file
+ *
+ * Post: path holds the name of the file
+ */
+
+static void write_wav(char *path, unsigned int channels, unsigned int bits,
+                      unsigned int rate)
+{
+    int fd;
+    unsigned int s, c, frame;
+    FILE *f;
+
+    fd = mkstemp(path);
+    assert(fd != -1);
+    f = fdopen(fd, "w");
+    assert(f != NULL);
+
+    frame = channels * bits / 8;
+
+    fputs("RIFF", f);
+    put(f, 4 + 24 + 8 + SAMPLES * frame, 4);
+    fputs("WAVEfmt ", f);
+    put(f, 16, 4);
+    put(f, 1, 2); /* PCM */
+    put(f, channels, 2);
+    put(f, rate, 4);
+    put(f, rate * frame, 4);
+    put(f, frame, 2);
+    put(f, bits, 2);
+    fputs("data", f);
+    put(f, SAMPLES * frame, 4);
+
+    for (s = 0; s < SAMPLES; s++) {
+        for (c = 0; c < channels; c++) {
+            unsigned short v = value(s, c);
+
+            if (bits == 24)
+                put(f, (unsigned int)v << 8, 3);
+            else
+                put(f, v, 2);
+        }
+    }
+
+    fclose(f);
+}
+
+/*
+ * Return: the number of samples decoded, or -1 if the file was not
+ * accepted or any sample was wrong
+ */
+
+static long decode(unsigned int channels, unsigned int bits,
+                   unsigned int rate)
+{
+    long total;
+    ssize_t z;
+    char path[] = "/tmp/xwax-decoder-XXXXXX";
+    signed short pcm[4096 * 2];
+    static struct decode d;
+
+    write_wav(path, channels, bits, rate);
+
+    if (decode_open(&d, path, RATE) == -1) {
+        unlink(path);
+        return -1;
+    }
+
+    unlink(path);
+    total = 0;
+
+    while ((z = decode_read(&d, pcm, 4096)) > 0) {
+        ssize_t n;
+
+        for (n = 0; n < z; n++) {
+            unsigned int s = total + n;
+
+            if (pcm[n * 2] != value(s, 0)
+                || pcm[n * 2 + 1] != value(s, channels == 1 ? 0 : 1))
+            {
+                total = -1;
+                break;
+            }
+        }
+
+        if (total == -1)
+            break;
+
+        total += z;
+    }
+
+    decode_close(&d);
+
+    if (z == -1)
+        return -1;
+
+    return total;
+}
+
+/*
+ * Return: the first sample decoded after seeking to the given sample
+ */
+
+static signed short seek(unsigned int sample)
+{
+    char path[] = "/tmp/xwax-decoder-XXXXXX";
+    signed short pcm[2];
+    static struct decode d;
+
+    write_wav(path, 2, 16, RATE);
+    assert(decode_open(&d, path, RATE) == 0);
+    unlink(path);
+
+    assert(d.samples == SAMPLES);
+    assert(decode_seek(&d, sample) == 0);
+    assert(decode_read(&d, pcm, 1) == 1);
+    decode_close(&d);
+
+    return pcm[0];
+}
+
+/*
+ * Self-contained test of native decoding of audio files
+ */
+
+int main(int argc, char *argv[])
+{
+    assert(decode(2, 16, RATE) == SAMPLES);
+    assert(decode(1, 16, RATE) == SAMPLES);
+    assert(decode(2, 24, RATE) == SAMPLES);
+
+    assert(decode(2, 16, 48000) == -1); /* left to the importer */
+
+    assert(seek(0) == value(0, 0));
+    assert(seek(SAMPLES / 3) == value(SAMPLES / 3, 0));
+
+    return 0;
+}
@@ -0,0 +1,655 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see
+ * <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE /* mkdtemp(), wait4() */
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "decoder.h"
+#include "pcmcache.h"
+#include "rig.h"
+#include "thread.h"
+#include "track.h"
+
+#define RATE 44100
+#define LENGTH (RATE * 240) /* a track of four minutes */
+
+#define MAX_RESULTS 64
+#define REGRESSION 1.2 /* slower than the baseline by this is a failure */
+#define NOISE 0.005 /* seconds, of difference which is not a failure */
+
+#define POLL 50 /* microseconds, between looks at the import */
+
+static struct result {
+    char name[64];
+    double first, total; /* seconds */
+    size_t bytes;
+    unsigned int reads, wakeups;
+    long long syscalls; /* or -1 if not known */
+    long rss; /* peak, in kilobytes */
+} results[MAX_RESULTS];
+
+static size_t nresults = 0;
+static bool verbose = false;
+static char dir[] = "/tmp/xwax-import.XXXXXX";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        abort();
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * System calls are counted by the kernel where it allows, including
+ * those of the import threads and processes; otherwise they are not
+ * reported
+ */
+
+static int syscalls_open(void)
+{
+    static const char *ids[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+    };
+    unsigned int n;
+    unsigned long long id;
+    struct perf_event_attr attr;
+    FILE *f;
+
+    f = NULL;
+    for (n = 0; n < sizeof ids / sizeof *ids && f == NULL; n++)
+        f = fopen(ids[n], "r");
+    if (f == NULL)
+        return -1;
+
+    if (fscanf(f, "%llu", &id) != 1) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    memset(&attr, '\0', sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = id;
+    attr.disabled = 1;
+    attr.inherit = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Return: system calls counted on fd, or -1 if not known
+ */
+
+static long long syscalls_read(int fd)
+{
+    long long count;
+
+    if (fd == -1)
+        return -1;
+
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(fd, &count, sizeof count) != sizeof count)
+        return -1;
+
+    return count;
+}
+
+static void* rig(void *arg)
+{
+    if (rig_main() == -1)
+        abort();
+
+    return NULL;
+}
+
+/*
+ * Import a track and time it, in this process
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int measure(const char *importer, const char *path,
+                   struct result *r)
+{
+    int fd;
+    double start;
+    pthread_t ph;
+    struct track *t;
+
+    if (thread_global_init() == -1)
+        return -1;
+
+    track_global_init();
+
+    if (rig_init() == -1)
+        return -1;
+
+    if (pthread_create(&ph, NULL, rig, NULL) != 0)
+        return -1;
+
+    fd = syscalls_open();
+    if (fd != -1)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    start = now();
+
+    rig_lock();
+    t = track_get_by_import(importer, path, RATE, false);
+    rig_unlock();
+
+    /* The first block is enough to start playing */
+
+    r->first = 0.0;
+
+    for (;;) {
+        unsigned int length;
+        bool importing;
+
+        length = __atomic_load_n(&t->length, __ATOMIC_ACQUIRE);
+        if (r->first == 0.0
+            && track_block_ready(t, length, 0) == track_block_samples(0))
+        {
+            r->first = now() - start;
+        }
+
+        rig_lock();
+        importing = track_is_importing(t);
+        rig_unlock();
+
+        if (!importing)
+            break;
+
+        usleep(POLL);
+    }
+
+    r->total = now() - start;
+    if (r->first == 0.0) /* shorter than a block */
+        r->first = r->total;
+
+    r->syscalls = syscalls_read(fd);
+    r->bytes = (size_t)t->length * TRACK_CHANNELS * sizeof(signed short);
+    r->reads = t->reads;
+    r->wakeups = t->wakeups;
+
+    rig_lock();
+    track_put(t);
+    rig_unlock();
+
+    rig_quit();
+    if (pthread_join(ph, NULL) != 0)
+        abort();
+
+    rig_clear();
+    thread_global_clear();
+
+    return 0;
+}
+
+/*
+ * Run one benchmark in a process of its own, so that its peak memory
+ * is not that of the others
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int run(const char *name, const char *importer, const char *path,
+               bool cache, bool reported)
+{
+    int p[2], status;
+    pid_t pid;
+    struct rusage usage;
+    struct result *r;
+
+    assert(nresults < MAX_RESULTS);
+    r = &results[nresults];
+
+    if (pipe(p) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        int null;
+
+        if (!verbose) {
+            null = open("/dev/null", O_WRONLY);
+            if (null != -1)
+                dup2(null, STDERR_FILENO);
+        }
+
+        if (cache)
+            pcmcache_set_dir(dir);
+
+        if (measure(importer, path, r) == -1)
+            _exit(EXIT_FAILURE);
+
+        if (write(p[1], r, sizeof *r) != sizeof *r)
+            _exit(EXIT_FAILURE);
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(p[1]);
+
+    if (read(p[0], r, sizeof *r) != sizeof *r) {
+        fprintf(stderr, "%s: benchmark failed\n", name);
+        close(p[0]);
+        (void)wait4(pid, &status, 0, &usage);
+        return -1;
+    }
+    close(p[0]);
+
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return -1;
+    }
+
+    if (r->bytes == 0) {
+        fprintf(stderr, "%s: nothing was imported\n", name);
+        return -1;
+    }
+
+    if (!reported)
+        return 0;
+
+    snprintf(r->name, sizeof r->name, "%s", name);
+    r->rss = usage.ru_maxrss;
+    nresults++;
+
+    printf("%-24s %8.1f %8.1f %8.1f %8.1f %8.1f",
+           r->name, r->first * 1e3, r->total * 1e3,
+           r->bytes / r->total / 1048576,
+           r->reads * 1048576.0 / r->bytes,
+           r->wakeups * 1048576.0 / r->bytes);
+
+    if (r->syscalls == -1)
+        printf(" %8s", "-");
+    else
+        printf(" %8.1f", r->syscalls * 1048576.0 / r->bytes);
+
+    printf(" %8.1f\n", r->rss / 1024.0);
+
+    return 0;
+}
+
+/*
+ * Write a number as little-endian
+ */
+
+static void le(FILE *f, unsigned long v, int bytes)
+{
+    int n;
+
+    for (n = 0; n < bytes; n++)
+        fputc(v >> (8 * n) & 0xff, f);
+}
+
+/*
+ * Write a track of noise, as a WAV file or as raw audio for the
+ * importer
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int synthesise(const char *pathname, bool wav)
+{
+    unsigned int s;
+    unsigned long bytes;
+    FILE *f;
+
+    f = fopen(pathname, "w");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    bytes = (unsigned long)LENGTH * TRACK_CHANNELS * 2;
+
+    if (wav) {
+        fputs("RIFF", f);
+        le(f, 36 + bytes, 4);
+        fputs("WAVEfmt ", f);
+        le(f, 16, 4);
+        le(f, 1, 2); /* PCM */
+        le(f, TRACK_CHANNELS, 2);
+        le(f, RATE, 4);
+        le(f, RATE * TRACK_CHANNELS * 2, 4);
+        le(f, TRACK_CHANNELS * 2, 2);
+        le(f, 16, 2);
+        fputs("data", f);
+        le(f, bytes, 4);
+    }
+
+    srand(0);
+
+    for (s = 0; s < LENGTH * TRACK_CHANNELS; s++)
+        le(f, rand() & 0xffff, 2);
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write an importer which passes raw audio through
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int write_importer(const char *pathname)
+{
+    FILE *f;
+
+    f = fopen(pathname, "w");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    fputs("#!/bin/sh\nexec cat \"$1\"\n", f);
+
+    if (fclose(f) != 0 || chmod(pathname, 0700) == -1) {
+        perror(pathname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return: true if the file can be read without an importer
+ */
+
+static bool is_native(const char *path)
+{
+    struct decode d;
+
+    if (decode_open(&d, path, RATE) == -1)
+        return false;
+
+    decode_close(&d);
+    return true;
+}
+
+/*
+ * Benchmark a file through the decoder within the program where it
+ * can be read natively, otherwise the importer; then the cache
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int bench(const char *name, const char *importer, const char *path)
+{
+    char label[64];
+
+    snprintf(label, sizeof label, "%s-%s",
+             is_native(path) ? "decoder" : "importer", name);
+    if (run(label, importer, path, false, true) == -1)
+        return -1;
+
+    /* Fill the cache, then hit it */
+
+    if (run("fill", importer, path, true, false) == -1)
+        return -1;
+
+    snprintf(label, sizeof label, "cache-%s", name);
+    return run(label, importer, path, true, true);
+}
+
+/*
+ * Write the results as a baseline for a later run
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int write_baseline(const char *pathname)
+{
+    size_t n;
+    FILE *f;
+
+    f = fopen(pathname, "w");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    for (n = 0; n < nresults; n++) {
+        fprintf(f, "%s %f %f\n", results[n].name,
+                results[n].first, results[n].total);
+    }
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Compare the results against a baseline
+ *
+ * Return: -1 on error, otherwise the number of regressions
+ */
+
+static int compare_baseline(const char *pathname)
+{
+    int regressions;
+    char name[64];
+    double first, total;
+    FILE *f;
+
+    f = fopen(pathname, "r");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    regressions = 0;
+
+    while (fscanf(f, "%63s %lf %lf", name, &first, &total) == 3) {
+        size_t n;
+
+        for (n = 0; n < nresults; n++) {
+            const struct result *r = &results[n];
+
+            if (strcmp(r->name, name) != 0)
+                continue;
+
+            printf("%-24s %+7.1f%% %+7.1f%%", name,
+                   100.0 * (r->first / first - 1),
+                   100.0 * (r->total / total - 1));
+
+            if ((r->first > first * REGRESSION && r->first > first + NOISE)
+                || (r->total > total * REGRESSION && r->total > total + NOISE))
+            {
+                printf("  regression");
+                regressions++;
+            }
+
+            putchar('\n');
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}
+
+/*
+ * Remove the files made by the benchmark
+ */
+
+static void clean(void)
+{
+    DIR *d;
+    struct dirent *e;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return;
+
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.')
+            (void)unlinkat(dirfd(d), e->d_name, 0);
+    }
+
+    closedir(d);
+    (void)rmdir(dir);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-v] [-i <importer>] [-w <baseline>] "
+            "[-c <baseline>] [<path> ...]\n", argv0);
+}
+
+/*
+ * Benchmark of importing tracks: a synthesised one, and any files
+ * given. Each is imported through the importer, or the decoder within
+ * the program where it can be, and then from the cache.
+ *
+ * Reported are the time until the first block can be played, the
+ * time of the whole import and its throughput; the calls to read()
+ * and wakeups of the rig, and system calls of all the threads and
+ * processes, per megabyte of audio; and the peak memory (RSS).
+ *
+ * With "-w", write the results to a baseline file. With "-c", compare
+ * against a baseline file and fail if the first block or the whole
+ * import is slower by more than a given margin, and more than noise.
+ */
+
+int main(int argc, char *argv[])
+{
+    int c, r;
+    char wav[64], raw[64], passthrough[64];
+    const char *importer = "./import",
+        *write = NULL, *compare = NULL;
+
+    while ((c = getopt(argc, argv, "vi:w:c:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'i':
+            importer = optarg;
+            break;
+        case 'w':
+            write = optarg;
+            break;
+        case 'c':
+            compare = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    snprintf(wav, sizeof wav, "%s/synth.wav", dir);
+    snprintf(raw, sizeof raw, "%s/synth.raw", dir);
+    snprintf(passthrough, sizeof passthrough, "%s/import", dir);
+
+    if (synthesise(wav, true) == -1 || synthesise(raw, false) == -1
+        || write_importer(passthrough) == -1)
+    {
+        clean();
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %8s %8s %8s %8s %8s %8s %8s\n", "name", "first ms",
+           "total ms", "Mb/s", "reads/Mb", "wakes/Mb", "calls/Mb",
+           "RSS Mb");
+
+    r = 0;
+
+    /* The raw audio is not native, so the importer reads it; its
+     * cached copy is the same as that of the WAV file */
+
+    if (run("importer-synth", passthrough, raw, false, true) == -1
+        || run("decoder-synth", passthrough, wav, false, true) == -1
+        || run("fill", passthrough, wav, true, false) == -1
+        || run("cache-synth", passthrough, wav, true, true) == -1)
+    {
+        r = -1;
+    }
+
+    for (; r == 0 && optind < argc; optind++) {
+        const char *path = argv[optind], *name;
+
+        name = strrchr(path, '/');
+        name = (name == NULL) ? path : name + 1;
+
+        if (bench(name, importer, path) == -1)
+            r = -1;
+    }
+
+    clean();
+
+    if (r == -1)
+        return EXIT_FAILURE;
+
+    if (write != NULL && write_baseline(write) == -1)
+        return EXIT_FAILURE;
+
+    if (compare != NULL) {
+        putchar('\n');
+        if (compare_baseline(compare) != 0)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
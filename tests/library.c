@@ -43,10 +43,13 @@ int main(int argc, char *argv[])
         return -1;
 
     for (n = 2; n < argc; n++) {
-        if (library_import(&lib, scan, argv[n]) == -1)
+        if (library_queue(&lib, scan, argv[n]) == -1)
             return -1;
     }
 
+    if (library_wait(&lib) == -1)
+        return -1;
+
     library_clear(&lib);
 
     return 0;
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Tests of matching records, by words and by range of tempo
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "listing.h"
+#include "trigram.h"
+
+#define RECORDS 2000
+
+static const char *artists[] = {
+    "Daft Punk", "Aphex Twin", "Orbital", "Underworld", "Leftfield",
+};
+
+/*
+ * Check that a match from the listing by tempo finds the same records,
+ * in the same order, as one through every record
+ */
+
+static void check(struct listing *by_artist, struct listing *by_bpm,
+                  const struct trigram *index, const char *match,
+                  size_t expect)
+{
+    struct listing a, b;
+    size_t n;
+
+    listing_init(&a);
+    listing_init(&b);
+
+    assert(listing_match_index(by_artist, &a, match, index) == 0);
+    assert(listing_match_bpm(by_bpm, &b, match, index, SORT_ARTIST) == 0);
+    assert(a.entries == expect);
+    assert(b.entries == expect);
+    for (n = 0; n < a.entries; n++)
+        assert(a.record[n] == b.record[n]);
+
+    assert(listing_match_index(by_bpm, &a, match, index) == 0);
+    assert(listing_match_bpm(by_bpm, &b, match, index, SORT_BPM) == 0);
+    assert(a.entries == expect);
+    assert(b.entries == expect);
+    for (n = 0; n < a.entries; n++)
+        assert(a.record[n] == b.record[n]);
+
+    listing_clear(&a);
+    listing_clear(&b);
+}
+
+/*
+ * Return: number of records with a tempo in the given range, and by
+ * the given artist if not NULL
+ */
+
+static size_t count(struct record *re, double min, double max,
+                    const char *artist)
+{
+    size_t n, c;
+
+    c = 0;
+    for (n = 0; n < RECORDS; n++) {
+        if (re[n].bpm == 0.0 || re[n].bpm < min || re[n].bpm > max)
+            continue;
+        if (artist != NULL && strcmp(re[n].artist, artist) != 0)
+            continue;
+        c++;
+    }
+
+    return c;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n;
+    char *title;
+    struct record *re;
+    struct listing by_artist, by_bpm, out;
+    struct trigram index;
+
+    re = calloc(RECORDS, sizeof *re);
+    assert(re != NULL);
+
+    listing_init(&by_artist);
+    listing_init(&by_bpm);
+    listing_init(&out);
+    trigram_init(&index);
+
+    for (n = 0; n < RECORDS; n++) {
+        assert(asprintf(&re[n].pathname, "/music/%zu.mp3", n) != -1);
+        assert(asprintf(&title, "Track %zu", n) != -1);
+        re[n].title = title;
+        re[n].artist = (char*)artists[n % 5];
+        re[n].bpm = (n % 7 == 0) ? 0.0 : 80.0 + (n * 37 % 1000) / 10.0;
+        record_set_key(&re[n]);
+
+        assert(trigram_add(&index, &re[n]) == 0);
+        assert(listing_add(&by_artist, &re[n]) == 0);
+        assert(listing_add(&by_bpm, &re[n]) == 0);
+    }
+
+    listing_sort(&by_artist, SORT_ARTIST);
+    listing_sort(&by_bpm, SORT_BPM);
+
+    check(&by_artist, &by_bpm, &index, "124..128", count(re, 124, 128, NULL));
+    check(&by_artist, &by_bpm, &index, "128..124", count(re, 124, 128, NULL));
+    check(&by_artist, &by_bpm, &index, "170..", count(re, 170, 1000, NULL));
+    check(&by_artist, &by_bpm, &index, "..90.5", count(re, 0, 90.5, NULL));
+    check(&by_artist, &by_bpm, &index, "120..140 orbit",
+          count(re, 120, 140, "Orbital"));
+    check(&by_artist, &by_bpm, &index, "daft 100..200 110..120",
+          count(re, 110, 120, "Daft Punk"));
+    check(&by_artist, &by_bpm, &index, "300..400", 0);
+
+    /* Words which are not a range are matched as they are */
+
+    assert(listing_match_bpm(&by_bpm, &out, "orbital", &index,
+                             SORT_BPM) == 1);
+    assert(listing_match_bpm(&by_bpm, &out, "..", &index, SORT_BPM) == 1);
+    assert(listing_match_bpm(&by_bpm, &out, "1.2.3..4", &index,
+                             SORT_BPM) == 1);
+    assert(listing_match_index(&by_artist, &out, "track 12..", &index) == 0);
+    assert(out.entries == count(re, 12, 1000, NULL));
+
+    assert(listing_ends_in_range("daft 124..128"));
+    assert(listing_ends_in_range("124.."));
+    assert(!listing_ends_in_range("124..128 "));
+    assert(!listing_ends_in_range("124."));
+
+    for (n = 0; n < RECORDS; n++) {
+        free(re[n].pathname);
+        free(re[n].title);
+    }
+
+    trigram_clear(&index);
+    listing_clear(&by_artist);
+    listing_clear(&by_bpm);
+    listing_clear(&out);
+    free(re);
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mapping.h"
+
+/*
+ * Write the given text to a temporary file
+ *
+ * Post: path holds the name of the file
+ */
+
+static void write_file(char *path, const char *text)
+{
+    int fd;
+    FILE *f;
+
+    fd = mkstemp(path);
+    assert(fd != -1);
+
+    f = fdopen(fd, "w");
+    assert(f != NULL);
+    fputs(text, f);
+    fclose(f);
+}
+
+static int load(struct mapping *m, const char *text)
+{
+    int r;
+    char path[] = "/tmp/xwax-mapping-XXXXXX";
+
+    write_file(path, text);
+    r = mapping_load(m, path);
+    unlink(path);
+
+    return r;
+}
+
+/*
+ * Self-contained test of loading a mapping
+ */
+
+int main(int argc, char *argv[])
+{
+    const struct binding *b;
+    static struct mapping m;
+
+    assert(load(&m, "# a comment\n"
+                "\n"
+                "0x90 60 1 cue 1\n"
+                "0x91 0x3d 2 punch 16 # another comment\n"
+                "176 7 1 recue\n") == 0);
+
+    b = mapping_lookup(&m, 0x90, 60);
+    assert(b->action == ACTION_CUE && b->deck == 0 && b->cue == 0);
+
+    b = mapping_lookup(&m, 0x81, 61); /* note off */
+    assert(b->action == ACTION_PUNCH && b->deck == 1 && b->cue == 15);
+
+    b = mapping_lookup(&m, 0xb0, 7);
+    assert(b->action == ACTION_RECUE);
+
+    b = mapping_lookup(&m, 0x90, 61);
+    assert(b->action == ACTION_NONE);
+
+    assert(load(&m, "0x90 60 1 cue\n") == -1); /* no cue point */
+    assert(load(&m, "0x90 60 1 cue 17\n") == -1);
+    assert(load(&m, "0x90 128 1 cue 1\n") == -1);
+    assert(load(&m, "0x80 60 1 cue 1\n") == -1); /* note off */
+    assert(load(&m, "0x90 60 9 cue 1\n") == -1);
+    assert(load(&m, "0x90 60 1 recue 1\n") == -1);
+    assert(load(&m, "0x90 60 1 jump\n") == -1);
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+#include "track.h"
+
+#define SAMPLES (PACK_CHUNK * 20 + 1234) /* not a whole number of chunks */
+
+/*
+ * Pack the given audio, in uneven parts as a track is, and check
+ * that it reads back the same from any position
+ */
+
+static size_t round_trip(const signed short *pcm, unsigned int samples)
+{
+    unsigned int n;
+    size_t bytes;
+    struct pack p;
+    signed short *out;
+
+    pack_init(&p);
+    assert(pack_add(&p, pcm, PACK_CHUNK * 5) == 0);
+    assert(pack_add(&p, pcm + PACK_CHUNK * 5 * TRACK_CHANNELS,
+                    samples - PACK_CHUNK * 5) == 0);
+    pack_finish(&p);
+
+    assert(p.length == samples);
+
+    out = malloc(sizeof *out * samples * TRACK_CHANNELS);
+    assert(out != NULL);
+
+    pack_read(&p, 0, out, samples);
+    assert(memcmp(out, pcm, sizeof *out * samples * TRACK_CHANNELS) == 0);
+
+    for (n = 0; n < 100; n++) {
+        unsigned int start, len;
+
+        start = rand() % samples;
+        len = rand() % (samples - start) + 1;
+
+        pack_read(&p, start, out, len);
+        assert(memcmp(out, pcm + start * TRACK_CHANNELS,
+                      sizeof *out * len * TRACK_CHANNELS) == 0);
+    }
+
+    free(out);
+
+    bytes = pack_bytes(&p);
+    pack_clear(&p);
+    return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int s;
+    size_t raw, bytes;
+    signed short *pcm;
+
+    pcm = malloc(sizeof *pcm * SAMPLES * TRACK_CHANNELS);
+    if (pcm == NULL)
+        return -1;
+
+    raw = sizeof *pcm * SAMPLES * TRACK_CHANNELS;
+
+    /* Music-like audio is packed into less memory */
+
+    for (s = 0; s < SAMPLES; s++) {
+        double t = s / 44100.0;
+
+        pcm[s * 2] = 12000 * sin(2 * M_PI * 220 * t)
+            + 3000 * sin(2 * M_PI * 1250 * t) + rand() % 16;
+        pcm[s * 2 + 1] = 11000 * sin(2 * M_PI * 220 * t + 0.3)
+            + rand() % 16;
+    }
+
+    bytes = round_trip(pcm, SAMPLES);
+    printf("tone: %zu of %zu bytes\n", bytes, raw);
+    assert(bytes < raw * 3 / 4);
+
+    /* Silence is almost nothing */
+
+    memset(pcm, 0, raw);
+    bytes = round_trip(pcm, SAMPLES);
+    printf("silence: %zu of %zu bytes\n", bytes, raw);
+    assert(bytes < raw / 8);
+
+    /* Noise, and the extremes of each channel and the difference
+     * between them, still read back exactly */
+
+    for (s = 0; s < SAMPLES; s++) {
+        pcm[s * 2] = rand() % 65536 - 32768;
+        pcm[s * 2 + 1] = rand() % 65536 - 32768;
+    }
+
+    for (s = 0; s < PACK_CHUNK; s++) {
+        pcm[s * 2] = (s & 1) ? 32767 : -32768;
+        pcm[s * 2 + 1] = (s & 1) ? -32768 : 32767;
+    }
+
+    bytes = round_trip(pcm, SAMPLES);
+    printf("noise: %zu of %zu bytes\n", bytes, raw);
+    assert(bytes < raw + raw / 100);
+
+    free(pcm);
+
+    return 0;
+}
@@ -0,0 +1,530 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "synth.h"
+#include "timecoder.h"
+
+#define MAX_BLOCK 1024
+#define START 50000 /* cycles into the timecode */
+#define CYCLES 100000 /* prepared for the needle to move around in */
+#define JUMP 0.01 /* seconds of movement which is not explained by pitch */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+static const char *timecodes[] = {
+    "serato_2a", "serato_2b", "serato_cd", "traktor_a", "traktor_b",
+    "mixvibes_v2", "mixvibes_7inch"
+};
+
+static const unsigned int rates[] = { 44100, 48000, 96000 };
+static const unsigned int blocks[] = { 64, 256, 1024 };
+
+static int filter = PITCH_DEFAULT;
+static bool detect = false;
+static unsigned int max_rate = 0; /* or 0 to decode at the sample rate */
+
+/*
+ * Movements of the record, as the speed at a given time after the
+ * needle is dropped
+ */
+
+static double play(double t)
+{
+    return 1.0;
+}
+
+static double backspin(double t)
+{
+    if (t < 1.0)
+        return 1.0;
+    if (t < 1.1) /* a sharp spin backwards */
+        return 1.0 - 50.0 * (t - 1.0);
+    if (t < 1.6)
+        return -4.0;
+    if (t < 2.1) /* released, and back up to speed */
+        return -4.0 + 10.0 * (t - 1.6);
+
+    return 1.0;
+}
+
+static double scratch(double t)
+{
+    if (t < 1.0)
+        return 1.0;
+
+    return 3.0 * sin(2 * M_PI * 2.0 * (t - 1.0));
+}
+
+static struct scenario {
+    const char *name;
+    double silence, /* before the needle drops */
+        duration;
+    double (*speed)(double t);
+} scenarios[] = {
+    { "needle-drop", 0.25, 2.0, play },
+    { "backspin", 0.0, 3.5, backspin },
+    { "scratch", 0.0, 4.0, scratch },
+};
+
+/*
+ * Score of the decoder over a run, from the time it first gave a
+ * position
+ */
+
+struct score {
+    bool locked;
+    double lock; /* seconds to the first position */
+    unsigned int blocks, lost; /* without a position */
+    double position_sum, position_max, /* error, in seconds */
+        pitch_sum; /* squared error */
+};
+
+static void score_init(struct score *sc)
+{
+    memset(sc, '\0', sizeof *sc);
+}
+
+/*
+ * Take account of the decoder's output after a block of audio
+ *
+ * Return: true if a position was given, otherwise false
+ */
+
+static bool score_block(struct score *sc, struct timecoder *tc, double t,
+                        double *position, double *pitch)
+{
+    signed int r;
+    double when;
+
+    r = timecoder_get_position(tc, &when);
+    *pitch = timecoder_get_pitch(tc);
+
+    if (r == -1) {
+        if (sc->locked) {
+            sc->blocks++;
+            sc->lost++;
+        }
+        return false;
+    }
+
+    if (!sc->locked) {
+        sc->locked = true;
+        sc->lock = t;
+    }
+
+    sc->blocks++;
+
+    /* As used by the player */
+
+    *position = (double)r / timecoder_get_resolution(tc) + *pitch * when;
+    return true;
+}
+
+/*
+ * Add the error of the decoder against the known movement
+ */
+
+static void score_error(struct score *sc, double position, double truth,
+                        double pitch, double speed)
+{
+    double e;
+
+    e = fabs(position - truth);
+    sc->position_sum += e;
+    if (e > sc->position_max)
+        sc->position_max = e;
+
+    sc->pitch_sum += (pitch - speed) * (pitch - speed);
+}
+
+/*
+ * Replay a synthesised movement of the record through a decoder,
+ * and print the score
+ */
+
+static void replay(struct synth *synth, struct scenario *m,
+                   unsigned int rate, unsigned int block)
+{
+    unsigned int s, frames, resolution;
+    double phase;
+    signed short pcm[MAX_BLOCK * TIMECODER_CHANNELS];
+    struct timecoder tc;
+    struct score sc;
+
+    /* To detect the timecode, start from another one */
+
+    if (detect) {
+        struct timecode_def *other;
+
+        other = timecoder_find_definition(timecodes[0]);
+        if (other == synth->def)
+            other = timecoder_find_definition(timecodes[1]);
+
+        timecoder_init(&tc, other, 1.0, rate);
+        timecoder_detect(&tc);
+    } else {
+        timecoder_init(&tc, synth->def, 1.0, rate);
+    }
+
+    if (max_rate != 0)
+        timecoder_set_max_rate(&tc, max_rate);
+    timecoder_set_pitch_filter(&tc, filter);
+    score_init(&sc);
+
+    resolution = synth->def->resolution;
+    frames = (m->silence + m->duration) * rate;
+    phase = START;
+
+    for (s = 0; s < frames; s += block) {
+        unsigned int n, i;
+        double t, position, pitch;
+
+        n = frames - s;
+        if (n > block)
+            n = block;
+
+        for (i = 0; i < n; i++) {
+            t = (double)(s + i) / rate - m->silence;
+
+            if (t < 0.0) {
+                pcm[i * TIMECODER_CHANNELS] = 0;
+                pcm[i * TIMECODER_CHANNELS + 1] = 0;
+            } else {
+                synth_sample(synth, phase, &pcm[i * TIMECODER_CHANNELS]);
+                phase += m->speed(t) * resolution / rate;
+            }
+        }
+
+        timecoder_submit(&tc, pcm, n);
+
+        t = (double)(s + n) / rate - m->silence;
+        if (t < 0.0)
+            continue;
+
+        if (score_block(&sc, &tc, t, &position, &pitch))
+            score_error(&sc, position, phase / resolution, pitch, m->speed(t));
+    }
+
+    printf("%-12s %-15s %6u %5u", m->name, synth->def->name, rate, block);
+
+    if (!sc.locked) {
+        printf("  no lock");
+    } else {
+        unsigned int valid;
+
+        valid = sc.blocks - sc.lost;
+
+        printf(" %8.1f %8.2f %8.2f %6.1f%% %8.4f",
+               sc.lock * 1e3,
+               sc.position_sum / valid * 1e3, sc.position_max * 1e3,
+               100.0 * sc.lost / sc.blocks, sqrt(sc.pitch_sum / valid));
+    }
+
+    if (detect)
+        printf("  %s", timecoder_get_definition(&tc)->name);
+    printf("\n");
+
+    timecoder_clear(&tc);
+}
+
+/*
+ * Return: value of a little-endian integer of the given bytes
+ */
+
+static uint32_t le(const unsigned char *b, size_t bytes)
+{
+    uint32_t v;
+
+    v = 0;
+    while (bytes-- > 0)
+        v = (v << 8) | b[bytes];
+
+    return v;
+}
+
+/*
+ * Read the header of a WAV file, up to the start of the audio
+ *
+ * Return: -1 if not 16-bit stereo PCM, otherwise 0
+ * Post: if 0, *rate is the sample rate
+ */
+
+static int read_wav_header(FILE *f, unsigned int *rate)
+{
+    unsigned char b[16];
+    bool fmt;
+
+    if (fread(b, 1, 12, f) != 12 || memcmp(b, "RIFF", 4) != 0
+        || memcmp(b + 8, "WAVE", 4) != 0)
+    {
+        fprintf(stderr, "Not a WAV file.\n");
+        return -1;
+    }
+
+    fmt = false;
+
+    for (;;) {
+        uint32_t size;
+
+        if (fread(b, 1, 8, f) != 8) {
+            fprintf(stderr, "No audio in WAV file.\n");
+            return -1;
+        }
+
+        size = le(b + 4, 4);
+
+        if (!memcmp(b, "data", 4))
+            break;
+
+        if (!memcmp(b, "fmt ", 4) && size >= 16) {
+            if (fread(b, 1, 16, f) != 16)
+                return -1;
+
+            if (le(b, 2) != 1 || le(b + 2, 2) != TIMECODER_CHANNELS
+                || le(b + 14, 2) != 16)
+            {
+                fprintf(stderr, "WAV file is not 16-bit stereo PCM.\n");
+                return -1;
+            }
+
+            *rate = le(b + 4, 4);
+            fmt = true;
+            size -= 16;
+        }
+
+        if (fseek(f, size + (size & 1), SEEK_CUR) == -1) {
+            perror("fseek");
+            return -1;
+        }
+    }
+
+    if (!fmt) {
+        fprintf(stderr, "WAV file has no format.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Replay a recording through a decoder, where the movement is not
+ * known. It is scored on the time to lock, how often the position
+ * is lost, and jumps in the position which are not explained by the
+ * pitch
+ */
+
+static int replay_file(const char *pathname, struct timecode_def *def,
+                       unsigned int block)
+{
+    unsigned int rate, s, jumps;
+    bool valid;
+    double t, last;
+    signed short pcm[MAX_BLOCK * TIMECODER_CHANNELS];
+    struct timecoder tc;
+    struct score sc;
+    FILE *f;
+
+    f = fopen(pathname, "r");
+    if (f == NULL) {
+        perror(pathname);
+        return -1;
+    }
+
+    if (read_wav_header(f, &rate) == -1) {
+        fclose(f);
+        return -1;
+    }
+
+    timecoder_init(&tc, def, 1.0, rate);
+    if (max_rate != 0)
+        timecoder_set_max_rate(&tc, max_rate);
+    timecoder_set_pitch_filter(&tc, filter);
+    score_init(&sc);
+
+    jumps = 0;
+    valid = false;
+    last = 0.0;
+    s = 0;
+
+    for (;;) {
+        size_t n;
+        double position, pitch;
+
+        n = fread(pcm, sizeof(signed short) * TIMECODER_CHANNELS, block, f);
+        if (n == 0)
+            break;
+
+        timecoder_submit(&tc, pcm, n);
+        s += n;
+        t = (double)s / rate;
+
+        if (!score_block(&sc, &tc, t, &position, &pitch)) {
+            valid = false;
+            continue;
+        }
+
+        if (valid && fabs(position - last - pitch * n / rate) > JUMP)
+            jumps++;
+
+        valid = true;
+        last = position;
+    }
+
+    fclose(f);
+
+    printf("%s: %s at %uHz, %.1f seconds\n", pathname, def->name, rate,
+           (double)s / rate);
+
+    if (!sc.locked) {
+        printf("no lock\n");
+    } else {
+        printf("lock %.1fms, lost %.1f%%, %u jumps\n", sc.lock * 1e3,
+               100.0 * sc.lost / sc.blocks, jumps);
+    }
+
+    timecoder_clear(&tc);
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-t <timecode>] [-b <block>] [-p <filter>] "
+            "[-a] [-d <hz>] [-f <file.wav>]\n", argv0);
+}
+
+/*
+ * Replay timecode signals through the decoder, and measure the
+ * accuracy of what is decoded.
+ *
+ * By default, each timecode is synthesised with known movements of
+ * the record and scored at several sample rates and block sizes. With
+ * "-f", instead a recording is replayed. With "-p", the given filter
+ * is used for the pitch. With "-a", each timecode is detected by a
+ * decoder which starts from another one, and the timecode found is
+ * printed. With "-d", audio is decoded at no more than the given rate.
+ */
+
+int main(int argc, char *argv[])
+{
+    int c;
+    unsigned int n, m, r, b, block;
+    const char *name = NULL, *file = NULL;
+
+    block = 0;
+
+    while ((c = getopt(argc, argv, "t:b:p:ad:f:")) != -1) {
+        switch (c) {
+        case 't':
+            name = optarg;
+            break;
+        case 'b':
+            block = atoi(optarg);
+            if (block == 0 || block > MAX_BLOCK) {
+                fprintf(stderr, "Block must be 1 to %d samples.\n", MAX_BLOCK);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            filter = pitch_find_filter(optarg);
+            if (filter == -1) {
+                fprintf(stderr, "Pitch filter '%s' is not known.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a':
+            detect = true;
+            break;
+        case 'd':
+            max_rate = atoi(optarg);
+            if (max_rate == 0) {
+                fprintf(stderr, "Rate must be a number of Hz.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (file != NULL) {
+        struct timecode_def *def;
+
+        def = timecoder_find_definition(name ? name : timecodes[0]);
+        if (def == NULL)
+            return EXIT_FAILURE;
+
+        if (replay_file(file, def, block ? block : 256) == -1)
+            return EXIT_FAILURE;
+
+        timecoder_free_lookup();
+        return 0;
+    }
+
+    if (detect && timecoder_build_lookups() == -1)
+        return EXIT_FAILURE;
+
+    printf("%-12s %-15s %6s %5s %8s %8s %8s %7s %8s%s\n",
+           "movement", "timecode", "rate", "block", "lock(ms)",
+           "mean(ms)", "max(ms)", "lost", "pitch",
+           detect ? "  found" : "");
+
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        struct timecode_def *def;
+        struct synth synth;
+
+        if (name != NULL && strcmp(name, timecodes[n]) != 0)
+            continue;
+
+        def = timecoder_find_definition(timecodes[n]);
+        if (def == NULL)
+            return EXIT_FAILURE;
+
+        if (synth_init(&synth, def, CYCLES) == -1)
+            return EXIT_FAILURE;
+
+        for (m = 0; m < ARRAY_SIZE(scenarios); m++) {
+            for (r = 0; r < ARRAY_SIZE(rates); r++) {
+                for (b = 0; b < ARRAY_SIZE(blocks); b++) {
+                    if (block != 0 && blocks[b] != block)
+                        continue;
+
+                    replay(&synth, &scenarios[m], rates[r], blocks[b]);
+                }
+            }
+        }
+
+        synth_clear(&synth);
+    }
+
+    timecoder_free_lookup();
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "player.h"
+#include "timecoder.h"
+#include "track.h"
+
+#define RATE 48000
+#define PERIOD 256 /* samples */
+#define PERIODS 1000
+#define LENGTH (44100 * 80)
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+static const char *names[] = { "linear", "cubic", "sinc" };
+static const double pitches[] = { 1.0, 1.08, 2.0, -4.0, 8.0 };
+
+/*
+ * Return: a track of the given length filled with noise
+ */
+
+static struct track* synthesise(unsigned int length)
+{
+    unsigned int n, s;
+    static struct track tr;
+
+    tr.refcount = 2; /* never released */
+    tr.rate = 44100;
+    tr.blocks = track_block(length - 1, &s) + 1;
+
+    for (n = 0; n < tr.blocks; n++) {
+        tr.block[n] = malloc(track_bytes(track_block_samples(n)));
+        if (tr.block[n] == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (s = 0; s < length; s++) {
+        signed short *pcm;
+
+        pcm = track_get_sample(&tr, s);
+        pcm[0] = rand() % 65536 - 32768;
+        pcm[1] = rand() % 65536 - 32768;
+    }
+
+    tr.length = length;
+    return &tr;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        abort();
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Benchmark of each resampler against the time available in a
+ * period of audio. Percentages are of the real-time budget for a
+ * single deck.
+ */
+
+int main(int argc, char *argv[])
+{
+    unsigned int n, m, p;
+    float pcm[PERIOD * PLAYER_CHANNELS];
+    struct track *tr;
+    static struct timecoder tc; /* not used */
+
+    tr = synthesise(LENGTH);
+
+    printf("%-8s %6s %10s %10s %8s\n",
+           "name", "pitch", "mean (us)", "worst (us)", "budget");
+
+    for (n = 0; n < ARRAY_SIZE(names); n++) {
+        for (m = 0; m < ARRAY_SIZE(pitches); m++) {
+            double mean, worst, budget;
+            struct player pl;
+            struct resampler *r;
+
+            r = player_find_resampler(names[n]);
+            assert(r != NULL);
+
+            track_get(tr);
+            player_init(&pl, RATE, tr, &tc);
+            player_set_resampler(&pl, r);
+            pl.timecode_control = false;
+            player_seek_to(&pl, 30.0);
+            pl.pitch = pitches[m];
+
+            mean = 0.0;
+            worst = 0.0;
+
+            for (p = 0; p < PERIODS; p++) {
+                double start, t;
+
+                start = now();
+                player_collect(&pl, pcm, PERIOD);
+                t = now() - start;
+
+                mean += t;
+                if (t > worst)
+                    worst = t;
+            }
+
+            mean /= PERIODS;
+            budget = (double)PERIOD / RATE;
+
+            printf("%-8s %6.2f %10.2f %10.2f %7.2f%%\n",
+                   names[n], pitches[m], mean * 1e6, worst * 1e6,
+                   100.0 * worst / budget);
+
+            player_clear(&pl);
+        }
+    }
+
+    return 0;
+}
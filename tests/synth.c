@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "synth.h"
+
+/* Flags of a timecode definition, as timecoder.c */
+
+#define SWITCH_PHASE 0x1
+#define SWITCH_PRIMARY 0x2
+
+#define HIGH 24000 /* level of a cycle carrying a 1 */
+#define LOW 16000 /* or a 0 */
+#define NOISE 400
+
+/*
+ * The timecode sequence, as timecoder.c
+ */
+
+static bits_t fwd(bits_t current, struct timecode_def *def)
+{
+    bits_t l;
+
+    l = __builtin_parity(current & (def->taps | 0x1));
+    return (current >> 1) | (l << (def->bits - 1));
+}
+
+/*
+ * Prepare the given number of cycles of a timecode, from its start
+ *
+ * Return: -1 if not enough memory, otherwise 0
+ */
+
+int synth_init(struct synth *s, struct timecode_def *def,
+               unsigned int cycles)
+{
+    unsigned int n;
+    bits_t code;
+
+    s->bit = malloc(cycles);
+    if (s->bit == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    /* Cycle n carries the newest bit of the code at position n */
+
+    code = def->seed;
+    for (n = 0; n < cycles; n++) {
+        code = fwd(code, def);
+        s->bit[n] = code >> (def->bits - 1);
+    }
+
+    s->def = def;
+    s->cycles = cycles;
+    s->noise = 1;
+
+    return 0;
+}
+
+void synth_clear(struct synth *s)
+{
+    free(s->bit);
+}
+
+/*
+ * Synthesise one stereo sample for the needle at the given phase
+ *
+ * Each cycle of the primary channel is at a level given by the bit of
+ * the timecode, and the secondary channel is a quarter cycle apart.
+ * The same noise is added on every run, so results can be compared.
+ *
+ * Pre: phase is in cycles from the start, within those prepared
+ */
+
+void synth_sample(struct synth *s, double phase, signed short *pcm)
+{
+    unsigned int c;
+    double level, shift, primary, secondary;
+
+    c = phase;
+    if (c >= s->cycles)
+        c = s->cycles - 1;
+
+    level = s->bit[c] ? HIGH : LOW;
+    shift = (s->def->flags & SWITCH_PHASE) ? M_PI / 2 : -M_PI / 2;
+
+    primary = level * sin(2 * M_PI * phase);
+    secondary = HIGH * sin(2 * M_PI * phase + shift);
+
+    s->noise = s->noise * 1103515245 + 12345;
+    primary += (int)(s->noise >> 16) % NOISE - NOISE / 2;
+    s->noise = s->noise * 1103515245 + 12345;
+    secondary += (int)(s->noise >> 16) % NOISE - NOISE / 2;
+
+    if (s->def->flags & SWITCH_PRIMARY) {
+        pcm[0] = primary;
+        pcm[1] = secondary;
+    } else {
+        pcm[0] = secondary;
+        pcm[1] = primary;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Synthesised timecode signal, for tests
+ */
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "timecoder.h"
+
+struct synth {
+    struct timecode_def *def;
+    unsigned int cycles;
+    unsigned char *bit; /* of each cycle */
+    unsigned int noise; /* state of the generator */
+};
+
+int synth_init(struct synth *s, struct timecode_def *def,
+               unsigned int cycles);
+void synth_clear(struct synth *s);
+
+void synth_sample(struct synth *s, double phase, signed short *pcm);
+
+#endif
@@ -19,16 +19,86 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "lut.h"
 #include "timecoder.h"
 
 #define STEREO 2
 #define RATE 96000
 #define INTERVAL 4096
 
+#define LOOKUPS 10000000
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        abort();
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Time lookups in a table of the given size, for each type of table
+ */
+
+static void bench_lut(const char *label, int nslots, int bits)
+{
+    int n;
+    struct {
+        const char *name;
+        int hash_bits;
+    } *t, types[] = {
+        { "chained", 16 }, /* the original table */
+        { "sized", 22 },
+        { "direct", bits },
+    };
+
+    for (t = types; t < types + sizeof types / sizeof *types; t++) {
+        unsigned int x, mask, hits;
+        double start, elapsed;
+        struct lut lut;
+
+        if (t->hash_bits > bits)
+            continue;
+
+        if (lut_init_as(&lut, nslots, bits, t->hash_bits) == -1)
+            abort();
+
+        /* Any sequence of unique codes will do */
+
+        mask = (1 << bits) - 1;
+        for (n = 0; n < nslots; n++)
+            lut_push(&lut, (n * 2654435761U) & mask);
+
+        hits = 0;
+        x = 1;
+        start = now();
+
+        for (n = 0; n < LOOKUPS; n++) {
+            x = x * 1103515245 + 12345;
+            if (lut_lookup(&lut, x & mask) != (unsigned)-1)
+                hits++;
+        }
+
+        elapsed = now() - start;
+
+        printf("%-10s %-8s %6.1fns per lookup (%u hits)\n",
+               label, t->name, elapsed * 1e9 / LOOKUPS, hits);
+
+        lut_clear(&lut);
+    }
+}
+
 /*
  * Manual test of the timecoder's movement tracking. Read raw sample
  * information and write decoded pitch information.
+ *
+ * With "-b", instead benchmark the lookup tables.
  */
 
 int main(int argc, char *argv[])
@@ -38,6 +108,12 @@ int main(int argc, char *argv[])
     struct timecoder tc;
     struct timecode_def *def;
 
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+        bench_lut("serato_2a", 712000, 20);
+        bench_lut("traktor_b", 2110000, 23);
+        return 0;
+    }
+
     def = timecoder_find_definition("serato_2a");
     assert(def != NULL);
 
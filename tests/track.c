@@ -23,6 +23,8 @@
 #include "thread.h"
 #include "track.h"
 
+#define RATE 44100
+
 /*
  * Self-contained manual test of a track import operation
  */
@@ -39,9 +41,11 @@ int main(int argc, char *argv[])
     if (thread_global_init() == -1)
         return -1;
 
+    track_global_init();
+
     rig_init();
 
-    track = track_get_by_import(argv[1], argv[2]);
+    track = track_get_by_import(argv[1], argv[2], RATE, false);
     if (track == NULL)
         return -1;
 
@@ -17,8 +17,10 @@
  *
  */
 
+#define _GNU_SOURCE /* asprintf() */
 #include <assert.h>
 #include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +42,11 @@
 #define VALID_BITS 24
 
 #define MONITOR_DECAY_EVERY 512 /* in samples */
+#define MONITOR_DECIMATE 2 /* samples per point */
+#define MONITOR_POINTS 8192 /* power of two */
+#define MONITOR_SCALE 16384 /* of a point, for the full width */
+
+#define BLOCK 256 /* samples decoded at a time */
 
 #define SQ(x) ((x)*(x))
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
@@ -50,6 +57,8 @@
 #define SWITCH_PRIMARY 0x2 /* use left channel (not right) as primary */
 #define SWITCH_POLARITY 0x4 /* read bit values in negative (not positive) */
 
+static const char *cache_dir = NULL;
+
 static struct timecode_def timecodes[] = {
     {
         .name = "serato_2a",
@@ -186,6 +195,65 @@ static inline bits_t rev(bits_t current, struct timecode_def *def)
     return ((current << 1) & mask) | l;
 }
 
+/*
+ * Keep lookup tables in the given directory, so they are only built
+ * once; otherwise they are built every time
+ */
+
+void timecoder_set_cache_dir(const char *d)
+{
+    cache_dir = d;
+}
+
+/*
+ * Return: pathname of the cached lookup table for this timecode, or
+ *     NULL if there is no cache
+ * Post: if not NULL, the return value must be free'd
+ */
+
+static char* cache_pathname(struct timecode_def *def)
+{
+    char *p;
+
+    if (cache_dir == NULL)
+        return NULL;
+
+    /* The table depends only on the sequence itself */
+
+    if (asprintf(&p, "%s/timecode-%d-%x-%x-%u.lut", cache_dir,
+                 def->bits, def->seed, def->taps, def->length) == -1)
+    {
+        perror("asprintf");
+        return NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Use a previously cached lookup table for this timecode
+ *
+ * Return: -1 if not in the cache, otherwise 0
+ */
+
+static int load_lookup(struct timecode_def *def, const char *pathname)
+{
+    if (lut_load(&def->lut, pathname, def->length, def->bits) == -1)
+        return -1;
+
+    /* A basic check that this is the right sequence */
+
+    if (lut_lookup(&def->lut, def->seed) != 0) {
+        lut_clear(&def->lut);
+        return -1;
+    }
+
+    debug("loaded LUT from %s", pathname);
+    def->lookup = true;
+
+    return 0;
+}
+
 /*
  * Where necessary, build the lookup table required for this timecode
  *
@@ -196,15 +264,24 @@ static int build_lookup(struct timecode_def *def)
 {
     unsigned int n;
     bits_t current;
+    char *pathname;
 
     if (def->lookup)
         return 0;
 
+    pathname = cache_pathname(def);
+    if (pathname != NULL && load_lookup(def, pathname) == 0) {
+        free(pathname);
+        return 0;
+    }
+
     fprintf(stderr, "Building LUT for %d bit %dHz timecode (%s)\n",
             def->bits, def->resolution, def->desc);
 
-    if (lut_init(&def->lut, def->length) == -1)
+    if (lut_init(&def->lut, def->length, def->bits) == -1) {
+        free(pathname);
         return -1;
+    }
 
     current = def->seed;
 
@@ -224,6 +301,14 @@ static int build_lookup(struct timecode_def *def)
 
     def->lookup = true;
 
+    /* Failure to cache the table is not an error */
+
+    if (pathname != NULL) {
+        if (lut_save(&def->lut, pathname) == 0)
+            debug("saved LUT to %s", pathname);
+        free(pathname);
+    }
+
     return 0;
 }
 
@@ -256,6 +341,25 @@ struct timecode_def* timecoder_find_definition(const char *name)
     return def;
 }
 
+/*
+ * Build the lookup tables of every definition, so that any of them
+ * can be detected on a record
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int timecoder_build_lookups(void)
+{
+    struct timecode_def *def;
+
+    for (def = timecodes; def < timecodes + ARRAY_SIZE(timecodes); def++) {
+        if (build_lookup(def) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Free the timecoder lookup tables when they are no longer needed
  */
@@ -303,19 +407,66 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
 
     tc->dt = 1.0 / sample_rate;
     tc->zero_alpha = tc->dt / (ZERO_RC + tc->dt);
+    tc->decimate = 1;
+    tc->summed = 0;
+    tc->sum[0] = 0;
+    tc->sum[1] = 0;
 
     tc->forwards = 1;
     init_channel(&tc->primary);
     init_channel(&tc->secondary);
-    pitch_init(&tc->pitch, tc->dt);
+    pitch_init(&tc->pitch, tc->dt, PITCH_DEFAULT);
 
     tc->ref_level = INT_MAX;
     tc->bitstream = 0;
     tc->timecode = 0;
     tc->valid_counter = 0;
     tc->timecode_ticker = 0;
+    tc->candidates = 0;
 
     tc->mon = NULL;
+    tc->mon_points = NULL;
+}
+
+/*
+ * Decode the input at no more than the given rate, which need be no
+ * higher than a few times that of the timecode
+ *
+ * The sample rate is divided by a whole number, and the average of
+ * each group of samples is taken; a cheap filter against aliasing,
+ * with nulls at each multiple of the new rate. Times are still given
+ * in seconds, so the pitch and position match those of the device.
+ *
+ * Pre: not called while the timecoder is in use by the realtime thread
+ */
+
+void timecoder_set_max_rate(struct timecoder *tc, unsigned int rate)
+{
+    unsigned int sample_rate;
+
+    assert(rate > 0);
+
+    sample_rate = lround(tc->decimate / tc->dt);
+
+    tc->decimate = sample_rate / rate;
+    if (tc->decimate == 0)
+        tc->decimate = 1;
+    tc->summed = 0;
+    tc->sum[0] = 0;
+    tc->sum[1] = 0;
+
+    tc->dt = (double)tc->decimate / sample_rate;
+    tc->zero_alpha = tc->dt / (ZERO_RC + tc->dt);
+    pitch_init(&tc->pitch, tc->dt, tc->pitch.filter);
+}
+
+/*
+ * Use the given filter, from pitch_find_filter(), for the pitch
+ */
+
+void timecoder_set_pitch_filter(struct timecoder *tc, int filter)
+{
+    pitch_init(&tc->pitch, tc->dt, filter);
 }
 
 /*
@@ -325,13 +476,16 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
 void timecoder_clear(struct timecoder *tc)
 {
     assert(tc->mon == NULL);
+    free(tc->mon_points);
 }
 
 /*
  * Initialise a raster display of the incoming audio
  *
  * The monitor (otherwise known as 'scope' in the interface) is an x-y
- * display of the post-calibrated incoming audio.
+ * display of the post-calibrated incoming audio. The realtime thread
+ * only passes points to the interface, which draws them with
+ * timecoder_monitor_update().
  *
  * Return: -1 if not enough memory could be allocated, otherwise 0
  */
@@ -346,7 +500,28 @@ int timecoder_monitor_init(struct timecoder *tc, int size)
         return -1;
     }
     memset(tc->mon, 0, SQ(tc->mon_size));
-    tc->mon_counter = 0;
+    tc->mon_decay = 0;
+
+    /* The points are kept until timecoder_clear(), as the realtime
+     * thread may be using them */
+
+    if (tc->mon_points == NULL) {
+        struct timecoder_point *points;
+
+        points = malloc(sizeof *points * MONITOR_POINTS);
+        if (points == NULL) {
+            perror("malloc");
+            free(tc->mon);
+            tc->mon = NULL;
+            return -1;
+        }
+
+        tc->mon_head = 0;
+        tc->mon_tail = 0;
+        tc->mon_counter = 0;
+        __atomic_store_n(&tc->mon_points, points, __ATOMIC_RELEASE);
+    }
+
     return 0;
 }
 
@@ -361,12 +536,61 @@ void timecoder_monitor_clear(struct timecoder *tc)
     tc->mon = NULL;
 }
 
+/*
+ * Draw the latest points onto the x-y monitor, from the interface
+ *
+ * If the monitor has not been drawn for a while, the realtime thread
+ * has stopped adding points. These are out of date, so are dropped.
+ */
+
+void timecoder_monitor_update(struct timecoder *tc)
+{
+    int size;
+    unsigned int head, tail;
+
+    assert(tc->mon != NULL);
+
+    size = tc->mon_size;
+    head = __atomic_load_n(&tc->mon_head, __ATOMIC_ACQUIRE);
+    tail = tc->mon_tail;
+
+    if (head - tail == MONITOR_POINTS) {
+        memset(tc->mon, 0, SQ(size));
+        tail = head;
+    }
+
+    for (; tail != head; tail++) {
+        int px, py;
+        const struct timecoder_point *pt;
+
+        /* Decay the pixels already in the monitor */
+
+        if (++tc->mon_decay % (MONITOR_DECAY_EVERY / MONITOR_DECIMATE) == 0) {
+            int p;
+
+            for (p = 0; p < SQ(size); p++)
+                tc->mon[p] = tc->mon[p] * 7 / 8;
+        }
+
+        pt = &tc->mon_points[tail % MONITOR_POINTS];
+        px = size / 2 + pt->x * size / MONITOR_SCALE;
+        py = size / 2 + pt->y * size / MONITOR_SCALE;
+
+        if (px < 0 || px >= size || py < 0 || py >= size)
+            continue;
+
+        tc->mon[py * size + px] = 0xff; /* white */
+    }
+
+    __atomic_store_n(&tc->mon_tail, tail, __ATOMIC_RELEASE);
+}
+
 /*
  * Update channel information with axis-crossings
  */
 
-static void detect_zero_crossing(struct timecoder_channel *ch,
-                                 signed int v, double alpha)
+static inline void detect_zero_crossing(struct timecoder_channel *ch,
+                                        signed int v, double alpha)
 {
     ch->crossing_ticker++;
 
@@ -385,77 +609,70 @@ static void detect_zero_crossing(struct timecoder_channel *ch,
 }
 
 /*
- * Plot the given sample value in the x-y monitor
+ * Return: coordinate of a point in the x-y monitor for the given
+ *     sample value, relative to the centre
  */
 
-static void update_monitor(struct timecoder *tc, signed int x, signed int y)
+static inline signed short monitor_coord(signed int v, signed int ref)
 {
-    int px, py, size, ref;
-
-    if (!tc->mon)
-        return;
-
-    size = tc->mon_size;
-    ref = tc->ref_level;
-
-    /* Decay the pixels already in the montior */
-
-    if (++tc->mon_counter % MONITOR_DECAY_EVERY == 0) {
-        int p;
-
-        for (p = 0; p < SQ(size); p++) {
-            if (tc->mon[p])
-                tc->mon[p] = tc->mon[p] * 7 / 8;
-        }
-    }
-
-    assert(ref > 0);
+    long long c;
 
     /* ref_level is half the prevision of signal level */
-    px = size / 2 + (long long)x * size / ref / 8;
-    py = size / 2 + (long long)y * size / ref / 8;
 
-    if (px < 0 || px >= size || py < 0 || py >= size)
-        return;
-
-    tc->mon[py * size + px] = 0xff; /* white */
+    c = (long long)v * MONITOR_SCALE / ref / 8;
+    if (c > SHRT_MAX)
+        return SHRT_MAX;
+    if (c < SHRT_MIN)
+        return SHRT_MIN;
+    return c;
 }
 
 /*
- * Extract the bitstream from the sample value
+ * Add a bit read from the record to a bitstream, and check it against
+ * the bit expected from the previous ones
  */
 
-static void process_bitstream(struct timecoder *tc, signed int m)
+static inline void add_bit(struct timecode_def *def, bool forwards,
+                           bits_t b, bits_t *bitstream, bits_t *timecode,
+                           unsigned int *valid_counter)
 {
-    bits_t b;
-
-    b = m > tc->ref_level;
-
     /* Add it to the bitstream, and work out what we were expecting
      * (timecode). */
 
-    /* tc->bitstream is always in the order it is physically placed on
+    /* The bitstream is always in the order it is physically placed on
      * the vinyl, regardless of the direction. */
 
-    if (tc->forwards) {
-        tc->timecode = fwd(tc->timecode, tc->def);
-        tc->bitstream = (tc->bitstream >> 1)
-            + (b << (tc->def->bits - 1));
+    if (forwards) {
+        *timecode = fwd(*timecode, def);
+        *bitstream = (*bitstream >> 1) + (b << (def->bits - 1));
 
     } else {
         bits_t mask;
 
-        mask = ((1 << tc->def->bits) - 1);
-        tc->timecode = rev(tc->timecode, tc->def);
-        tc->bitstream = ((tc->bitstream << 1) & mask) + b;
+        mask = ((1 << def->bits) - 1);
+        *timecode = rev(*timecode, def);
+        *bitstream = ((*bitstream << 1) & mask) + b;
     }
 
-    if (tc->timecode == tc->bitstream)
-        tc->valid_counter++;
+    if (*timecode == *bitstream)
+        (*valid_counter)++;
     else {
-        tc->timecode = tc->bitstream;
-        tc->valid_counter = 0;
+        *timecode = *bitstream;
+        *valid_counter = 0;
     }
+}
+
+/*
+ * Extract the bitstream from the sample value
+ */
+
+static void process_bitstream(struct timecoder *tc, signed int m)
+{
+    bits_t b;
+
+    b = m > tc->ref_level;
+    add_bit(tc->def, tc->forwards, b, &tc->bitstream, &tc->timecode,
+            &tc->valid_counter);
 
     /* Take note of the last time we read a valid timecode */
 
@@ -474,52 +691,41 @@ static void process_bitstream(struct timecoder *tc, signed int m)
 }
 
 /*
- * Process a single sample from the incoming audio
+ * Process a sample from the incoming audio at which either axis has
+ * been crossed
  *
  * The two input signals (primary and secondary) are in the full range
  * of a signed int; ie. 32-bit signed.
  */
 
-static void process_sample(struct timecoder *tc,
-                           signed int primary, signed int secondary)
+static void process_crossing(struct timecoder *tc, signed int primary)
 {
-    detect_zero_crossing(&tc->primary, primary, tc->zero_alpha);
-    detect_zero_crossing(&tc->secondary, secondary, tc->zero_alpha);
+    bool forwards;
+    double dx;
 
-    /* If an axis has been crossed, use the direction of the crossing
-     * to work out the direction of the vinyl */
+    /* Use the direction of the crossing to work out the direction of
+     * the vinyl */
 
-    if (tc->primary.swapped || tc->secondary.swapped) {
-        bool forwards;
-
-        if (tc->primary.swapped) {
-            forwards = (tc->primary.positive != tc->secondary.positive);
-        } else {
-            forwards = (tc->primary.positive == tc->secondary.positive);
-        }
+    if (tc->primary.swapped) {
+        forwards = (tc->primary.positive != tc->secondary.positive);
+    } else {
+        forwards = (tc->primary.positive == tc->secondary.positive);
+    }
 
-        if (tc->def->flags & SWITCH_PHASE)
-            forwards = !forwards;
+    if (tc->def->flags & SWITCH_PHASE)
+        forwards = !forwards;
 
-        if (forwards != tc->forwards) { /* direction has changed */
-            tc->forwards = forwards;
-            tc->valid_counter = 0;
-        }
+    if (forwards != tc->forwards) { /* direction has changed */
+        tc->forwards = forwards;
+        tc->valid_counter = 0;
     }
 
-    /* If any axis has been crossed, register movement using the pitch
-     * counters */
+    /* Register movement using the pitch counters */
 
-    if (!tc->primary.swapped && !tc->secondary.swapped)
-        pitch_dt_observation(&tc->pitch, 0.0);
-    else {
-        double dx;
-
-        dx = 1.0 / tc->def->resolution / 4;
-        if (!tc->forwards)
-            dx = -dx;
-        pitch_dt_observation(&tc->pitch, dx);
-    }
+    dx = 1.0 / tc->def->resolution / 4;
+    if (!tc->forwards)
+        dx = -dx;
+    pitch_dt_observation(&tc->pitch, dx);
 
     /* If we have crossed the primary channel in the right polarity,
      * it's time to read off a timecode 0 or 1 value */
@@ -537,6 +743,161 @@ static void process_sample(struct timecoder *tc,
     tc->timecode_ticker++;
 }
 
+/*
+ * Decode the bitstream of each candidate definition at a crossing,
+ * as process_crossing()
+ *
+ * The zero crossings of the channels are shared. Each candidate reads
+ * them as its own definition would, which may see the channels the
+ * other way round.
+ */
+
+static void detect_crossing(struct timecoder *tc, signed int primary,
+                            signed int secondary)
+{
+    unsigned int n;
+
+    for (n = 0; n < tc->candidates; n++) {
+        bool forwards;
+        struct timecoder_candidate *k;
+        const struct timecoder_channel *p, *s;
+        signed int v;
+
+        k = &tc->candidate[n];
+
+        if ((k->def->flags & SWITCH_PRIMARY)
+            == (tc->def->flags & SWITCH_PRIMARY))
+        {
+            p = &tc->primary;
+            s = &tc->secondary;
+            v = primary;
+        } else {
+            p = &tc->secondary;
+            s = &tc->primary;
+            v = secondary;
+        }
+
+        if (p->swapped)
+            forwards = (p->positive != s->positive);
+        else
+            forwards = (p->positive == s->positive);
+
+        if (k->def->flags & SWITCH_PHASE)
+            forwards = !forwards;
+
+        if (forwards != k->forwards) {
+            k->forwards = forwards;
+            k->valid_counter = 0;
+        }
+
+        if (s->swapped
+            && p->positive == ((k->def->flags & SWITCH_POLARITY) == 0))
+        {
+            signed int m;
+
+            m = abs(v / 2 - p->zero / 2);
+            add_bit(k->def, k->forwards, m > k->ref_level,
+                    &k->bitstream, &k->timecode, &k->valid_counter);
+
+            k->ref_level -= k->ref_level / REF_PEAKS_AVG;
+            k->ref_level += m / REF_PEAKS_AVG;
+        }
+    }
+}
+
+/*
+ * Process a block of samples from the incoming audio, given as
+ * separate primary and secondary channels
+ *
+ * Most samples are not at a crossing, and only update the filters.
+ * Their state is kept in local variables, so it stays in registers
+ * for the duration of the block, and the full decoding is only done
+ * at a crossing.
+ */
+
+static void process_block(struct timecoder *tc, const signed int *primary,
+                          const signed int *secondary, size_t n)
+{
+    size_t s;
+    unsigned int ticker, head, tail, counter;
+    double alpha;
+    struct timecoder_channel pc, sc;
+    struct pitch pitch;
+    struct timecoder_point *points;
+
+    alpha = tc->zero_alpha;
+
+    /* Points for the monitor are only added whilst the interface is
+     * taking them; otherwise the queue is full */
+
+    head = 0;
+    tail = 0;
+    points = __atomic_load_n(&tc->mon_points, __ATOMIC_ACQUIRE);
+    if (points != NULL) {
+        head = tc->mon_head;
+        tail = __atomic_load_n(&tc->mon_tail, __ATOMIC_ACQUIRE);
+        if (head - tail == MONITOR_POINTS)
+            points = NULL;
+    }
+    counter = tc->mon_counter;
+    pc = tc->primary;
+    sc = tc->secondary;
+    pitch = tc->pitch;
+    ticker = tc->timecode_ticker;
+
+    for (s = 0; s < n; s++) {
+        detect_zero_crossing(&pc, primary[s], alpha);
+        detect_zero_crossing(&sc, secondary[s], alpha);
+
+        if (!pc.swapped && !sc.swapped) {
+            pitch_dt_observation(&pitch, 0.0);
+            ticker++;
+        } else {
+            tc->primary = pc;
+            tc->secondary = sc;
+            tc->pitch = pitch;
+            tc->timecode_ticker = ticker;
+
+            process_crossing(tc, primary[s]);
+            if (tc->candidates > 0)
+                detect_crossing(tc, primary[s], secondary[s]);
+
+            pitch = tc->pitch;
+            ticker = tc->timecode_ticker;
+        }
+
+        if (points != NULL && ++counter % MONITOR_DECIMATE == 0
+            && head - tail < MONITOR_POINTS)
+        {
+            signed int x, y;
+            struct timecoder_point *pt;
+
+            if (tc->def->flags & SWITCH_PRIMARY) {
+                x = primary[s];
+                y = secondary[s];
+            } else {
+                x = secondary[s];
+                y = primary[s];
+            }
+
+            assert(tc->ref_level > 0);
+
+            pt = &points[head++ % MONITOR_POINTS];
+            pt->x = monitor_coord(x, tc->ref_level);
+            pt->y = monitor_coord(y, tc->ref_level);
+        }
+    }
+
+    if (points != NULL)
+        __atomic_store_n(&tc->mon_head, head, __ATOMIC_RELEASE);
+    tc->mon_counter = counter;
+
+    tc->primary = pc;
+    tc->secondary = sc;
+    tc->pitch = pitch;
+    tc->timecode_ticker = ticker;
+}
+
 /*
  * Cycle to the next timecode definition which has a valid lookup
  *
@@ -567,6 +928,141 @@ void timecoder_cycle_definition(struct timecoder *tc)
     tc->def = next_definition(tc->def);
     tc->valid_counter = 0;
     tc->timecode_ticker = 0;
+    __atomic_store_n(&tc->candidates, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the definition on the record, from all of those which have a
+ * lookup table (see timecoder_build_lookups())
+ *
+ * Every definition decodes the same audio until one of them reads a
+ * position, and it is then used as if it were given. Until then the
+ * definition given to timecoder_init() is used.
+ *
+ * Pre: not called while the timecoder is in use by the realtime thread
+ */
+
+void timecoder_detect(struct timecoder *tc)
+{
+    struct timecode_def *def;
+    unsigned int n;
+
+    assert(ARRAY_SIZE(timecodes) <= TIMECODER_CANDIDATES);
+
+    n = 0;
+
+    for (def = timecodes; def < timecodes + ARRAY_SIZE(timecodes); def++) {
+        struct timecoder_candidate *k;
+
+        if (!def->lookup)
+            continue;
+
+        k = &tc->candidate[n++];
+        k->def = def;
+        k->forwards = true;
+        k->ref_level = INT_MAX;
+        k->bitstream = 0;
+        k->timecode = 0;
+        k->valid_counter = 0;
+    }
+
+    tc->candidates = n;
+}
+
+/*
+ * Use the first candidate to read a valid position on the record, if
+ * any, in place of the current definition; the others are dropped
+ *
+ * Definitions which share a sequence of bits can only be told apart
+ * by the position being on the record; where it is on both, the first
+ * definition is used.
+ */
+
+static void lock_on(struct timecoder *tc)
+{
+    unsigned int n;
+
+    for (n = 0; n < tc->candidates; n++) {
+        struct timecoder_candidate *k;
+
+        k = &tc->candidate[n];
+
+        if (k->valid_counter <= VALID_BITS)
+            continue;
+
+        if (lut_lookup(&k->def->lut, k->bitstream) == (unsigned)-1)
+            continue;
+
+        /* The channels follow the primary of the definition */
+
+        if ((k->def->flags & SWITCH_PRIMARY)
+            != (tc->def->flags & SWITCH_PRIMARY))
+        {
+            struct timecoder_channel c;
+
+            c = tc->primary;
+            tc->primary = tc->secondary;
+            tc->secondary = c;
+        }
+
+        tc->def = k->def;
+        tc->forwards = k->forwards;
+        tc->ref_level = k->ref_level;
+        tc->bitstream = k->bitstream;
+        tc->timecode = k->timecode;
+        tc->valid_counter = k->valid_counter;
+
+        __atomic_store_n(&tc->candidates, 0, __ATOMIC_RELAXED);
+        return;
+    }
+}
+
+/*
+ * Reduce a block of input to the rate at which it is decoded, in
+ * place; a group of samples can span the end of a block
+ *
+ * Return: number of samples to decode
+ */
+
+static size_t decimate(struct timecoder *tc, signed int *left,
+                       signed int *right, size_t n)
+{
+    size_t s, m;
+    unsigned int summed;
+    signed long long l, r;
+    double scale;
+
+    /* Keep the state in registers for the duration of the block; a
+     * multiply is much cheaper than a division of each sum */
+
+    scale = 1.0 / tc->decimate;
+
+    l = tc->sum[0];
+    r = tc->sum[1];
+    summed = tc->summed;
+    m = 0;
+
+    for (s = 0; s < n; s++) {
+        l += left[s];
+        r += right[s];
+
+        if (++summed < tc->decimate)
+            continue;
+
+        left[m] = l * scale;
+        right[m] = r * scale;
+        m++;
+
+        l = 0;
+        r = 0;
+        summed = 0;
+    }
+
+    tc->sum[0] = l;
+    tc->sum[1] = r;
+    tc->summed = summed;
+
+    return m;
 }
 
 /*
@@ -577,24 +1073,84 @@ void timecoder_cycle_definition(struct timecoder *tc)
 
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
 {
-    while (npcm--) {
-        signed int left, right, primary, secondary;
+    while (npcm > 0) {
+        size_t n, s;
+        signed int left[BLOCK], right[BLOCK];
 
-        left = pcm[0] << 16;
-        right = pcm[1] << 16;
+        n = (npcm < BLOCK) ? npcm : BLOCK;
 
-        if (tc->def->flags & SWITCH_PRIMARY) {
-            primary = left;
-            secondary = right;
-        } else {
-            primary = right;
-            secondary = left;
+        for (s = 0; s < n; s++) {
+            left[s] = pcm[s * TIMECODER_CHANNELS] << 16;
+            right[s] = pcm[s * TIMECODER_CHANNELS + 1] << 16;
         }
 
-        process_sample(tc, primary, secondary);
-        update_monitor(tc, left, right);
+        pcm += n * TIMECODER_CHANNELS;
+        npcm -= n;
+
+        if (tc->decimate > 1)
+            n = decimate(tc, left, right, n);
+
+        if (tc->def->flags & SWITCH_PRIMARY)
+            process_block(tc, left, right, n);
+        else
+            process_block(tc, right, left, n);
+
+        if (tc->candidates > 0)
+            lock_on(tc);
+    }
+}
+
+/*
+ * Return: v, at a full scale of 1.0, in the range of signed int
+ */
+
+static inline signed int from_float(float v)
+{
+    if (v >= 1.0f)
+        return INT_MAX;
+    else if (v <= -1.0f)
+        return INT_MIN;
+    else
+        return (signed int)(v * 2147483648.0f);
+}
+
+/*
+ * Submit and decode a block of PCM audio data, as timecoder_submit()
+ *
+ * PCM data is at a full scale of 1.0, so it is used at more than
+ * 16-bit resolution where the device provides it. Each channel is in
+ * its own buffer, as the device provides it, so nothing needs to be
+ * deinterleaved.
+ */
+
+void timecoder_submit_planar(struct timecoder *tc, const float *left,
+                             const float *right, size_t npcm)
+{
+    while (npcm > 0) {
+        size_t n, s;
+        signed int l[BLOCK], r[BLOCK];
+
+        n = (npcm < BLOCK) ? npcm : BLOCK;
+
+        for (s = 0; s < n; s++) {
+            l[s] = from_float(left[s]);
+            r[s] = from_float(right[s]);
+        }
+
+        left += n;
+        right += n;
+        npcm -= n;
+
+        if (tc->decimate > 1)
+            n = decimate(tc, l, r, n);
+
+        if (tc->def->flags & SWITCH_PRIMARY)
+            process_block(tc, l, r, n);
+        else
+            process_block(tc, r, l, n);
 
-        pcm += TIMECODER_CHANNELS;
+        if (tc->candidates > 0)
+            lock_on(tc);
     }
 }
 
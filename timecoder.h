@@ -22,10 +22,12 @@
 
 #include <stdbool.h>
 
+#include "cacheline.h"
 #include "lut.h"
 #include "pitch.h"
 
 #define TIMECODER_CHANNELS 2
+#define TIMECODER_CANDIDATES 8 /* at least the number of definitions */
 
 typedef unsigned int bits_t;
 
@@ -49,13 +51,34 @@ struct timecoder_channel {
     unsigned int crossing_ticker; /* samples since we last crossed zero */
 };
 
+/* A decoder of the bitstream alone, for one definition which may be
+ * on the record; see timecoder_detect() */
+
+struct timecoder_candidate {
+    struct timecode_def *def;
+    bool forwards;
+    signed int ref_level;
+    bits_t bitstream, timecode;
+    unsigned int valid_counter;
+};
+
+struct timecoder_point {
+    signed short x, y;
+};
+
 struct timecoder {
     struct timecode_def *def;
     double speed;
 
     /* Precomputed values */
 
-    double dt, zero_alpha;
+    double dt, zero_alpha; /* of each sample decoded */
+
+    /* Input is decoded at a lower rate; see timecoder_set_max_rate() */
+
+    unsigned int decimate, /* input samples to each one decoded */
+        summed;
+    signed long long sum[TIMECODER_CHANNELS];
 
     /* Pitch information */
 
@@ -71,24 +94,50 @@ struct timecoder {
     unsigned int valid_counter, /* number of successful error checks */
         timecode_ticker; /* samples since valid timecode was read */
 
-    /* Feedback */
+    /* Definitions being tried, until one is found on the record */
+
+    unsigned int candidates; /* or 0 if not detecting */
+    struct timecoder_candidate candidate[TIMECODER_CANDIDATES];
+
+    /* Feedback; points are queued by the realtime thread, and drawn
+     * onto the x-y array by the interface */
+
+    struct timecoder_point *mon_points;
+    unsigned int mon_head, /* next point to be added */
+        mon_counter;
+
+    /* Everything above is the working state of the realtime thread;
+     * what follows is written by the interface as it draws the
+     * monitor, so it is kept to cache lines of its own */
+
+    unsigned int mon_tail /* next point to be drawn */
+        __attribute__ ((aligned(CACHE_LINE)));
+    unsigned int mon_decay;
 
     unsigned char *mon; /* x-y array */
-    int mon_size, mon_counter;
+    int mon_size;
 };
 
 struct timecode_def* timecoder_find_definition(const char *name);
+int timecoder_build_lookups(void);
+void timecoder_set_cache_dir(const char *dir);
 void timecoder_free_lookup(void);
 
 void timecoder_init(struct timecoder *tc, struct timecode_def *def,
                     double speed, unsigned int sample_rate);
+void timecoder_set_max_rate(struct timecoder *tc, unsigned int rate);
+void timecoder_set_pitch_filter(struct timecoder *tc, int filter);
 void timecoder_clear(struct timecoder *tc);
 
 int timecoder_monitor_init(struct timecoder *tc, int size);
 void timecoder_monitor_clear(struct timecoder *tc);
+void timecoder_monitor_update(struct timecoder *tc);
 
 void timecoder_cycle_definition(struct timecoder *tc);
+void timecoder_detect(struct timecoder *tc);
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm);
+void timecoder_submit_planar(struct timecoder *tc, const float *left,
+                             const float *right, size_t npcm);
 signed int timecoder_get_position(struct timecoder *tc, double *when);
 
 /*
@@ -100,6 +149,15 @@ static inline struct timecode_def* timecoder_get_definition(struct timecoder *tc
     return tc->def;
 }
 
+/*
+ * Return: true if the definition is still to be detected
+ */
+
+static inline bool timecoder_is_detecting(struct timecoder *tc)
+{
+    return __atomic_load_n(&tc->candidates, __ATOMIC_RELAXED) > 0;
+}
+
 /*
  * Return the pitch relative to reference playback speed
  */
@@ -17,34 +17,110 @@
  *
  */
 
-#define _BSD_SOURCE /* vfork() */
+#define _GNU_SOURCE /* F_SETPIPE_SZ, syscall() */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/mman.h> /* mlock() */
+#include <sys/mman.h> /* mlock(), madvise() */
 
 #include "debug.h"
+#include "decoder.h"
 #include "external.h"
 #include "list.h"
+#include "pack.h"
+#include "pcmcache.h"
+#include "pool.h"
 #include "realtime.h"
 #include "rig.h"
 #include "status.h"
 #include "track.h"
 
-#define RATE 44100
+#define RATE 44100 /* of the empty track */
+
+/* Ask for a large pipe from the importer, so that audio arrives in
+ * fewer, larger reads. The kernel may limit this for unprivileged
+ * users (see /proc/sys/fs/pipe-max-size) and this is not an error */
+
+#define PIPE_BYTES (1024 * 1024)
+
+#define METER_BATCH 4096 /* samples */
+#define DECODE_BATCH 65536 /* samples, read at once by the thread */
+
+/* A track read natively is divided into segments of at least this
+ * length, each decoded by a thread of its own */
+
+#define SEGMENT_MIN (60 * 5) /* seconds */
+#define MAX_SEGMENTS 4
+
+/* Importers run at a lower priority than the interface; a track which
+ * is not yet wanted on a deck is lower still */
+
+#define NICE_FOREGROUND 5
+#define NICE_BACKGROUND 15
+
+/* See ioprio_set(2), for which there is no glibc wrapper */
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_FOREGROUND 4
+#define IOPRIO_BACKGROUND 7
 
 #define SAMPLE (sizeof(signed short) * TRACK_CHANNELS) /* bytes per sample */
-#define TRACK_BLOCK_PCM_BYTES (TRACK_BLOCK_SAMPLES * SAMPLE)
 
-#define _STR(tok) #tok
-#define STR(tok) _STR(tok)
+#define REGISTRY_BUCKETS 1024 /* power of two */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/* Part of a track imported within the program, by one thread; see
+ * decode_segment() */
+
+struct segment {
+    struct track *track;
+    struct decode *decode;
+
+    unsigned int start, end, /* samples, from a block boundary */
+        pos; /* next to be decoded */
+
+    pthread_t thread;
+    pid_t tid; /* of the thread, once it is running */
+    bool started, /* the thread was created */
+        decoded; /* thread is done */
+    int result; /* of the thread, 0 on success */
+
+    unsigned short ppm; /* meters, as those of the track */
+    unsigned int overview;
+};
+
+/* Packing of the audio of a kept track, by a thread; see
+ * pack_track() */
+
+struct packer {
+    struct track *track;
+    struct pack pack;
+
+    pthread_t thread;
+    bool done; /* thread is done */
+    int result; /* of the thread, 0 on success */
+};
 
-static struct list tracks = LIST_INIT(tracks);
-static bool use_mlock = false;
+static struct list registry[REGISTRY_BUCKETS], /* tracks, by hash */
+    kept = LIST_INIT(kept); /* most recently used first */
+static bool use_mlock = false, use_pack = false;
+static size_t keep_bytes = 0;
 
 /*
  * An empty track is used rarely, and is easier than
@@ -53,13 +129,21 @@ static bool use_mlock = false;
 
 static struct track empty = {
     .refcount = 1,
+    .queued = false,
+    .is_kept = false,
 
     .rate = RATE,
     .bytes = 0,
     .length = 0,
     .blocks = 0,
 
-    .pid = 0
+    .map = NULL,
+    .cache = NULL,
+
+    .pid = 0,
+    .segment = NULL,
+    .pack = NULL,
+    .packer = NULL
 };
 
 /*
@@ -73,41 +157,127 @@ void track_use_mlock(void)
 }
 
 /*
- * Allocate more memory
+ * Request that kept tracks are packed to use less memory, rather than
+ * forgotten, when there is no more room for them
+ */
+
+void track_use_pack(void)
+{
+    use_pack = true;
+}
+
+/*
+ * Keep recently used tracks in memory, up to the given size
+ *
+ * Otherwise a track is freed as soon as it is no longer used.
+ */
+
+void track_set_keep(size_t bytes)
+{
+    keep_bytes = bytes;
+}
+
+/*
+ * Allocate memory for a block outside of the pool, aligned so that
+ * as much of it as possible can be on huge pages
+ *
+ * Return: pointer to memory, or NULL on error
+ */
+
+static void* alloc_memory(size_t bytes)
+{
+    int r;
+    void *p;
+
+    if (bytes < POOL_HUGE_PAGE) {
+        p = malloc(bytes);
+        if (p == NULL)
+            perror("malloc");
+        return p;
+    }
+
+    r = posix_memalign(&p, POOL_HUGE_PAGE, bytes);
+    if (r != 0) {
+        errno = r;
+        perror("posix_memalign");
+        return NULL;
+    }
+
+    /* Only whole huge pages, so the end of the block does not use
+     * one of its own */
+
+    if (madvise(p, bytes / POOL_HUGE_PAGE * POOL_HUGE_PAGE,
+                MADV_HUGEPAGE) == -1)
+    {
+        debug("madvise: %s", strerror(errno));
+    }
+
+    return p;
+}
+
+/*
+ * Allocate the memory for the given block
  *
  * Return: -1 if memory could not be allocated, otherwize 0
+ * Post: if 0, tr->block[n] is set
  */
 
-static int more_space(struct track *tr)
+static int alloc_block(struct track *tr, unsigned int n)
 {
-    struct track_block *block;
+    signed short *block;
+    unsigned int samples;
+    size_t bytes;
 
     rt_not_allowed();
 
-    if (tr->blocks >= TRACK_MAX_BLOCKS) {
-        fprintf(stderr, "Maximum track length reached.\n");
-        return -1;
-    }
+    samples = track_block_samples(n);
+    bytes = track_bytes(samples);
+
+    /* Memory from the pool is already faulted in (and locked, if
+     * requested) so prefer it; fall back when the pool is used up */
 
-    block = malloc(sizeof(struct track_block));
+    block = pool_alloc(samples);
     if (block == NULL) {
-        perror("malloc");
-        return -1;
+        block = alloc_memory(bytes);
+        if (block == NULL)
+            return -1;
+
+        if (use_mlock && mlock(block, bytes) == -1) {
+            perror("mlock");
+            free(block);
+            return -1;
+        }
     }
 
-    if (use_mlock && mlock(block, sizeof(struct track_block)) == -1) {
-        perror("mlock");
-        free(block);
+    /* No memory barrier is needed here, because nobody else tries to
+     * access this block until tr->length (or tr->ready) is actually
+     * incremented */
+
+    tr->block[n] = block;
+
+    return 0;
+}
+
+/*
+ * Allocate more memory
+ *
+ * Return: -1 if memory could not be allocated, otherwize 0
+ */
+
+static int more_space(struct track *tr)
+{
+    if (tr->blocks >= TRACK_MAX_BLOCKS) {
+        fprintf(stderr, "Maximum track length reached.\n");
         return -1;
     }
 
-    /* No memory barrier is needed here, because nobody else tries to
-     * access these blocks until tr->length is actually incremented */
+    if (alloc_block(tr, tr->blocks) == -1)
+        return -1;
 
-    tr->block[tr->blocks++] = block;
+    tr->blocks++;
 
     debug("allocated new track block (%d blocks, %zu bytes)",
-          tr->blocks, tr->blocks * TRACK_BLOCK_SAMPLES * SAMPLE);
+          tr->blocks, track_bytes(track_block_start(tr->blocks)));
 
     return 0;
 }
@@ -121,77 +291,176 @@ static int more_space(struct track *tr)
 
 static void* access_pcm(struct track *tr, size_t *len)
 {
-    unsigned int block;
+    unsigned int block, offset;
     size_t fill;
 
-    block = tr->bytes / TRACK_BLOCK_PCM_BYTES;
+    block = track_block(tr->bytes / SAMPLE, &offset);
     if (block == tr->blocks) {
         if (more_space(tr) == -1)
             return NULL;
     }
 
-    fill = tr->bytes % TRACK_BLOCK_PCM_BYTES;
-    *len = TRACK_BLOCK_PCM_BYTES - fill;
+    fill = offset * SAMPLE + tr->bytes % SAMPLE;
+    *len = track_block_samples(block) * SAMPLE - fill;
 
-    return (void*)tr->block[block]->pcm + fill;
+    return (char*)tr->block[block] + fill;
 }
 
 /*
- * Notify that audio has been placed in the buffer
+ * Calculate the level of each sample for metering
  *
- * The parameter is the number of stereo samples which have been
- * placed in the buffer.
+ * This is kept separate from the meters themselves, so it can be
+ * vectorised by the compiler.
  */
 
-static void commit_pcm_samples(struct track *tr, unsigned int samples)
+static void levels(unsigned short *v, const signed short *pcm,
+                   unsigned int samples)
 {
-    unsigned int fill, n;
-    signed short *pcm;
-    struct track_block *block;
+    unsigned int n;
 
-    block = tr->block[tr->length / TRACK_BLOCK_SAMPLES];
-    fill = tr->length % TRACK_BLOCK_SAMPLES;
-    pcm = block->pcm + TRACK_CHANNELS * fill;
+    for (n = 0; n < samples; n++)
+        v[n] = abs(pcm[n * TRACK_CHANNELS]) + abs(pcm[n * TRACK_CHANNELS + 1]);
+}
 
-    assert(samples <= TRACK_BLOCK_SAMPLES - fill);
+/*
+ * Bring the peaks above a meter value up to date, after it is stored
+ *
+ * The peak of a pair is taken only from values which have been
+ * stored, so the levels are valid up to the end of the audio; the
+ * last meter value may be stored again as more audio arrives.
+ */
 
-    /* Meter the new audio */
+static void update_peaks(unsigned char *level[], unsigned int levels,
+                         unsigned int i)
+{
+    unsigned int l;
 
-    for (n = samples; n > 0; n--) {
-        unsigned short v;
-        unsigned int w;
+    for (l = 1; l <= levels; l++) {
+        unsigned int x;
+        unsigned char v;
 
-        v = abs(pcm[0]) + abs(pcm[1]);
+        x = i >> l << 1; /* first of the pair, in the level below */
+        v = level[l - 1][x];
+        if (x + 1 <= i >> (l - 1) && level[l - 1][x + 1] > v)
+            v = level[l - 1][x + 1];
 
-        /* PPM-style fast meter approximation */
+        level[l][i >> l] = v;
+    }
+}
 
-        if (v > tr->ppm)
-            tr->ppm += (v - tr->ppm) >> 3;
-        else
-            tr->ppm -= (tr->ppm - v) >> 9;
+/*
+ * Run the meters over the given levels
+ *
+ * The meters are filters whose output depends on the previous
+ * sample, so cannot be vectorised. But both directions are calculated
+ * and selected without a branch, and each meter value is stored once
+ * when it is complete, not on every sample. The state of the filters
+ * is carried from one call to the next in *last_ppm and
+ * *last_overview.
+ */
+
+static void meter(struct track *tr, unsigned int block,
+                  unsigned int fill, const unsigned short *v,
+                  unsigned int samples, unsigned short *last_ppm,
+                  unsigned int *last_overview)
+{
+    unsigned int n, end, overview, l;
+    unsigned short ppm;
+    unsigned char *ppm_meter, *overview_meter,
+        *ppm_peak[TRACK_PPM_LEVELS + 1],
+        *overview_peak[TRACK_OVERVIEW_LEVELS + 1];
 
-        block->ppm[fill / TRACK_PPM_RES] = tr->ppm >> 8;
+    for (l = 0; l <= TRACK_PPM_LEVELS; l++)
+        ppm_peak[l] = track_block_ppm_peak(tr, block, l);
+    for (l = 0; l <= TRACK_OVERVIEW_LEVELS; l++)
+        overview_peak[l] = track_block_overview_peak(tr, block, l);
 
-        /* Update the slow-metering overview. Fixed point arithmetic
-         * going on here */
+    ppm_meter = ppm_peak[0];
+    overview_meter = overview_peak[0];
 
-        w = v << 16;
+    ppm = *last_ppm;
+    overview = *last_overview;
 
-        if (w > tr->overview)
-            tr->overview += (w - tr->overview) >> 8;
-        else
-            tr->overview -= (tr->overview - w) >> 17;
+    for (n = 0; n < samples;) {
+
+        /* Up to the end of this PPM meter value */
+
+        end = n + TRACK_PPM_RES - (fill + n) % TRACK_PPM_RES;
+        if (end > samples)
+            end = samples;
+
+        for (; n < end; n++) {
+            unsigned int w, up, down;
+
+            /* PPM-style fast meter approximation */
 
-        block->overview[fill / TRACK_OVERVIEW_RES] = tr->overview >> 24;
+            up = (v[n] - ppm) >> 3;
+            down = (ppm - v[n]) >> 9;
+            ppm = (v[n] > ppm) ? ppm + up : ppm - down;
 
-        fill++;
-        pcm += TRACK_CHANNELS;
+            /* Update the slow-metering overview. Fixed point
+             * arithmetic going on here */
+
+            w = (unsigned int)v[n] << 16;
+
+            up = (w - overview) >> 8;
+            down = (overview - w) >> 17;
+            overview = (w > overview) ? overview + up : overview - down;
+        }
+
+        ppm_meter[(fill + n - 1) / TRACK_PPM_RES] = ppm >> 8;
+        overview_meter[(fill + n - 1) / TRACK_OVERVIEW_RES] = overview >> 24;
+
+        update_peaks(ppm_peak, TRACK_PPM_LEVELS,
+                     (fill + n - 1) / TRACK_PPM_RES);
+        update_peaks(overview_peak, TRACK_OVERVIEW_LEVELS,
+                     (fill + n - 1) / TRACK_OVERVIEW_RES);
     }
 
-    /* Increment the track length. A memory barrier ensures the
-     * realtime or UI thread does not access garbage audio */
+    *last_ppm = ppm;
+    *last_overview = overview;
+}
+
+/*
+ * Notify that audio has been placed in the buffer
+ *
+ * The parameter is the number of stereo samples which have been
+ * placed in the buffer.
+ */
+
+static void commit_pcm_samples(struct track *tr, unsigned int samples)
+{
+    unsigned int block, fill;
+    signed short *pcm;
+
+    block = track_block(tr->length, &fill);
+    pcm = tr->block[block] + TRACK_CHANNELS * fill;
+
+    assert(samples <= track_block_samples(block) - fill);
+
+    /* Meter the new audio, in batches */
+
+    while (samples > 0) {
+        unsigned int n;
+        unsigned short v[METER_BATCH];
+
+        n = samples;
+        if (n > METER_BATCH)
+            n = METER_BATCH;
+
+        levels(v, pcm, n);
+        meter(tr, block, fill, v, n, &tr->ppm, &tr->overview);
+
+        /* Increment the track length. A memory barrier ensures the
+         * realtime or UI thread does not access garbage audio or
+         * incomplete meters */
 
-    __sync_fetch_and_add(&tr->length, samples);
+        __sync_fetch_and_add(&tr->length, n);
+
+        samples -= n;
+        fill += n;
+        pcm += TRACK_CHANNELS * n;
+    }
 }
 
 /*
@@ -203,213 +472,1191 @@ static void commit_pcm_samples(struct track *tr, unsigned int samples)
 
 static void commit(struct track *tr, size_t len)
 {
+    pcmcache_write(tr, tr->bytes, len);
+
     tr->bytes += len;
     commit_pcm_samples(tr, tr->bytes / SAMPLE - tr->length);
 }
 
 /*
- * Initialise object which will hold PCM audio data, and start
- * importing the data
+ * Notify that audio has been placed in a segment other than the
+ * first, which is ahead of the length of the track
  *
- * Post: track is initialised
- * Post: track is importing
+ * Pre: the given number of samples from s->pos are in the track, and
+ *     lie within one block
+ * Post: the samples are ready to play; see track_block_ready()
  */
 
-static int track_init(struct track *t, const char *importer, const char *path)
+static void commit_segment(struct segment *s, unsigned int samples)
 {
-    pid_t pid;
-
-    fprintf(stderr, "Importing '%s'...\n", path);
+    unsigned int block, fill;
+    signed short *pcm;
+    struct track *tr = s->track;
 
-    pid = fork_pipe_nb(&t->fd, importer, "import", path, STR(RATE), NULL);
-    if (pid == -1)
-        return -1;
+    block = track_block(s->pos, &fill);
+    pcm = tr->block[block] + TRACK_CHANNELS * fill;
 
-    t->pid = pid;
-    t->pe = NULL;
-    t->terminated = false;
+    assert(samples <= track_block_samples(block) - fill);
 
-    t->refcount = 0;
+    pcmcache_write(tr, (size_t)s->pos * SAMPLE, samples * SAMPLE);
+    s->pos += samples;
 
-    t->blocks = 0;
-    t->rate = RATE;
+    while (samples > 0) {
+        unsigned int n;
+        unsigned short v[METER_BATCH];
 
-    t->bytes = 0;
-    t->length = 0;
-    t->ppm = 0;
-    t->overview = 0;
+        n = samples;
+        if (n > METER_BATCH)
+            n = METER_BATCH;
 
-    t->importer = importer;
-    t->path = path;
+        levels(v, pcm, n);
+        meter(tr, block, fill, v, n, &s->ppm, &s->overview);
 
-    list_add(&t->tracks, &tracks);
-    rig_post_track(t);
+        fill += n;
+        __atomic_store_n(&tr->ready[block], fill, __ATOMIC_RELEASE);
 
-    return 0;
+        samples -= n;
+        pcm += TRACK_CHANNELS * n;
+    }
 }
 
 /*
- * Destroy this track from memory
- *
- * Terminates any import processes and frees any memory allocated by
- * this object.
+ * Use the cached copy of a track, if there is one
  *
- * Pre: track is not importing
- * Pre: track is initialised
+ * Return: -1 if the track is not cached, otherwise 0
+ * Post: if 0, track is initialised and is not importing
  */
 
-static void track_clear(struct track *tr)
+static int track_init_from_cache(struct track *t, const char *importer,
+                                 const char *path)
 {
-    int n;
+    t->map = NULL;
+    t->cache = NULL;
 
-    assert(tr->pid == 0);
+    if (pcmcache_map(t, importer, path, t->rate) == -1)
+        return -1;
+
+    if (use_mlock && mlock(t->map, t->map_bytes) == -1) {
+        perror("mlock");
+        pcmcache_unmap(t);
+        return -1;
+    }
 
-    for (n = 0; n < tr->blocks; n++)
-        free(tr->block[n]);
+    fprintf(stderr, "Loaded '%s' from cache\n", path);
 
-    list_del(&tr->tracks);
-}
+    t->pid = 0;
+    t->segment = NULL;
+    t->pack = NULL;
+    t->packer = NULL;
+    t->queued = false;
+    t->is_kept = false;
+    t->terminated = false;
+    t->finished = true;
 
-/*
- * Get a pointer to a track object already in memory
- *
- * Return: pointer, or NULL if no such track exists
- */
+    t->refcount = 0;
+    t->ppm = 0;
+    t->overview = 0;
 
-static struct track* track_get_again(const char *importer, const char *path)
-{
-    struct track *t;
+    t->importer = importer;
+    t->path = path;
 
-    list_for_each(t, &tracks, tracks) {
-        if (t->importer == importer && t->path == path) {
-            track_get(t);
-            return t;
-        }
-    }
+    t->ahead = false;
+    memset(t->ready, 0, sizeof t->ready);
 
-    return NULL;
+    return 0;
 }
 
 /*
- * Get a pointer to a track object for the given importer and path
+ * Initialise object which will hold PCM audio data, and queue the
+ * import of the data
  *
- * Return: pointer, or NULL if not enough resources
+ * Post: track is initialised
+ * Post: track is queued for import, or was loaded from the cache
  */
 
-struct track* track_get_by_import(const char *importer, const char *path)
+static int track_init(struct track *t, const char *importer, const char *path,
+                      bool background)
 {
-    struct track *t;
+    if (track_init_from_cache(t, importer, path) == 0)
+        return 0;
 
-    t = track_get_again(importer, path);
-    if (t != NULL)
-        return t;
+    t->pid = 0;
+    t->segment = NULL;
+    t->pack = NULL;
+    t->packer = NULL;
+    t->queued = true;
+    t->is_kept = false;
+    t->background = background;
+    t->terminated = false;
+    t->finished = false;
 
-    t = malloc(sizeof *t);
-    if (t == NULL) {
-        perror("malloc");
-        return NULL;
-    }
+    t->refcount = 0;
 
-    if (track_init(t, importer, path) == -1) {
-        free(t);
-        return NULL;
-    }
+    t->blocks = 0;
 
-    track_get(t);
+    t->bytes = 0;
+    t->length = 0;
+    t->ppm = 0;
+    t->overview = 0;
 
-    return t;
+    t->importer = importer;
+    t->path = path;
+
+    t->ahead = false;
+    memset(t->ready, 0, sizeof t->ready);
+
+    rig_post_track(t);
+
+    return 0;
 }
 
 /*
- * Get a pointer to a static track containing no audio
- *
- * Return: pointer, not NULL
+ * Return: true if the import is running, by a process or thread,
+ *     or the audio is being packed
  */
 
-struct track* track_get_empty(void)
-{
-    empty.refcount++;
-    return &empty;
-}
-
-void track_get(struct track *t)
+static bool is_running(const struct track *t)
 {
-    t->refcount++;
+    return t->pid != 0 || t->segment != NULL
+        || (t->packer != NULL && !t->queued);
 }
 
 /*
- * Request premature termination of an import operation
+ * Set the CPU and I/O priority of the given process or thread
  */
 
-static void terminate(struct track *t)
+static void set_priority(const struct track *t, pid_t who)
 {
-    assert(t->pid != 0);
+    int nice, ioprio;
 
-    if (kill(t->pid, SIGTERM) == -1)
-        abort();
+    if (t->background) {
+        nice = NICE_BACKGROUND;
+        ioprio = IOPRIO_BACKGROUND;
+    } else {
+        nice = NICE_FOREGROUND;
+        ioprio = IOPRIO_FOREGROUND;
+    }
 
-    t->terminated = true;
+    if (setpriority(PRIO_PROCESS, who, nice) == -1)
+        debug("setpriority: %s", strerror(errno));
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, who,
+                IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | ioprio) == -1)
+    {
+        debug("ioprio_set: %s", strerror(errno));
+    }
 }
 
 /*
- * Finish use of a track object
+ * Set the CPU and I/O priority of the import process, or threads
  */
 
-void track_put(struct track *t)
+static void set_import_priority(struct track *t)
 {
-    t->refcount--;
+    unsigned int n;
 
-    /* When importing, a reference is held. If it's the
-     * only one remaining terminate it to save resources */
+    assert(is_running(t));
 
-    if (t->refcount == 1 && t->pid != 0) {
-        terminate(t);
+    if (t->packer != NULL) /* stays in the background */
+        return;
+
+    if (t->segment == NULL) {
+        set_priority(t, t->pid);
         return;
     }
 
-    if (t->refcount == 0) {
-        assert(t != &empty);
-        track_clear(t);
-        free(t);
+    for (n = 0; n < t->segments; n++) {
+        pid_t tid;
+
+        /* A thread sets its own when it starts */
+
+        tid = __atomic_load_n(&t->segment[n].tid, __ATOMIC_RELAXED);
+        if (tid != 0)
+            set_priority(t, tid);
     }
 }
 
 /*
- * Get entry for use by poll()
- *
- * Pre: track is importing
- * Post: *pe contains poll entry
+ * Wake the rig from an import thread
  */
 
-void track_pollfd(struct track *t, struct pollfd *pe)
+static void wake_rig(struct track *t)
 {
-    assert(t->pid != 0);
+    uint64_t one = 1;
 
-    pe->fd = t->fd;
-    pe->events = POLLIN;
-
-    t->pe = pe;
+    if (write(t->fd, &one, sizeof one) == -1)
+        perror("write");
 }
 
 /*
- * Read the next block of data from the file handle into the track's
- * PCM data
+ * Thread which imports one segment of a track read natively, directly
+ * into its blocks
  *
- * Return: -1 on completion, otherwise zero
+ * The first segment increases the length of the track, as any import
+ * does. The others fill blocks ahead of it, and the rig brings the
+ * length up to date once the first is done.
  */
 
-static int read_from_pipe(struct track *tr)
+static void* decode_segment(void *p)
 {
-    for (;;) {
-        void *pcm;
-        size_t len;
-        ssize_t z;
+    int result;
+    struct segment *s = p;
+    struct track *t = s->track;
 
-        pcm = access_pcm(tr, &len);
+    __atomic_store_n(&s->tid, syscall(SYS_gettid), __ATOMIC_RELAXED);
+    set_priority(t, s->tid);
+
+    result = decode_seek(s->decode, s->start);
+
+    while (result == 0 && s->pos < s->end) {
+        unsigned int block, fill, samples;
+        ssize_t z;
+
+        if (__atomic_load_n(&t->cancel, __ATOMIC_RELAXED))
+            break;
+
+        block = track_block(s->pos, &fill);
+        if (t->block[block] == NULL && alloc_block(t, block) == -1) {
+            result = -1;
+            break;
+        }
+
+        samples = track_block_samples(block) - fill;
+        if (samples > s->end - s->pos)
+            samples = s->end - s->pos;
+        if (samples > DECODE_BATCH)
+            samples = DECODE_BATCH;
+
+        z = decode_read(s->decode, t->block[block] + fill * TRACK_CHANNELS,
+                        samples);
+        __atomic_fetch_add(&t->reads, 1, __ATOMIC_RELAXED);
+
+        if (z == -1) {
+            result = -1;
+            break;
+        }
+
+        if (z == 0) /* end of file */
+            break;
+
+        if (s->start == 0) {
+            commit(t, z * SAMPLE);
+            s->pos += z;
+            continue;
+        }
+
+        commit_segment(s, z);
+
+        /* On each block, the length can be brought further */
+
+        if (fill + z == track_block_samples(block))
+            wake_rig(t);
+    }
+
+    s->result = result;
+    __atomic_store_n(&s->decoded, true, __ATOMIC_RELEASE);
+
+    wake_rig(t); /* to finish the import */
+
+    return NULL;
+}
+
+/*
+ * Open the audio of a track to be read natively, from its pack if it
+ * has one
+ *
+ * Return: -1 if the track is not read natively, otherwise 0
+ */
+
+static int open_source(struct track *t, struct decode *d)
+{
+    if (t->pack != NULL) {
+        decode_open_pack(d, t->pack);
+        return 0;
+    }
+
+    return decode_open(d, t->path, t->rate);
+}
+
+/*
+ * Return: the first block boundary at or after the given sample
+ */
+
+static unsigned int block_boundary(unsigned int s)
+{
+    unsigned int b, offset;
+
+    b = track_block(s, &offset);
+    if (offset == 0)
+        return s;
+
+    return track_block_start(b + 1);
+}
+
+/*
+ * Divide into segments a track which has been opened natively
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0, t->segment and t->segments are set, and describe
+ *     segments each with their own decode, d being the first
+ */
+
+static int make_segments(struct track *t, struct decode *d)
+{
+    unsigned int n, segments, total;
+
+    total = d->samples;
+
+    segments = total / ((unsigned int)t->rate * SEGMENT_MIN);
+    if (segments < 1)
+        segments = 1;
+    if (segments > MAX_SEGMENTS)
+        segments = MAX_SEGMENTS;
+
+    t->segment = malloc(sizeof *t->segment * segments);
+    if (t->segment == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (n = 0; n < segments; n++) {
+        struct segment *s = &t->segment[n];
+
+        s->track = t;
+        s->started = false;
+        s->decoded = false;
+        s->tid = 0;
+        s->result = 0;
+        s->ppm = 0;
+        s->overview = 0;
+
+        /* Each is at least SEGMENT_MIN, so is still not empty when
+         * moved to a block boundary */
+
+        s->start = block_boundary((uint64_t)total * n / segments);
+        s->pos = s->start;
+        if (n > 0)
+            t->segment[n - 1].end = s->start;
+
+        if (n == 0) {
+            s->decode = d;
+            continue;
+        }
+
+        s->decode = malloc(sizeof *s->decode);
+        if (s->decode == NULL) {
+            perror("malloc");
+            goto fail;
+        }
+
+        if (open_source(t, s->decode) == -1) {
+            free(s->decode);
+            goto fail;
+        }
+
+        if (s->decode->samples != total) { /* file has changed */
+            decode_close(s->decode);
+            free(s->decode);
+            goto fail;
+        }
+    }
+
+    t->segment[segments - 1].end = total;
+    t->segments = segments;
+
+    return 0;
+
+ fail:
+    while (--n > 0) {
+        decode_close(t->segment[n].decode);
+        free(t->segment[n].decode);
+    }
+    free(t->segment);
+    t->segment = NULL;
+    return -1;
+}
+
+/*
+ * Free the segments of a track, the threads of which are done
+ *
+ * Post: t->segment is NULL
+ */
+
+static void free_segments(struct track *t)
+{
+    unsigned int n;
+
+    for (n = 0; n < t->segments; n++) {
+        decode_close(t->segment[n].decode);
+        free(t->segment[n].decode);
+    }
+
+    free(t->segment);
+    t->segment = NULL;
+}
+
+/*
+ * Start the thread of each segment of a track
+ *
+ * If a thread cannot be started, the import is cancelled and the
+ * threads will finish with an error.
+ */
+
+static void start_segments(struct track *t)
+{
+    unsigned int n;
+
+    for (n = 0; n < t->segments; n++) {
+        int r;
+        struct segment *s = &t->segment[n];
+
+        r = pthread_create(&s->thread, NULL, decode_segment, s);
+        if (r != 0) {
+            errno = r;
+            perror("pthread_create");
+            break;
+        }
+
+        s->started = true;
+    }
+
+    if (n == t->segments)
+        return;
+
+    __atomic_store_n(&t->cancel, true, __ATOMIC_RELAXED);
+
+    for (; n < t->segments; n++) {
+        t->segment[n].result = -1;
+        t->segment[n].decoded = true;
+    }
+
+    wake_rig(t);
+}
+
+/*
+ * Import the track within the program, if it can be read natively
+ *
+ * Return: -1 if the track must be imported by the importer,
+ *     otherwise 0
+ * Post: if 0, track is importing
+ */
+
+static int start_decode(struct track *t)
+{
+    unsigned int n, blocks, offset;
+    struct decode *d;
+
+    d = malloc(sizeof *d);
+    if (d == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (open_source(t, d) == -1)
+        goto fail;
+
+    if (d->samples > UINT_MAX) /* longer than a track can be */
+        goto fail_open;
+
+    if (make_segments(t, d) == -1)
+        goto fail_open;
+
+    /* The rig is woken through this, as the threads progress */
+
+    t->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->fd == -1) {
+        perror("eventfd");
+        free_segments(t);
+        return -1;
+    }
+
+    /* Each thread allocates the blocks of its segment as it goes */
+
+    if (d->samples > 0)
+        blocks = track_block(d->samples - 1, &offset) + 1;
+    else
+        blocks = 0;
+
+    for (n = 0; n < blocks; n++)
+        t->block[n] = NULL;
+    t->blocks = blocks;
+
+    t->cancel = false;
+    if (t->segments > 1)
+        t->ahead = true;
+
+    if (t->pack == NULL) /* otherwise, it was cached when imported */
+        pcmcache_create(t);
+    start_segments(t);
+
+    return 0;
+
+ fail_open:
+    decode_close(d);
+ fail:
+    free(d);
+    return -1;
+}
+
+/*
+ * Thread which packs the audio of a track which is only kept
+ *
+ * The blocks are only read, and are freed once the rig sees the
+ * result, so the track can still be loaded onto a deck meanwhile.
+ */
+
+static void* pack_track(void *p)
+{
+    unsigned int s;
+    struct packer *k = p;
+    struct track *t = k->track;
+
+    set_priority(t, syscall(SYS_gettid));
+
+    k->result = 0;
+
+    for (s = 0; s < t->length; ) {
+        unsigned int block, offset, n;
+
+        if (__atomic_load_n(&t->cancel, __ATOMIC_RELAXED)) {
+            k->result = -1;
+            break;
+        }
+
+        block = track_block(s, &offset);
+        n = track_block_samples(block);
+        if (n > t->length - s)
+            n = t->length - s;
+
+        if (pack_add(&k->pack, t->block[block], n) == -1) {
+            k->result = -1;
+            break;
+        }
+
+        s += n;
+    }
+
+    pack_finish(&k->pack);
+    __atomic_store_n(&k->done, true, __ATOMIC_RELEASE);
+
+    wake_rig(t);
+
+    return NULL;
+}
+
+/*
+ * Start packing the audio of a track
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0, track is being packed; otherwise t->packer is NULL
+ */
+
+static int start_pack(struct track *t)
+{
+    int r;
+    struct packer *k = t->packer;
+
+    fprintf(stderr, "Packing '%s'...\n", t->path);
+
+    t->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->fd == -1) {
+        perror("eventfd");
+        goto fail;
+    }
+
+    pack_init(&k->pack);
+    k->done = false;
+    t->cancel = false;
+
+    r = pthread_create(&k->thread, NULL, pack_track, k);
+    if (r != 0) {
+        errno = r;
+        perror("pthread_create");
+        if (close(t->fd) == -1)
+            abort();
+        goto fail;
+    }
+
+    t->finished = false;
+
+    return 0;
+
+ fail:
+    free(k);
+    t->packer = NULL;
+    return -1;
+}
+
+/*
+ * Start importing a track which was queued
+ *
+ * Return: -1 on error, otherwise 0
+ * Pre: track is queued
+ * Post: track is not queued; if 0, track is importing
+ */
+
+int track_start_import(struct track *t)
+{
+    pid_t pid;
+    char rate[16];
+
+    assert(t->queued);
+    t->queued = false;
+
+    if (t->packer != NULL)
+        return start_pack(t);
+
+    fprintf(stderr, "Importing '%s'...\n", t->path);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t->started) == -1)
+        abort();
+    t->reads = 0;
+    t->wakeups = 0;
+
+    if (start_decode(t) == 0)
+        return 0;
+
+    snprintf(rate, sizeof rate, "%d", t->rate);
+
+    pid = fork_pipe_nb(&t->fd, t->importer, "import", t->path, rate, NULL);
+    if (pid == -1) {
+        status_printf(STATUS_ERROR, "Error importing %s", t->path);
+        return -1;
+    }
+
+    if (fcntl(t->fd, F_SETPIPE_SZ, PIPE_BYTES) == -1)
+        debug("fcntl F_SETPIPE_SZ: %s", strerror(errno));
+
+    t->pid = pid;
+    set_import_priority(t);
+
+    pcmcache_create(t);
+
+    return 0;
+}
+
+/*
+ * Free the memory of the blocks of a track
+ *
+ * Post: track has no blocks
+ */
+
+static void free_blocks(struct track *t)
+{
+    unsigned int n;
+
+    for (n = 0; n < t->blocks; n++) {
+        if (!pool_free(t->block[n], track_block_samples(n)))
+            free(t->block[n]);
+    }
+
+    t->blocks = 0;
+}
+
+static void free_pack(struct track *t)
+{
+    pack_clear(t->pack);
+    free(t->pack);
+    t->pack = NULL;
+}
+
+/*
+ * Destroy this track from memory
+ *
+ * Terminates any import processes and frees any memory allocated by
+ * this object.
+ *
+ * Pre: track is not importing
+ * Pre: track is initialised
+ */
+
+static void track_clear(struct track *tr)
+{
+    assert(!is_running(tr));
+    assert(tr->cache == NULL);
+
+    if (tr->map != NULL)
+        pcmcache_unmap(tr);
+    else
+        free_blocks(tr);
+
+    if (tr->pack != NULL)
+        free_pack(tr);
+
+    list_del(&tr->tracks);
+}
+
+/*
+ * Initialise the registry of tracks
+ */
+
+void track_global_init(void)
+{
+    size_t n;
+
+    for (n = 0; n < ARRAY_SIZE(registry); n++)
+        list_init(&registry[n]);
+}
+
+/*
+ * Fill in the identity of the source of a track
+ *
+ * A file is identified by its inode, so the same file reached by
+ * different paths (eg. through links in two crates) is imported once.
+ * If the file cannot be found, its path is used instead. The same
+ * file at a different sample rate is a different track.
+ *
+ * Post: t->importer, t->path, t->rate, t->dev, t->ino and t->hash are
+ *     set
+ */
+
+static void set_identity(struct track *t, const char *importer,
+                         const char *path, unsigned int rate)
+{
+    uint64_t hash;
+    const char *s;
+    struct stat st;
+
+    t->importer = importer;
+    t->path = path;
+    t->rate = rate;
+
+    /* FNV-1a, over the importer, rate and then the file */
+
+    hash = 14695981039346656037ULL;
+
+    for (s = importer; *s != '\0'; s++)
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+
+    hash = (hash ^ rate) * 1099511628211ULL;
+
+    if (stat(path, &st) == 0) {
+        t->dev = st.st_dev;
+        t->ino = st.st_ino;
+        hash = (hash ^ (uint64_t)t->dev) * 1099511628211ULL;
+        hash = (hash ^ (uint64_t)t->ino) * 1099511628211ULL;
+    } else {
+        t->dev = 0;
+        t->ino = 0;
+        for (s = path; *s != '\0'; s++)
+            hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+
+    t->hash = hash ^ hash >> 32;
+}
+
+/*
+ * Return: true if the two tracks are of the same source
+ */
+
+static bool same_identity(const struct track *a, const struct track *b)
+{
+    if (a->hash != b->hash || a->ino != b->ino || a->dev != b->dev
+        || a->rate != b->rate)
+    {
+        return false;
+    }
+
+    if (a->importer != b->importer && strcmp(a->importer, b->importer) != 0)
+        return false;
+
+    if (a->ino == 0 && strcmp(a->path, b->path) != 0)
+        return false;
+
+    return true;
+}
+
+static struct list* bucket(const struct track *t)
+{
+    return &registry[t->hash & (ARRAY_SIZE(registry) - 1)];
+}
+
+/*
+ * Request premature termination of an import operation
+ */
+
+static void terminate(struct track *t)
+{
+    assert(is_running(t));
+
+    if (t->pid == 0) {
+        __atomic_store_n(&t->cancel, true, __ATOMIC_RELAXED);
+    } else {
+        if (kill(t->pid, SIGTERM) == -1)
+            abort();
+    }
+
+    t->terminated = true;
+}
+
+/*
+ * Take a track from the queue of the rig, before its import starts
+ *
+ * Post: the reference held by the rig is dropped
+ */
+
+static void dequeue(struct track *t)
+{
+    free(t->packer); /* never started */
+    t->packer = NULL;
+
+    rig_cancel_track(t);
+}
+
+/*
+ * Abandon the packing of a track, which is wanted after all
+ *
+ * Pre: track is to be packed
+ */
+
+static void cancel_pack(struct track *t)
+{
+    if (t->queued)
+        dequeue(t);
+    else
+        terminate(t); /* the result is then not used */
+}
+
+/*
+ * Import the audio of a packed track back into blocks
+ *
+ * Pre: track is packed, and is not importing
+ * Post: track is queued for import
+ */
+
+static void queue_unpack(struct track *t)
+{
+    t->queued = true;
+    t->background = false;
+    t->terminated = false;
+    t->finished = false;
+
+    t->ppm = 0;
+    t->overview = 0;
+
+    t->ahead = false;
+    memset(t->ready, 0, sizeof t->ready);
+
+    rig_post_track(t);
+}
+
+/*
+ * Get a pointer to a track object already in memory
+ *
+ * Return: pointer, or NULL if no such track exists
+ */
+
+static struct track* track_get_again(const struct track *want,
+                                     bool background)
+{
+    struct track *t;
+
+    list_for_each(t, bucket(want), tracks) {
+        if (!same_identity(t, want))
+            continue;
+
+        track_get(t);
+
+        /* Packed audio is imported again, once it is wanted for
+         * playback */
+
+        if (!background) {
+            if (t->packer != NULL)
+                cancel_pack(t);
+            if (t->pack != NULL && !t->queued && !is_running(t))
+                queue_unpack(t);
+        }
+
+        /* The track is now wanted sooner */
+
+        if (t->background && !background) {
+            t->background = false;
+            if (is_running(t))
+                set_import_priority(t);
+        }
+
+        return t;
+    }
+
+    return NULL;
+}
+
+/*
+ * Get a pointer to a track object for the given importer and path
+ *
+ * The audio is imported at the given sample rate, normally that of
+ * the device which will play it, so it is only resampled once.
+ *
+ * A background import waits until other tracks have been imported;
+ * it is promoted if the track is later asked for in the foreground.
+ *
+ * Return: pointer, or NULL if not enough resources
+ */
+
+struct track* track_get_by_import(const char *importer, const char *path,
+                                  unsigned int rate, bool background)
+{
+    struct track *t, *again;
+
+    t = malloc(sizeof *t);
+    if (t == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    set_identity(t, importer, path, rate);
+
+    again = track_get_again(t, background);
+    if (again != NULL) {
+        free(t);
+        return again;
+    }
+
+    if (track_init(t, importer, path, background) == -1) {
+        free(t);
+        return NULL;
+    }
+
+    list_add(&t->tracks, bucket(t));
+    track_get(t);
+
+    return t;
+}
+
+/*
+ * Get a pointer to a static track containing no audio
+ *
+ * Return: pointer, not NULL
+ */
+
+struct track* track_get_empty(void)
+{
+    empty.refcount++;
+    return &empty;
+}
+
+void track_get(struct track *t)
+{
+    t->refcount++;
+}
+
+/*
+ * Finish use of a track object
+ */
+
+void track_put(struct track *t)
+{
+    t->refcount--;
+
+    /* When importing, a reference is held. If it's the
+     * only one remaining terminate it to save resources */
+
+    if (t->refcount == 1 && is_running(t)) {
+        terminate(t);
+        return;
+    }
+
+    if (t->refcount == 1 && t->queued) {
+        dequeue(t); /* drops the last reference */
+        return;
+    }
+
+    if (t->refcount == 0) {
+        assert(t != &empty);
+        track_clear(t);
+        free(t);
+    }
+}
+
+/*
+ * Return: memory used by the audio of a track, in bytes
+ */
+
+static size_t track_memory(const struct track *t)
+{
+    unsigned int n;
+    size_t bytes;
+
+    if (t->map != NULL)
+        return t->map_bytes;
+
+    bytes = 0;
+    if (t->pack != NULL)
+        bytes += pack_bytes(t->pack);
+
+    for (n = 0; n < t->blocks; n++)
+        bytes += track_bytes(track_block_samples(n));
+
+    return bytes;
+}
+
+/*
+ * Return: the memory which kept tracks can use, in bytes
+ */
+
+static size_t keep_limit(void)
+{
+    struct rlimit rl;
+
+    if (!use_mlock)
+        return keep_bytes;
+
+    /* Do not keep more than can be locked into RAM */
+
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+        perror("getrlimit");
+        return keep_bytes;
+    }
+
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < keep_bytes)
+        return rl.rlim_cur;
+
+    return keep_bytes;
+}
+
+/*
+ * Stop keeping a track
+ */
+
+static void forget(struct track *t)
+{
+    debug("no longer keeping %s", t->path);
+    list_del(&t->kept);
+    t->is_kept = false;
+    track_put(t);
+}
+
+/*
+ * Return: true if the track is only kept, and its audio can be packed
+ */
+
+static bool can_pack(const struct track *t)
+{
+    return use_pack && t->refcount == 1 && !t->queued && !is_running(t)
+        && t->pack == NULL && t->map == NULL && t->length > 0;
+}
+
+/*
+ * Queue a kept track for its audio to be packed
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int queue_pack(struct track *t)
+{
+    struct packer *k;
+
+    k = malloc(sizeof *k);
+    if (k == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    k->track = t;
+
+    t->packer = k;
+    t->queued = true;
+    t->background = true;
+    t->terminated = false;
+
+    rig_post_track(t);
+
+    return 0;
+}
+
+/*
+ * Stop keeping the least recently used tracks, until those which are
+ * kept fit in memory
+ *
+ * Where asked, a track is packed before it is forgotten; one at a
+ * time, so that a track is not forgotten which would fit once the
+ * others are packed. The most recently used track is always kept.
+ */
+
+static void evict(void)
+{
+    bool packing;
+    size_t limit, total;
+    struct track *t, *x;
+
+    limit = keep_limit();
+    total = 0;
+    packing = false;
+
+    list_for_each_safe(t, x, &kept, kept) {
+        total += track_memory(t);
+        if (total <= limit || &t->kept == kept.next)
+            continue;
+
+        if (t->packer != NULL)
+            packing = true;
+
+        if (!packing && can_pack(t) && queue_pack(t) == 0)
+            packing = true;
+
+        if (packing)
+            continue;
+
+        forget(t);
+    }
+}
+
+/*
+ * Keep a track in memory after it is no longer used, for as long as
+ * there is room
+ *
+ * Post: track is the most recently used
+ */
+
+void track_keep(struct track *t)
+{
+    if (keep_bytes == 0 || t == &empty)
+        return;
+
+    if (t->is_kept) {
+        list_del(&t->kept);
+    } else {
+        track_get(t);
+        t->is_kept = true;
+    }
+
+    list_add(&t->kept, &kept);
+    evict();
+}
+
+/*
+ * Stop keeping all tracks
+ */
+
+void track_keep_clear(void)
+{
+    struct track *t, *x;
+
+    list_for_each_safe(t, x, &kept, kept)
+        forget(t);
+}
+
+/*
+ * Read the next block of data from the file handle into the track's
+ * PCM data
+ *
+ * Return: -1 on completion, otherwise zero
+ */
+
+static int read_from_pipe(struct track *tr)
+{
+    for (;;) {
+        void *pcm;
+        size_t len;
+        ssize_t z;
+
+        pcm = access_pcm(tr, &len);
         if (pcm == NULL)
             return -1;
 
         z = read(tr->fd, pcm, len);
+        tr->reads++;
+
         if (z == -1) {
             if (errno == EAGAIN) {
                 return 0;
@@ -429,17 +1676,31 @@ static int read_from_pipe(struct track *tr)
 }
 
 /*
- * Synchronise with the import process and complete it
+ * Show how much of the memory pool is used by tracks
+ */
+
+static void report_pool(void)
+{
+    size_t used, total;
+
+    pool_usage(&used, &total);
+    if (total == 0)
+        return;
+
+    status_printf(STATUS_VERBOSE, "Track memory %zu of %zuMb in use (%d%%)",
+                  used / 1048576, total / 1048576, (int)(100 * used / total));
+}
+
+/*
+ * Wait for the import process to exit
  *
- * Pre: track is importing
- * Post: track is not importing
+ * Return: true if it was a success, otherwise false
  */
 
-static void stop_import(struct track *t)
+static bool stop_process(struct track *t)
 {
     int status;
-
-    assert(t->pid != 0);
+    bool success;
 
     if (close(t->fd) == -1)
         abort();
@@ -447,40 +1708,374 @@ static void stop_import(struct track *t)
     if (waitpid(t->pid, &status, 0) == -1)
         abort();
 
-    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+    success = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+
+    if (success)
         fprintf(stderr, "Track import completed\n");
-    } else {
+    else
         fprintf(stderr, "Track import completed with status %d\n", status);
-        if (!t->terminated)
-            status_printf(STATUS_ERROR, "Error importing %s", t->path);
-    }
 
     t->pid = 0;
+    return success;
 }
 
 /*
- * Handle any file descriptor activity on this track
+ * Bring the length of the track up to date with the audio imported
+ * ahead of it, by segments after the first
  *
- * Return: true if import has completed, otherwise false
+ * Pre: the first segment is decoded, so only the rig sets the length
  */
 
-void track_handle(struct track *tr)
+static void extend_length(struct track *t)
+{
+    for (;;) {
+        unsigned int b, offset, ready;
+
+        b = track_block(t->length, &offset);
+        if (b >= t->blocks)
+            break;
+
+        ready = __atomic_load_n(&t->ready[b], __ATOMIC_ACQUIRE);
+        if (ready <= offset)
+            break;
+
+        __atomic_store_n(&t->length, track_block_start(b) + ready,
+                         __ATOMIC_RELEASE);
+
+        if (ready < track_block_samples(b))
+            break;
+    }
+}
+
+/*
+ * Return: true if the thread of every segment is done
+ */
+
+static bool is_decoded(struct track *t)
+{
+    unsigned int n;
+
+    for (n = 0; n < t->segments; n++) {
+        if (!__atomic_load_n(&t->segment[n].decoded, __ATOMIC_ACQUIRE))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Wait for the import threads to finish
+ *
+ * Return: true if it was a success, otherwise false
+ */
+
+static bool stop_decode(struct track *t)
+{
+    bool success;
+    unsigned int n, total;
+
+    success = true;
+
+    for (n = 0; n < t->segments; n++) {
+        struct segment *s = &t->segment[n];
+
+        if (s->started && pthread_join(s->thread, NULL) != 0)
+            abort();
+
+        if (s->result != 0)
+            success = false;
+    }
+
+    if (close(t->fd) == -1)
+        abort();
+
+    extend_length(t);
+
+    /* A file which was cut short while it was imported may have left
+     * a gap */
+
+    total = t->segment[t->segments - 1].end;
+    if (t->length == total)
+        t->ahead = false; /* the length covers it all */
+    else
+        success = false;
+
+    free_segments(t);
+    t->bytes = (size_t)t->length * SAMPLE;
+
+    if (success)
+        fprintf(stderr, "Track import completed\n");
+    else
+        fprintf(stderr, "Track import failed\n");
+
+    return success;
+}
+
+/*
+ * Wait for the thread packing the audio, and use the pack in place of
+ * the blocks if the track is still only kept
+ */
+
+static void stop_pack(struct track *t)
+{
+    size_t bytes;
+    struct packer *k = t->packer;
+
+    if (pthread_join(k->thread, NULL) != 0)
+        abort();
+
+    if (close(t->fd) == -1)
+        abort();
+
+    t->packer = NULL;
+    t->finished = true;
+
+    if (k->result != 0 && !t->terminated) {
+
+        /* Rather than try again, make room as if it was not packed */
+
+        pack_clear(&k->pack);
+        free(k);
+        if (t->is_kept)
+            forget(t);
+        return;
+    }
+
+    /* If only the rig and the keep hold a reference, nobody is reading
+     * the blocks */
+
+    if (t->terminated || t->refcount != 2) {
+        pack_clear(&k->pack);
+        free(k);
+        return;
+    }
+
+    t->pack = malloc(sizeof *t->pack);
+    if (t->pack == NULL) {
+        perror("malloc");
+        pack_clear(&k->pack);
+        free(k);
+        return;
+    }
+
+    *t->pack = k->pack;
+    free(k);
+
+    bytes = track_memory(t) - pack_bytes(t->pack);
+    fprintf(stderr, "Packed '%s' into %zu%% of its memory\n", t->path,
+            100 * pack_bytes(t->pack) / (bytes ? bytes : 1));
+
+    free_blocks(t);
+    t->bytes = 0;
+    t->length = 0;
+}
+
+/*
+ * Synchronise with the import process or thread and complete it
+ *
+ * Pre: track is importing
+ * Post: track is not importing
+ */
+
+static void stop_import(struct track *t)
 {
-    assert(tr->pid != 0);
+    bool success;
+    double elapsed;
+    struct timespec now;
+
+    assert(is_running(t));
+
+    if (t->packer != NULL) {
+        stop_pack(t);
+        return;
+    }
+
+    if (t->segment != NULL)
+        success = stop_decode(t);
+    else
+        success = stop_process(t);
+
+    if (!success && !t->terminated)
+        status_printf(STATUS_ERROR, "Error importing %s", t->path);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+        abort();
+
+    elapsed = (now.tv_sec - t->started.tv_sec)
+        + (now.tv_nsec - t->started.tv_nsec) / 1e9;
+
+    fprintf(stderr, "Imported %zu bytes in %.2fs (%.1fMb/s), "
+            "%u reads, %u wakeups\n",
+            t->bytes, elapsed, t->bytes / elapsed / 1048576,
+            t->reads, t->wakeups);
+
+    pcmcache_finish(t, success && !t->terminated);
+
+    if (t->pack != NULL) /* audio is now in the blocks */
+        free_pack(t);
+
+    if (success)
+        report_pool();
+}
+
+/*
+ * Import any audio which is waiting for this track
+ *
+ * The rig calls this without holding the lock; only the rig (or the
+ * threads of an import within the program) adds audio to a track, and
+ * other threads see it once tr->length, or tr->ready, is incremented.
+ *
+ * Pre: track is importing
+ */
 
-    /* A track may be added while poll() was waiting,
-     * in which case it has no return data from poll */
+void track_import(struct track *tr)
+{
+    assert(is_running(tr));
 
-    if (tr->pe == NULL)
+    if (tr->finished)
         return;
 
-    if (tr->pe->revents == 0)
+    tr->wakeups++;
+
+    if (tr->segment != NULL || tr->packer != NULL) {
+        uint64_t v;
+        bool done;
+
+        if (read(tr->fd, &v, sizeof v) == -1 && errno != EAGAIN)
+            perror("read");
+
+        if (tr->packer != NULL) {
+            if (__atomic_load_n(&tr->packer->done, __ATOMIC_ACQUIRE))
+                tr->finished = true;
+            return;
+        }
+
+        if (!__atomic_load_n(&tr->segment[0].decoded, __ATOMIC_ACQUIRE))
+            return;
+
+        done = is_decoded(tr);
+        extend_length(tr);
+        if (done)
+            tr->finished = true;
+
         return;
+    }
+
+    if (read_from_pipe(tr) == -1)
+        tr->finished = true;
+}
+
+/*
+ * Complete the import of this track, if all the audio has arrived
+ *
+ * Pre: track is importing
+ */
+
+void track_handle(struct track *tr)
+{
+    assert(is_running(tr));
 
-    if (read_from_pipe(tr) != -1)
+    if (!tr->finished)
         return;
 
     stop_import(tr);
     list_del(&tr->rig);
     track_put(tr); /* may delete the track */
+
+    /* Kept tracks may now be using more memory than they can */
+
+    evict();
+}
+
+/*
+ * Return: a pointer to the given level of peaks of a meter
+ */
+
+static unsigned char* meter_level(struct track *tr, unsigned int block,
+                                  bool overview, unsigned int level)
+{
+    if (overview)
+        return track_block_overview_peak(tr, block, level);
+    else
+        return track_block_ppm_peak(tr, block, level);
+}
+
+/*
+ * Return: the highest value of a meter over the given range of samples
+ *
+ * The levels of peaks are used so that each block takes a few
+ * lookups. The range is rounded outwards to whole values of the
+ * level used, which is less than half the length of the range.
+ */
+
+static unsigned char meter_peak(struct track *tr, bool overview,
+                                unsigned int start, unsigned int end)
+{
+    unsigned int res, levels;
+    unsigned char v;
+
+    if (overview) {
+        res = TRACK_OVERVIEW_RES;
+        levels = TRACK_OVERVIEW_LEVELS;
+    } else {
+        res = TRACK_PPM_RES;
+        levels = TRACK_PPM_LEVELS;
+    }
+
+    if (end > tr->length)
+        end = tr->length;
+
+    v = 0;
+
+    while (start < end) {
+        unsigned int b, offset, first, last, l, x;
+        const unsigned char *level;
+
+        b = track_block(start, &offset);
+        first = offset / res;
+
+        /* Up to the end of this block */
+
+        if (end - start > track_block_samples(b) - offset)
+            last = track_block_samples(b) / res - 1;
+        else
+            last = (offset + end - start - 1) / res;
+
+        l = sizeof(l) * 8 - 1 - __builtin_clz(last - first + 1);
+        if (l > levels)
+            l = levels;
+
+        level = meter_level(tr, b, overview, l);
+
+        for (x = first >> l; x <= last >> l; x++) {
+            if (level[x] > v)
+                v = level[x];
+        }
+
+        start += (last + 1) * res - offset;
+    }
+
+    return v;
+}
+
+/*
+ * Return: the highest PPM meter value over the given range of
+ * samples, or 0 if the range is empty
+ */
+
+unsigned char track_get_ppm_peak(struct track *tr, unsigned int start,
+                                 unsigned int end)
+{
+    return meter_peak(tr, false, start, end);
+}
+
+/*
+ * Return: the highest overview meter value over the given range of
+ * samples, or 0 if the range is empty
+ */
+
+unsigned char track_get_overview_peak(struct track *tr, unsigned int start,
+                                      unsigned int end)
+{
+    return meter_peak(tr, true, start, end);
 }
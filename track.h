@@ -21,23 +21,42 @@
 #define TRACK_H
 
 #include <stdbool.h>
-#include <sys/poll.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "list.h"
 
 #define TRACK_CHANNELS 2
 
-#define TRACK_MAX_BLOCKS 64
-#define TRACK_BLOCK_SAMPLES (2048 * 1024)
 #define TRACK_PPM_RES 64
 #define TRACK_OVERVIEW_RES 2048
 
-struct track_block {
-    signed short pcm[TRACK_BLOCK_SAMPLES * TRACK_CHANNELS];
-    unsigned char ppm[TRACK_BLOCK_SAMPLES / TRACK_PPM_RES],
-        overview[TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES];
-};
+/* Levels of peaks above each meter; see track_get_ppm_peak() */
+
+#define TRACK_PPM_LEVELS 10
+#define TRACK_OVERVIEW_LEVELS 5
+
+/* Audio is held in blocks which double in size from the start of the
+ * track up to a maximum, so a short track does not use much memory.
+ * Each block is of the form:
+ *
+ *   signed short pcm[samples * TRACK_CHANNELS];
+ *   unsigned char ppm[samples / TRACK_PPM_RES];
+ *   unsigned char overview[samples / TRACK_OVERVIEW_RES];
+ *   unsigned char ppm_peak[TRACK_PPM_LEVELS][...];
+ *   unsigned char overview_peak[TRACK_OVERVIEW_LEVELS][...];
+ *
+ * where each level of peaks holds the highest of each pair of values
+ * in the level below, so is half the length.
+ *
+ * There are enough blocks for any length of track which fits in an
+ * unsigned int */
+
+#define TRACK_BLOCK_SHIFT_MIN 16 /* 65536 samples, 1.5 seconds */
+#define TRACK_BLOCK_SHIFT_MAX 21 /* 2M samples, 47 seconds */
+
+#define TRACK_MAX_BLOCKS (TRACK_BLOCK_SHIFT_MAX - TRACK_BLOCK_SHIFT_MIN \
+                          + (1ULL << 32 >> TRACK_BLOCK_SHIFT_MAX))
 
 struct track {
     struct list tracks;
@@ -47,19 +66,67 @@ struct track {
     /* pointers to external data */
    
     const char *importer, *path;
-    
+
+    /* Identity of the source; see track_get_by_import() */
+
+    dev_t dev;
+    ino_t ino; /* or 0 if not known */
+    unsigned int hash;
+
     size_t bytes; /* loaded in */
     unsigned int length, /* track length in samples */
         blocks; /* number of blocks allocated */
-    struct track_block *block[TRACK_MAX_BLOCKS];
+    signed short *block[TRACK_MAX_BLOCKS];
+
+    /* Persistent copy of the audio; see pcmcache.c */
+
+    void *map; /* blocks are mapped from the cache, or NULL */
+    size_t map_bytes;
+    struct pcmcache *cache; /* writing to the cache, or NULL */
+
+    /* Kept in memory whilst not in use; see track_keep() */
+
+    struct list kept;
+    bool is_kept;
 
     /* State of audio import */
 
     struct list rig;
+    bool queued, /* waiting for the rig to start the import */
+        background; /* import can wait for others */
     pid_t pid;
     int fd;
-    struct pollfd *pe;
-    bool terminated;
+
+    /* Import within the program, for audio which is read natively;
+     * see decoder.c. A long track is divided into segments which are
+     * decoded at once, each by its own thread, so that audio far into
+     * the track is soon ready to play */
+
+    struct segment *segment; /* or NULL */
+    unsigned int segments;
+    bool cancel; /* threads are asked to stop */
+
+    /* Whilst it is only kept, the audio can be packed into less
+     * memory in place of its blocks (see pack.c), but is imported
+     * from the pack again before it returns to a deck */
+
+    struct pack *pack; /* or NULL */
+    struct packer *packer; /* the import is to pack it, or NULL */
+
+    /* Samples imported from the start of each block, where a segment
+     * has filled it ahead of the length; see track_block_ready() */
+
+    bool ahead; /* any may be */
+    unsigned int ready[TRACK_MAX_BLOCKS];
+
+    bool terminated,
+        finished; /* all audio has been read */
+
+    /* Throughput of the import */
+
+    struct timespec started;
+    unsigned int reads, /* calls to read() */
+        wakeups; /* calls to track_import() */
 
     /* Current value of audio meters when loading */
     
@@ -67,52 +134,271 @@ struct track {
     unsigned int overview;
 };
 
+void track_global_init(void);
 void track_use_mlock(void);
+void track_use_pack(void);
+void track_set_keep(size_t bytes);
 
 /* Tracks are dynamically allocated and reference counted */
 
-struct track* track_get_by_import(const char *importer, const char *path);
+struct track* track_get_by_import(const char *importer, const char *path,
+                                  unsigned int rate, bool background);
 struct track* track_get_empty(void);
 void track_get(struct track *t);
 void track_put(struct track *t);
 
+void track_keep(struct track *t);
+void track_keep_clear(void);
+
+unsigned char track_get_ppm_peak(struct track *tr, unsigned int start,
+                                 unsigned int end);
+unsigned char track_get_overview_peak(struct track *tr, unsigned int start,
+                                      unsigned int end);
+
 /* Functions used by the rig and main thread */
 
-void track_pollfd(struct track *tr, struct pollfd *pe);
+int track_start_import(struct track *tr);
+void track_import(struct track *tr);
 void track_handle(struct track *tr);
 
-/* Return true if the track importer is running, otherwise false */
+/* Return true if the track is still to be imported, otherwise false */
 
 static inline bool track_is_importing(struct track *tr)
 {
-    return tr->pid != 0;
+    return tr->pid != 0 || tr->segment != NULL || tr->queued;
+}
+
+/* Return the number of samples held in the given block */
+
+static inline unsigned int track_block_samples(unsigned int n)
+{
+    if (n == 0)
+        return 1 << TRACK_BLOCK_SHIFT_MIN;
+
+    if (n > TRACK_BLOCK_SHIFT_MAX - TRACK_BLOCK_SHIFT_MIN)
+        return 1 << TRACK_BLOCK_SHIFT_MAX;
+
+    return 1 << (TRACK_BLOCK_SHIFT_MIN + n - 1);
+}
+
+/* Return the number of the first sample in the given block */
+
+static inline unsigned int track_block_start(unsigned int n)
+{
+    if (n == 0)
+        return 0;
+
+    if (n > TRACK_BLOCK_SHIFT_MAX - TRACK_BLOCK_SHIFT_MIN)
+        return (n - (TRACK_BLOCK_SHIFT_MAX - TRACK_BLOCK_SHIFT_MIN))
+            << TRACK_BLOCK_SHIFT_MAX;
+
+    return 1 << (TRACK_BLOCK_SHIFT_MIN + n - 1);
+}
+
+/* Return the block which holds the given sample, and the offset of
+ * the sample within that block, in constant time */
+
+static inline unsigned int track_block(unsigned int s, unsigned int *offset)
+{
+    unsigned int b;
+
+    if (s < 1 << TRACK_BLOCK_SHIFT_MIN) {
+        *offset = s;
+        return 0;
+    }
+
+    if (s >= 1 << TRACK_BLOCK_SHIFT_MAX) {
+        *offset = s & ((1 << TRACK_BLOCK_SHIFT_MAX) - 1);
+        return (s >> TRACK_BLOCK_SHIFT_MAX)
+            + TRACK_BLOCK_SHIFT_MAX - TRACK_BLOCK_SHIFT_MIN;
+    }
+
+    b = sizeof(s) * 8 - 1 - __builtin_clz(s); /* highest bit set */
+    *offset = s - (1 << b);
+    return b - TRACK_BLOCK_SHIFT_MIN + 1;
+}
+
+/* Return the number of bytes used by the given number of meter
+ * values, in all the levels of peaks above them (excluding the meter
+ * itself) */
+
+static inline size_t track_peak_bytes(size_t values, unsigned int levels)
+{
+    return values - (values >> levels);
+}
+
+/* Return the number of bytes used by the given number of samples
+ * and their meters */
+
+static inline size_t track_bytes(size_t samples)
+{
+    return samples * TRACK_CHANNELS * sizeof(signed short)
+        + samples / TRACK_PPM_RES + samples / TRACK_OVERVIEW_RES
+        + track_peak_bytes(samples / TRACK_PPM_RES, TRACK_PPM_LEVELS)
+        + track_peak_bytes(samples / TRACK_OVERVIEW_RES,
+                           TRACK_OVERVIEW_LEVELS);
+}
+
+/* Return a pointer to the meters of the given block */
+
+static inline unsigned char* track_block_ppm(struct track *tr,
+                                             unsigned int n)
+{
+    return (unsigned char*)(tr->block[n]
+                            + track_block_samples(n) * TRACK_CHANNELS);
+}
+
+static inline unsigned char* track_block_overview(struct track *tr,
+                                                  unsigned int n)
+{
+    return track_block_ppm(tr, n) + track_block_samples(n) / TRACK_PPM_RES;
+}
+
+/* Return a pointer to the given level of peaks of the meters of the
+ * given block, where level 0 is the meter itself */
+
+static inline unsigned char* track_block_ppm_peak(struct track *tr,
+                                                  unsigned int n,
+                                                  unsigned int level)
+{
+    unsigned int values;
+
+    values = track_block_samples(n) / TRACK_PPM_RES;
+
+    if (level == 0)
+        return track_block_ppm(tr, n);
+
+    return track_block_overview(tr, n)
+        + track_block_samples(n) / TRACK_OVERVIEW_RES
+        + track_peak_bytes(values, level - 1);
+}
+
+static inline unsigned char* track_block_overview_peak(struct track *tr,
+                                                       unsigned int n,
+                                                       unsigned int level)
+{
+    unsigned int values;
+
+    values = track_block_samples(n) / TRACK_OVERVIEW_RES;
+
+    if (level == 0)
+        return track_block_overview(tr, n);
+
+    return track_block_ppm_peak(tr, n, TRACK_PPM_LEVELS)
+        + (track_block_samples(n) / TRACK_PPM_RES >> TRACK_PPM_LEVELS)
+        + track_peak_bytes(values, level - 1);
 }
 
 /* Return the pseudo-PPM meter value for the given sample */
 
 static inline unsigned char track_get_ppm(struct track *tr, int s)
 {
-    struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return b->ppm[(s % TRACK_BLOCK_SAMPLES) / TRACK_PPM_RES];
+    unsigned int b, o;
+
+    b = track_block(s, &o);
+    return track_block_ppm(tr, b)[o / TRACK_PPM_RES];
 }
 
 /* Return the overview meter value for the given sample */
 
 static inline unsigned char track_get_overview(struct track *tr, int s)
 {
-    struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return b->overview[(s % TRACK_BLOCK_SAMPLES) / TRACK_OVERVIEW_RES];
+    unsigned int b, o;
+
+    b = track_block(s, &o);
+    return track_block_overview(tr, b)[o / TRACK_OVERVIEW_RES];
+}
+
+/* Return the number of samples, from the start of the given block,
+ * which can be read. Audio up to the length is always ready, but
+ * beyond it a block may be imported ahead of those before it */
+
+static inline unsigned int track_block_ready(struct track *tr,
+                                             unsigned int length,
+                                             unsigned int n)
+{
+    unsigned int start, samples, ready;
+
+    start = track_block_start(n);
+    samples = track_block_samples(n);
+
+    if (length <= start) {
+        ready = 0;
+    } else if (length - start >= samples) {
+        return samples;
+    } else {
+        ready = length - start;
+    }
+
+    if (tr->ahead) {
+        unsigned int r;
+
+        r = __atomic_load_n(&tr->ready[n], __ATOMIC_ACQUIRE);
+        if (r > ready)
+            ready = r;
+    }
+
+    return ready;
+}
+
+/* Return true if the given sample can be read, where the given length
+ * was taken from the track */
+
+static inline bool track_is_ready(struct track *tr, unsigned int length,
+                                  int s)
+{
+    unsigned int b, o;
+
+    if (s < 0)
+        return false;
+
+    if ((unsigned int)s < length)
+        return true;
+
+    if (!tr->ahead)
+        return false;
+
+    b = track_block(s, &o);
+    return o < track_block_ready(tr, length, b);
 }
 
 /* Return a pointer to (not value of) the sample data for each channel */
 
 static inline signed short* track_get_sample(struct track *tr, int s)
 {
-    struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return &b->pcm[(s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
+    unsigned int b, o;
+
+    b = track_block(s, &o);
+    return tr->block[b] + o * TRACK_CHANNELS;
+}
+
+/* Return a pointer to the pseudo-PPM meter value for the given
+ * sample, as track_get_ppm(). A further *n - 1 meter values (each of
+ * TRACK_PPM_RES samples) follow contiguously */
+
+static inline unsigned char* track_get_ppm_span(struct track *tr, int s,
+                                                unsigned int *n)
+{
+    unsigned int b, o;
+
+    b = track_block(s, &o);
+    o /= TRACK_PPM_RES;
+    *n = track_block_samples(b) / TRACK_PPM_RES - o;
+    return track_block_ppm(tr, b) + o;
+}
+
+/* Return a pointer to the overview meter value for the given sample,
+ * with *n values contiguous as track_get_ppm_span() */
+
+static inline unsigned char* track_get_overview_span(struct track *tr, int s,
+                                                     unsigned int *n)
+{
+    unsigned int b, o;
+
+    b = track_block(s, &o);
+    o /= TRACK_OVERVIEW_RES;
+    *n = track_block_samples(b) / TRACK_OVERVIEW_RES - o;
+    return track_block_overview(tr, b) + o;
 }
 
 #endif
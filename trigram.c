@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Each trigram (three consecutive characters, folded to lower case)
+ * of a record's artist and title has a posting list of the records
+ * which contain it, in the order they were added. A word of a search
+ * can only be in records which are in the posting list of every one
+ * of its trigrams. This is a superset of the real matches, which are
+ * still checked by the listing.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+
+#define MIN_SIZE 4096 /* power of two */
+#define SEPARATOR ' ' /* never appears in a search word */
+
+struct posting {
+    uint32_t key; /* or 0 if this entry is unused */
+    unsigned int entries, size;
+    unsigned int *id;
+};
+
+/*
+ * Return: key for the trigram at the given string, or 0 if it cannot
+ *     be part of a search
+ */
+
+static uint32_t key(const char *s)
+{
+    unsigned char a, b, c;
+
+    a = tolower((unsigned char)s[0]);
+    b = tolower((unsigned char)s[1]);
+    c = tolower((unsigned char)s[2]);
+
+    if (a == SEPARATOR || b == SEPARATOR || c == SEPARATOR)
+        return 0;
+
+    return (uint32_t)a << 16 | (uint32_t)b << 8 | c;
+}
+
+static size_t hash(uint32_t k)
+{
+    return (k * 2654435761U) >> 8;
+}
+
+/*
+ * Return: the entry in the table for the given key, which is unused
+ *     if the key is not present
+ */
+
+static struct posting* find(const struct trigram *t, uint32_t k)
+{
+    size_t n;
+
+    for (n = hash(k) & (t->size - 1);; n = (n + 1) & (t->size - 1)) {
+        struct posting *p = &t->table[n];
+
+        if (p->key == k || p->key == 0)
+            return p;
+    }
+}
+
+void trigram_init(struct trigram *t)
+{
+    t->records = 0;
+    t->table = NULL;
+    t->size = 0;
+    t->used = 0;
+}
+
+void trigram_clear(struct trigram *t)
+{
+    size_t n;
+
+    for (n = 0; n < t->size; n++)
+        free(t->table[n].id);
+    free(t->table);
+}
+
+/*
+ * Double the size of the hash table
+ *
+ * Return: -1 on memory allocation failure, otherwise 0
+ */
+
+static int grow(struct trigram *t)
+{
+    size_t n;
+    struct trigram old;
+
+    old = *t;
+
+    t->size = old.size ? old.size * 2 : MIN_SIZE;
+    t->table = calloc(t->size, sizeof *t->table);
+    if (t->table == NULL) {
+        perror("calloc");
+        *t = old;
+        return -1;
+    }
+
+    for (n = 0; n < old.size; n++) {
+        if (old.table[n].key != 0)
+            *find(t, old.table[n].key) = old.table[n];
+    }
+
+    free(old.table);
+    return 0;
+}
+
+/*
+ * Add a record to the posting list of the given trigram
+ *
+ * Return: -1 on memory allocation failure, otherwise 0
+ */
+
+static int post(struct trigram *t, uint32_t k, unsigned int id)
+{
+    struct posting *p;
+
+    if (t->used * 2 >= t->size) {
+        if (grow(t) == -1)
+            return -1;
+    }
+
+    p = find(t, k);
+
+    if (p->key == 0) {
+        p->key = k;
+        t->used++;
+    }
+
+    /* Records are added in order, and just once */
+
+    if (p->entries > 0 && p->id[p->entries - 1] == id)
+        return 0;
+
+    if (p->entries == p->size) {
+        unsigned int *id;
+        size_t size;
+
+        size = p->size ? p->size * 2 : 4;
+        id = realloc(p->id, sizeof *id * size);
+        if (id == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        p->id = id;
+        p->size = size;
+    }
+
+    p->id[p->entries++] = id;
+    return 0;
+}
+
+static int post_string(struct trigram *t, const char *s, unsigned int id)
+{
+    size_t len;
+
+    for (len = strlen(s); len >= 3; len--, s++) {
+        uint32_t k;
+
+        k = key(s);
+        if (k == 0)
+            continue;
+
+        if (post(t, k, id) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Add a record to the index
+ *
+ * Return: -1 on memory allocation failure, otherwise 0
+ * Post: if 0, re->id identifies the record in the index
+ */
+
+int trigram_add(struct trigram *t, struct record *re)
+{
+    re->id = t->records;
+
+    if (post_string(t, re->artist, re->id) == -1)
+        return -1;
+    if (post_string(t, re->title, re->id) == -1)
+        return -1;
+
+    t->records++;
+    return 0;
+}
+
+/*
+ * Remove from a sorted list of ids any which are not in another
+ *
+ * Return: the number of ids which remain
+ */
+
+static size_t intersect(unsigned int *id, size_t entries,
+                        const struct posting *p)
+{
+    size_t n, m, out;
+
+    out = 0;
+    m = 0;
+
+    for (n = 0; n < entries; n++) {
+        while (m < p->entries && p->id[m] < id[n])
+            m++;
+
+        if (m == p->entries)
+            break;
+
+        if (p->id[m] == id[n])
+            id[out++] = id[n];
+    }
+
+    return out;
+}
+
+/*
+ * Find the records which may match all of the given words
+ *
+ * Return: bitmap of records which may match, to be used with
+ *     trigram_selected() and then freed; or NULL if no records can
+ *     be ruled out
+ */
+
+unsigned char* trigram_select(const struct trigram *t, char **words)
+{
+    unsigned int n, *id;
+    unsigned char *selected;
+    size_t entries;
+    bool any;
+
+    if (t->size == 0)
+        return NULL;
+
+    id = NULL;
+    entries = 0;
+    any = false;
+
+    for (; *words != NULL; words++) {
+        const char *s;
+
+        for (s = *words; strlen(s) >= 3; s++) {
+            const struct posting *p;
+            uint32_t k;
+
+            k = key(s);
+            p = find(t, k);
+
+            if (!any) {
+
+                /* The first posting list is the starting point */
+
+                id = malloc(sizeof *id * (p->entries + 1));
+                if (id == NULL) {
+                    perror("malloc");
+                    return NULL;
+                }
+
+                if (p->entries > 0)
+                    memcpy(id, p->id, sizeof *id * p->entries);
+                entries = p->entries;
+                any = true;
+
+            } else {
+                entries = intersect(id, entries, p);
+            }
+        }
+    }
+
+    if (!any)
+        return NULL;
+
+    selected = calloc(t->records / 8 + 1, 1);
+    if (selected == NULL) {
+        perror("calloc");
+        free(id);
+        return NULL;
+    }
+
+    for (n = 0; n < entries; n++)
+        selected[id[n] / 8] |= 1 << id[n] % 8;
+
+    free(id);
+    return selected;
+}
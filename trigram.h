@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Index of the records in a library, by every three characters of
+ * their artist and title, to narrow down a search
+ */
+
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "listing.h"
+
+struct posting;
+
+struct trigram {
+    unsigned int records; /* number of records indexed */
+
+    struct posting *table; /* hashed by trigram */
+    size_t size, used;
+};
+
+void trigram_init(struct trigram *t);
+void trigram_clear(struct trigram *t);
+
+int trigram_add(struct trigram *t, struct record *re);
+unsigned char* trigram_select(const struct trigram *t, char **words);
+
+/* Return true if the record was selected by trigram_select() */
+
+static inline bool trigram_selected(const unsigned char *selected,
+                                    const struct record *re)
+{
+    return selected[re->id / 8] & (1 << re->id % 8);
+}
+
+#endif
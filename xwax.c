@@ -18,6 +18,9 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,16 +30,27 @@
 #include <SDL.h> /* may override main() */
 
 #include "alsa.h"
+#include "analysis.h"
 #include "controller.h"
 #include "device.h"
 #include "dicer.h"
 #include "interface.h"
 #include "jack.h"
+#include "libcache.h"
 #include "library.h"
+#include "midimap.h"
 #include "oss.h"
+#include "pcmcache.h"
+#include "pitch.h"
+#include "player.h"
+#include "pool.h"
+#include "preload.h"
 #include "realtime.h"
+#include "remote.h"
 #include "thread.h"
 #include "rig.h"
+#include "startup.h"
+#include "stats.h"
 #include "timecoder.h"
 #include "track.h"
 #include "xwax.h"
@@ -52,6 +66,8 @@
 #define DEFAULT_IMPORTER EXECDIR "/xwax-import"
 #define DEFAULT_SCANNER EXECDIR "/xwax-scan"
 #define DEFAULT_TIMECODE "serato_2a"
+#define DEFAULT_PITCH "alpha-beta"
+#define DEFAULT_IMPORTS 2
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
@@ -61,6 +77,76 @@ char *banner = "xwax " VERSION \
 size_t ndeck;
 struct deck deck[3];
 
+/*
+ * Exit cleanly on a signal; used when there is no interface to quit
+ */
+
+static void quit(int sig)
+{
+    (void)rig_quit();
+}
+
+/* The library is loaded last, once the decks are running */
+
+struct loader {
+    struct library *library;
+    const char *analyser;
+    unsigned int analysis; /* threads, or 0 for none */
+    const char *trace; /* or NULL */
+    bool analysing, stopping;
+};
+
+/*
+ * Return: true if the program is exiting, so the library need go no
+ * further than it has
+ */
+
+static bool is_stopping(struct loader *l)
+{
+    return __atomic_load_n(&l->stopping, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Scan the library, add its records to the selector as they are
+ * found and go on to find their tempo; this is the end of startup
+ */
+
+static void* load(void *arg)
+{
+    int p, r;
+    struct loader *l = arg;
+
+    p = startup_begin("library", NULL);
+    library_scan(l->library);
+    startup_end(p);
+
+    p = startup_begin("library merge", NULL);
+    rig_lock();
+    r = library_merge(l->library);
+    rig_unlock();
+    startup_end(p);
+
+    if (r == -1) {
+        if (!is_stopping(l))
+            fputs("Library could not be loaded.\n", stderr);
+    } else {
+        if (l->analysis > 0 && !is_stopping(l)) {
+            p = startup_begin("analysis", NULL);
+            if (analysis_start(l->library, l->analyser, l->analysis) == 0)
+                l->analysing = true;
+            startup_end(p);
+        }
+
+        if (!is_stopping(l) && rig_watch_library(l->library) == -1)
+            fputs("Changes to the library will not be followed.\n", stderr);
+    }
+
+    if (l->trace != NULL)
+        startup_report(l->trace);
+
+    return NULL;
+}
+
 static void usage(FILE *fd)
 {
     fprintf(fd, "Usage: xwax [<options>]\n\n");
@@ -68,13 +154,26 @@ static void usage(FILE *fd)
     fprintf(fd, "Program-wide options:\n"
       "  -k             Lock real-time memory into RAM\n"
       "  -q <n>         Real-time priority (0 for no priority, default %d)\n"
+      "  -cpu <n>       Run the current real-time thread on the given CPU\n"
       "  -g <n>x<n>     Set display geometry\n"
+      "  -headless      Run without the display, taking commands on stdin\n"
+      "  -cache <dir>   Keep decoded audio, timecode tables and library\n"
+      "                 snapshots in the given directory\n"
+      "  -pool <Mb>     Reserve memory for tracks in advance\n"
+      "  -imports <n>   Maximum imports at once (0 for no limit, default %d)\n"
+      "  -keep <Mb>     Keep recently used tracks in memory, up to this size\n"
+      "  -pack          Pack kept tracks into less memory, rather than drop\n"
+      "  -stats <path>  Write timing of the real-time work to the given file\n"
+      "  -trace <path>  Report the time taken by each part of startup\n"
       "  -h             Display this message to stdout and exit\n\n",
-      DEFAULT_PRIORITY);
+      DEFAULT_PRIORITY, DEFAULT_IMPORTS);
 
     fprintf(fd, "Music library options:\n"
       "  -l <path>      Location to scan for audio tracks\n"
-      "  -s <program>   Library scanner (default '%s')\n\n",
+      "  -s <program>   Library scanner (default '%s')\n"
+      "  -watch         Update the library as its files change\n"
+      "  -preload <n>   Import tracks below the selection ahead of time\n"
+      "  -analyse <n>   Find the tempo of untagged records, using n threads\n\n",
       DEFAULT_SCANNER);
 
     fprintf(fd, "Deck options:\n"
@@ -83,8 +182,13 @@ static void usage(FILE *fd)
       "  -45            Use timecode at 45RPM\n"
       "  -c             Protect against certain operations while playing\n"
       "  -u             Allow all operations when playing\n"
-      "  -i <program>   Importer (default '%s')\n\n",
-      DEFAULT_IMPORTER);
+      "  -i <program>   Importer (default '%s')\n"
+      "  -thread <n>    Real-time thread to handle the deck (default 0)\n"
+      "  -resample <name>  Resampler quality (default '%s')\n"
+      "  -pitch <name>  Filter for the pitch of the timecode (default '%s')\n"
+      "  -decode <hz>   Decode timecode at no more than this rate (0 for any)\n"
+      "  -record <path> Record the output of the next deck to a WAV file\n\n",
+      DEFAULT_IMPORTER, DEFAULT_RESAMPLER, DEFAULT_PITCH);
 
 #ifdef WITH_OSS
     fprintf(fd, "OSS device options:\n"
@@ -105,12 +209,14 @@ static void usage(FILE *fd)
 
 #ifdef WITH_JACK
     fprintf(fd, "JACK device options:\n"
-      "  -j <name>      Create a JACK deck with the given name\n\n");
+      "  -j <name>      Create a JACK deck with the given name\n"
+      "  -J <name>      Create a JACK deck with its own client\n\n");
 #endif
 
 #ifdef WITH_ALSA
     fprintf(fd, "MIDI control:\n"
-      "  -dicer <dev>   Novation Dicer\n\n");
+      "  -dicer <dev>   Novation Dicer\n"
+      "  -midi <dev> <file>  MIDI controller, following the mapping file\n\n");
 #endif
 
     fprintf(fd,
@@ -119,21 +225,31 @@ static void usage(FILE *fd)
       "manual for details.\n\n"
       "Available timecodes (for use with -t):\n"
       "  serato_2a (default), serato_2b, serato_cd,\n"
-      "  traktor_a, traktor_b, mixvibes_v2, mixvibes_7inch\n\n"
+      "  traktor_a, traktor_b, mixvibes_v2, mixvibes_7inch,\n"
+      "  auto (to detect any of the above)\n\n"
+      "Available resamplers (for use with -resample):\n"
+      "  linear, cubic (default), sinc\n\n"
+      "Available pitch filters (for use with -pitch):\n"
+      "  alpha-beta (default), kalman\n\n"
       "See the xwax(1) man page for full information and examples.\n");
 }
 
 int main(int argc, char *argv[])
 {
-    int r, n, priority;
-    const char *importer, *scanner, *geo;
+    int r, n, p, priority, pitch, decode_rate, analysis;
+    unsigned int thread;
+    const char *importer, *scanner, *geo, *recording, *analyser, *trace;
     char *endptr;
     size_t nctl;
     double speed;
     struct timecode_def *timecode;
-    bool protect, use_mlock;
+    struct resampler *resampler;
+    bool protect, use_mlock, keep, pack, preload, headless, detect;
+    sigset_t quit_signals;
+    pthread_t loading;
+    struct loader loader;
 
-    struct controller ctl[2];
+    struct controller ctl[4];
     struct rt rt;
     struct library library;
 
@@ -149,13 +265,17 @@ int main(int argc, char *argv[])
     int alsa_buffer;
 #endif
 
+    startup_init();
     fprintf(stderr, "%s\n\n" NOTICE "\n\n", banner);
 
     if (thread_global_init() == -1)
         return -1;
 
+    track_global_init();
+
     if (rig_init() == -1)
         return -1;
+    rig_set_max_imports(DEFAULT_IMPORTS);
     rt_init(&rt);
     library_init(&library);
 
@@ -163,12 +283,27 @@ int main(int argc, char *argv[])
     geo = "";
     nctl = 0;
     priority = DEFAULT_PRIORITY;
+    thread = 0;
     importer = DEFAULT_IMPORTER;
     scanner = DEFAULT_SCANNER;
     timecode = NULL;
+    detect = false;
+    decode_rate = 0;
+    recording = NULL;
+    resampler = player_find_resampler(DEFAULT_RESAMPLER);
+    assert(resampler != NULL);
+    pitch = pitch_find_filter(DEFAULT_PITCH);
+    assert(pitch != -1);
     speed = 1.0;
     protect = false;
     use_mlock = false;
+    keep = false;
+    pack = false;
+    preload = false;
+    analysis = 0;
+    analyser = NULL;
+    trace = NULL;
+    headless = false;
 
 #if defined WITH_OSS || WITH_ALSA
     rate = DEFAULT_RATE;
@@ -282,7 +417,7 @@ int main(int argc, char *argv[])
 #endif
 
         } else if (!strcmp(argv[0], "-d") || !strcmp(argv[0], "-a") ||
-                   !strcmp(argv[0], "-j"))
+                   !strcmp(argv[0], "-j") || !strcmp(argv[0], "-J"))
         {
             unsigned int sample_rate;
             struct deck *ld;
@@ -308,11 +443,15 @@ int main(int argc, char *argv[])
             device = &ld->device;
             timecoder = &ld->timecoder;
             ld->importer = importer;
+            ld->resampler = resampler;
             ld->protect = protect;
+            ld->recording = recording;
 
             /* Work out which device type we are using, and initialise
              * an appropriate device. */
 
+            p = startup_begin("device", argv[1]);
+
             switch(argv[0][1]) {
 
 #ifdef WITH_OSS
@@ -327,7 +466,10 @@ int main(int argc, char *argv[])
 #endif
 #ifdef WITH_JACK
             case 'j':
-                r = jack_init(device, argv[1]);
+                r = jack_init(device, argv[1], false);
+                break;
+            case 'J':
+                r = jack_init(device, argv[1], true);
                 break;
 #endif
             default:
@@ -336,6 +478,7 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
+            startup_end(p);
             if (r == -1)
                 return -1;
 
@@ -344,24 +487,36 @@ int main(int argc, char *argv[])
             /* Default timecode decoder where none is specified */
 
             if (timecode == NULL) {
+                p = startup_begin("timecode", DEFAULT_TIMECODE);
                 timecode = timecoder_find_definition(DEFAULT_TIMECODE);
                 assert(timecode != NULL);
+                startup_end(p);
             }
 
             timecoder_init(timecoder, timecode, speed, sample_rate);
+            if (decode_rate > 0)
+                timecoder_set_max_rate(timecoder, decode_rate);
+            timecoder_set_pitch_filter(timecoder, pitch);
+            if (detect)
+                timecoder_detect(timecoder);
 
             /* Connect up the elements to make an operational deck */
 
-            r = deck_init(ld, &rt);
+            p = startup_begin("deck", argv[1]);
+            r = deck_init(ld, &rt, thread);
+            startup_end(p);
             if (r == -1)
                 return -1;
 
             /* Connect this deck to available controllers */
 
-            for (n = 0; n < nctl; n++)
-                controller_add_deck(&ctl[n], &deck[ndeck]);
+            for (n = 0; n < nctl; n++) {
+                if (controller_add_deck(&ctl[n], &deck[ndeck]) == -1)
+                    return -1;
+            }
 
             ndeck++;
+            recording = NULL; /* only ever for one deck */
 
             argv += 2;
             argc -= 2;
@@ -375,15 +530,100 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
-            timecode = timecoder_find_definition(argv[1]);
-            if (timecode == NULL) {
-                fprintf(stderr, "Timecode '%s' is not known.\n", argv[1]);
+            /* Any definition can be detected, starting from the
+             * default */
+
+            detect = !strcmp(argv[1], "auto");
+            p = startup_begin("timecode", argv[1]);
+
+            if (detect) {
+                if (timecoder_build_lookups() == -1)
+                    return -1;
+                timecode = timecoder_find_definition(DEFAULT_TIMECODE);
+                assert(timecode != NULL);
+            } else {
+                timecode = timecoder_find_definition(argv[1]);
+                if (timecode == NULL) {
+                    fprintf(stderr, "Timecode '%s' is not known.\n", argv[1]);
+                    return -1;
+                }
+            }
+
+            startup_end(p);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-resample")) {
+
+            /* Set the resampler for subsequent decks */
+
+            if (argc < 2) {
+                fprintf(stderr, "-resample requires a name as an argument.\n");
+                return -1;
+            }
+
+            resampler = player_find_resampler(argv[1]);
+            if (resampler == NULL) {
+                fprintf(stderr, "Resampler '%s' is not known.\n", argv[1]);
+                return -1;
+            }
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-pitch")) {
+
+            /* Set the pitch filter for subsequent decks */
+
+            if (argc < 2) {
+                fprintf(stderr, "-pitch requires a name as an argument.\n");
+                return -1;
+            }
+
+            pitch = pitch_find_filter(argv[1]);
+            if (pitch == -1) {
+                fprintf(stderr, "Pitch filter '%s' is not known.\n", argv[1]);
+                return -1;
+            }
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-decode")) {
+
+            /* Limit the rate the timecode of subsequent decks is
+             * decoded at */
+
+            if (argc < 2) {
+                fprintf(stderr, "-decode requires an integer argument.\n");
+                return -1;
+            }
+
+            decode_rate = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || decode_rate < 0) {
+                fprintf(stderr, "-decode requires an integer argument.\n");
                 return -1;
             }
 
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "-record")) {
+
+            /* Record the output of the next deck */
+
+            if (argc < 2) {
+                fprintf(stderr, "-record requires a pathname as an "
+                        "argument.\n");
+                return -1;
+            }
+
+            recording = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-33")) {
 
             speed = 1.0;
@@ -420,6 +660,46 @@ int main(int argc, char *argv[])
             argv++;
             argc--;
 
+        } else if (!strcmp(argv[0], "-cache")) {
+
+            /* Directory for subsequent loads to use as a cache */
+
+            if (argc < 2) {
+                fprintf(stderr, "-cache requires a directory as an "
+                        "argument.\n");
+                return -1;
+            }
+
+            pcmcache_set_dir(argv[1]);
+            analysis_set_dir(argv[1]);
+            timecoder_set_cache_dir(argv[1]);
+            libcache_set_dir(argv[1]);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-pool")) {
+
+            long mb;
+
+            if (argc < 2) {
+                fprintf(stderr, "-pool requires an integer argument.\n");
+                return -1;
+            }
+
+            mb = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || mb <= 0) {
+                fprintf(stderr, "-pool requires a positive integer "
+                        "argument.\n");
+                return -1;
+            }
+
+            if (pool_init((size_t)mb * 1048576) == -1)
+                return -1;
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-q")) {
 
             if (argc < 2) {
@@ -442,6 +722,187 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "-keep")) {
+
+            unsigned long mb;
+
+            if (argc < 2) {
+                fprintf(stderr, "-keep requires an integer argument.\n");
+                return -1;
+            }
+
+            mb = strtoul(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "-keep requires an integer argument.\n");
+                return -1;
+            }
+
+            track_set_keep((size_t)mb * 1024 * 1024);
+            keep = (mb > 0);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-pack")) {
+
+            track_use_pack();
+            pack = true;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "-stats")) {
+
+            /* File to report timing of the realtime threads to */
+
+            if (argc < 2) {
+                fprintf(stderr, "-stats requires a pathname as an "
+                        "argument.\n");
+                return -1;
+            }
+
+            stats_set_file(argv[1]);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-trace")) {
+
+            /* File to write the phases of startup to */
+
+            if (argc < 2) {
+                fprintf(stderr, "-trace requires a pathname as an "
+                        "argument.\n");
+                return -1;
+            }
+
+            trace = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-preload")) {
+
+            int n;
+
+            if (argc < 2) {
+                fprintf(stderr, "-preload requires an integer argument.\n");
+                return -1;
+            }
+
+            n = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || n < 0) {
+                fprintf(stderr, "-preload requires an integer argument.\n");
+                return -1;
+            }
+
+            preload_set_count(n);
+            preload = (n > 0);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-analyse")) {
+
+            /* Find the tempo of records, using the importer given
+             * so far */
+
+            if (argc < 2) {
+                fprintf(stderr, "-analyse requires an integer argument.\n");
+                return -1;
+            }
+
+            analysis = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || analysis < 0
+                || analysis > ANALYSIS_MAX_THREADS)
+            {
+                fprintf(stderr, "-analyse requires an integer argument, "
+                        "up to %d.\n", ANALYSIS_MAX_THREADS);
+                return -1;
+            }
+
+            analyser = importer;
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-imports")) {
+
+            int imports;
+
+            if (argc < 2) {
+                fprintf(stderr, "-imports requires an integer argument.\n");
+                return -1;
+            }
+
+            imports = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "-imports requires an integer argument.\n");
+                return -1;
+            }
+
+            if (imports < 0) {
+                fprintf(stderr, "Imports (%d) must be zero or positive.\n",
+                        imports);
+                return -1;
+            }
+
+            rig_set_max_imports(imports);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-thread")) {
+
+            unsigned long t;
+
+            /* Real-time thread for subsequent decks */
+
+            if (argc < 2) {
+                fprintf(stderr, "-thread requires an integer argument.\n");
+                return -1;
+            }
+
+            t = strtoul(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "-thread requires an integer argument.\n");
+                return -1;
+            }
+
+            if (t >= RT_MAX_THREADS) {
+                fprintf(stderr, "Thread (%lu) must be less than %d.\n",
+                        t, RT_MAX_THREADS);
+                return -1;
+            }
+
+            thread = t;
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "-cpu")) {
+
+            int cpu;
+
+            /* Pin the current real-time thread */
+
+            if (argc < 2) {
+                fprintf(stderr, "-cpu requires an integer argument.\n");
+                return -1;
+            }
+
+            cpu = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "-cpu requires an integer argument.\n");
+                return -1;
+            }
+
+            if (rt_set_cpu(&rt, thread, cpu) == -1)
+                return -1;
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-g")) {
 
             if (argc < 2) {
@@ -454,6 +915,13 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "-headless")) {
+
+            headless = true;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-i")) {
 
             /* Importer script for subsequent decks */
@@ -484,6 +952,16 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "-watch")) {
+
+            /* Follow changes to the files of every library */
+
+            if (library_watch(&library) == -1)
+                return -1;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-l")) {
 
             /* Load in a music library */
@@ -494,7 +972,7 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
-            if (library_import(&library, scanner, argv[1]) == -1)
+            if (library_queue(&library, scanner, argv[1]) == -1)
                 return -1;
 
             argv += 2;
@@ -505,7 +983,7 @@ int main(int argc, char *argv[])
 
             struct controller *c;
 
-            if (nctl == sizeof ctl) {
+            if (nctl == ARRAY_SIZE(ctl)) {
                 fprintf(stderr, "Too many controllers; aborting.\n");
                 return -1;
             }
@@ -517,13 +995,42 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
+            p = startup_begin("dicer", argv[1]);
             if (dicer_init(c, &rt, argv[1]) == -1)
                 return -1;
+            startup_end(p);
 
             nctl++;
 
             argv += 2;
             argc -= 2;
+
+        } else if (!strcmp(argv[0], "-midi")) {
+
+            struct controller *c;
+
+            if (nctl == ARRAY_SIZE(ctl)) {
+                fprintf(stderr, "Too many controllers; aborting.\n");
+                return -1;
+            }
+
+            c = &ctl[nctl];
+
+            if (argc < 3) {
+                fprintf(stderr, "-midi requires an ALSA device name and "
+                        "a mapping file.\n");
+                return -1;
+            }
+
+            p = startup_begin("midi", argv[1]);
+            if (midimap_init(c, &rt, argv[1], argv[2]) == -1)
+                return -1;
+            startup_end(p);
+
+            nctl++;
+
+            argv += 3;
+            argc -= 3;
 #endif
 
         } else {
@@ -542,16 +1049,39 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (preload && !keep) {
+        fprintf(stderr, "Preloaded tracks need memory to be kept in; "
+                "see -keep.\n");
+        return -1;
+    }
+
+    if (pack && !keep) {
+        fprintf(stderr, "Only kept tracks are packed; see -keep.\n");
+        return -1;
+    }
+
     /* FIXME: move this to controller for proper error recovery */
 
     for (n = 0; n < nctl; n++) {
         if (rt_add_controller(&rt, &ctl[n]) == -1)
             return -1;
+        rig_watch_controller(&ctl[n]);
     }
 
-    /* Order is important: launch realtime thread first, then mlock */
+    /* Order is important: launch realtime thread first, then mlock.
+     * Signals to quit are for the rig, not the realtime threads,
+     * which inherit the mask */
 
-    if (rt_start(&rt, priority) == -1)
+    sigemptyset(&quit_signals);
+    sigaddset(&quit_signals, SIGINT);
+    sigaddset(&quit_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quit_signals, NULL);
+
+    p = startup_begin("realtime", NULL);
+    r = rt_start(&rt, priority);
+    pthread_sigmask(SIG_UNBLOCK, &quit_signals, NULL);
+    startup_end(p);
+    if (r == -1)
         return -1;
 
     if (use_mlock && mlockall(MCL_CURRENT) == -1) {
@@ -559,15 +1089,59 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    if (interface_start(&library, geo) == -1)
+    /* Without an interface, commands come from stdin, and a signal
+     * is the other way to quit */
+
+    p = startup_begin("interface", NULL);
+
+    if (headless) {
+        if (remote_start(&library, STDIN_FILENO) == -1)
+            return -1;
+
+        signal(SIGINT, quit);
+        signal(SIGTERM, quit);
+
+    } else if (interface_start(&library, geo) == -1) {
+        return -1;
+    }
+
+    startup_end(p);
+
+    /* The decks are running; the library follows in the background,
+     * and the rig handles its changes */
+
+    loader.library = &library;
+    loader.analyser = analyser;
+    loader.analysis = analysis;
+    loader.trace = trace;
+    loader.analysing = false;
+    loader.stopping = false;
+
+    r = pthread_create(&loading, NULL, load, &loader);
+    if (r != 0) {
+        errno = r;
+        perror("pthread_create");
         return -1;
+    }
 
     if (rig_main() == -1)
         return -1;
 
     fprintf(stderr, "Exiting cleanly...\n");
 
-    interface_stop();
+    if (headless)
+        remote_stop();
+    else
+        interface_stop();
+
+    /* Reading the library can take a long time, so cut it short */
+
+    __atomic_store_n(&loader.stopping, true, __ATOMIC_SEQ_CST);
+    library_stop(&library);
+    if (pthread_join(loading, NULL) != 0)
+        abort();
+    if (loader.analysing)
+        analysis_stop();
     rt_stop(&rt);
 
     for (n = 0; n < ndeck; n++)
@@ -576,10 +1150,13 @@ int main(int argc, char *argv[])
     for (n = 0; n < nctl; n++)
         controller_clear(&ctl[n]);
 
+    track_keep_clear();
+
     timecoder_free_lookup();
     library_clear(&library);
     rt_clear(&rt);
     rig_clear();
+    pool_clear();
     thread_global_clear();
 
     fprintf(stderr, "Done.\n");